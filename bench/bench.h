@@ -0,0 +1,133 @@
+#pragma once
+
+/**
+ * Minimal benchmark harness.
+ *
+ * A benchmark is a function, which is run repeatedly. First, the number of
+ * iterations is doubled until `min_seconds` are spent in one repetition. Then
+ * the iterations are repeated `NUM_REPETITIONS` times, and the median time
+ * per iteration is reported, which is robust against hiccups of the machine.
+ *
+ * Usage:
+ *
+ * ```
+ * bench::Runner runner(std::cout, bench::Runner::JSON);
+ * runner.run("sampling::hemisphere", 1, [] {
+ *     bench::do_not_optimize(sampling::hemisphere());
+ * });
+ * ```
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace bench {
+
+/**
+ * Prevent the compiler from optimizing away the computation of value.
+ */
+template <typename T> inline void do_not_optimize(const T& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+struct Result {
+    std::string name;
+    size_t iterations; // per repetition
+    double ns_per_op;  // median over all repetitions
+    double items_per_second;
+};
+
+inline std::ostream& write_json(std::ostream& os, const Result& res) {
+    return os << "{\"name\": \"" << res.name
+              << "\", \"iterations\": " << res.iterations
+              << ", \"ns_per_op\": " << res.ns_per_op
+              << ", \"items_per_second\": " << res.items_per_second << "}";
+}
+
+inline std::ostream& operator<<(std::ostream& os, const Result& res) {
+    return os << std::setw(48) << std::left << res.name << std::right
+              << std::setw(12) << res.iterations << std::setw(14)
+              << std::fixed << std::setprecision(1) << res.ns_per_op << " ns"
+              << std::setw(14) << std::setprecision(0) << res.items_per_second
+              << " items/s";
+}
+
+class Runner {
+public:
+    enum Format { TABLE, JSON };
+
+    static constexpr size_t NUM_REPETITIONS = 5;
+
+    /**
+     * @param os          results are written to this stream
+     * @param format      table for humans, or one JSON object per line
+     * @param filter      run only the benchmarks containing this string
+     * @param min_seconds minimal runtime of a repetition
+     */
+    Runner(std::ostream& os, Format format, std::string filter = "",
+           double min_seconds = 0.1)
+        : os_(os)
+        , format_(format)
+        , filter_(std::move(filter))
+        , min_seconds_(min_seconds) {}
+
+    /**
+     * Run a benchmark and report its result.
+     *
+     * @param name           unique name of the benchmark, e.g. to compare
+     *                       results between commits
+     * @param items_per_op   number of items (e.g. rays) processed by one call
+     *                       of op
+     * @param op             function to benchmark
+     */
+    template <typename Op>
+    void run(const std::string& name, size_t items_per_op, Op op) {
+        if (name.find(filter_) == std::string::npos) {
+            return;
+        }
+
+        size_t iterations = 1;
+        while (time(op, iterations) < min_seconds_ && iterations < (1u << 30)) {
+            iterations *= 2;
+        }
+
+        std::vector<double> seconds;
+        for (size_t i = 0; i < NUM_REPETITIONS; ++i) {
+            seconds.push_back(time(op, iterations));
+        }
+        std::nth_element(seconds.begin(),
+                         seconds.begin() + NUM_REPETITIONS / 2,
+                         seconds.end());
+        const double median = seconds[NUM_REPETITIONS / 2];
+
+        Result res{name, iterations, 1e9 * median / iterations,
+                   items_per_op * iterations / median};
+        if (format_ == JSON) {
+            write_json(os_, res) << std::endl;
+        } else {
+            os_ << res << std::endl;
+        }
+    }
+
+private:
+    template <typename Op> static double time(Op& op, size_t iterations) {
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < iterations; ++i) {
+            op();
+        }
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        return elapsed.count();
+    }
+
+    std::ostream& os_;
+    Format format_;
+    std::string filter_;
+    double min_seconds_;
+};
+
+} // namespace bench
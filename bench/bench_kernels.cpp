@@ -0,0 +1,351 @@
+#include "bench.h"
+#include "reference_traversal.h"
+
+#include "../lib/bvh.h"
+#include "../lib/effects.h"
+#include "../lib/intersection.h"
+#include "../lib/kdtree.h"
+#include "../lib/radiosity.h"
+#include "../lib/raster.h"
+#include "../lib/sampling.h"
+#include "../lib/scene.h"
+#include "../lib/triangle.h"
+#include "../lib/xorshift.h"
+
+#include <assimp/Importer.hpp>
+#include <assimp/postprocess.h>
+#include <assimp/scene.h>
+#include <docopt/docopt.h>
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+static const char* USAGE =
+    R"(Usage: bench_kernels [options] [<scene>...]
+
+Microbenchmarks of the core kernels. The kd-tree and BVH builds are
+benchmarked for every given scene in addition to random scenes of 1000 to
+64000 triangles.
+
+Options:
+  -h --help             Show this screen.
+  --json                Print the results as one JSON object per line.
+  --filter=<name>       Run only the benchmarks containing <name> [default: ].
+  --min-time=<sec>      Minimal runtime of a repetition [default: 0.1].
+)";
+
+namespace {
+
+// Every run of the benchmarks uses the same scenes and rays.
+constexpr uint64_t SEED = 0x9E3779B97F4A7C15ULL;
+constexpr size_t NUM_TRIANGLES = 10000;
+constexpr size_t NUM_RAYS = 4096;
+// numbers of triangles of the random scenes the builds are benchmarked with
+constexpr size_t BUILD_SIZES[] = {1000, 4000, 16000, 64000};
+
+// Stream buffer discarding the output, s.t. only the formatting is measured.
+class NullBuffer : public std::streambuf {
+protected:
+    int overflow(int c) override { return c; }
+    std::streamsize xsputn(const char*, std::streamsize n) override {
+        return n;
+    }
+};
+
+// Small random triangles in [-10, 10]^3.
+Triangles random_triangles(size_t num_triangles) {
+    xorshift64star<float> gen(SEED);
+    auto point = [&gen](float scale) {
+        return Point3f(scale * (2 * gen() - 1), scale * (2 * gen() - 1),
+                       scale * (2 * gen() - 1));
+    };
+
+    Triangles triangles;
+    triangles.reserve(num_triangles);
+    for (size_t i = 0; i < num_triangles; ++i) {
+        const Point3f center = point(10);
+        const Point3f p0 = center + Vector3f(point(0.3f));
+        const Point3f p1 = center + Vector3f(point(0.3f));
+        const Point3f p2 = center + Vector3f(point(0.3f));
+        triangles.emplace_back(std::array<Point3f, 3>{p0, p1, p2});
+    }
+    return triangles;
+}
+
+// Geometry of the meshes of a scene.
+Triangles load_triangles(const std::string& filename) {
+    Assimp::Importer importer;
+    const aiScene* scene = importer.ReadFile(
+        filename, aiProcess_Triangulate | aiProcess_JoinIdenticalVertices |
+                      aiProcess_GenNormals);
+    if (!scene) {
+        throw std::runtime_error(importer.GetErrorString());
+    }
+    return triangles_from_scene(scene);
+}
+
+// Rays from a common origin through a small window, like primary rays.
+std::vector<Ray> coherent_rays(size_t num_rays) {
+    std::vector<Ray> rays;
+    rays.reserve(num_rays);
+    const Point3f origin(0, 0, 30);
+    const size_t side = std::sqrt(num_rays);
+    for (size_t i = 0; i < num_rays; ++i) {
+        const float x = (i % side) / static_cast<float>(side) - 0.5f;
+        const float y = (i / side) / static_cast<float>(side) - 0.5f;
+        rays.emplace_back(origin, normalize(Vector3f(x, y, -1)));
+    }
+    return rays;
+}
+
+// Rays with random origins in the scene and random directions, like
+// secondary rays.
+std::vector<Ray> incoherent_rays(size_t num_rays) {
+    xorshift64star<float> gen(SEED + 1);
+    std::vector<Ray> rays;
+    rays.reserve(num_rays);
+    for (size_t i = 0; i < num_rays; ++i) {
+        const Point3f origin(20 * gen() - 10, 20 * gen() - 10, 20 * gen() - 10);
+        const Vector3f dir(2 * gen() - 1, 2 * gen() - 1, 2 * gen() - 1);
+        rays.emplace_back(origin, normalize(dir));
+    }
+    return rays;
+}
+
+void bench_intersection(bench::Runner& runner) {
+    const Triangle tri({Point3f(-1, -1, 0), Point3f(1, -1, 0),
+                        Point3f(0, 1, 0)});
+    const CompactTriangle compact_tri(tri);
+    const Bbox3f box(Point3f(-1, -1, -1), Point3f(1, 1, 1));
+    const auto rays = coherent_rays(NUM_RAYS);
+
+    runner.run("intersect_ray_triangle", rays.size(), [&] {
+        for (const auto& ray : rays) {
+            float r, s, t;
+            bench::do_not_optimize(
+                intersect_ray_triangle(ray, compact_tri, r, s, t));
+        }
+    });
+    runner.run("intersect_ray_box", rays.size(), [&] {
+        for (const auto& ray : rays) {
+            float tmin, tmax;
+            bench::do_not_optimize(intersect_ray_box(ray, box, tmin, tmax));
+        }
+    });
+    const std::vector<PrecomputedRay> precomputed_rays(rays.begin(),
+                                                       rays.end());
+    runner.run("intersect_ray_box/precomputed", rays.size(), [&] {
+        for (const auto& ray : precomputed_rays) {
+            float tmin, tmax;
+            bench::do_not_optimize(intersect_ray_box(ray, box, tmin, tmax));
+        }
+    });
+}
+
+void bench_intersector(bench::Runner& runner, const std::string& name,
+                       Intersector& intersector) {
+    for (const auto& rays :
+         {std::make_pair("coherent", coherent_rays(NUM_RAYS)),
+          std::make_pair("incoherent", incoherent_rays(NUM_RAYS))}) {
+        runner.run(name + "::intersect/" + rays.first, rays.second.size(),
+                   [&] {
+                       for (const auto& ray : rays.second) {
+                           float r, a, b;
+                           bench::do_not_optimize(
+                               intersector.intersect(ray, r, a, b));
+                       }
+                   });
+        runner.run(name + "::occluded/" + rays.first, rays.second.size(),
+                   [&] {
+                       for (const auto& ray : rays.second) {
+                           bench::do_not_optimize(
+                               intersector.occluded(ray, 1000));
+                       }
+                   });
+        // NUM_RAYS is a multiple of the packet size
+        runner.run(name + "::intersect_packet/" + rays.first,
+                   rays.second.size(), [&] {
+                       const auto& r = rays.second;
+                       Intersector::RayPacket packet;
+                       for (size_t i = 0; i < r.size(); i += packet.size()) {
+                           std::copy(r.begin() + i,
+                                     r.begin() + i + packet.size(),
+                                     packet.begin());
+                           bench::do_not_optimize(
+                               intersector.intersect_packet(packet));
+                       }
+                   });
+        std::vector<Intersector::Hit> hits;
+        runner.run(name + "::intersect_batch/" + rays.first,
+                   rays.second.size(), [&] {
+                       intersector.intersect_batch(rays.second, hits);
+                       bench::do_not_optimize(hits.data());
+                   });
+    }
+}
+
+void bench_kdtree(bench::Runner& runner, const Triangles& triangles) {
+    const KDTree tree(triangles);
+    KDTreeIntersection tree_intersection(tree);
+    bench_intersector(runner, "KDTreeIntersection", tree_intersection);
+
+    // the traversal with a std::stack it replaced
+    for (const auto& rays :
+         {std::make_pair("coherent", coherent_rays(NUM_RAYS)),
+          std::make_pair("incoherent", incoherent_rays(NUM_RAYS))}) {
+        runner.run(std::string("KDTreeIntersection::intersect/") +
+                       rays.first + "/std_stack",
+                   rays.second.size(), [&] {
+                       for (const auto& ray : rays.second) {
+                           float r;
+                           bench::do_not_optimize(
+                               bench::reference_intersect(tree, ray, r));
+                       }
+                   });
+    }
+
+    // the batch is sorted by the intersection itself (cf. the unsorted
+    // batches of bench_intersector)
+    KDTreeIntersection sorting_intersection(tree, true);
+    const auto rays = incoherent_rays(NUM_RAYS);
+    std::vector<Intersector::Hit> hits;
+    runner.run("KDTreeIntersection::intersect_batch/incoherent/sorted",
+               rays.size(), [&] {
+                   sorting_intersection.intersect_batch(rays, hits);
+                   bench::do_not_optimize(hits.data());
+               });
+}
+
+void bench_bvh(bench::Runner& runner, const Triangles& triangles) {
+    const BVH bvh(triangles);
+    BVHIntersection bvh_intersection(bvh);
+    bench_intersector(runner, "BVHIntersection", bvh_intersection);
+}
+
+// The copy of the triangles is part of the measured time.
+void bench_build(bench::Runner& runner, const std::string& name,
+                 const Triangles& triangles) {
+    using Strategy = KDTree::BuildStrategy;
+    const size_t num_threads =
+        std::max(2u, std::thread::hardware_concurrency());
+
+    runner.run("KDTree/" + name, triangles.size(), [&] {
+        bench::do_not_optimize(KDTree(triangles).num_nodes());
+    });
+    runner.run("KDTree/sort_per_node/" + name, triangles.size(), [&] {
+        bench::do_not_optimize(
+            KDTree(triangles, Strategy::SORT_PER_NODE).num_nodes());
+    });
+    runner.run("KDTree/parallel/" + name, triangles.size(), [&] {
+        bench::do_not_optimize(
+            KDTree(triangles, Strategy::PRESORTED_EVENTS, num_threads)
+                .num_nodes());
+    });
+    runner.run("BVH/" + name, triangles.size(), [&] {
+        bench::do_not_optimize(BVH(triangles).num_nodes());
+    });
+}
+
+void bench_form_factor(bench::Runner& runner) {
+    // two parallel triangles facing each other, half occluded by a third one
+    const Point3f a0(0, 0, 0), a1(1, 0, 0), a2(0, 1, 0);
+    const Point3f b0(0, 0, 1), b1(0, 1, 1), b2(1, 0, 1);
+    const Point3f c0(0, 0, 0.5f), c1(0.5f, 0, 0.5f), c2(0, 0.5f, 0.5f);
+    const KDTree tree(Triangles{Triangle({a0, a1, a2}), Triangle({b0, b1, b2}),
+                                Triangle({c0, c1, c2})});
+    KDTreeIntersection tree_intersection(tree);
+
+    runner.run("form_factor", 1, [&] {
+        bench::do_not_optimize(form_factor(tree_intersection, 0, 1));
+    });
+}
+
+void bench_sampling(bench::Runner& runner) {
+    sampling::seed(SEED);
+    runner.run("sampling::hemisphere", 1,
+               [] { bench::do_not_optimize(sampling::hemisphere()); });
+    runner.run("sampling::cosine_hemisphere", 1, [] {
+        bench::do_not_optimize(sampling::cosine_hemisphere());
+    });
+}
+
+void bench_output(bench::Runner& runner) {
+    Image image(640, 480);
+    xorshift64star<float> gen(SEED);
+    for (auto& color : image) {
+        color = Color(gen(), gen(), gen(), 1);
+    }
+
+    NullBuffer buffer;
+    std::ostream os(&buffer);
+    for (auto format :
+         {ImageFormat::PPM_ASCII, ImageFormat::PPM, ImageFormat::PFM}) {
+        runner.run(std::string("write_image/") + to_string(format),
+                   image.width() * image.height(),
+                   [&] { write_image(os, image, format); });
+    }
+}
+
+void bench_postprocess(bench::Runner& runner) {
+    Image image(640, 480);
+    xorshift64star<float> gen(SEED);
+    for (auto& color : image) {
+        color = Color(4 * gen(), 4 * gen(), 4 * gen(), 1);
+    }
+    const size_t num_pixels = image.width() * image.height();
+
+    // Every run maps the result of the previous one, which is as expensive
+    // as mapping the original colors.
+    runner.run("postprocess/scalar", num_pixels, [&] {
+        for (auto& color : image) {
+            color = gamma(exposure(color, 1.f));
+        }
+        bench::do_not_optimize(image(0, 0));
+    });
+    for (auto op : {ToneMapping::EXPOSURE, ToneMapping::REINHARD,
+                    ToneMapping::ACES}) {
+        const PostProcessor postprocess(op, 1.f, true, 1 / 2.2f);
+        runner.run(std::string("postprocess/") + to_string(op), num_pixels,
+                   [&] {
+                       postprocess(image);
+                       bench::do_not_optimize(image(0, 0));
+                   });
+    }
+}
+
+} // namespace
+
+int main(int argc, char const* argv[]) {
+    std::map<std::string, docopt::value> args =
+        docopt::docopt(USAGE, {argv + 1, argv + argc});
+
+    bench::Runner runner(
+        std::cout, args.at("--json").asBool() ? bench::Runner::JSON
+                                              : bench::Runner::TABLE,
+        args.at("--filter").asString(),
+        std::stod(args.at("--min-time").asString()));
+
+    const auto triangles = random_triangles(NUM_TRIANGLES);
+    bench_intersection(runner);
+    bench_kdtree(runner, triangles);
+    bench_bvh(runner, triangles);
+    // the time per triangle shows how the builds scale
+    for (size_t count : BUILD_SIZES) {
+        bench_build(runner, "random_" + std::to_string(count),
+                    random_triangles(count));
+    }
+    for (const auto& filename : args.at("<scene>").asStringList()) {
+        const std::string name = filename.substr(filename.rfind('/') + 1);
+        bench_build(runner, name, load_triangles(filename));
+    }
+    bench_form_factor(runner);
+    bench_sampling(runner);
+    bench_output(runner);
+    bench_postprocess(runner);
+    return 0;
+}
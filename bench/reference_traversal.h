@@ -0,0 +1,88 @@
+#pragma once
+
+#include "../lib/intersection.h"
+#include "../lib/kdtree.h"
+
+#include <limits>
+#include <stack>
+#include <tuple>
+#include <utility>
+
+namespace bench {
+
+/**
+ * Reference traversal with a dynamically allocated std::stack, as used in
+ * KDTreeIntersection before the traversal stack was allocated upfront.
+ *
+ * The tests compare the traversal with it, and bench_kernels times both.
+ */
+inline KDTreeIntersection::OptionalId
+reference_intersect(const KDTree& tree, const Ray& ray, float& r) {
+    using Node = detail::FlatNode;
+    using OptionalId = KDTreeIntersection::OptionalId;
+
+    Vector3f d = ray.d;
+    for (auto ax : AXES3) {
+        if (d[ax] == 0) {
+            d[ax] = EPS;
+        }
+    }
+    const Ray fixed_ray(ray.o, d);
+
+    float tenter, texit;
+    if (!intersect_ray_box(fixed_ray, tree.box(), tenter, texit)) {
+        return OptionalId{};
+    }
+
+    std::stack<std::tuple<const Node*, float, float>> stack;
+    const Node* root = tree.nodes().data();
+    stack.emplace(root, tenter, texit);
+
+    Vector3f d_inv(1 / fixed_ray.d.x, 1 / fixed_ray.d.y, 1 / fixed_ray.d.z);
+    const Node* node;
+    OptionalId res;
+    r = std::numeric_limits<float>::max();
+    while (!stack.empty()) {
+        std::tie(node, tenter, texit) = stack.top();
+        stack.pop();
+
+        while (node->is_inner()) {
+            int ax = static_cast<int>(node->split_axis());
+            float t = (node->split_pos() - fixed_ray.o[ax]) * d_inv[ax];
+            const Node* near = node + 1;
+            const Node* far = root + node->right();
+            if (fixed_ray.d[ax] <= 0) {
+                std::swap(near, far);
+            }
+
+            if (texit < t) {
+                node = near;
+            } else if (t < tenter) {
+                node = far;
+            } else {
+                stack.emplace(far, t, texit);
+                node = near;
+                texit = t;
+            }
+        }
+
+        auto intersect = [&](uint32_t id) {
+            float tri_r, s, t;
+            if (intersect_ray_triangle(ray, tree[id], tri_r, s, t) &&
+                tri_r < r) {
+                r = tri_r;
+                res = OptionalId{id};
+            }
+        };
+        for (uint32_t i = node->bundles_begin(); i < node->bundles_end(); ++i) {
+            for (uint32_t id : tree.bundles()[i].ids) {
+                if (id != TriangleBundle::INVALID_ID) {
+                    intersect(id);
+                }
+            }
+        }
+    }
+    return res;
+}
+
+} // namespace bench
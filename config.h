@@ -1,5 +1,12 @@
 #pragma once
 
+#include "lib/algorithm.h"
+#include "lib/batch.h"
+#include "lib/effects.h"
+#include "lib/intersector.h"
+#include "lib/raster.h"
+#include "lib/sampler.h"
+#include "lib/tiles.h"
 #include "lib/types.h"
 
 #include <docopt/docopt.h>
@@ -20,8 +27,23 @@ struct Config {
     size_t num_threads = 1;
     float inverse_gamma = 0.454545;
     float exposure = 1;
+    ToneMapping tone_mapping = ToneMapping::EXPOSURE;
     Color bg_color;
     bool gamma_correction_enabled = true;
+    size_t tile_size = 16;
+    TileOrder tile_order = TileOrder::MORTON;
+    ImageFormat image_format = ImageFormat::PPM;
+    AcceleratorType accelerator = AcceleratorType::KDTREE;
+    // cache of the kd-tree, e.g. shared by the nodes of a distributed
+    // rendering
+    std::string kdtree_cache_filename = "kdtree.cache";
+    // profiler samples are written to this file, if it is not empty
+    std::string profile_filename;
+    // stats with the resources of every stage are written to this file, if
+    // it is not empty
+    std::string stats_filename;
+    // primary visibility is rasterized instead of traced (cf. visibility.h)
+    bool raster_primary_enabled = false;
 
     // scene
     std::string filename;
@@ -30,6 +52,7 @@ struct Config {
         assert(0 < aspect);
         assert(1 <= num_threads);
         assert(0 <= exposure);
+        assert(0 < tile_size);
     }
 
     /**
@@ -72,15 +95,58 @@ struct Config {
         conf.num_threads = args.at("--threads").asLong();
         conf.inverse_gamma = std::stof(args.at("--inverse-gamma").asString());
         conf.exposure = std::stof(args.at("--exposure").asString());
+        if (args.count("--tone-mapping")) {
+            conf.tone_mapping =
+                parse_tone_mapping(args.at("--tone-mapping").asString());
+        }
         conf.bg_color = parse_color(args.at("--background").asString());
         conf.gamma_correction_enabled =
             !args.at("--no-gamma-correction").asBool();
+        if (args.count("--tile-size")) {
+            conf.tile_size = args.at("--tile-size").asLong();
+        }
+        if (args.count("--tile-order")) {
+            conf.tile_order =
+                parse_tile_order(args.at("--tile-order").asString());
+        }
+        if (args.count("--format")) {
+            conf.image_format =
+                parse_image_format(args.at("--format").asString());
+        }
+        if (args.count("--accelerator")) {
+            conf.accelerator =
+                parse_accelerator_type(args.at("--accelerator").asString());
+        }
+        if (args.count("--kdtree-cache")) {
+            conf.kdtree_cache_filename = args.at("--kdtree-cache").asString();
+        }
+        if (args.count("--profile") && args.at("--profile")) {
+            conf.profile_filename = args.at("--profile").asString();
+        }
+        if (args.count("--stats") && args.at("--stats")) {
+            conf.stats_filename = args.at("--stats").asString();
+        }
+        if (args.count("--raster-primary")) {
+            conf.raster_primary_enabled = args.at("--raster-primary").asBool();
+        }
 
         conf.filename = args.at("<filename>").asString();
 
         conf.check();
         return conf;
     }
+
+    /**
+     * Post-processing of the rendered linear colors. PFM images keep the
+     * linear colors, i.e. they are neither tone mapped nor clamped.
+     */
+    PostProcessor postprocessor() const {
+        if (image_format == ImageFormat::PFM) {
+            return {};
+        }
+        return {tone_mapping, exposure, gamma_correction_enabled,
+                inverse_gamma};
+    }
 };
 
 inline std::ostream& operator<<(std::ostream& os, const Config& conf) {
@@ -92,8 +158,19 @@ inline std::ostream& operator<<(std::ostream& os, const Config& conf) {
     os << "  Number of threads: " << conf.num_threads << std::endl;
     os << "  Inverse gamma: " << conf.inverse_gamma << std::endl;
     os << "  Exposure: " << conf.exposure << std::endl;
+    os << "  Tone mapping: " << to_string(conf.tone_mapping) << std::endl;
     os << "  Background color: " << conf.exposure << std::endl;
-    os << "  Gamma correction enabled: " << conf.gamma_correction_enabled;
+    os << "  Gamma correction enabled: " << conf.gamma_correction_enabled
+       << std::endl;
+    os << "  Tile size: " << conf.tile_size << std::endl;
+    os << "  Tile order: " << to_string(conf.tile_order) << std::endl;
+    os << "  Image format: " << to_string(conf.image_format) << std::endl;
+    os << "  Acceleration structure: " << to_string(conf.accelerator)
+       << std::endl;
+    os << "  Kd-tree cache: " << conf.kdtree_cache_filename << std::endl;
+    os << "  Profile: " << conf.profile_filename << std::endl;
+    os << "  Stats: " << conf.stats_filename << std::endl;
+    os << "  Rasterized primary visibility: " << conf.raster_primary_enabled;
     return os;
 }
 
@@ -105,6 +182,38 @@ struct TracerConfig : public Config {
 
     // common tracer options
     int max_recursion_depth = 3;
+    // progressive rendering: passes of one sample per pixel, which are
+    // accumulated in a buffer
+    bool progressive_enabled = false;
+    std::string accumulation_filename; // saved buffer to resume from
+    std::string snapshot_filename;     // image written during the rendering
+    float snapshot_seconds = 10;       // min time between two snapshots
+    // distributed progressive rendering: this node renders the passes
+    // node_index, node_index + num_nodes, ...
+    size_t node_index = 0;
+    size_t num_nodes = 1;
+    // camera of --look-at instead of the camera of the scene
+    bool look_at_enabled = false;
+    LookAt look_at;
+    // batch rendering: the frames of all cameras of the scene, or of the
+    // camera list, are written to the files of the pattern (cf. batch.h)
+    std::string batch_pattern;
+    std::string camera_list_filename;
+    // render service on this port of localhost (0: no service, cf.
+    // tracer_server.h)
+    unsigned serve_port = 0;
+    // cost of the tiles is written to this file, if it is not empty (cf.
+    // heatmap.h)
+    std::string heatmap_filename;
+    // preview rendered, while the acceleration structure is built, if it is
+    // not empty (cf. `render_preview`)
+    std::string preview_filename;
+    // pin the workers to the NUMA nodes, and replicate the kd-tree per node
+    // (cf. numa.h)
+    bool numa_enabled = false;
+    // memory budget of the bricks mapped with --accelerator=bricks (cf.
+    // bricks.h)
+    size_t brick_cache_mb = 1024;
 
     // raycaster options
     float max_visibility = 2;
@@ -114,15 +223,29 @@ struct TracerConfig : public Config {
 
     // pathtracer options
     int num_pixel_samples = 1;
+    // sampler of the pixel samples
+    SamplerType sampler = SamplerType::SOBOL;
     int num_monte_carlo_samples = 1;
+    bool wavefront_enabled = false;
+    // sort the secondary rays of the wavefront path tracer
+    bool sort_rays_enabled = false;
+    // adaptive sampling: a pixel is sampled until the standard error of its
+    // luminance is below adaptive_threshold times its luminance (0: disabled)
+    float adaptive_threshold = 0;
+    int max_pixel_samples = 64;
 
     void check() const {
         Config::check();
         assert(0 < max_recursion_depth);
+        assert(0 <= snapshot_seconds);
+        assert(node_index < num_nodes);
+        assert(serve_port <= 65535);
         assert(0 <= max_visibility);
         assert(0 <= shadow_intensity && shadow_intensity <= 1);
         assert(1 <= num_pixel_samples);
         assert(0 <= num_monte_carlo_samples);
+        assert(0 <= adaptive_threshold);
+        assert(1 <= max_pixel_samples);
     }
 
     static TracerConfig
@@ -132,6 +255,51 @@ struct TracerConfig : public Config {
         if (args.count("--max-depth")) {
             conf.max_recursion_depth = args.at("--max-depth").asLong();
         }
+        if (args.count("--progressive")) {
+            conf.progressive_enabled = args.at("--progressive").asBool();
+        }
+        if (args.count("--accumulation") && args.at("--accumulation")) {
+            conf.accumulation_filename =
+                args.at("--accumulation").asString();
+        }
+        if (args.count("--snapshot") && args.at("--snapshot")) {
+            conf.snapshot_filename = args.at("--snapshot").asString();
+        }
+        if (args.count("--snapshot-seconds")) {
+            conf.snapshot_seconds =
+                std::stof(args.at("--snapshot-seconds").asString());
+        }
+        if (args.count("--node")) {
+            conf.node_index = args.at("--node").asLong();
+        }
+        if (args.count("--nodes")) {
+            conf.num_nodes = args.at("--nodes").asLong();
+        }
+        if (args.count("--look-at") && args.at("--look-at")) {
+            conf.look_at_enabled = true;
+            conf.look_at = parse_look_at(args.at("--look-at").asString());
+        }
+        if (args.count("--batch") && args.at("--batch")) {
+            conf.batch_pattern = args.at("--batch").asString();
+        }
+        if (args.count("--camera-list") && args.at("--camera-list")) {
+            conf.camera_list_filename = args.at("--camera-list").asString();
+        }
+        if (args.count("--serve") && args.at("--serve")) {
+            conf.serve_port = args.at("--serve").asLong();
+        }
+        if (args.count("--heatmap") && args.at("--heatmap")) {
+            conf.heatmap_filename = args.at("--heatmap").asString();
+        }
+        if (args.count("--preview") && args.at("--preview")) {
+            conf.preview_filename = args.at("--preview").asString();
+        }
+        if (args.count("--numa")) {
+            conf.numa_enabled = args.at("--numa").asBool();
+        }
+        if (args.count("--brick-cache")) {
+            conf.brick_cache_mb = args.at("--brick-cache").asLong();
+        }
         if (args.count("--max-visibility")) {
             conf.max_visibility =
                 std::stof(args.at("--max-visibility").asString());
@@ -142,10 +310,26 @@ struct TracerConfig : public Config {
         if (args.count("--pixel-samples")) {
             conf.num_pixel_samples = args.at("--pixel-samples").asLong();
         }
+        if (args.count("--sampler")) {
+            conf.sampler = parse_sampler_type(args.at("--sampler").asString());
+        }
         if (args.count("--monte-carlo-samples")) {
             conf.num_monte_carlo_samples =
                 args.at("--monte-carlo-samples").asLong();
         }
+        if (args.count("--wavefront")) {
+            conf.wavefront_enabled = args.at("--wavefront").asBool();
+        }
+        if (args.count("--sort-rays")) {
+            conf.sort_rays_enabled = args.at("--sort-rays").asBool();
+        }
+        if (args.count("--adaptive-threshold")) {
+            conf.adaptive_threshold =
+                std::stof(args.at("--adaptive-threshold").asString());
+        }
+        if (args.count("--max-pixel-samples")) {
+            conf.max_pixel_samples = args.at("--max-pixel-samples").asLong();
+        }
 
         conf.check();
         return conf;
@@ -157,10 +341,34 @@ inline std::ostream& operator<<(std::ostream& os, const TracerConfig& conf) {
     os << std::endl;
     os << "Tracer parameters (not all applicable):" << std::endl;
     os << "  Max recursion depth: " << conf.max_recursion_depth << std::endl;
+    os << "  Progressive rendering enabled: " << conf.progressive_enabled
+       << std::endl;
+    os << "  Accumulation buffer: " << conf.accumulation_filename << std::endl;
+    os << "  Snapshot: " << conf.snapshot_filename << std::endl;
+    os << "  Snapshot interval: " << conf.snapshot_seconds << " sec"
+       << std::endl;
+    os << "  Node: " << conf.node_index << " of " << conf.num_nodes
+       << std::endl;
+    os << "  Look at enabled: " << conf.look_at_enabled << std::endl;
+    os << "  Batch: " << conf.batch_pattern << std::endl;
+    os << "  Camera list: " << conf.camera_list_filename << std::endl;
+    os << "  Service port: " << conf.serve_port << std::endl;
+    os << "  Heatmap: " << conf.heatmap_filename << std::endl;
+    os << "  Preview: " << conf.preview_filename << std::endl;
+    os << "  NUMA enabled: " << conf.numa_enabled << std::endl;
+    os << "  Brick cache: " << conf.brick_cache_mb << " MB" << std::endl;
     os << "  Max visibility: " << conf.max_visibility << std::endl;
     os << "  Shadow intensity: " << conf.shadow_intensity << std::endl;
     os << "  Number of pixel samples: " << conf.num_pixel_samples << std::endl;
-    os << "  Number of Monte-Carlo samples: " << conf.num_monte_carlo_samples;
+    os << "  Sampler: " << to_string(conf.sampler) << std::endl;
+    os << "  Number of Monte-Carlo samples: " << conf.num_monte_carlo_samples
+       << std::endl;
+    os << "  Wavefront path tracing enabled: " << conf.wavefront_enabled
+       << std::endl;
+    os << "  Ray sorting enabled: " << conf.sort_rays_enabled << std::endl;
+    os << "  Adaptive sampling threshold: " << conf.adaptive_threshold
+       << std::endl;
+    os << "  Max number of pixel samples: " << conf.max_pixel_samples;
     return os;
 }
 
@@ -170,7 +378,7 @@ inline std::ostream& operator<<(std::ostream& os, const TracerConfig& conf) {
 struct RadiosityConfig : public Config {
     RadiosityConfig(const Config& conf) : Config(conf) {}
 
-    enum Mode { EXACT, HIERARCHICAL } mode;
+    enum Mode { EXACT, HIERARCHICAL, PROGRESSIVE } mode;
 
     // radiosity parameters
     float F_eps = 0.04;  // form factor epsilon
@@ -178,8 +386,20 @@ struct RadiosityConfig : public Config {
     // max number of allowed subdivision of a trinagle
     size_t max_subdivisions = 3;
     size_t max_iterations = 3; // max number of iterations in push-pull solver
+    // link distant clusters of triangles instead of all pairs of triangles
+    bool clustering_enabled = true;
     // minimal area of a triangle (no subdivision if the triangle area is less)
     float min_area = 1. / pow(4, max_subdivisions);
+    // the solver of the exact radiosity stops when the residual is below
+    // solver_eps, or after max_solver_iterations iterations
+    SolverOrder solver_order = SolverOrder::RED_BLACK;
+    float solver_eps = 1e-4;
+    size_t max_solver_iterations = 100;
+    // progressive refinement stops when the unshot power is below shoot_eps
+    // times the emitted power, or after max_shots shots
+    float shoot_eps = 0.01;
+    size_t max_shots = 100000;
+    size_t snapshot_interval = 0; // write an image every n shots (0: never)
 
     // flags
     bool gouraud_enabled = false;
@@ -187,19 +407,37 @@ struct RadiosityConfig : public Config {
     bool links_enabled = false;
     bool exact_hierarchical_enabled = false;
 
+    // bake of the radiosity solution (cf. radiosity_bake.h), if not empty
+    std::string bake_filename;
+    // only render the bake; the mode is the one of the bake
+    bool render_bake = false;
+
     void check() const {
         Config::check();
+        assert(!render_bake || !bake_filename.empty());
         assert(0 < F_eps);
         assert(0 < BF_eps);
         assert(0 < min_area);
+        assert(0 <= shoot_eps);
+        assert(0 <= solver_eps);
     }
 
     static RadiosityConfig
     from_docopt(const std::map<std::string, docopt::value>& args) {
         RadiosityConfig conf(Config::from_docopt(args));
 
-        conf.mode = args.at("exact").asBool() ? EXACT : HIERARCHICAL;
-        assert(args.at("hierarchical").asBool() == !args.at("exact").asBool());
+        if (args.count("render") && args.at("render").asBool()) {
+            conf.render_bake = true;
+            conf.mode = HIERARCHICAL;
+        } else if (args.at("exact").asBool()) {
+            conf.mode = EXACT;
+        } else if (args.count("progressive") &&
+                   args.at("progressive").asBool()) {
+            conf.mode = PROGRESSIVE;
+        } else {
+            assert(args.at("hierarchical").asBool());
+            conf.mode = HIERARCHICAL;
+        }
 
         // radiosity parameters
         if (args.count("--form-factor-eps")) {
@@ -216,6 +454,29 @@ struct RadiosityConfig : public Config {
             conf.max_iterations =
                 std::stof(args.at("--max-iterations").asString());
         }
+        if (args.count("--solver")) {
+            conf.solver_order =
+                parse_solver_order(args.at("--solver").asString());
+        }
+        if (args.count("--solver-eps")) {
+            conf.solver_eps = std::stof(args.at("--solver-eps").asString());
+        }
+        if (args.count("--solver-iterations")) {
+            conf.max_solver_iterations =
+                args.at("--solver-iterations").asLong();
+        }
+        if (args.count("--no-clustering")) {
+            conf.clustering_enabled = !args.at("--no-clustering").asBool();
+        }
+        if (args.count("--shoot-eps")) {
+            conf.shoot_eps = std::stof(args.at("--shoot-eps").asString());
+        }
+        if (args.count("--max-shots")) {
+            conf.max_shots = args.at("--max-shots").asLong();
+        }
+        if (args.count("--snapshot-interval")) {
+            conf.snapshot_interval = args.at("--snapshot-interval").asLong();
+        }
 
         // extra options
         if (args.count("--gouraud")) {
@@ -238,6 +499,9 @@ struct RadiosityConfig : public Config {
         if (args.count("--exact")) {
             conf.exact_hierarchical_enabled = args.at("--exact").asBool();
         }
+        if (args.count("--bake") && args.at("--bake")) {
+            conf.bake_filename = args.at("--bake").asString();
+        }
 
         conf.check();
         return conf;
@@ -252,7 +516,17 @@ inline std::ostream& operator<<(std::ostream& os, const RadiosityConfig& conf) {
     os << "  BF_eps (shoot radiosity epsilon): " << conf.BF_eps << std::endl;
     os << "  Max subdivisions: " << conf.max_subdivisions << std::endl;
     os << "  Max iterations: " << conf.max_iterations << std::endl;
+    os << "  Clustering enabled: " << conf.clustering_enabled << std::endl;
     os << "  Min area: " << conf.min_area << std::endl;
+    os << "  Solver: " << to_string(conf.solver_order) << std::endl;
+    os << "  Solver epsilon (relative residual): " << conf.solver_eps
+       << std::endl;
+    os << "  Max solver iterations: " << conf.max_solver_iterations
+       << std::endl;
+    os << "  Shoot epsilon (relative unshot power): " << conf.shoot_eps
+       << std::endl;
+    os << "  Max shots: " << conf.max_shots << std::endl;
+    os << "  Snapshot interval: " << conf.snapshot_interval << std::endl;
     os << std::endl;
     os << "Radiosity flags:" << std::endl;
     os << "  Gouraud shading enabled: " << conf.gouraud_enabled << std::endl;
@@ -264,6 +538,9 @@ inline std::ostream& operator<<(std::ostream& os, const RadiosityConfig& conf) {
        << std::endl;
     os << "  Render links between patches: " << conf.links_enabled << std::endl;
     os << "  Compute hierarchical radiosity exactly: "
-       << conf.exact_hierarchical_enabled;
+       << conf.exact_hierarchical_enabled << std::endl;
+    os << "  Bake: "
+       << (conf.bake_filename.empty() ? "none" : conf.bake_filename)
+       << (conf.render_bake ? " (render only)" : "");
     return os;
 }
@@ -1,8 +1,20 @@
 #pragma once
 
+#include "aligned_allocator.h"
 #include "matrix.h"
+
+#include <ThreadPool.h>
+#include <xmmintrin.h>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
 #include <cstddef>
+#include <future>
 #include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
 
 template <typename Iter, typename ValueFun>
 auto min(Iter begin, Iter end, ValueFun&& get_value)
@@ -73,3 +85,371 @@ gauss_seidel(const math::Matrix<Number>& A, const math::Vector<Number>& x_0,
     }
     return x;
 }
+
+/**
+ * Solves the radiosity equation
+ *
+ *   (I - diag(rho_c) * F) x_c = e_c
+ *
+ * for vectors x_c of all channels c at once with Gauss-Seidel iteration.
+ *
+ * The result is the same as of `gauss_seidel` applied to the matrix
+ * I - diag(rho_c) * F for each channel, but the matrix is never materialized,
+ * and every iteration takes a single pass over the non-zero entries of F.
+ *
+ * @param F              sparse square matrix (e.g. form factors) with zero
+ *                       diagonal
+ * @param rho            reflectivity per row and channel
+ * @param e              right hand side per row and channel; it is also used
+ *                       as initial guess
+ * @param max_iterations number of iterations
+ */
+template <typename Number, size_t Channels>
+std::vector<std::array<Number, Channels>>
+gauss_seidel(const math::SparseMatrix<Number>& F,
+             const std::vector<std::array<Number, Channels>>& rho,
+             const std::vector<std::array<Number, Channels>>& e,
+             const int max_iterations = 100) {
+    assert(F.rows() == F.cols() && F.rows() == rho.size() &&
+           F.rows() == e.size());
+    auto x = e;
+    const size_t rows = F.rows();
+    for (int k = 0; k < max_iterations; ++k) {
+        for (size_t i = 0; i < rows; ++i) {
+            std::array<Number, Channels> sum{};
+            for (auto it = F.row_begin(i); it != F.row_end(i); ++it) {
+                assert(it->col != i && "Diagonal of F is expected to be 0.");
+                for (size_t c = 0; c < Channels; ++c) {
+                    sum[c] += it->value * x[it->col][c];
+                }
+            }
+            for (size_t c = 0; c < Channels; ++c) {
+                x[i][c] = e[i][c] + rho[i][c] * sum[c];
+            }
+        }
+    }
+    return x;
+}
+
+/**
+ * Order of the row updates of `solve_radiosity`.
+ */
+enum class SolverOrder {
+    // sequential, every update uses the latest values of all rows
+    GAUSS_SEIDEL,
+    // parallel, every update uses the values of the previous iteration
+    JACOBI,
+    // parallel in two half sweeps: the even rows are updated with the values
+    // of the previous iteration, and then the odd rows with the new values of
+    // the even rows
+    RED_BLACK,
+};
+
+inline SolverOrder parse_solver_order(const std::string& order) {
+    if (order == "gauss-seidel") {
+        return SolverOrder::GAUSS_SEIDEL;
+    } else if (order == "jacobi") {
+        return SolverOrder::JACOBI;
+    } else if (order == "red-black") {
+        return SolverOrder::RED_BLACK;
+    }
+    throw std::runtime_error("unknown solver order: " + order);
+}
+
+inline const char* to_string(SolverOrder order) {
+    switch (order) {
+    case SolverOrder::GAUSS_SEIDEL:
+        return "gauss-seidel";
+    case SolverOrder::JACOBI:
+        return "jacobi";
+    case SolverOrder::RED_BLACK:
+        return "red-black";
+    }
+    return "";
+}
+
+namespace detail {
+
+/**
+ * sum += F_i x for the entries [begin, end) of row i of F, where x holds
+ * `Stride` interleaved channels per row.
+ */
+template <typename Number, size_t Stride> struct RowProduct {
+    using Entry = typename math::SparseMatrix<Number>::Entry;
+
+    static void accumulate(const Entry* begin, const Entry* end,
+                           const Number* x, Number* sum) {
+        for (auto it = begin; it != end; ++it) {
+            const Number* x_j = x + it->col * Stride;
+            for (size_t c = 0; c < Stride; ++c) {
+                sum[c] += it->value * x_j[c];
+            }
+        }
+    }
+};
+
+// The channels of floats are padded to multiples of 4, and 16 byte aligned.
+template <size_t Stride> struct RowProduct<float, Stride> {
+    static_assert(Stride % 4 == 0, "rows have to be padded to full vectors");
+    using Entry = math::SparseMatrix<float>::Entry;
+
+    static void accumulate(const Entry* begin, const Entry* end,
+                           const float* x, float* sum) {
+        __m128 acc[Stride / 4];
+        for (auto& a : acc) {
+            a = _mm_setzero_ps();
+        }
+        for (auto it = begin; it != end; ++it) {
+            const __m128 value = _mm_set1_ps(it->value);
+            const float* x_j = x + it->col * Stride;
+            for (size_t k = 0; k < Stride / 4; ++k) {
+                acc[k] = _mm_add_ps(
+                    acc[k], _mm_mul_ps(value, _mm_load_ps(x_j + 4 * k)));
+            }
+        }
+        for (size_t k = 0; k < Stride / 4; ++k) {
+            _mm_store_ps(sum + 4 * k,
+                         _mm_add_ps(_mm_load_ps(sum + 4 * k), acc[k]));
+        }
+    }
+};
+
+} // namespace detail
+
+/**
+ * Solves the radiosity equation
+ *
+ *   (I - diag(rho_c) * F) x_c = e_c
+ *
+ * for vectors x_c of all channels c at once, like the sparse `gauss_seidel`,
+ * but in parallel (cf. `SolverOrder`) and until convergence.
+ *
+ * The channels of a row are interleaved and padded to a multiple of 4, s.t.
+ * the product of a row of F with x is computed for 4 channels at once. Rows
+ * are distributed in contiguous chunks over the threads. The result of the
+ * parallel orders does not depend on the number of threads.
+ *
+ * The residual of an iteration is the largest change of a value in it
+ * relative to the largest value of e. The iteration stops as soon as it is
+ * at most `tolerance`, or after `max_iterations` iterations.
+ *
+ * @param F              sparse square matrix (e.g. form factors) with zero
+ *                       diagonal
+ * @param rho            reflectivity per row and channel
+ * @param e              right hand side per row and channel; it is also used
+ *                       as initial guess
+ * @param order          order of the row updates
+ * @param num_threads    number of threads of the parallel orders
+ * @param max_iterations maximum number of iterations
+ * @param tolerance      residual at which the iteration stops
+ * @param on_iteration   called as `on_iteration(iteration, residual)` after
+ *                       every iteration; the iteration stops if it returns
+ *                       false
+ * @return               solution x per row and channel
+ */
+template <typename Number, size_t Channels, typename OnIteration>
+std::vector<std::array<Number, Channels>>
+solve_radiosity(const math::SparseMatrix<Number>& F,
+                const std::vector<std::array<Number, Channels>>& rho,
+                const std::vector<std::array<Number, Channels>>& e,
+                SolverOrder order, size_t num_threads, int max_iterations,
+                Number tolerance, OnIteration on_iteration) {
+    using Numbers = std::vector<Number, AlignedAllocator<Number, 16>>;
+    constexpr size_t STRIDE = (Channels + 3) / 4 * 4;
+    assert(F.rows() == F.cols() && F.rows() == rho.size() &&
+           F.rows() == e.size());
+    assert(0 < num_threads);
+    const size_t rows = F.rows();
+    if (order == SolverOrder::GAUSS_SEIDEL) {
+        num_threads = 1;
+    }
+
+    Number e_max = 0;
+    Numbers rho_s(rows * STRIDE);
+    Numbers e_s(rows * STRIDE);
+    for (size_t i = 0; i < rows; ++i) {
+        for (size_t c = 0; c < Channels; ++c) {
+            rho_s[i * STRIDE + c] = rho[i][c];
+            e_s[i * STRIDE + c] = e[i][c];
+            e_max = std::max(e_max, std::abs(e[i][c]));
+        }
+    }
+    Numbers x = e_s;
+    Numbers x_new = e_s;
+
+    // Update the rows [begin, end) of the given parity (or all rows), and
+    // copy the other ones. Returns the largest change.
+    auto sweep = [&](const Numbers& src, Numbers& dst, size_t begin,
+                     size_t end, size_t parity, bool all) {
+        Number change = 0;
+        for (size_t i = begin; i < end; ++i) {
+            Number* dst_i = dst.data() + i * STRIDE;
+            if (!all && i % 2 != parity) {
+                std::copy_n(src.data() + i * STRIDE, STRIDE, dst_i);
+                continue;
+            }
+            alignas(16) std::array<Number, STRIDE> sum{};
+            detail::RowProduct<Number, STRIDE>::accumulate(
+                F.row_begin(i), F.row_end(i), src.data(), sum.data());
+            for (size_t c = 0; c < Channels; ++c) {
+                const Number value =
+                    e_s[i * STRIDE + c] + rho_s[i * STRIDE + c] * sum[c];
+                change = std::max(change,
+                                  std::abs(value - src[i * STRIDE + c]));
+                dst_i[c] = value;
+            }
+        }
+        return change;
+    };
+
+    ThreadPool pool(num_threads);
+    auto parallel_sweep = [&](const Numbers& src, Numbers& dst,
+                              size_t parity, bool all) {
+        std::vector<std::future<Number>> workers;
+        for (size_t worker = 0; worker < num_threads; ++worker) {
+            const size_t begin = worker * rows / num_threads;
+            const size_t end = (worker + 1) * rows / num_threads;
+            workers.emplace_back(pool.enqueue([&, begin, end]() {
+                return sweep(src, dst, begin, end, parity, all);
+            }));
+        }
+        Number change = 0;
+        for (auto& worker : workers) {
+            change = std::max(change, worker.get());
+        }
+        return change;
+    };
+
+    for (int k = 1; k <= max_iterations && 0 < e_max; ++k) {
+        Number change = 0;
+        switch (order) {
+        case SolverOrder::GAUSS_SEIDEL:
+            change = sweep(x, x, 0, rows, 0, true);
+            break;
+        case SolverOrder::JACOBI:
+            change = parallel_sweep(x, x_new, 0, true);
+            x.swap(x_new);
+            break;
+        case SolverOrder::RED_BLACK:
+            change = std::max(parallel_sweep(x, x_new, 0, false),
+                              parallel_sweep(x_new, x, 1, false));
+            break;
+        }
+
+        const Number residual = change / e_max;
+        if (!on_iteration(k, residual) || residual <= tolerance) {
+            break;
+        }
+    }
+
+    std::vector<std::array<Number, Channels>> result(rows);
+    for (size_t i = 0; i < rows; ++i) {
+        std::copy_n(x.data() + i * STRIDE, Channels, result[i].data());
+    }
+    return result;
+}
+
+/**
+ * Solves the radiosity equation
+ *
+ *   (I - diag(rho_c) * F) x_c = e_c
+ *
+ * for all channels c with progressive refinement, i.e. Southwell iteration.
+ *
+ * Initially, every patch has the unshot radiosity e_c. In every step, the patch
+ * with the highest unshot power (unshot radiosity times area) shoots it to all
+ * other patches. The row F_i of the shooting patch i is requested only then,
+ * so rows of patches which never shoot are never computed. The iteration
+ * stops, when the unshot power is below `eps` times the emitted power, or
+ * after `max_shots` shots.
+ *
+ * Cf. [CW93], chapter 5.
+ *
+ * @param area         area per patch
+ * @param rho          reflectivity per patch and channel
+ * @param e            emitted radiosity per patch and channel
+ * @param form_factors called as `form_factors(i, F_i)` to store the form
+ *                     factors F_ij for all j in the vector F_i of size n
+ * @param eps          relative unshot power at which the iteration stops
+ * @param max_shots    maximum number of shots
+ * @param on_shot      called as `on_shot(num_shots, x, unshot)` after every
+ *                     shot with the current solution x and the relative unshot
+ *                     power; the iteration stops if it returns false
+ * @return             solution x per patch and channel
+ */
+template <typename Number, size_t Channels, typename FormFactors,
+          typename OnShot>
+std::vector<std::array<Number, Channels>> progressive_refinement(
+    const std::vector<Number>& area,
+    const std::vector<std::array<Number, Channels>>& rho,
+    const std::vector<std::array<Number, Channels>>& e,
+    FormFactors form_factors, const Number eps, const size_t max_shots,
+    OnShot on_shot) {
+    const size_t n = area.size();
+    assert(rho.size() == n && e.size() == n);
+
+    auto power = [&area](const std::array<Number, Channels>& rad, size_t i) {
+        Number sum = 0;
+        for (size_t c = 0; c < Channels; ++c) {
+            sum += rad[c];
+        }
+        return sum * area[i];
+    };
+
+    auto x = e;
+    auto unshot = e;
+    std::vector<Number> unshot_power(n);
+    Number emitted_power = 0;
+    for (size_t i = 0; i < n; ++i) {
+        unshot_power[i] = power(e[i], i);
+        emitted_power += unshot_power[i];
+    }
+    if (emitted_power <= 0) {
+        return x;
+    }
+
+    std::vector<Number> F_i(n);
+    for (size_t shot = 1; shot <= max_shots; ++shot) {
+        // Summing up the unshot power each time is cheap compared to computing
+        // a row of form factors, and does not accumulate rounding errors.
+        size_t i = 0;
+        Number total = 0;
+        for (size_t j = 0; j < n; ++j) {
+            total += unshot_power[j];
+            if (unshot_power[i] < unshot_power[j]) {
+                i = j;
+            }
+        }
+        if (total <= eps * emitted_power) {
+            break;
+        }
+
+        const auto shooting = unshot[i];
+        unshot[i] = {};
+        unshot_power[i] = 0;
+
+        form_factors(i, F_i);
+        for (size_t j = 0; j < n; ++j) {
+            if (j == i || F_i[j] == 0) {
+                continue;
+            }
+            // F_ji = A_i/A_j F_ij (reciprocity)
+            const Number F_ji = area[i] / area[j] * F_i[j];
+            for (size_t c = 0; c < Channels; ++c) {
+                const Number delta = rho[j][c] * F_ji * shooting[c];
+                x[j][c] += delta;
+                unshot[j][c] += delta;
+            }
+            unshot_power[j] = power(unshot[j], j);
+        }
+
+        Number remaining = 0;
+        for (size_t j = 0; j < n; ++j) {
+            remaining += unshot_power[j];
+        }
+        if (!on_shot(shot, x, remaining / emitted_power)) {
+            break;
+        }
+    }
+    return x;
+}
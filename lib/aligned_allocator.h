@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+/**
+ * Allocator returning memory aligned at `Alignment` bytes, e.g. at cache line
+ * boundaries.
+ *
+ * `std::allocator` does not respect the alignment of over-aligned types before
+ * C++17.
+ */
+template <typename T, size_t Alignment> struct AlignedAllocator {
+    static_assert((Alignment & (Alignment - 1)) == 0,
+                  "alignment must be a power of 2");
+    static_assert(Alignment % sizeof(void*) == 0,
+                  "alignment must be a multiple of the pointer size");
+
+    using value_type = T;
+
+    template <typename U> struct rebind {
+        using other = AlignedAllocator<U, Alignment>;
+    };
+
+    AlignedAllocator() = default;
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+    T* allocate(size_t n) {
+        void* ptr = nullptr;
+        if (posix_memalign(&ptr, Alignment, n * sizeof(T)) != 0) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(ptr);
+    }
+
+    void deallocate(T* ptr, size_t) { free(ptr); }
+};
+
+template <typename T, typename U, size_t Alignment>
+bool operator==(const AlignedAllocator<T, Alignment>&,
+                const AlignedAllocator<U, Alignment>&) {
+    return true;
+}
+
+template <typename T, typename U, size_t Alignment>
+bool operator!=(const AlignedAllocator<T, Alignment>&,
+                const AlignedAllocator<U, Alignment>&) {
+    return false;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <stdexcept>
+#include <vector>
+
+/**
+ * Non-owning read-only view of a contiguous array, e.g. of a std::vector or of
+ * a memory-mapped file.
+ */
+template <typename T> class ArrayView {
+public:
+    using value_type = T;
+    using const_iterator = const T*;
+
+    ArrayView() = default;
+    ArrayView(const T* data, size_t size) : data_(data), size_(size) {}
+
+    template <typename Alloc>
+    ArrayView(const std::vector<T, Alloc>& vec)
+        : data_(vec.data()), size_(vec.size()) {}
+
+    const T* data() const { return data_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    const T* begin() const { return data_; }
+    const T* end() const { return data_ + size_; }
+
+    const T& operator[](size_t i) const { return data_[i]; }
+    const T& at(size_t i) const {
+        if (i >= size_) {
+            throw std::out_of_range("ArrayView::at");
+        }
+        return data_[i];
+    }
+    const T& front() const { return data_[0]; }
+    const T& back() const { return data_[size_ - 1]; }
+
+private:
+    const T* data_ = nullptr;
+    size_t size_ = 0;
+};
@@ -0,0 +1,80 @@
+/**
+ * Cameras and output files of a batch rendering, which renders several
+ * frames of a scene in one process (cf. --batch of the tracers).
+ */
+
+#pragma once
+
+#include <assimp/types.h>
+
+#include <algorithm>
+#include <istream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/**
+ * Camera at eye looking at target (cf. `look_at_transformation`).
+ */
+struct LookAt {
+    aiVector3D eye;
+    aiVector3D target{0, 0, -1};
+    aiVector3D up{0, 1, 0};
+};
+
+/**
+ * Parse nine whitespace-separated numbers: the position of the camera, its
+ * target and its up vector.
+ *
+ * @throw std::runtime_error, if there are not nine numbers
+ */
+inline LookAt parse_look_at(const std::string& look_at_str) {
+    std::vector<float> v;
+    std::istringstream ss(look_at_str);
+    std::string item;
+    while (ss >> item) {
+        v.push_back(std::stof(item));
+    }
+    if (v.size() != 9) {
+        throw std::runtime_error("camera needs 9 numbers: " + look_at_str);
+    }
+    return {{v[0], v[1], v[2]}, {v[3], v[4], v[5]}, {v[6], v[7], v[8]}};
+}
+
+/**
+ * Read a list of cameras, one per line in the format of `parse_look_at`,
+ * e.g. the shot list of a turntable. Empty lines and lines starting with #
+ * are skipped.
+ */
+inline std::vector<LookAt> read_camera_list(std::istream& is) {
+    std::vector<LookAt> cameras;
+    std::string line;
+    while (std::getline(is, line)) {
+        const size_t begin = line.find_first_not_of(" \t\r");
+        if (begin == std::string::npos || line[begin] == '#') {
+            continue;
+        }
+        cameras.push_back(parse_look_at(line));
+    }
+    return cameras;
+}
+
+/**
+ * File of a frame: the first run of # in the pattern is replaced by the
+ * frame number padded with zeros to the length of the run, e.g. frame 7 of
+ * `shot_###.ppm` is `shot_007.ppm`. Without #, the frame number is appended.
+ */
+inline std::string frame_filename(const std::string& pattern, size_t frame) {
+    std::string number = std::to_string(frame);
+    const size_t begin = pattern.find('#');
+    if (begin == std::string::npos) {
+        return pattern + number;
+    }
+    const size_t end = std::min(pattern.find_first_not_of('#', begin),
+                                pattern.size());
+    if (number.size() < end - begin) {
+        number.insert(0, end - begin - number.size(), '0');
+    }
+    return pattern.substr(0, begin) + number + pattern.substr(end);
+}
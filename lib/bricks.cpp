@@ -0,0 +1,397 @@
+#include "bricks.h"
+
+#include "emitters.h"
+#include "intersection.h"
+#include "profile.h"
+
+#include <algorithm>
+#include <cassert>
+#include <limits>
+#include <stdexcept>
+#include <utility>
+
+namespace {
+
+// Does the ray hit the box in [0, t_max]?
+bool hit_box(const PrecomputedRay& ray, const Bbox3f& box, float t_max,
+             float& tenter) {
+    float tleave;
+    return intersect_ray_box(ray, box, tenter, tleave) && 0 <= tleave &&
+           tenter <= t_max;
+}
+
+Bbox3f points_box(const std::vector<Point3f>& points) {
+    assert(!points.empty());
+    Bbox3f box(points.front());
+    for (const auto& p : points) {
+        box = bbox_union(box, p);
+    }
+    return box;
+}
+
+} // namespace anonymous
+
+//
+// BrickedScene
+//
+
+BrickedScene::BrickedScene(const IndexedMesh& mesh, const std::string& prefix,
+                           size_t max_brick_triangles, size_t num_threads)
+    : num_triangles_(mesh.num_triangles()) {
+    turner::Profile _(turner::ProfCategory::KDTreeBuild);
+    assert(0 < max_brick_triangles);
+    if (mesh.num_triangles() >= std::numeric_limits<TriangleId>::max()) {
+        throw std::runtime_error("too many triangles for bricks");
+    }
+
+    // centroids of the triangles (scaled by 3)
+    const auto& vertices = mesh.vertices();
+    std::vector<Point3f> centroids;
+    centroids.reserve(mesh.num_triangles());
+    for (const auto& tri : mesh.indexed_triangles()) {
+        const Point3f& v0 = vertices[tri.vertices[0]];
+        const Point3f& v1 = vertices[tri.vertices[1]];
+        const Point3f& v2 = vertices[tri.vertices[2]];
+        centroids.emplace_back(v0.x + v1.x + v2.x, v0.y + v1.y + v2.y,
+                               v0.z + v1.z + v2.z);
+    }
+
+    // Split the triangles at the median of their centroids along the longest
+    // axis of the centroid box, until the bricks are small enough. The
+    // ranges are split depth first, s.t. neighboring bricks get consecutive
+    // ids.
+    std::vector<uint32_t> ids(mesh.num_triangles());
+    for (size_t id = 0; id < ids.size(); ++id) {
+        ids[id] = id;
+    }
+    std::vector<std::pair<size_t, size_t>> ranges;
+    if (!ids.empty()) {
+        ranges.emplace_back(0, ids.size());
+    }
+    std::vector<std::pair<size_t, size_t>> bricks;
+    std::vector<Point3f> points;
+    while (!ranges.empty()) {
+        const auto range = ranges.back();
+        ranges.pop_back();
+        if (range.second - range.first <= max_brick_triangles) {
+            bricks.push_back(range);
+            continue;
+        }
+
+        points.clear();
+        for (size_t i = range.first; i < range.second; ++i) {
+            points.push_back(centroids[ids[i]]);
+        }
+        const Vector3f extent = points_box(points).diagonal();
+        const int axis = extent.x >= extent.y && extent.x >= extent.z
+                             ? 0
+                             : (extent.y >= extent.z ? 1 : 2);
+        const size_t mid = range.first + (range.second - range.first) / 2;
+        std::nth_element(ids.begin() + range.first, ids.begin() + mid,
+                         ids.begin() + range.second,
+                         [&centroids, axis](uint32_t a, uint32_t b) {
+                             return centroids[a][axis] < centroids[b][axis];
+                         });
+        ranges.emplace_back(mid, range.second);
+        ranges.emplace_back(range.first, mid);
+    }
+
+    // Build the bricks one after another. Only the triangles and the tree of
+    // the current brick are in memory.
+    TriangleId first_id = 0;
+    for (const auto& range : bricks) {
+        Triangles tris;
+        tris.reserve(range.second - range.first);
+        points.clear();
+        for (size_t i = range.first; i < range.second; ++i) {
+            tris.push_back(mesh.triangle(ids[i]));
+            const Triangle& tri = tris.back();
+            points.insert(points.end(), tri.vertices.begin(),
+                          tri.vertices.end());
+            if (is_emissive(tri)) {
+                emissive_triangles_.push_back(tri);
+            }
+        }
+
+        Brick brick;
+        brick.box = points_box(points);
+        brick.filename = prefix + "." + std::to_string(bricks_.size());
+        brick.key = KDTree::cache_key(tris);
+        brick.first_id = first_id;
+        brick.num_triangles = tris.size();
+        first_id += tris.size();
+
+        KDTree tree;
+        if (!tree.map_file(brick.filename, brick.key)) {
+            tree = KDTree(std::move(tris),
+                          KDTree::BuildStrategy::PRESORTED_EVENTS,
+                          num_threads);
+            tree.write_file(brick.filename, brick.key);
+        }
+        bricks_.push_back(std::move(brick));
+    }
+}
+
+size_t BrickedScene::brick_index(TriangleId id) const {
+    assert(id < num_triangles());
+    // the last brick, whose first id is not after id
+    return std::upper_bound(bricks_.begin(), bricks_.end(), id,
+                            [](TriangleId id, const Brick& brick) {
+                                return id < brick.first_id;
+                            }) -
+           bricks_.begin() - 1;
+}
+
+//
+// BrickCache
+//
+
+BrickCache::BrickCache(const BrickedScene& scene, size_t budget_bytes)
+    : scene_(&scene)
+    , budget_bytes_(budget_bytes)
+    , entries_(scene.num_bricks()) {}
+
+std::shared_ptr<const KDTree> BrickCache::tree(size_t brick) {
+    assert(brick < entries_.size());
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto& entry = entries_[brick];
+        if (entry.tree) {
+            lru_.splice(lru_.end(), lru_, entry.position);
+            return entry.tree;
+        }
+    }
+
+    // map the tree without holding the lock
+    const auto& info = scene_->brick(brick);
+    auto tree = std::make_shared<KDTree>();
+    if (!tree->map_file(info.filename, info.key)) {
+        throw std::runtime_error("could not map brick " + info.filename);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& entry = entries_[brick];
+    if (entry.tree) {
+        // mapped by another thread meanwhile
+        lru_.splice(lru_.end(), lru_, entry.position);
+        return entry.tree;
+    }
+    entry.tree = std::move(tree);
+    entry.bytes = tree_bytes(*entry.tree);
+    entry.position = lru_.insert(lru_.end(), brick);
+    bytes_ += entry.bytes;
+    num_loads_ += 1;
+
+    // drop the least recently used trees, but not the one just mapped
+    while (bytes_ > budget_bytes_ && lru_.front() != brick) {
+        auto& dropped = entries_[lru_.front()];
+        bytes_ -= dropped.bytes;
+        dropped.tree.reset();
+        lru_.pop_front();
+    }
+    return entry.tree;
+}
+
+size_t BrickCache::bytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return bytes_;
+}
+
+size_t BrickCache::num_loads() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return num_loads_;
+}
+
+size_t BrickCache::tree_bytes(const KDTree& tree) {
+    return tree.num_nodes() * KDTree::node_size() +
+           tree.bundles().size() * sizeof(TriangleBundle) +
+           tree.num_triangles() * (sizeof(Triangle) + sizeof(CompactTriangle));
+}
+
+//
+// BrickIntersection
+//
+
+BrickIntersection::BrickIntersection(const BrickedScene& scene,
+                                     BrickCache& cache)
+    : scene_(&scene), cache_(&cache), queues_(scene.num_bricks()) {}
+
+const Triangle& BrickIntersection::operator[](const TriangleId id) const {
+    auto it = triangles_.find(id);
+    if (it == triangles_.end()) {
+        const size_t index = scene_->brick_index(id);
+        const auto tree = cache_->tree(index);
+        it = triangles_
+                 .emplace(id, (*tree)[id - scene_->brick(index).first_id])
+                 .first;
+    }
+    return it->second;
+}
+
+const Triangle& BrickIntersection::at(const TriangleId id) const {
+    if (scene_->num_triangles() <= id) {
+        throw std::out_of_range("BrickIntersection::at");
+    }
+    return (*this)[id];
+}
+
+const BrickIntersection::OptionalId
+BrickIntersection::intersect(const Ray& ray, float& r, float& a, float& b) {
+    // bricks hit by the ray front to back
+    const PrecomputedRay fixed_ray(ray);
+    hit_bricks_.clear();
+    for (size_t index = 0; index < scene_->num_bricks(); ++index) {
+        float tenter;
+        if (hit_box(fixed_ray, scene_->brick(index).box, ray.t_max, tenter)) {
+            hit_bricks_.emplace_back(tenter, index);
+        }
+    }
+    std::sort(hit_bricks_.begin(), hit_bricks_.end());
+
+    OptionalId res;
+    Ray brick_ray = ray;
+    for (const auto& hit_brick : hit_bricks_) {
+        // behind the closest hit
+        if (brick_ray.t_max < hit_brick.first) {
+            break;
+        }
+        const auto tree = cache_->tree(hit_brick.second);
+        KDTreeIntersection intersection(*tree);
+        float brick_r, brick_a, brick_b;
+        const auto id =
+            intersection.intersect(brick_ray, brick_r, brick_a, brick_b);
+        add_counts(intersection);
+        if (id && brick_r < brick_ray.t_max) {
+            res = OptionalId(scene_->brick(hit_brick.second).first_id +
+                             static_cast<TriangleId>(id));
+            brick_ray.t_max = r = brick_r;
+            a = brick_a;
+            b = brick_b;
+        }
+    }
+    if (!res) {
+        r = std::numeric_limits<float>::max();
+    }
+    return res;
+}
+
+bool BrickIntersection::occluded(const Ray& ray, float t_max) {
+    const PrecomputedRay fixed_ray(ray);
+    for (size_t index = 0; index < scene_->num_bricks(); ++index) {
+        float tenter;
+        if (!hit_box(fixed_ray, scene_->brick(index).box, t_max, tenter)) {
+            continue;
+        }
+        const auto tree = cache_->tree(index);
+        KDTreeIntersection intersection(*tree);
+        const bool is_occluded = intersection.occluded(ray, t_max);
+        add_counts(intersection);
+        if (is_occluded) {
+            return true;
+        }
+    }
+    return false;
+}
+
+BrickIntersection::HitPacket
+BrickIntersection::intersect_packet(const RayPacket& rays, unsigned active) {
+    HitPacket hits;
+    for (size_t i = 0; i < PACKET_SIZE; ++i) {
+        if (active & (1 << i)) {
+            auto& hit = hits[i];
+            hit.id = intersect(rays[i], hit.r, hit.a, hit.b);
+        }
+    }
+    return hits;
+}
+
+unsigned BrickIntersection::occluded_packet(
+    const RayPacket& rays, const std::array<float, PACKET_SIZE>& t_max,
+    unsigned active) {
+    unsigned occluded_mask = 0;
+    for (size_t i = 0; i < PACKET_SIZE; ++i) {
+        if ((active & (1 << i)) && occluded(rays[i], t_max[i])) {
+            occluded_mask |= 1 << i;
+        }
+    }
+    return occluded_mask;
+}
+
+void BrickIntersection::intersect_batch(ArrayView<Ray> rays,
+                                        std::vector<Hit>& hits) {
+    std::vector<float> t_max(rays.size());
+    for (size_t i = 0; i < rays.size(); ++i) {
+        t_max[i] = rays[i].t_max;
+    }
+    queue_rays(rays, t_max);
+
+    // The bricks are visited in the order of their ids, hence the closest hit
+    // so far only limits the rays, but does not skip bricks.
+    hits.assign(rays.size(), Hit());
+    for (size_t index = 0; index < queues_.size(); ++index) {
+        if (queues_[index].empty()) {
+            continue;
+        }
+        const auto tree = cache_->tree(index);
+        const TriangleId first_id = scene_->brick(index).first_id;
+        KDTreeIntersection intersection(*tree);
+        for (uint32_t i : queues_[index]) {
+            auto& hit = hits[i];
+            Ray ray = rays[i];
+            ray.t_max = std::min(ray.t_max, hit.r);
+            float r, a, b;
+            const auto id = intersection.intersect(ray, r, a, b);
+            if (id && r < hit.r) {
+                hit.id = OptionalId(first_id + static_cast<TriangleId>(id));
+                hit.r = r;
+                hit.a = a;
+                hit.b = b;
+            }
+        }
+        add_counts(intersection);
+    }
+}
+
+void BrickIntersection::occluded_batch(ArrayView<Ray> rays,
+                                       ArrayView<float> t_max,
+                                       std::vector<uint8_t>& occluded) {
+    assert(rays.size() == t_max.size());
+    queue_rays(rays, t_max);
+
+    occluded.assign(rays.size(), 0);
+    for (size_t index = 0; index < queues_.size(); ++index) {
+        if (queues_[index].empty()) {
+            continue;
+        }
+        const auto tree = cache_->tree(index);
+        KDTreeIntersection intersection(*tree);
+        for (uint32_t i : queues_[index]) {
+            if (!occluded[i]) {
+                occluded[i] = intersection.occluded(rays[i], t_max[i]);
+            }
+        }
+        add_counts(intersection);
+    }
+}
+
+void BrickIntersection::queue_rays(ArrayView<Ray> rays,
+                                   ArrayView<float> t_max) {
+    for (auto& queue : queues_) {
+        queue.clear();
+    }
+    for (size_t i = 0; i < rays.size(); ++i) {
+        const PrecomputedRay fixed_ray(rays[i]);
+        for (size_t index = 0; index < queues_.size(); ++index) {
+            float tenter;
+            if (hit_box(fixed_ray, scene_->brick(index).box, t_max[i],
+                        tenter)) {
+                queues_[index].push_back(i);
+            }
+        }
+    }
+}
+
+void BrickIntersection::add_counts(const KDTreeIntersection& intersection) {
+    counts_.nodes += intersection.traversal_counts().nodes;
+    counts_.triangles += intersection.traversal_counts().triangles;
+}
@@ -0,0 +1,224 @@
+/**
+ * Out-of-core acceleration structure for scenes, whose kd-tree does not fit
+ * into memory (cf. --accelerator=bricks of the tracers).
+ *
+ * The triangles are partitioned into spatial bricks by median splits of
+ * their centroids, until every brick has at most a given number of
+ * triangles. Every brick has its own kd-tree, which is written to its own
+ * file (cf. `KDTree::write_file`). The bricks are built one after another,
+ * i.e. the build needs memory for the indexed mesh of the scene and for a
+ * single brick, but not for the kd-tree of the whole scene.
+ *
+ * While rendering, the trees of the bricks are mapped from their files on
+ * demand, and kept in a cache with a memory budget, which drops the least
+ * recently used trees (cf. `BrickCache`). A batch of rays is queued per
+ * brick, whose box the rays hit, s.t. every brick is paged in at most once per
+ * batch (cf. `BrickIntersection::intersect_batch`).
+ *
+ * The triangle ids of a brick are consecutive, i.e. the triangle with id i in
+ * the tree of brick b has the id `brick(b).first_id + i`.
+ */
+
+#pragma once
+
+#include "indexed_mesh.h"
+#include "intersector.h"
+#include "kdtree.h"
+#include "triangle.h"
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class BrickedScene {
+public:
+    using TriangleId = detail::TriangleId;
+
+    static constexpr size_t DEFAULT_BRICK_TRIANGLES = 1 << 20;
+
+    struct Brick {
+        Bbox3f box;           // box of the triangles of the brick
+        std::string filename; // file of the kd-tree of the brick
+        uint64_t key;         // cf. `KDTree::cache_key`
+        TriangleId first_id;  // id of the first triangle of the brick
+        size_t num_triangles;
+    };
+
+    BrickedScene() = default;
+
+    /**
+     * Partition the triangles of the mesh into bricks, and write the kd-tree
+     * of every brick to its file. A brick, whose file contains the tree of
+     * the same triangles, is not built again (cf. `KDTree::load_or_build`).
+     *
+     * @param mesh                triangles of the scene
+     * @param prefix              the tree of brick i is written to
+     *                            "<prefix>.<i>"
+     * @param max_brick_triangles maximum number of triangles of a brick
+     * @param num_threads         cf. `KDTree::KDTree`
+     * @throw std::runtime_error, if a brick cannot be written
+     */
+    BrickedScene(const IndexedMesh& mesh, const std::string& prefix,
+                 size_t max_brick_triangles = DEFAULT_BRICK_TRIANGLES,
+                 size_t num_threads = 1);
+
+    size_t num_bricks() const { return bricks_.size(); }
+    const Brick& brick(size_t index) const { return bricks_[index]; }
+    size_t num_triangles() const { return num_triangles_; }
+
+    // index of the brick containing the triangle with the given id
+    size_t brick_index(TriangleId id) const;
+
+    /**
+     * Emissive triangles of all bricks, i.e. the area lights of the scene
+     * (cf. emitters.h), which are kept in memory.
+     */
+    const Triangles& emissive_triangles() const { return emissive_triangles_; }
+
+private:
+    std::vector<Brick> bricks_;
+    size_t num_triangles_ = 0;
+    Triangles emissive_triangles_;
+};
+
+/**
+ * Trees of the bricks of a scene, which are mapped from their files on demand.
+ * When the trees exceed the memory budget, the least recently used ones are
+ * dropped. A dropped tree stays alive, as long as it is used (cf. `tree`).
+ *
+ * The cache is shared by the threads of a rendering. A tree is mapped without
+ * holding the lock, s.t. threads needing other bricks are not blocked.
+ */
+class BrickCache {
+public:
+    /**
+     * @param scene        scene of the bricks, which must outlive the cache
+     * @param budget_bytes memory budget of the mapped trees; the last used
+     *                     tree is kept, even if it exceeds the budget
+     */
+    BrickCache(const BrickedScene& scene, size_t budget_bytes);
+
+    BrickCache(const BrickCache&) = delete;
+    BrickCache& operator=(const BrickCache&) = delete;
+
+    /**
+     * Tree of the brick, which is mapped from its file, if it is not cached.
+     *
+     * @throw std::runtime_error, if the file of the brick cannot be mapped
+     */
+    std::shared_ptr<const KDTree> tree(size_t brick);
+
+    // memory of the cached trees
+    size_t bytes() const;
+    // number of trees mapped from their files so far
+    size_t num_loads() const;
+
+    // memory of a tree, i.e. of its nodes, bundles and triangles
+    static size_t tree_bytes(const KDTree& tree);
+
+private:
+    struct Entry {
+        std::shared_ptr<const KDTree> tree;
+        size_t bytes = 0;
+        std::list<size_t>::iterator position; // in lru_
+    };
+
+    const BrickedScene* scene_;
+    const size_t budget_bytes_;
+    mutable std::mutex mutex_;
+    std::vector<Entry> entries_;
+    // indices of the cached bricks from the least to the most recently used
+    std::list<size_t> lru_;
+    size_t bytes_ = 0;
+    size_t num_loads_ = 0;
+};
+
+/**
+ * Wraps a bricked scene and its cache, and provides an interface for
+ * computing Ray-Triangle intersection.
+ *
+ * Batches are answered brick by brick (cf. above), and are the intended way
+ * of querying the scene, e.g. by the wavefront tracer. A single ray or packet
+ * visits the bricks, whose box it hits, front to back, and may page in a
+ * brick per ray.
+ */
+class BrickIntersection : public Intersector {
+public:
+    using TriangleId = BrickedScene::TriangleId;
+    using Intersector::intersect;
+    using Intersector::intersect_packet;
+    using Intersector::occluded_packet;
+
+    BrickIntersection(const BrickedScene& scene, BrickCache& cache);
+
+    /**
+     * The triangles are copied from the trees of their bricks, and cached in
+     * this intersection, s.t. the references stay valid as long as it exists,
+     * even if the brick is dropped from the cache. Hence, the memory grows
+     * with the number of different triangles looked up.
+     */
+    const Triangle& operator[](const TriangleId id) const override;
+    const Triangle& at(const TriangleId id) const override;
+
+    /**
+     * Cf. `Intersector::intersect`
+     */
+    const OptionalId intersect(const Ray& ray, float& r, float& a,
+                               float& b) override;
+
+    /**
+     * Cf. `Intersector::occluded`
+     */
+    bool occluded(const Ray& ray, float t_max) override;
+
+    /**
+     * The rays are intersected one by one.
+     *
+     * Cf. `Intersector::intersect_packet`
+     */
+    HitPacket intersect_packet(const RayPacket& rays,
+                               unsigned active) override;
+
+    /**
+     * The rays are tested one by one.
+     *
+     * Cf. `Intersector::occluded_packet`
+     */
+    unsigned occluded_packet(const RayPacket& rays,
+                             const std::array<float, PACKET_SIZE>& t_max,
+                             unsigned active) override;
+
+    /**
+     * The rays are queued per brick, whose box they hit, and every brick is
+     * intersected with its queue at once.
+     *
+     * Cf. `Intersector::intersect_batch`
+     */
+    void intersect_batch(ArrayView<Ray> rays,
+                         std::vector<Hit>& hits) override;
+
+    /**
+     * Cf. `intersect_batch` and `Intersector::occluded_batch`
+     */
+    void occluded_batch(ArrayView<Ray> rays, ArrayView<float> t_max,
+                        std::vector<uint8_t>& occluded) override;
+
+private:
+    // Queue the rays per brick, whose box they hit before their t_max.
+    void queue_rays(ArrayView<Ray> rays, ArrayView<float> t_max);
+
+    // Add the traversal counts of an intersection of a brick.
+    void add_counts(const KDTreeIntersection& intersection);
+
+    const BrickedScene* scene_;
+    BrickCache* cache_;
+    // ids of the rays of a batch queued per brick
+    std::vector<std::vector<uint32_t>> queues_;
+    // bricks hit by a single ray with the distance, at which it enters them
+    std::vector<std::pair<float, size_t>> hit_bricks_;
+    mutable std::unordered_map<TriangleId, Triangle> triangles_;
+};
@@ -0,0 +1,441 @@
+#include "bvh.h"
+
+#include "intersection.h"
+#include "profile.h"
+
+#include <algorithm>
+#include <cassert>
+#include <functional>
+#include <limits>
+#include <xmmintrin.h>
+
+namespace {
+
+using TriangleId = BVH::TriangleId;
+
+// Same costs as for the kd-tree, cf. [WH06], 5.2, Table 1
+constexpr float COST_TRAVERSAL = 15;
+constexpr float COST_INTERSECTION = 20;
+
+// Cf. [Wal07], 3.2: 16 bins are as good as a full sweep in practice.
+constexpr size_t NUM_BINS = 16;
+
+// Leaves with more primitives are split, even if the SAH does not favor it.
+constexpr size_t MAX_LEAF_SIZE = 4 * TriangleBundle::SIZE;
+
+// Leaf triangles are intersected a bundle at a time (cf. kd-tree). The cost
+// of other primitives is estimated in the same way.
+size_t num_bundles(size_t num_prims) {
+    return (num_prims + TriangleBundle::SIZE - 1) / TriangleBundle::SIZE;
+}
+
+// Box containing nothing, s.t. the union with it is the other box (the
+// default box is infinite).
+Bbox3f empty_box() {
+    Bbox3f box;
+    box.p_min = Point3f(std::numeric_limits<float>::infinity(),
+                        std::numeric_limits<float>::infinity(),
+                        std::numeric_limits<float>::infinity());
+    box.p_max = Point3f(-std::numeric_limits<float>::infinity(),
+                        -std::numeric_limits<float>::infinity(),
+                        -std::numeric_limits<float>::infinity());
+    return box;
+}
+
+} // namespace anonymous
+
+detail::BinaryBVH::BinaryBVH(std::vector<Bbox3f> boxes,
+                             std::vector<Point3f> centroids)
+    : ids(boxes.size())
+    , boxes_(std::move(boxes))
+    , centroids_(std::move(centroids)) {
+    assert(boxes_.size() == centroids_.size());
+    for (size_t i = 0; i < ids.size(); ++i) {
+        ids[i] = i;
+    }
+    if (!ids.empty()) {
+        build(0, ids.size());
+    }
+}
+
+uint32_t detail::BinaryBVH::build(uint32_t begin, uint32_t end) {
+    const size_t num_prims = end - begin;
+    assert(0 < num_prims);
+
+    Bbox3f box = empty_box();
+    Bbox3f centroid_box = empty_box();
+    for (uint32_t i = begin; i < end; ++i) {
+        box = bbox_union(box, boxes_[ids[i]]);
+        centroid_box = bbox_union(centroid_box, centroids_[ids[i]]);
+    }
+
+    const uint32_t index = nodes.size();
+    nodes.emplace_back();
+    nodes[index].box = box;
+    nodes[index].begin = begin;
+    nodes[index].end = end;
+
+    // too few primitives -> terminate
+    if (num_prims <= TriangleBundle::SIZE) {
+        return index;
+    }
+
+    // Bins of the centroids along every axis, s.t. the primitives of the
+    // bins [0, split) go to the left child, the others to the right one.
+    float min_cost = std::numeric_limits<float>::infinity();
+    size_t split_ax = 0, split_bin = 0;
+    const float area = box.surface_area();
+    for (size_t ax = 0; ax < 3; ++ax) {
+        const float extent = centroid_box.p_max[ax] - centroid_box.p_min[ax];
+        if (!(0 < extent)) {
+            continue;
+        }
+
+        size_t counts[NUM_BINS] = {};
+        Bbox3f bin_boxes[NUM_BINS];
+        std::fill(std::begin(bin_boxes), std::end(bin_boxes), empty_box());
+        for (uint32_t i = begin; i < end; ++i) {
+            const size_t bin = bin_index(centroid_box, ax, ids[i]);
+            counts[bin] += 1;
+            bin_boxes[bin] = bbox_union(bin_boxes[bin], boxes_[ids[i]]);
+        }
+
+        // sweep from the right to get the area and count of the right
+        // children of all splits
+        float rareas[NUM_BINS];
+        size_t rcounts[NUM_BINS];
+        Bbox3f rbox = empty_box();
+        size_t rcount = 0;
+        for (size_t bin = NUM_BINS - 1; 0 < bin; --bin) {
+            rbox = bbox_union(rbox, bin_boxes[bin]);
+            rcount += counts[bin];
+            rareas[bin] = rcount ? rbox.surface_area() : 0;
+            rcounts[bin] = rcount;
+        }
+
+        Bbox3f lbox = empty_box();
+        size_t lcount = 0;
+        for (size_t split = 1; split < NUM_BINS; ++split) {
+            lbox = bbox_union(lbox, bin_boxes[split - 1]);
+            lcount += counts[split - 1];
+            if (lcount == 0 || rcounts[split] == 0) {
+                continue;
+            }
+            const float cost =
+                COST_TRAVERSAL +
+                COST_INTERSECTION *
+                    (lbox.surface_area() * num_bundles(lcount) +
+                     rareas[split] * num_bundles(rcounts[split])) /
+                    area;
+            if (cost < min_cost) {
+                min_cost = cost;
+                split_ax = ax;
+                split_bin = split;
+            }
+        }
+    }
+
+    uint32_t mid;
+    if (min_cost < std::numeric_limits<float>::infinity()) {
+        // automatic termination
+        if (COST_INTERSECTION * num_bundles(num_prims) <= min_cost &&
+            num_prims <= MAX_LEAF_SIZE) {
+            return index;
+        }
+        mid = std::partition(ids.begin() + begin, ids.begin() + end,
+                             [&](uint32_t id) {
+                                 return bin_index(centroid_box, split_ax,
+                                                  id) < split_bin;
+                             }) -
+              ids.begin();
+    } else {
+        // All centroids coincide, hence any split is as good as another.
+        if (num_prims <= MAX_LEAF_SIZE) {
+            return index;
+        }
+        mid = begin + num_prims / 2;
+    }
+    assert(begin < mid && mid < end);
+
+    const uint32_t left = build(begin, mid);
+    const uint32_t right = build(mid, end);
+    nodes[index].left = left;
+    nodes[index].right = right;
+    return index;
+}
+
+size_t detail::BinaryBVH::bin_index(const Bbox3f& centroid_box, size_t ax,
+                                    uint32_t id) const {
+    const float extent = centroid_box.p_max[ax] - centroid_box.p_min[ax];
+    const float pos = centroids_[id][ax] - centroid_box.p_min[ax];
+    return std::min(NUM_BINS - 1,
+                    static_cast<size_t>(NUM_BINS * (pos / extent)));
+}
+
+BVH::BVH(Triangles tris) : tris_(std::move(tris)) {
+    turner::Profile _(turner::ProfCategory::KDTreeBuild);
+    if (tris_.empty()) {
+        return;
+    }
+    std::vector<Bbox3f> boxes;
+    std::vector<Point3f> centroids;
+    boxes.reserve(tris_.size());
+    centroids.reserve(tris_.size());
+    for (const auto& tri : tris_) {
+        boxes.push_back(tri.bbox());
+        centroids.push_back(
+            (tri.vertices[0] + tri.vertices[1] + tri.vertices[2]) / 3.f);
+    }
+    const detail::BinaryBVH builder(std::move(boxes), std::move(centroids));
+    box_ = builder.nodes.front().box;
+
+    // Collapse the binary tree: the children of a node are the children of a
+    // binary node, where inner children with the largest surface area are
+    // replaced by their children, until there are 4 children (cf. [Wal07]).
+    const auto& bnodes = builder.nodes;
+    std::function<size_t(uint32_t)> collapse = [&](uint32_t bindex) {
+        std::vector<uint32_t> children;
+        if (bnodes[bindex].is_leaf()) {
+            children.push_back(bindex);
+        } else {
+            children = {bnodes[bindex].left, bnodes[bindex].right};
+        }
+        while (children.size() < detail::BVHNode::WIDTH) {
+            auto largest = children.end();
+            for (auto it = children.begin(); it != children.end(); ++it) {
+                if (!bnodes[*it].is_leaf() &&
+                    (largest == children.end() ||
+                     bnodes[*largest].box.surface_area() <
+                         bnodes[*it].box.surface_area())) {
+                    largest = it;
+                }
+            }
+            if (largest == children.end()) {
+                break;
+            }
+            const uint32_t replaced = *largest;
+            *largest = bnodes[replaced].left;
+            children.push_back(bnodes[replaced].right);
+        }
+
+        const size_t index = nodes_.size();
+        nodes_.emplace_back();
+        size_t height = 1;
+        for (size_t i = 0; i < detail::BVHNode::WIDTH; ++i) {
+            const Bbox3f box =
+                i < children.size() ? bnodes[children[i]].box : empty_box();
+            for (size_t ax = 0; ax < 3; ++ax) {
+                nodes_[index].bounds[0][ax][i] = box.p_min[ax];
+                nodes_[index].bounds[1][ax][i] = box.p_max[ax];
+            }
+            nodes_[index].child[i] = 0;
+            nodes_[index].num_bundles[i] = 0;
+            if (children.size() <= i) {
+                continue;
+            }
+
+            const auto& bnode = bnodes[children[i]];
+            if (bnode.is_leaf()) {
+                const size_t first_bundle = bundles_.size();
+                for (uint32_t k = bnode.begin; k < bnode.end; ++k) {
+                    const size_t lane =
+                        (k - bnode.begin) % TriangleBundle::SIZE;
+                    if (lane == 0) {
+                        bundles_.emplace_back();
+                    }
+                    const TriangleId id = builder.ids[k];
+                    bundles_.back().set(lane, tris_[id], id);
+                }
+                nodes_[index].child[i] = first_bundle;
+                nodes_[index].num_bundles[i] = bundles_.size() - first_bundle;
+            } else {
+                // the vector of nodes may be reallocated
+                const size_t child = collapse(children[i]);
+                nodes_[index].child[i] = child;
+                height = std::max(height, 1 + height_);
+            }
+        }
+        height_ = height;
+        return index;
+    };
+    collapse(0);
+}
+
+namespace {
+
+/**
+ * Slab test of a ray against the boxes of the 4 children of a node at once
+ * (cf. `intersect_ray_box`), clipped to [0, t_max].
+ *
+ * @param  tenter out param containing the distance, at which the ray enters
+ *                the box of each child
+ * @return        mask of the children hit (bit i for child i)
+ */
+inline int intersect_children(const detail::BVHNode& node,
+                              const PrecomputedRay& ray, const __m128 o[3],
+                              const __m128 d_inv[3], float t_max,
+                              __m128& tenter) {
+    // Enlarge the interval by a few ulps, s.t. rounding errors do not let
+    // rays slip through at the faces of the boxes.
+    static constexpr float ROBUST_FACTOR = 1 + 8 * 0.5f * 1.19209290e-7f;
+
+    __m128 tmin = _mm_setzero_ps();
+    __m128 tmax = _mm_set1_ps(t_max);
+    for (size_t ax = 0; ax < 3; ++ax) {
+        const __m128 near = _mm_load_ps(node.bounds[ray.sign[ax]][ax]);
+        const __m128 far = _mm_load_ps(node.bounds[1 - ray.sign[ax]][ax]);
+        tmin = _mm_max_ps(tmin,
+                          _mm_mul_ps(_mm_sub_ps(near, o[ax]), d_inv[ax]));
+        tmax = _mm_min_ps(tmax, _mm_mul_ps(_mm_sub_ps(far, o[ax]), d_inv[ax]));
+    }
+    tenter = tmin;
+    return _mm_movemask_ps(
+        _mm_cmple_ps(tmin, _mm_mul_ps(tmax, _mm_set1_ps(ROBUST_FACTOR))));
+}
+
+} // namespace anonymous
+
+const BVHIntersection::OptionalId
+BVHIntersection::intersect(const Ray& ray, float& r, float& a, float& b) {
+    r = std::numeric_limits<float>::max();
+    return intersect(ray, ray.t_max, r, a, b);
+}
+
+const BVHIntersection::OptionalId
+BVHIntersection::intersect(const Ray& ray, float t_max, float& r, float& a,
+                           float& b) {
+    turner::Profile _(turner::ProfCategory::Intersect);
+    OptionalId res;
+    float min_r = t_max;
+    if (bvh_->nodes_.empty()) {
+        return res;
+    }
+
+    const PrecomputedRay fixed_ray(ray);
+    const __m128 o[3] = {_mm_set1_ps(ray.o.x), _mm_set1_ps(ray.o.y),
+                         _mm_set1_ps(ray.o.z)};
+    const __m128 d_inv[3] = {_mm_set1_ps(fixed_ray.d_inv.x),
+                             _mm_set1_ps(fixed_ray.d_inv.y),
+                             _mm_set1_ps(fixed_ray.d_inv.z)};
+    const auto* bundles = bvh_->bundles_.data();
+
+    StackEntry* stack = stack_.data();
+    size_t stack_size = 0;
+    stack[stack_size++] = {0, 0, 0};
+    while (stack_size > 0) {
+        const StackEntry entry = stack[--stack_size];
+        // behind the closest hit
+        if (min_r < entry.tenter) {
+            continue;
+        }
+
+        if (entry.num_bundles > 0) {
+            float leaf_r = min_r, leaf_a, leaf_b;
+            const uint32_t id = intersect_ray_bundles(
+                ray, bundles + entry.index,
+                bundles + entry.index + entry.num_bundles, leaf_r, leaf_a,
+                leaf_b);
+            if (id != TriangleBundle::INVALID_ID) {
+                res = OptionalId{id};
+                min_r = r = leaf_r;
+                a = leaf_a;
+                b = leaf_b;
+            }
+            continue;
+        }
+
+        const auto& node = bvh_->nodes_[entry.index];
+        __m128 tenter;
+        const int mask =
+            intersect_children(node, fixed_ray, o, d_inv, min_r, tenter);
+        alignas(16) float tenters[detail::BVHNode::WIDTH];
+        _mm_store_ps(tenters, tenter);
+
+        // push the children from far to near, s.t. the nearest child is
+        // visited first
+        const size_t first = stack_size;
+        for (size_t i = 0; i < detail::BVHNode::WIDTH; ++i) {
+            if (!(mask & (1 << i))) {
+                continue;
+            }
+            StackEntry child{node.child[i], node.num_bundles[i], tenters[i]};
+            size_t k = stack_size++;
+            for (; first < k && stack[k - 1].tenter < child.tenter; --k) {
+                stack[k] = stack[k - 1];
+            }
+            assert(stack_size <= stack_.size());
+            stack[k] = child;
+        }
+    }
+    return res;
+}
+
+const BVHIntersection::OptionalId
+BVHIntersection::occluder(const Ray& ray, float t_max) {
+    turner::Profile _(turner::ProfCategory::Intersect);
+    if (bvh_->nodes_.empty()) {
+        return {};
+    }
+
+    const PrecomputedRay fixed_ray(ray);
+    const __m128 o[3] = {_mm_set1_ps(ray.o.x), _mm_set1_ps(ray.o.y),
+                         _mm_set1_ps(ray.o.z)};
+    const __m128 d_inv[3] = {_mm_set1_ps(fixed_ray.d_inv.x),
+                             _mm_set1_ps(fixed_ray.d_inv.y),
+                             _mm_set1_ps(fixed_ray.d_inv.z)};
+    const auto* bundles = bvh_->bundles_.data();
+
+    // same traversal as in `intersect`, except that the order of the children
+    // does not matter
+    StackEntry* stack = stack_.data();
+    size_t stack_size = 0;
+    stack[stack_size++] = {0, 0, 0};
+    while (stack_size > 0) {
+        const StackEntry entry = stack[--stack_size];
+        if (entry.num_bundles > 0) {
+            const OptionalId id{occluder_in_bundles(
+                ray, bundles + entry.index,
+                bundles + entry.index + entry.num_bundles, t_max)};
+            if (id) {
+                return id;
+            }
+            continue;
+        }
+
+        const auto& node = bvh_->nodes_[entry.index];
+        __m128 tenter;
+        const int mask =
+            intersect_children(node, fixed_ray, o, d_inv, t_max, tenter);
+        for (size_t i = 0; i < detail::BVHNode::WIDTH; ++i) {
+            if (mask & (1 << i)) {
+                assert(stack_size < stack_.size());
+                stack[stack_size++] = {node.child[i], node.num_bundles[i], 0};
+            }
+        }
+    }
+    return {};
+}
+
+BVHIntersection::HitPacket
+BVHIntersection::intersect_packet(const RayPacket& rays, unsigned active) {
+    HitPacket hits;
+    for (size_t i = 0; i < PACKET_SIZE; ++i) {
+        if (active & (1 << i)) {
+            auto& hit = hits[i];
+            hit.id = intersect(rays[i], hit.r, hit.a, hit.b);
+        }
+    }
+    return hits;
+}
+
+unsigned BVHIntersection::occluded_packet(
+    const RayPacket& rays, const std::array<float, PACKET_SIZE>& t_max,
+    unsigned active) {
+    unsigned occluded_mask = 0;
+    for (size_t i = 0; i < PACKET_SIZE; ++i) {
+        if ((active & (1 << i)) && occluded(rays[i], t_max[i])) {
+            occluded_mask |= 1 << i;
+        }
+    }
+    return occluded_mask;
+}
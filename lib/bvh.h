@@ -0,0 +1,233 @@
+/**
+ * Bounding volume hierarchy (BVH) storing a set of triangles and providing a
+ * fast intersection lookup. Alternative to the kd-tree (cf. kdtree.h).
+ *
+ * Contrary to the kd-tree, every triangle is referenced by exactly one leaf,
+ * i.e. triangles are never clipped at the cells, and long thin triangles do
+ * not end up in many leaves. The number of triangles is only limited by the
+ * 32 bit triangle ids.
+ *
+ * The hierarchy is built as binary tree with the binned surface area
+ * heuristic (SAH) following the article:
+ *
+ * "On fast Construction of SAH-based Bounding Volume Hierarchies"
+ * by Ingo Wald
+ * [Wal07]
+ *
+ * Afterwards, the binary tree is collapsed into a tree with 4 children per
+ * node, s.t. a ray is tested against the boxes of all children of a node at
+ * once (SSE). The triangles of a leaf are stored in bundles (cf.
+ * TriangleBundle), like in the leaves of the kd-tree.
+ */
+
+#pragma once
+
+#include "aligned_allocator.h"
+#include "intersector.h"
+#include "triangle.h"
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+namespace detail {
+
+/**
+ * Node of a BVH with 4 children.
+ *
+ * A child is either an inner node, or a leaf consisting of consecutive
+ * bundles. Unused children have an empty box, which is never hit.
+ */
+struct alignas(64) BVHNode {
+    static constexpr size_t WIDTH = 4;
+
+    // bounds[0][ax] (bounds[1][ax]) contains the minimal (maximal) coordinate
+    // along axis ax of the box of every child
+    float bounds[2][3][WIDTH];
+    // index of the node of an inner child, or of the first bundle of a leaf
+    uint32_t child[WIDTH];
+    // number of bundles of a leaf, 0 for an inner child
+    uint32_t num_bundles[WIDTH];
+};
+
+static_assert(sizeof(BVHNode) == 128, "BVH node should fill two cache lines");
+
+/**
+ * Binary BVH over primitives given by their boxes and centroids, built with
+ * the binned SAH (cf. [Wal07], 3.1 and 3.2).
+ *
+ * The primitives are e.g. the triangles of a BVH, or the instances of an
+ * instanced scene (cf. instancing.h).
+ */
+class BinaryBVH {
+public:
+    // Node of the binary BVH. A leaf contains the primitives ids[begin, end).
+    struct Node {
+        Bbox3f box;
+        uint32_t left = 0; // 0 for a leaf, since the root is no child
+        uint32_t right = 0;
+        uint32_t begin = 0;
+        uint32_t end = 0;
+
+        bool is_leaf() const { return left == 0; }
+    };
+
+    /**
+     * @param boxes     box of every primitive
+     * @param centroids point of every primitive, by which it is binned
+     */
+    BinaryBVH(std::vector<Bbox3f> boxes, std::vector<Point3f> centroids);
+
+    // The root is the first node. There are no nodes for no primitives.
+    std::vector<Node> nodes;
+    // Primitive ids, s.t. every leaf references a range of them.
+    std::vector<uint32_t> ids;
+
+private:
+    /**
+     * Build the subtree of the primitives ids[begin, end).
+     *
+     * @return index of the root of the subtree
+     */
+    uint32_t build(uint32_t begin, uint32_t end);
+
+    size_t bin_index(const Bbox3f& centroid_box, size_t ax, uint32_t id) const;
+
+    std::vector<Bbox3f> boxes_;
+    std::vector<Point3f> centroids_;
+};
+
+} // namespace detail
+
+class BVHIntersection;
+
+class BVH {
+    friend BVHIntersection;
+
+public:
+    using TriangleId = detail::TriangleId;
+
+    using Nodes =
+        std::vector<detail::BVHNode, AlignedAllocator<detail::BVHNode, 64>>;
+    using TriangleBundles =
+        std::vector<TriangleBundle, AlignedAllocator<TriangleBundle, 64>>;
+
+    BVH() = default;
+
+    /**
+     * Build up the BVH.
+     *
+     * @param tris triangles to store in the BVH
+     */
+    explicit BVH(Triangles tris);
+
+    size_t height() const { return height_; }
+    size_t num_nodes() const { return nodes_.size(); }
+    size_t num_triangles() const { return tris_.size(); }
+    const Triangles& triangles() const { return tris_; }
+    const Bbox3f& box() const { return box_; }
+    const Triangle& operator[](const TriangleId id) const { return tris_[id]; }
+    const Triangle& at(const TriangleId id) const { return tris_.at(id); }
+
+private:
+    Triangles tris_;
+    Bbox3f box_;
+    // number of inner nodes on the longest path from the root to a leaf
+    size_t height_ = 0;
+
+    // The root is the first node. A BVH of no triangles has no nodes.
+    Nodes nodes_;
+    // Compact triangles of all leaves; the triangles of a leaf are stored in
+    // consecutive bundles.
+    TriangleBundles bundles_;
+};
+
+/**
+ * Wraps a BVH and provides an interface for computing Ray-Triangle
+ * intersection.
+ */
+class BVHIntersection : public Intersector {
+public:
+    using TriangleId = BVH::TriangleId;
+    using Intersector::intersect;
+    using Intersector::intersect_packet;
+    using Intersector::occluded_packet;
+
+    // At most 3 entries per level of the tree are pushed while descending.
+    explicit BVHIntersection(const BVH& bvh)
+        : bvh_(&bvh), stack_(3 * bvh.height() + 1) {}
+
+    const Triangle& operator[](const TriangleId id) const override {
+        return (*bvh_)[id];
+    }
+    const Triangle& at(const TriangleId id) const override {
+        return bvh_->at(id);
+    }
+
+    /**
+     * The children of a node are visited front to back, and children behind
+     * the closest hit found so far are skipped.
+     *
+     * Cf. `Intersector::intersect`
+     */
+    const OptionalId intersect(const Ray& ray, float& r, float& a,
+                               float& b) override;
+
+    /**
+     * Find the closest triangle hit by the ray before t_max, e.g. to find the
+     * closest hit in several BVHs (cf. instancing.h).
+     *
+     * @param  ray   Ray for which the intersection will be computed
+     * @param  t_max only triangles hit at a distance < t_max are considered
+     * @param  r     distance from ray to triangle (if intersection exists,
+     *               otherwise unchanged)
+     * @param  a, b  barycentric coordinates of the intersection point
+     * @return       optional id of the triangle hit by the ray
+     */
+    const OptionalId intersect(const Ray& ray, float t_max, float& r, float& a,
+                               float& b);
+
+    /**
+     * The traversal terminates at the first triangle found.
+     *
+     * Cf. `Intersector::occluded`
+     */
+    bool occluded(const Ray& ray, float t_max) override {
+        return static_cast<bool>(occluder(ray, t_max));
+    }
+
+    /**
+     * Same traversal as `occluded`, which returns the triangle found.
+     *
+     * Cf. `Intersector::occluder`
+     */
+    const OptionalId occluder(const Ray& ray, float t_max) override;
+
+    /**
+     * The rays are intersected one by one, since the nodes are already tested
+     * with SSE.
+     *
+     * Cf. `Intersector::intersect_packet`
+     */
+    HitPacket intersect_packet(const RayPacket& rays,
+                               unsigned active) override;
+
+    /**
+     * The rays are tested one by one (cf. `intersect_packet`).
+     *
+     * Cf. `Intersector::occluded_packet`
+     */
+    unsigned occluded_packet(const RayPacket& rays,
+                             const std::array<float, PACKET_SIZE>& t_max,
+                             unsigned active) override;
+
+private:
+    struct StackEntry {
+        uint32_t index;       // node index, or first bundle of a leaf
+        uint32_t num_bundles; // 0 for an inner node
+        float tenter;         // distance at which the ray enters the box
+    };
+
+    const BVH* bvh_;
+    std::vector<StackEntry> stack_;
+};
@@ -0,0 +1,130 @@
+/**
+ * Generation of primary rays.
+ *
+ * `Camera::raster2cam` is linear in the raster coordinates. Hence, the
+ * direction of the primary ray through the raster point (x, y) is
+ *
+ *     d(x, y) = d(0, 0) + x * step_x + y * step_y,
+ *
+ * where step_x resp. step_y is the increment of the direction per column
+ * resp. row. The generator precomputes these vectors once per image, and
+ * computes directions of many raster points at once in SoA form.
+ */
+
+#pragma once
+
+#include "aligned_allocator.h"
+#include "intersector.h"
+#include "types.h"
+
+#include <xmmintrin.h>
+
+#include <array>
+#include <cassert>
+#include <vector>
+
+/**
+ * Directions of rays in SoA form, e.g. of all samples of a tile.
+ */
+struct RayDirections {
+    using Floats = std::vector<float, AlignedAllocator<float, 16>>;
+    Floats x, y, z;
+
+    size_t size() const { return x.size(); }
+    void resize(size_t n) {
+        x.resize(n);
+        y.resize(n);
+        z.resize(n);
+    }
+    Vector3f operator[](size_t i) const { return {x[i], y[i], z[i]}; }
+};
+
+class CameraRays {
+public:
+    static constexpr size_t PACKET_SIZE = Intersector::PACKET_SIZE;
+
+    CameraRays(const Camera& cam, int width, int height)
+        : origin_(cam.mPosition.x, cam.mPosition.y, cam.mPosition.z) {
+        // The increments are computed over the whole image, s.t. their
+        // rounding errors are not multiplied by the raster coordinates.
+        const float w = width;
+        const float h = height;
+        base_ = cam.raster2cam({0, 0}, w, h);
+        step_x_ = (cam.raster2cam({w, 0}, w, h) - base_) / w;
+        step_y_ = (cam.raster2cam({0, h}, w, h) - base_) / h;
+    }
+
+    const Point3f& origin() const { return origin_; }
+
+    // direction through the raster point (0, 0), and its increments per
+    // column and row (cf. above)
+    const Vector3f& base() const { return base_; }
+    const Vector3f& step_x() const { return step_x_; }
+    const Vector3f& step_y() const { return step_y_; }
+
+    /**
+     * Direction of the primary ray through the raster point (x, y) (cf.
+     * `Camera::raster2cam`).
+     */
+    Vector3f direction(float x, float y) const {
+        return base_ + x * step_x_ + y * step_y_;
+    }
+
+    Ray ray(float x, float y) const { return Ray(origin_, direction(x, y)); }
+
+    /**
+     * Directions of the primary rays through the raster points (xs[i],
+     * ys[i]), computed `PACKET_SIZE` at a time.
+     *
+     * @param xs, ys raster coordinates of the points; the size has to be a
+     *               multiple of `PACKET_SIZE`
+     * @param dirs   the directions are stored in it
+     */
+    void directions(const RayDirections::Floats& xs,
+                    const RayDirections::Floats& ys,
+                    RayDirections& dirs) const {
+        assert(xs.size() == ys.size());
+        assert(xs.size() % PACKET_SIZE == 0);
+        static_assert(PACKET_SIZE == 4, "directions are computed with SSE");
+
+        dirs.resize(xs.size());
+        const __m128 base[3] = {_mm_set1_ps(base_.x), _mm_set1_ps(base_.y),
+                                _mm_set1_ps(base_.z)};
+        const __m128 step_x[3] = {_mm_set1_ps(step_x_.x),
+                                  _mm_set1_ps(step_x_.y),
+                                  _mm_set1_ps(step_x_.z)};
+        const __m128 step_y[3] = {_mm_set1_ps(step_y_.x),
+                                  _mm_set1_ps(step_y_.y),
+                                  _mm_set1_ps(step_y_.z)};
+        float* out[3] = {dirs.x.data(), dirs.y.data(), dirs.z.data()};
+        for (size_t i = 0; i < xs.size(); i += PACKET_SIZE) {
+            const __m128 x = _mm_load_ps(xs.data() + i);
+            const __m128 y = _mm_load_ps(ys.data() + i);
+            for (int ax = 0; ax < 3; ++ax) {
+                _mm_store_ps(out[ax] + i,
+                             _mm_add_ps(_mm_add_ps(base[ax],
+                                                   _mm_mul_ps(x, step_x[ax])),
+                                        _mm_mul_ps(y, step_y[ax])));
+            }
+        }
+    }
+
+    /**
+     * Packet of the primary rays with the directions dirs[i], ...,
+     * dirs[i + PACKET_SIZE - 1].
+     */
+    Intersector::RayPacket packet(const RayDirections& dirs, size_t i) const {
+        assert(i + PACKET_SIZE <= dirs.size());
+        Intersector::RayPacket rays;
+        for (size_t k = 0; k < PACKET_SIZE; ++k) {
+            rays[k] = Ray(origin_, dirs[i + k]);
+        }
+        return rays;
+    }
+
+private:
+    Point3f origin_;
+    Vector3f base_;
+    Vector3f step_x_;
+    Vector3f step_y_;
+};
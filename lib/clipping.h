@@ -6,6 +6,9 @@
 
 #include "output.h"
 
+#include <array>
+#include <vector>
+
 /**
  * Cohen-Sutherland line clipping on AABB in 3d
  */
@@ -129,16 +132,54 @@ inline PointPlanePos classify_point_to_plane(const Point3f& p,
     return PointPlanePos::ON_PLANE;
 }
 
+/**
+ * Polygon with a fixed capacity, s.t. clipping does not allocate.
+ *
+ * Clipping a convex polygon at a plane adds at most one point, hence a
+ * triangle clipped at the 6 planes of a box has at most 9 points. The
+ * capacity leaves room for points added due to the thickness of the planes.
+ */
+class ClipPolygon {
+public:
+    static constexpr size_t CAPACITY = 16;
+
+    ClipPolygon() = default;
+    explicit ClipPolygon(const std::array<Point3f, 3>& tri)
+        : points_{{tri[0], tri[1], tri[2]}}, size_(3) {}
+
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    void clear() { size_ = 0; }
+
+    void emplace_back(const Point3f& p) {
+        assert(size_ < CAPACITY);
+        points_[size_++] = p;
+    }
+
+    const Point3f& back() const {
+        assert(size_ > 0);
+        return points_[size_ - 1];
+    }
+
+    const Point3f* begin() const { return points_.data(); }
+    const Point3f* end() const { return points_.data() + size_; }
+
+private:
+    std::array<Point3f, CAPACITY> points_;
+    size_t size_ = 0;
+};
+
 /**
  * Sutherland-Hodgman polygon clipping at a (thick) plane.
+ *
+ * @param poly   polygon to clip (`ClipPolygon` or `std::vector<Point3f>`)
+ * @param points the clipped polygon is appended to it
  */
-inline std::vector<Point3f>
-clip_polygon_at_plane(const std::vector<Point3f>& poly, const Normal3f& n,
-                      float d) {
+template <typename Polygon>
+void clip_polygon_at_plane(const Polygon& poly, const Normal3f& n, float d,
+                           Polygon& points) {
     assert(poly.size() > 1);
 
-    std::vector<Point3f> points;
-
     Point3f a = poly.back();
     auto a_side = classify_point_to_plane(a, n, d);
 
@@ -182,7 +223,13 @@ clip_polygon_at_plane(const std::vector<Point3f>& poly, const Normal3f& n,
         a = b;
         a_side = b_side;
     }
+}
 
+inline std::vector<Point3f>
+clip_polygon_at_plane(const std::vector<Point3f>& poly, const Normal3f& n,
+                      float d) {
+    std::vector<Point3f> points;
+    clip_polygon_at_plane(poly, n, d, points);
     return points;
 }
 
@@ -192,12 +239,13 @@ clip_polygon_at_plane(const std::vector<Point3f>& poly, const Normal3f& n,
  * Requirement: triangle and box intersect.
  *
  * Return:
- *   the bounding box of the clipped polygon.
- *
- * TODO: Do not allocate std::vector inside of this function.
+ *   the bounding box of the clipped polygon, or an empty box if the triangle
+ *   touches the box only in a single point (up to EPS).
  */
 inline Bbox3f clip_triangle_at_aabb(const Triangle& tri, const Bbox3f& box) {
-    std::vector<Point3f> points(tri.vertices.begin(), tri.vertices.end());
+    // the polygon is clipped back and forth between two buffers
+    ClipPolygon buffers[2] = {ClipPolygon(tri.vertices), ClipPolygon()};
+    int current = 0;
 
     // clip at 6 planes defined by box
     for (auto ax : AXES3) {
@@ -206,12 +254,16 @@ inline Bbox3f clip_triangle_at_aabb(const Triangle& tri, const Bbox3f& box) {
             normal[ax] = side == 0 ? 1 : -1;
             float dist = side == 0 ? box.p_min[ax] : -box.p_max[ax];
 
-            points = clip_polygon_at_plane(points, normal, dist);
-            if (points.size() < 2) {
-                return {};
+            auto& clipped = buffers[1 - current];
+            clipped.clear();
+            clip_polygon_at_plane(buffers[current], normal, dist, clipped);
+            current = 1 - current;
+            if (clipped.size() < 2) {
+                return Bbox3f(box.p_min);
             }
         }
     }
+    const ClipPolygon& points = buffers[current];
 
     // compute min and max coordinates
     Point3f p_min(std::numeric_limits<float>::max(),
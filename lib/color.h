@@ -0,0 +1,95 @@
+/**
+ * Linear RGBA color of the renderers, e.g. of the materials of the triangles,
+ * of the radiosity of the patches and of the pixels of an image.
+ *
+ * A color is a single 16-byte aligned SSE vector, s.t. the arithmetic of the
+ * shading and of the radiosity gather and push-pull is one instruction per
+ * operation, and a buffer of colors is loaded and stored with aligned moves
+ * (cf. `PostProcessor`). Like assimp's aiColor4D, which it replaces, the
+ * operators apply to all four channels, including alpha.
+ */
+
+#pragma once
+
+#include <assimp/types.h>
+#include <xmmintrin.h>
+
+#include <cstddef>
+
+class alignas(16) Color {
+public:
+    // black with zero alpha
+    Color() = default;
+    Color(float r, float g, float b, float a) : r(r), g(g), b(b), a(a) {}
+    // all channels set to the value
+    explicit Color(float value) : Color(value, value, value, value) {}
+    explicit Color(__m128 v) { _mm_store_ps(&r, v); }
+    // color of a material of assimp
+    explicit Color(const aiColor4D& c) : Color(c.r, c.g, c.b, c.a) {}
+
+    // channels as SSE vector (r, g, b, a)
+    __m128 simd() const { return _mm_load_ps(&r); }
+
+    float operator[](size_t channel) const { return (&r)[channel]; }
+    float& operator[](size_t channel) { return (&r)[channel]; }
+
+    Color& operator+=(const Color& c) {
+        return *this = Color(_mm_add_ps(simd(), c.simd()));
+    }
+    Color& operator-=(const Color& c) {
+        return *this = Color(_mm_sub_ps(simd(), c.simd()));
+    }
+    Color& operator*=(const Color& c) {
+        return *this = Color(_mm_mul_ps(simd(), c.simd()));
+    }
+    Color& operator*=(float x) {
+        return *this = Color(_mm_mul_ps(simd(), _mm_set1_ps(x)));
+    }
+    Color& operator/=(float x) {
+        return *this = Color(_mm_div_ps(simd(), _mm_set1_ps(x)));
+    }
+
+    bool operator==(const Color& c) const {
+        return _mm_movemask_ps(_mm_cmpeq_ps(simd(), c.simd())) == 0xF;
+    }
+    bool operator!=(const Color& c) const { return !(*this == c); }
+
+    // lexicographic order of the channels like aiColor4D's
+    bool operator<(const Color& c) const {
+        return r != c.r ? r < c.r
+                        : g != c.g ? g < c.g : b != c.b ? b < c.b : a < c.a;
+    }
+
+    float r = 0;
+    float g = 0;
+    float b = 0;
+    float a = 0;
+};
+
+static_assert(sizeof(Color) == 4 * sizeof(float), "a color is one SSE vector");
+
+inline Color operator+(const Color& c, const Color& d) {
+    return Color(_mm_add_ps(c.simd(), d.simd()));
+}
+
+inline Color operator-(const Color& c, const Color& d) {
+    return Color(_mm_sub_ps(c.simd(), d.simd()));
+}
+
+inline Color operator*(const Color& c, const Color& d) {
+    return Color(_mm_mul_ps(c.simd(), d.simd()));
+}
+
+inline Color operator/(const Color& c, const Color& d) {
+    return Color(_mm_div_ps(c.simd(), d.simd()));
+}
+
+inline Color operator*(const Color& c, float x) {
+    return Color(_mm_mul_ps(c.simd(), _mm_set1_ps(x)));
+}
+
+inline Color operator*(float x, const Color& c) { return c * x; }
+
+inline Color operator/(const Color& c, float x) {
+    return Color(_mm_div_ps(c.simd(), _mm_set1_ps(x)));
+}
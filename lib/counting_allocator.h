@@ -0,0 +1,94 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+/**
+ * Number of allocations, and the current and peak number of allocated bytes
+ * of the containers using a `CountingAllocator` with the same tag.
+ */
+class AllocationCounter {
+public:
+    void allocated(size_t bytes) {
+        num_allocations_.fetch_add(1, std::memory_order_relaxed);
+        const size_t current =
+            bytes_.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+        size_t peak = peak_bytes_.load(std::memory_order_relaxed);
+        while (peak < current &&
+               !peak_bytes_.compare_exchange_weak(peak, current,
+                                                  std::memory_order_relaxed)) {
+        }
+    }
+
+    void deallocated(size_t bytes) {
+        bytes_.fetch_sub(bytes, std::memory_order_relaxed);
+    }
+
+    size_t num_allocations() const {
+        return num_allocations_.load(std::memory_order_relaxed);
+    }
+    size_t bytes() const { return bytes_.load(std::memory_order_relaxed); }
+    size_t peak_bytes() const {
+        return peak_bytes_.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Start a new measurement of the peak, e.g. before a build.
+     */
+    void reset_peak() {
+        peak_bytes_.store(bytes(), std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<size_t> num_allocations_{0};
+    std::atomic<size_t> bytes_{0};
+    std::atomic<size_t> peak_bytes_{0};
+};
+
+/**
+ * Counter shared by all allocators with the given tag.
+ */
+template <typename Tag> AllocationCounter& allocation_counter() {
+    static AllocationCounter counter;
+    return counter;
+}
+
+/**
+ * Allocator counting its allocations in `allocation_counter<Tag>()`, e.g. to
+ * report the memory of the kd-tree build.
+ */
+template <typename T, typename Tag> struct CountingAllocator {
+    using value_type = T;
+
+    template <typename U> struct rebind {
+        using other = CountingAllocator<U, Tag>;
+    };
+
+    CountingAllocator() = default;
+    template <typename U>
+    CountingAllocator(const CountingAllocator<U, Tag>&) {}
+
+    T* allocate(size_t n) {
+        T* ptr = std::allocator<T>().allocate(n);
+        allocation_counter<Tag>().allocated(n * sizeof(T));
+        return ptr;
+    }
+
+    void deallocate(T* ptr, size_t n) {
+        allocation_counter<Tag>().deallocated(n * sizeof(T));
+        std::allocator<T>().deallocate(ptr, n);
+    }
+};
+
+template <typename T, typename U, typename Tag>
+bool operator==(const CountingAllocator<T, Tag>&,
+                const CountingAllocator<U, Tag>&) {
+    return true;
+}
+
+template <typename T, typename U, typename Tag>
+bool operator!=(const CountingAllocator<T, Tag>&,
+                const CountingAllocator<U, Tag>&) {
+    return false;
+}
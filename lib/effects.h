@@ -1,8 +1,18 @@
 #pragma once
 
+#include "raster.h"
 #include "types.h"
+
+#include <emmintrin.h>
 #include <math.h>
 
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
 /**
  * Apply explosure to given light.
  * @param  light light intensity in [0,1]
@@ -47,3 +57,230 @@ inline Color gamma(Color c, float inverse_gamma = 1 / 2.2f) {
     return {gamma(c.r, inverse_gamma), gamma(c.g, inverse_gamma),
             gamma(c.b, inverse_gamma), c.a};
 }
+
+/**
+ * Luminance of a linear rgb color (cf. Rec. 709).
+ * @param  c color
+ * @return   luminance
+ */
+inline float luminance(const Color& c) {
+    return 0.2126f * c.r + 0.7152f * c.g + 0.0722f * c.b;
+}
+
+/**
+ * Operator mapping the exposed linear light to [0, 1].
+ */
+enum class ToneMapping {
+    // 1 - exp(-light * exposure), cf. `exposure`
+    EXPOSURE,
+    // x / (1 + x), where x = light * exposure (Reinhard et al. 2002)
+    REINHARD,
+    // fit of the ACES filmic curve by K. Narkowicz (2015)
+    ACES,
+};
+
+inline ToneMapping parse_tone_mapping(const std::string& op) {
+    if (op == "exposure") {
+        return ToneMapping::EXPOSURE;
+    } else if (op == "reinhard") {
+        return ToneMapping::REINHARD;
+    } else if (op == "aces") {
+        return ToneMapping::ACES;
+    }
+    throw std::runtime_error("unknown tone mapping: " + op);
+}
+
+inline const char* to_string(ToneMapping op) {
+    switch (op) {
+    case ToneMapping::EXPOSURE:
+        return "exposure";
+    case ToneMapping::REINHARD:
+        return "reinhard";
+    case ToneMapping::ACES:
+        return "aces";
+    }
+    return "";
+}
+
+/**
+ * Scalar reference of the tone mapping operators.
+ */
+inline float tone_map(float light, ToneMapping op, float value) {
+    const float x = light * value;
+    switch (op) {
+    case ToneMapping::EXPOSURE:
+        return exposure(light, value);
+    case ToneMapping::REINHARD:
+        return x / (1 + x);
+    case ToneMapping::ACES:
+        return std::min(std::max(x * (2.51f * x + 0.03f) /
+                                     (x * (2.43f * x + 0.59f) + 0.14f),
+                                 0.f),
+                        1.f);
+    }
+    return x;
+}
+
+/**
+ * Gamma correction of light in [0, 1] by a lookup table.
+ *
+ * `powf(x, inverse_gamma)` has an unbounded slope at 0, which makes a table
+ * over x inaccurate for dark values. The table is indexed by sqrt(x) instead,
+ * where the function is u^(2 * inverse_gamma), i.e. almost linear for the
+ * usual gammas, and interpolated linearly.
+ */
+class GammaLUT {
+public:
+    explicit GammaLUT(float inverse_gamma = 1 / 2.2f, size_t size = 1024)
+        : scale_(size - 1), table_(size + 1) {
+        assert(2 <= size);
+        for (size_t i = 0; i < size; ++i) {
+            const float u = static_cast<float>(i) / (size - 1);
+            table_[i] = powf(u * u, inverse_gamma);
+        }
+        // sentinel for the interpolation at 1
+        table_[size] = table_[size - 1];
+    }
+
+    float operator()(float light) const {
+        const float u = sqrtf(std::min(std::max(light, 0.f), 1.f)) * scale_;
+        const size_t i = u;
+        const float t = u - i;
+        return table_[i] + t * (table_[i + 1] - table_[i]);
+    }
+
+    /**
+     * Apply the table to the lanes of v, which have to be in [0, 1].
+     */
+    __m128 operator()(__m128 v) const {
+        const __m128 u = _mm_mul_ps(_mm_sqrt_ps(v), _mm_set1_ps(scale_));
+        const __m128i i = _mm_cvttps_epi32(u);
+        const __m128 t = _mm_sub_ps(u, _mm_cvtepi32_ps(i));
+
+        alignas(16) int32_t idx[4];
+        _mm_store_si128(reinterpret_cast<__m128i*>(idx), i);
+        const __m128 lo = _mm_setr_ps(table_[idx[0]], table_[idx[1]],
+                                      table_[idx[2]], table_[idx[3]]);
+        const __m128 hi =
+            _mm_setr_ps(table_[idx[0] + 1], table_[idx[1] + 1],
+                        table_[idx[2] + 1], table_[idx[3] + 1]);
+        return _mm_add_ps(lo, _mm_mul_ps(t, _mm_sub_ps(hi, lo)));
+    }
+
+private:
+    float scale_;
+    std::vector<float> table_;
+};
+
+namespace detail {
+
+/**
+ * exp of the lanes of x by 2^x = 2^n * 2^f with n = round(x), |f| <= 1/2,
+ * where 2^f is approximated by its Taylor polynomial of degree 6. The
+ * relative error is below 1e-5; arguments below -87 are clamped.
+ */
+inline __m128 exp_ps(__m128 x) {
+    x = _mm_max_ps(_mm_min_ps(x, _mm_set1_ps(88.f)), _mm_set1_ps(-87.f));
+    x = _mm_mul_ps(x, _mm_set1_ps(1.44269504f)); // log2(e)
+
+    // rounding to nearest, i.e. the default rounding mode
+    const __m128i n = _mm_cvtps_epi32(x);
+    const __m128 f = _mm_sub_ps(x, _mm_cvtepi32_ps(n));
+
+    __m128 p = _mm_set1_ps(1.54035304e-4f);
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(1.33335581e-3f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(9.61812911e-3f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(5.55041087e-2f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(2.40226507e-1f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(6.93147181e-1f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(1.f));
+
+    // 2^n by the exponent bits
+    const __m128i e =
+        _mm_slli_epi32(_mm_add_epi32(n, _mm_set1_epi32(127)), 23);
+    return _mm_mul_ps(p, _mm_castsi128_ps(e));
+}
+
+inline __m128 tone_map_ps(__m128 light, ToneMapping op, float value) {
+    const __m128 one = _mm_set1_ps(1.f);
+    const __m128 x = _mm_mul_ps(light, _mm_set1_ps(value));
+    switch (op) {
+    case ToneMapping::EXPOSURE:
+        return _mm_sub_ps(one, exp_ps(_mm_sub_ps(_mm_setzero_ps(), x)));
+    case ToneMapping::REINHARD:
+        return _mm_div_ps(x, _mm_add_ps(one, x));
+    case ToneMapping::ACES: {
+        const __m128 num = _mm_mul_ps(
+            x, _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(2.51f)),
+                          _mm_set1_ps(0.03f)));
+        const __m128 den = _mm_add_ps(
+            _mm_mul_ps(x, _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(2.43f)),
+                                     _mm_set1_ps(0.59f))),
+            _mm_set1_ps(0.14f));
+        return _mm_min_ps(_mm_max_ps(_mm_div_ps(num, den), _mm_setzero_ps()),
+                          one);
+    }
+    }
+    return x;
+}
+
+} // namespace detail
+
+/**
+ * Post-processing of the linear colors of a rendered image: tone mapping of
+ * the exposed light, and gamma correction. It runs as one pass over the whole
+ * buffer after rendering; every pixel is one SSE vector, whose alpha channel
+ * is kept.
+ */
+class PostProcessor {
+public:
+    /**
+     * Keep the linear colors, e.g. for HDR output (cf. ImageFormat::PFM).
+     */
+    PostProcessor()
+        : tone_mapping_(ToneMapping::EXPOSURE)
+        , exposure_(1)
+        , gamma_correction_enabled_(false)
+        , gamma_(1.f, 2)
+        , linear_(true) {}
+
+    PostProcessor(ToneMapping tone_mapping, float exposure,
+                  bool gamma_correction_enabled, float inverse_gamma)
+        : tone_mapping_(tone_mapping)
+        , exposure_(exposure)
+        , gamma_correction_enabled_(gamma_correction_enabled)
+        , gamma_(inverse_gamma) {}
+
+    void operator()(Color* colors, size_t n) const {
+        if (linear_) {
+            return;
+        }
+        const __m128 rgb_mask =
+            _mm_castsi128_ps(_mm_setr_epi32(-1, -1, -1, 0));
+        for (size_t i = 0; i < n; ++i) {
+            const __m128 v = colors[i].simd();
+            // tone mapping keeps the light in [0, 1] for the table; NaNs
+            // become 0
+            __m128 mapped = _mm_min_ps(
+                _mm_max_ps(detail::tone_map_ps(v, tone_mapping_, exposure_),
+                           _mm_setzero_ps()),
+                _mm_set1_ps(1.f));
+            if (gamma_correction_enabled_) {
+                mapped = gamma_(mapped);
+            }
+            colors[i] = Color(_mm_or_ps(_mm_and_ps(rgb_mask, mapped),
+                                        _mm_andnot_ps(rgb_mask, v)));
+        }
+    }
+
+    void operator()(Image& image) const {
+        (*this)(image.data(), image.width() * image.height());
+    }
+
+private:
+    ToneMapping tone_mapping_;
+    float exposure_;
+    bool gamma_correction_enabled_;
+    GammaLUT gamma_;
+    bool linear_ = false;
+};
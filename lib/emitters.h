@@ -0,0 +1,102 @@
+#pragma once
+
+#include "array_view.h"
+#include "sampling.h"
+#include "triangle.h"
+#include "types.h"
+
+#include <cmath>
+#include <vector>
+
+// Density of the hemisphere samples (cf. sampling::cosine_hemisphere) w.r.t.
+// solid angle of a direction at the angle θ to the normal.
+inline float hemisphere_pdf(float cos_theta) {
+    return cos_theta * static_cast<float>(M_1_PI);
+}
+
+/**
+ * Power heuristic for multiple importance sampling, cf. [Veach97], 9.2.4.
+ *
+ * @param  n_f, pdf_f number of samples and density of the weighted strategy
+ * @param  n_g, pdf_g number of samples and density of the other strategy
+ * @return            weight of a sample drawn with the first strategy
+ */
+inline float power_heuristic(float n_f, float pdf_f, float n_g, float pdf_g) {
+    float f = n_f * pdf_f;
+    float g = n_g * pdf_g;
+    return f * f / (f * f + g * g);
+}
+
+/**
+ * Does the triangle emit light?
+ */
+inline bool is_emissive(const Triangle& triangle) {
+    return 0 < triangle.emissive.r || 0 < triangle.emissive.g ||
+           0 < triangle.emissive.b;
+}
+
+/**
+ * Emissive triangles of a scene, i.e. area lights, for explicit light
+ * sampling.
+ *
+ * The triangles are sampled proportional to their area with an alias table,
+ * and points uniformly on the sampled triangle. Hence, points on emitters are
+ * uniformly distributed w.r.t. the total emitting area.
+ */
+class Emitters {
+public:
+    struct Sample {
+        Point3f position;
+        Normal3f normal;
+        Color emission;
+    };
+
+    Emitters() = default;
+
+    explicit Emitters(ArrayView<Triangle> triangles) {
+        std::vector<float> areas;
+        for (const auto& triangle : triangles) {
+            if (is_emissive(triangle) && 0 < triangle.area()) {
+                triangles_.push_back(triangle);
+                areas.push_back(triangle.area());
+                total_area_ += areas.back();
+            }
+        }
+        if (!areas.empty()) {
+            table_ = sampling::AliasTable(areas);
+        }
+    }
+
+    bool empty() const { return triangles_.empty(); }
+    size_t size() const { return triangles_.size(); }
+    float total_area() const { return total_area_; }
+
+    /**
+     * Probability density of a sample (cf. `sample`) w.r.t. area, which is
+     * the same for all points on the emitters.
+     */
+    float pdf() const { return 1.f / total_area_; }
+
+    /**
+     * Sample a point on the emitters with the random number generator of the
+     * calling thread.
+     *
+     * Requires: !empty()
+     */
+    Sample sample() const {
+        const auto& triangle = triangles_[table_.sample()];
+        // cf. sampling::triangle
+        const float sqrt_r1 = std::sqrt(sampling::uniform());
+        const float r2 = sampling::uniform();
+        const float s = sqrt_r1 * (1 - r2);
+        const float t = sqrt_r1 * r2;
+        return {triangle.vertices[0] + s * triangle.u + t * triangle.v,
+                triangle.interpolate_normal(1 - s - t, s, t),
+                triangle.emissive};
+    }
+
+private:
+    std::vector<Triangle> triangles_;
+    sampling::AliasTable table_;
+    float total_area_ = 0;
+};
@@ -0,0 +1,89 @@
+/**
+ * Render cost of the tiles of an image, e.g. to find the geometry, which
+ * defeats the acceleration structure, or the sample budgets, which are wasted
+ * (cf. --heatmap of the tracers).
+ */
+
+#pragma once
+
+#include "intersector.h"
+#include "raster.h"
+#include "tiles.h"
+
+#include <cassert>
+#include <chrono>
+#include <vector>
+
+/**
+ * Cost of rendering a tile, accumulated over all passes.
+ */
+struct TileCost {
+    double ms = 0;        // wall time of the task rendering the tile
+    size_t nodes = 0;     // visited nodes of the acceleration structure
+    size_t triangles = 0; // ray-triangle tests (cf. `TraversalCounts`)
+};
+
+/**
+ * Measure the cost of rendering a tile with an intersector by using RAII.
+ * The cost is added to the given one, i.e. the tile has to be owned by the
+ * task (cf. `render_tiles`).
+ */
+class TileCostTimer {
+public:
+    TileCostTimer(const Intersector& intersector, TileCost& cost)
+        : intersector_(intersector)
+        , cost_(cost)
+        , counts_(intersector.traversal_counts()) {}
+
+    TileCostTimer(const TileCostTimer&) = delete;
+    TileCostTimer& operator=(const TileCostTimer&) = delete;
+
+    ~TileCostTimer() {
+        const auto& counts = intersector_.traversal_counts();
+        cost_.ms += std::chrono::duration<double, std::milli>(
+                        std::chrono::steady_clock::now() - started_)
+                        .count();
+        cost_.nodes += counts.nodes - counts_.nodes;
+        cost_.triangles += counts.triangles - counts_.triangles;
+    }
+
+private:
+    const Intersector& intersector_;
+    TileCost& cost_;
+    const Intersector::TraversalCounts counts_;
+    const std::chrono::steady_clock::time_point started_ =
+        std::chrono::steady_clock::now();
+};
+
+/**
+ * Heatmap of the cost per pixel: the cost of every tile is spread evenly
+ * over its pixels. The channels of a pixel are
+ *
+ *     r  wall time in µs
+ *     g  visited nodes
+ *     b  ray-triangle tests
+ *
+ * i.e. the image is meant to be written as PFM, and inspected channel by
+ * channel.
+ *
+ * @param costs cost of tiles[i] at index i
+ */
+inline Image cost_heatmap(const std::vector<Tile>& tiles,
+                          const std::vector<TileCost>& costs, size_t width,
+                          size_t height) {
+    assert(tiles.size() == costs.size());
+    Image heatmap(width, height);
+    for (size_t i = 0; i < tiles.size(); ++i) {
+        const Tile& tile = tiles[i];
+        const float num_pixels = tile.width() * tile.height();
+        const Color cost(1000 * costs[i].ms / num_pixels,
+                         costs[i].nodes / num_pixels,
+                         costs[i].triangles / num_pixels, 1);
+        for (size_t y = tile.y0; y < tile.y1; ++y) {
+            for (size_t x = tile.x0; x < tile.x1; ++x) {
+                heatmap(x, y) = cost;
+            }
+        }
+    }
+    return heatmap;
+}
@@ -7,9 +7,20 @@
 #include "progress_bar.h"
 #include "radiosity.h"
 #include "raster.h"
+#include "stats.h"
 #include "types.h"
 
+#include <ThreadPool.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <future>
 #include <iostream>
+#include <limits>
+#include <mutex>
+#include <numeric>
 #include <sstream>
 #include <stack>
 
@@ -17,7 +28,9 @@
 class HierarchicalRadiosity {
     using TriangleId = KDTree::TriangleId;
 
-    struct Quadnode;
+    // Index of a node in `nodes_`.
+    using NodeId = uint32_t;
+    static constexpr NodeId NONE = std::numeric_limits<NodeId>::max();
 
     /**
      * Links a node p to a node q.
@@ -26,16 +39,21 @@ class HierarchicalRadiosity {
      * p gathers radiosity from q, In particular, `form_factor` is F_pq.
      */
     struct Linknode {
-        Quadnode* q;       // shooting node
+        NodeId q;          // shooting node (NONE if the link was removed)
         float form_factor; // form factor F_pq, where p is the owner node
     };
 
+    /**
+     * Node of the quadtree of a triangle from the scene.
+     *
+     * All nodes are stored in `nodes_`, starting with the roots. The four
+     * children of a node are stored consecutively, and always after their
+     * parent.
+     */
     struct Quadnode {
-        bool operator==(const Quadnode&) const { return true; }
         bool is_leaf() const {
-            // due to full subdivision:
-            // if some child is none => all children are none
-            return children[0] == nullptr;
+            // due to full subdivision, all four children exist or none
+            return first_child == NONE;
         }
 
         TriangleId root_tri_id; // original parent triangle from scene
@@ -49,23 +67,144 @@ class HierarchicalRadiosity {
         Color emission;   // light emission
         Color rho;        // reflectivity (diffuse color)
 
-        Quadnode* parent = nullptr;
-        std::array<std::unique_ptr<Quadnode>, 4> children;
-        std::vector<Linknode> gathering_from; // links to this node
+        NodeId parent = NONE;
+        NodeId first_child = NONE; // children are first_child, ..., + 3
+    };
+
+    // Index of a cluster in `clusters_`.
+    using ClusterId = uint32_t;
+    // maximum number of roots in a leaf cluster
+    static constexpr size_t CLUSTER_LEAF_SIZE = 4;
+
+    /**
+     * Cluster of roots, i.e. of scene triangles, bounded by a sphere.
+     *
+     * The clusters form a binary tree above the quadtrees (cf. [SAG94]). Its
+     * root is `clusters_[0]`. The two children of a cluster are stored
+     * consecutively, and after their parent. The roots of a cluster are
+     * `cluster_roots_[begin]`, ..., `cluster_roots_[end - 1]`.
+     *
+     * [SAG94] B. Smits, J. Arvo, D. Greenberg, A Clustering Algorithm for
+     *         Radiosity in Complex Environments, SIGGRAPH 1994.
+     */
+    struct Cluster {
+        bool is_leaf() const { return first_child == NONE; }
+
+        Point3f center;
+        float radius;
+        float area; // total area of the roots
+        uint32_t begin, end;
+        ClusterId first_child = NONE; // children are first_child, + 1
+
+        Color rad_shoot; // area-weighted average of the roots
+    };
+
+    /**
+     * Link from cluster p gathering radiosity to cluster q.
+     *
+     * A cluster shoots its radiosity isotropically, i.e. the form factor from
+     * a root r of p to q is
+     *
+     *     F_rq = V_pq * A_q * cos+(θ_r) / (4π * d_rq²),
+     *
+     * where d_rq is the distance from the midpoint of r to the center of q,
+     * θ_r the angle between the normal of r and the direction to q, and V_pq
+     * the estimated visibility between the clusters.
+     */
+    struct ClusterLink {
+        ClusterId p;
+        ClusterId q;
+        float visibility; // V_pq
     };
 
 public:
+    /**
+     * Refined patches, i.e. the leaves of the quadtrees, as an indexed triangle
+     * mesh with their radiosity.
+     */
+    struct LeafMesh {
+        std::vector<Point3f> vertices;
+        std::vector<std::array<uint32_t, 3>> faces; // corners of the triangles
+        // triangle in the scene containing the face
+        std::vector<TriangleId> root_ids;
+        std::vector<Color> face_radiosity;
+        // average radiosity of the faces having the vertex as a corner
+        std::vector<Color> vertex_radiosity;
+        // vertex radiosity of the corners of every face, s.t. interpolation
+        // needs a single lookup per face
+        std::vector<std::array<Color, 3>> corner_radiosity;
+
+        size_t num_faces() const { return faces.size(); }
+
+        void compute_corner_radiosity() {
+            corner_radiosity.clear();
+            corner_radiosity.reserve(faces.size());
+            for (const auto& face : faces) {
+                corner_radiosity.push_back({{vertex_radiosity[face[0]],
+                                             vertex_radiosity[face[1]],
+                                             vertex_radiosity[face[2]]}});
+            }
+        }
+
+        /**
+         * Faces as triangles with the normal and the material of the
+         * triangle in the scene they are contained in.
+         */
+        Triangles triangles(const KDTree& tree) const {
+            Triangles triangles;
+            triangles.reserve(faces.size());
+            for (size_t i = 0; i < faces.size(); ++i) {
+                const auto& root = tree[root_ids[i]];
+                const Normal3f normal(root.normal);
+                triangles.emplace_back(
+                    std::array<Point3f, 3>{vertices[faces[i][0]],
+                                           vertices[faces[i][1]],
+                                           vertices[faces[i][2]]},
+                    std::array<Normal3f, 3>{normal, normal, normal},
+                    root.ambient, root.diffuse, root.emissive, root.reflective,
+                    root.reflectivity);
+            }
+            return triangles;
+        }
+
+        // The corner radiosity is not stored, but recomputed after loading.
+        template <class Archive> void save(Archive& archive) const {
+            archive(vertices, faces, root_ids, face_radiosity,
+                    vertex_radiosity);
+        }
+
+        template <class Archive> void load(Archive& archive) {
+            archive(vertices, faces, root_ids, face_radiosity,
+                    vertex_radiosity);
+            compute_corner_radiosity();
+        }
+    };
+
+    /**
+     * @param clustering link distant groups of scene triangles as clusters,
+     *                   instead of linking all pairs of scene triangles
+     * @param verbose    print the numbers of nodes and links to stderr
+     */
     HierarchicalRadiosity(const KDTree& tree, float F_eps, float A_eps,
-                          float BF_eps, size_t max_iterations)
+                          float BF_eps, size_t max_iterations,
+                          size_t num_threads = 1, bool clustering = true,
+                          bool verbose = false)
         : tree_(&tree)
-        , tree_intersection_(tree)
         , F_eps_(F_eps)
         , A_eps_(A_eps)
         , BF_eps_(BF_eps)
-        , max_iterations_(max_iterations){};
+        , max_iterations_(max_iterations)
+        , num_threads_(num_threads)
+        , clustering_(clustering)
+        , verbose_(verbose) {
+        assert(0 < num_threads);
+    };
 
     const RadiosityMesh& mesh() const { return mesh_; }
 
+    // Result of `compute`.
+    const LeafMesh& leaves() const { return leaves_; }
+
     Image visualize_links(const Camera& cam, Image&& image) const {
         auto draw_pixel = [&image](int x, int y) {
             if (0 <= x && static_cast<size_t>(x) < image.width() && 0 <= y &&
@@ -74,43 +213,45 @@ public:
             }
         };
 
-        size_t nodes_counter = 0;
+        size_t nodes_counter = nodes_.size();
         size_t links_counter = 0;
 
-        std::stack<const Quadnode*> stack;
-        for (const auto& root : nodes_) {
-            stack.push(&root);
-            while (!stack.empty()) {
-                const auto& p = *stack.top();
-                stack.pop();
-
-                nodes_counter += 1;
-
-                if (!p.gathering_from.empty()) {
-                    auto p_midpoint =
-                        convert_to_point(triangle_midpoint(mesh_, p.vs));
-                    auto to = cam.cam2raster(p_midpoint, image.width(),
-                                             image.height());
-                    for (const auto& link : p.gathering_from) {
-                        auto q_midpoint = convert_to_point(
-                            triangle_midpoint(mesh_, link.q->vs));
-                        auto from = cam.cam2raster(q_midpoint, image.width(),
-                                                   image.height());
-                        bresenham(from.x, from.y, to.x, to.y, draw_pixel);
-                    }
-                    links_counter += 1;
-                }
+        for (NodeId p = 0; p < nodes_.size(); ++p) {
+            auto range = link_range(p);
+            if (range.first == range.second) {
+                continue;
+            }
 
-                if (!p.is_leaf()) {
-                    for (const auto& child : p.children) {
-                        stack.push(child.get());
-                    }
+            auto p_midpoint =
+                convert_to_point(triangle_midpoint(mesh_, nodes_[p].vs));
+            auto to = cam.cam2raster(p_midpoint, image.width(), image.height());
+            for (size_t k = range.first; k < range.second; ++k) {
+                if (links_[k].q == NONE) {
+                    continue;
                 }
+                auto q_midpoint = convert_to_point(
+                    triangle_midpoint(mesh_, nodes_[links_[k].q].vs));
+                auto from = cam.cam2raster(q_midpoint, image.width(),
+                                           image.height());
+                bresenham(from.x, from.y, to.x, to.y, draw_pixel);
             }
+            links_counter += 1;
+        }
+
+        for (const auto& link : cluster_links_) {
+            auto to = cam.cam2raster(clusters_[link.p].center, image.width(),
+                                     image.height());
+            auto from = cam.cam2raster(clusters_[link.q].center,
+                                       image.width(), image.height());
+            bresenham(from.x, from.y, to.x, to.y, draw_pixel);
         }
 
-        std::cerr << "Nodes " << nodes_counter << std::endl;
-        std::cerr << "Links " << links_counter << std::endl;
+        if (verbose_) {
+            std::cerr << "Nodes " << nodes_counter << std::endl;
+            std::cerr << "Links " << links_counter << std::endl;
+            std::cerr << "Cluster links " << cluster_links_.size()
+                      << std::endl;
+        }
 
         return image;
     }
@@ -119,7 +260,10 @@ public:
         mesh_ = build_mesh(tree_->triangles());
 
         // Create quad nodes
-        for (size_t i = 0; i < tree_->num_triangles(); ++i) {
+        const size_t num_roots = tree_->num_triangles();
+        assert(num_roots < NONE);
+        nodes_.reserve(num_roots);
+        for (size_t i = 0; i < num_roots; ++i) {
             nodes_.emplace_back();
 
             nodes_.back().root_tri_id = i;
@@ -134,118 +278,293 @@ public:
             nodes_.back().rho = tri.diffuse;
         }
 
-        // Refine nodes
-        auto progress_bar =
-            ProgressBar(std::cerr, "Refine Nodes", nodes_.size());
-        for (size_t n = 0; n < nodes_.size(); ++n) {
-            auto& p = nodes_[n];
-            for (auto& q : nodes_) {
-                if (p.root_tri_id == q.root_tri_id) {
-                    continue;
+        // Refine nodes, i.e. link them by their form factors
+        StageTimer stage("form_factors");
+        if (clustering_) {
+            build_clusters();
+            refine_clusters();
+        } else {
+            auto progress_bar =
+                ProgressBar(std::cerr, "Refine Nodes", num_roots);
+            for (NodeId p = 0; p < num_roots; ++p) {
+                for (NodeId q = 0; q < num_roots; ++q) {
+                    if (p == q) {
+                        continue;
+                    }
+                    refine(p, q);
                 }
-                refine(p, q);
-            }
 
-            progress_bar.update(n + 1);
+                progress_bar.update(p + 1);
+            }
+            std::cerr << std::endl;
         }
-        std::cerr << std::endl;
+        compute_links();
+        stage.stop();
 
         // Solve system and refine links
         bool done = false;
         while (!done) {
-            solve_system();
+            {
+                StageTimer _("solve");
+                solve_system();
+            }
+            StageTimer _("refine");
             done = !refine_links();
         }
 
-        // store radiosity in mesh
-        store_radiosity_at_triangles();
-        std::cerr << "Triangulating T-vertices." << std::endl;
-        triangulate_t_vertices();
-        store_radiosity_at_vertices();
+        build_leaf_mesh();
     }
 
-    // TODO: Use mesh directly
-    auto triangles() const {
-        std::vector<Triangle> triangles;
-        for (const auto face : mesh_.faces()) {
-            const auto& vs = triangle_vertices(mesh_, face);
-            // copy triangle with minimal information
-            triangles.emplace_back(
-                std::array<Point3f, 3>{convert_to_point(mesh_.point(vs[0])),
-                                       convert_to_point(mesh_.point(vs[1])),
-                                       convert_to_point(mesh_.point(vs[2]))});
-        }
-        return triangles;
+private:
+    /**
+     * Collect the leaves of all quadtrees in `leaves_`.
+     *
+     * Vertices are shared between faces, which have them as a corner. We do
+     * not triangulate T-vertices: the faces tile the scene triangles anyway,
+     * and vertex radiosity is only used for interpolation inside a face.
+     */
+    void build_leaf_mesh() {
+        leaves_ = LeafMesh();
+
+        // compact vertex indices, indexed by the ids of the mesh vertices
+        std::vector<uint32_t> vertex_ids(mesh_.n_vertices(), NONE);
+        std::vector<size_t> num_vertex_faces;
+        for (const auto& p : nodes_) {
+            if (!p.is_leaf()) {
+                continue;
+            }
+
+            std::array<uint32_t, 3> face;
+            for (size_t i = 0; i < 3; ++i) {
+                uint32_t& id = vertex_ids[p.vs[i].idx()];
+                if (id == NONE) {
+                    id = leaves_.vertices.size();
+                    leaves_.vertices.push_back(
+                        convert_to_point(mesh_.point(p.vs[i])));
+                    leaves_.vertex_radiosity.emplace_back(0, 0, 0, 0);
+                    num_vertex_faces.push_back(0);
+                }
+                face[i] = id;
+            }
+
+            // The solver treats alpha like the color channels, i.e. it has no
+            // meaning here. The faces are opaque, since the images are
+            // weighted by alpha (cf. raster.h).
+            Color rad = p.rad_shoot;
+            rad.a = 1;
+            for (uint32_t id : face) {
+                leaves_.vertex_radiosity[id] += rad;
+                num_vertex_faces[id] += 1;
+            }
+
+            leaves_.faces.push_back(face);
+            leaves_.root_ids.push_back(p.root_tri_id);
+            leaves_.face_radiosity.push_back(rad);
+        }
+
+        for (size_t id = 0; id < leaves_.vertices.size(); ++id) {
+            leaves_.vertex_radiosity[id] /=
+                static_cast<float>(num_vertex_faces[id]);
+        }
+
+        leaves_.compute_corner_radiosity();
     }
 
-    void store_radiosity_at_triangles() {
-        auto rad = FaceRadiosityHandleProperty::createIfNotExists(
-            mesh_, "face_radiosity");
+    /**
+     * Build up the tree of clusters top-down. A cluster is split at the
+     * median of the midpoints of its roots along their longest extent.
+     */
+    void build_clusters() {
+        const size_t num_roots = tree_->num_triangles();
+        std::vector<Point3f> midpoints(num_roots);
+        for (size_t i = 0; i < num_roots; ++i) {
+            const auto& tri = (*tree_)[i];
+            midpoints[i] = tri.vertices[0] + (tri.u + tri.v) / 3.f;
+        }
+
+        cluster_roots_.resize(num_roots);
+        std::iota(cluster_roots_.begin(), cluster_roots_.end(), 0);
+        clusters_.clear();
+        clusters_.push_back(make_cluster(0, num_roots));
+        for (ClusterId c = 0; c < clusters_.size(); ++c) {
+            const uint32_t begin = clusters_[c].begin;
+            const uint32_t end = clusters_[c].end;
+            if (end - begin <= CLUSTER_LEAF_SIZE) {
+                continue;
+            }
 
-        std::stack<const Quadnode*> stack;
+            Bbox3f box(midpoints[cluster_roots_[begin]]);
+            for (uint32_t i = begin + 1; i < end; ++i) {
+                box = bbox_union(box, midpoints[cluster_roots_[i]]);
+            }
+            const auto d = box.diagonal();
+            const size_t ax = d.x >= d.y && d.x >= d.z ? 0 : d.y >= d.z ? 1 : 2;
+
+            const uint32_t mid = begin + (end - begin) / 2;
+            std::nth_element(cluster_roots_.begin() + begin,
+                             cluster_roots_.begin() + mid,
+                             cluster_roots_.begin() + end,
+                             [&midpoints, ax](NodeId a, NodeId b) {
+                                 return midpoints[a][ax] < midpoints[b][ax];
+                             });
+
+            assert(clusters_.size() + 2 < NONE);
+            clusters_[c].first_child = clusters_.size();
+            clusters_.push_back(make_cluster(begin, mid));
+            clusters_.push_back(make_cluster(mid, end));
+        }
+    }
 
-        // dfs for each node
-        for (const auto& root : nodes_) {
-            stack.push(&root);
-            while (!stack.empty()) {
-                const auto& p = *stack.top();
-                stack.pop();
+    Cluster make_cluster(uint32_t begin, uint32_t end) const {
+        assert(begin < end);
+        Cluster cluster;
+        cluster.begin = begin;
+        cluster.end = end;
+        cluster.area = 0;
+        Bbox3f box((*tree_)[cluster_roots_[begin]].vertices[0]);
+        for (uint32_t i = begin; i < end; ++i) {
+            const auto& tri = (*tree_)[cluster_roots_[i]];
+            for (const auto& vertex : tri.vertices) {
+                box = bbox_union(box, vertex);
+            }
+            cluster.area += tri.area();
+        }
+        cluster.center = box.lerp({0.5f, 0.5f, 0.5f});
+        cluster.radius = box.diagonal().length() / 2;
+        return cluster;
+    }
 
+    /**
+     * Link all roots to each other (cf. `refine`), starting at the root
+     * cluster.
+     *
+     * Two distinct clusters, which are far apart relative to their size, are
+     * linked as a whole. Otherwise, the larger one is split. Leaf clusters,
+     * which are not linked as a whole, link their roots. A cluster is linked
+     * to itself by linking its children. Hence, the number of links is about
+     * linear in the number of roots, instead of quadratic.
+     */
+    void refine_clusters() {
+        std::stack<std::pair<ClusterId, ClusterId>> cluster_stack;
+        cluster_stack.push({0, 0});
+        while (!cluster_stack.empty()) {
+            const ClusterId a = cluster_stack.top().first;
+            const ClusterId b = cluster_stack.top().second;
+            cluster_stack.pop();
+
+            const auto& p = clusters_[a];
+            const auto& q = clusters_[b];
+            if (a == b) {
                 if (p.is_leaf()) {
-                    rad[p.face] = p.rad_shoot;
-                    rad[p.face].a = 1; // TODO
+                    link_roots(p, p);
                 } else {
-                    for (const auto& child : p.children) {
-                        stack.push(child.get());
-                    }
+                    const ClusterId c = p.first_child;
+                    cluster_stack.push({c, c});
+                    cluster_stack.push({c + 1, c + 1});
+                    cluster_stack.push({c, c + 1});
+                    cluster_stack.push({c + 1, c});
                 }
+                continue;
+            }
+
+            if (are_separated(p, q)) {
+                pending_cluster_links_.emplace_back(a, b);
+            } else if (!p.is_leaf() && (q.is_leaf() || q.radius <= p.radius)) {
+                cluster_stack.push({p.first_child, b});
+                cluster_stack.push({p.first_child + 1, b});
+            } else if (!q.is_leaf()) {
+                cluster_stack.push({a, q.first_child});
+                cluster_stack.push({a, q.first_child + 1});
+            } else {
+                link_roots(p, q);
             }
         }
+        compute_cluster_links();
     }
 
-    void store_radiosity_at_vertices() {
-        auto vrad = VertexRadiosityHandleProperty::createIfNotExists(
-            mesh_, "vertex_radiosity");
-        FaceRadiosityHandle frad;
-        auto exists = mesh_.get_property_handle(frad, "face_radiosity");
-        assert(exists);
-        UNUSED(exists);
-
-        for (const auto v : mesh_.vertices()) {
-            Color& avg = vrad[v];
-            avg = Color(0, 0, 0, 1);
-
-            size_t n = 0;
-            for (const auto f : mesh_.vf_range(v)) {
-                avg += mesh_.property(frad, f);
-                n++;
+    // Refine the links from every root of p to every other root of q.
+    void link_roots(const Cluster& p, const Cluster& q) {
+        for (uint32_t i = p.begin; i < p.end; ++i) {
+            for (uint32_t j = q.begin; j < q.end; ++j) {
+                if (cluster_roots_[i] != cluster_roots_[j]) {
+                    refine(cluster_roots_[i], cluster_roots_[j]);
+                }
             }
-            avg /= n;
         }
     }
 
-    void triangulate_t_vertices() {
-        auto rad = FaceRadiosityHandleProperty::createIfNotExists(
-            mesh_, "face_radiosity");
-
-        size_t n_faces = mesh_.n_faces();
-        for (size_t i = 0; i < n_faces; ++i) {
-            auto face = RadiosityMesh::FaceHandle(i);
-            size_t n = mesh_.n_faces();
-            ::triangulate_t_vertices(mesh_, face); // no-op if nothing to do
-
-            if (n < mesh_.n_faces()) {
-                // copy radiosity
-                const auto& face_rad = rad[face];
-                for (; n < mesh_.n_faces(); ++n) {
-                    auto new_face = RadiosityMesh::FaceHandle(n);
-                    rad[new_face] = face_rad;
-                }
+    // Whether the bounding spheres of the clusters are disjoint, and the form
+    // factors between them are below F_eps, even for the nearest points.
+    bool are_separated(const Cluster& p, const Cluster& q) const {
+        const float gap = (q.center - p.center).length() - p.radius - q.radius;
+        if (gap <= 0) {
+            return false;
+        }
+        const float F_pq = q.area / (4 * M_PI * gap * gap);
+        const float F_qp = p.area / (4 * M_PI * gap * gap);
+        return F_pq < F_eps_ && F_qp < F_eps_;
+    }
+
+    /**
+     * Estimate the visibility of the pending cluster links, and add them to
+     * `cluster_links_`. The samples of a link only depend on its index.
+     */
+    void compute_cluster_links() {
+        KDTreeIntersection tree_intersection(*tree_);
+        for (const auto& pq : pending_cluster_links_) {
+            sampling::seed((cluster_links_.size() + 1) *
+                           0xD1B54A32D192ED03ULL);
+            cluster_links_.push_back(
+                {pq.first, pq.second,
+                 cluster_visibility(tree_intersection, clusters_[pq.first],
+                                    clusters_[pq.second])});
+        }
+        pending_cluster_links_.clear();
+        if (verbose_) {
+            std::cerr << "Cluster links: " << cluster_links_.size()
+                      << std::endl;
+        }
+    }
+
+    /**
+     * Fraction of unoccluded rays between random points on random roots of
+     * the clusters.
+     */
+    float cluster_visibility(Intersector& tree_intersection, const Cluster& p,
+                             const Cluster& q) const {
+        constexpr size_t PACKET_SIZE = Intersector::PACKET_SIZE;
+        constexpr size_t NUM_PACKETS = 2;
+
+        auto random_root = [this](const Cluster& cluster) -> const Triangle& {
+            const uint32_t n = cluster.end - cluster.begin;
+            const uint32_t i = std::min<uint32_t>(sampling::uniform() * n,
+                                                  n - 1);
+            return (*tree_)[cluster_roots_[cluster.begin + i]];
+        };
+
+        size_t num_visible = 0;
+        for (size_t packet = 0; packet < NUM_PACKETS; ++packet) {
+            Intersector::RayPacket rays;
+            std::array<float, PACKET_SIZE> t_max;
+            for (size_t l = 0; l < PACKET_SIZE; ++l) {
+                const Triangle& from = random_root(p);
+                const Point3f p1 = sampling::triangle(from);
+                const Point3f p2 = sampling::triangle(random_root(q));
+                // leave the triangle on the side facing the target
+                const float side = dot(p2 - p1, from.normal) < 0 ? -EPS : EPS;
+                const Point3f origin = p1 + Vector3f(side * from.normal);
+                rays[l] = Ray(origin, p2 - origin);
+                t_max[l] = 1 - EPS;
+            }
+            const unsigned occluded =
+                tree_intersection.occluded_packet(rays, t_max);
+            for (size_t l = 0; l < PACKET_SIZE; ++l) {
+                num_visible += (occluded & (1 << l)) ? 0 : 1;
             }
         }
+        return static_cast<float>(num_visible) / (NUM_PACKETS * PACKET_SIZE);
     }
 
-private:
     float estimate_form_factor(const Quadnode& p, const Quadnode& q) const {
         const auto p_midpoint = triangle_midpoint(mesh_, p.vs);
         const auto p_normal = triangle_normal(mesh_, p.vs);
@@ -267,42 +586,136 @@ private:
         return factor;
     }
 
-    bool subdivide(Quadnode& p) {
-        if (!p.is_leaf()) {
+    bool subdivide(NodeId p) {
+        if (!nodes_[p].is_leaf()) {
             return true;
         }
 
-        float p_area_4 = p.area / 4;
+        float p_area_4 = nodes_[p].area / 4;
         if (p_area_4 < A_eps_) {
             return false;
         }
 
-        auto faces = subdivide4(mesh_, p.face);
+        auto faces = subdivide4(mesh_, nodes_[p].face);
+        const NodeId first_child = nodes_.size();
+        assert(nodes_.size() + 4 < NONE);
         for (size_t i = 0; i < 4; ++i) {
-            auto& qnode = p.children[i];
-
-            // create a new quanode
-            qnode = std::make_unique<Quadnode>();
-            qnode->parent = &p;
-            qnode->rad_gather = Color();
-            qnode->rad_shoot = p.rad_shoot;
-            qnode->emission = p.emission;
-            qnode->area = p_area_4;
-            qnode->rho = p.rho;
-            qnode->face = faces[i];
-            qnode->vs = triangle_vertices(mesh_, faces[i]);
-            qnode->root_tri_id = p.root_tri_id;
+            // create a new quadnode; it inherits radiosity, emission, rho and
+            // the root triangle from p
+            Quadnode child = nodes_[p];
+            child.parent = p;
+            child.first_child = NONE;
+            child.rad_gather = Color();
+            child.area = p_area_4;
+            child.face = faces[i];
+            child.vs = triangle_vertices(mesh_, faces[i]);
+            nodes_.push_back(child); // invalidates references into nodes_
         }
+        nodes_[p].first_child = first_child;
 
         return true;
     }
 
     /**
      * Link p to q s.t. p gathers energy from q.
+     *
+     * The link is pending until the next call of `compute_links`, which
+     * computes its form factor and adds it to p.
+     *
      * @param p gathering node
      * @param q shooting node
      */
-    void link(Quadnode& p, Quadnode& q) {
+    void link(NodeId p, NodeId q) { pending_links_.emplace_back(p, q); }
+
+    /**
+     * Compute the form factors of all pending links in parallel, and add the
+     * links to their gathering nodes.
+     *
+     * The links are stored per gathering node in `links_`, like a sparse
+     * matrix in CSR format. Since links are added and removed during the
+     * refinement, the array is rebuilt here: first the remaining old links of
+     * a node, then the new ones.
+     *
+     * Every worker uses its own intersection context. The samples of a link
+     * only depend on the number of links created before it, s.t. the result
+     * does not depend on the number of threads.
+     */
+    void compute_links() {
+        constexpr size_t CHUNK_SIZE = 64;
+        const size_t num_links = pending_links_.size();
+        std::vector<float> form_factors(num_links);
+
+        auto progress_bar = ProgressBar(std::cerr, "Computing Links",
+                                        (num_links + CHUNK_SIZE - 1) /
+                                            CHUNK_SIZE);
+        std::mutex progress_mutex;
+        size_t num_completed = 0;
+
+        std::atomic<size_t> next_chunk(0);
+        ThreadPool pool(num_threads_);
+        std::vector<std::future<void>> workers;
+        for (size_t worker = 0; worker < num_threads_; ++worker) {
+            workers.emplace_back(pool.enqueue([&]() {
+                KDTreeIntersection tree_intersection(*tree_);
+                for (size_t begin = CHUNK_SIZE * next_chunk++;
+                     begin < num_links; begin = CHUNK_SIZE * next_chunk++) {
+                    size_t end = std::min(begin + CHUNK_SIZE, num_links);
+                    for (size_t k = begin; k < end; ++k) {
+                        sampling::seed((num_computed_links_ + k + 1) *
+                                       0x9E3779B97F4A7C15ULL);
+                        form_factors[k] = link_form_factor(
+                            tree_intersection, nodes_[pending_links_[k].first],
+                            nodes_[pending_links_[k].second]);
+                    }
+
+                    std::lock_guard<std::mutex> lock(progress_mutex);
+                    progress_bar.update(++num_completed);
+                }
+            }));
+        }
+        for (auto& worker : workers) {
+            worker.get();
+        }
+        std::cerr << std::endl;
+
+        // Count the links per node, and compute the offsets.
+        std::vector<size_t> offsets(nodes_.size() + 1, 0);
+        for (NodeId p = 0; p + 1 < link_offsets_.size(); ++p) {
+            for (size_t k = link_offsets_[p]; k < link_offsets_[p + 1]; ++k) {
+                if (links_[k].q != NONE) {
+                    offsets[p + 1] += 1;
+                }
+            }
+        }
+        for (const auto& pq : pending_links_) {
+            offsets[pq.first + 1] += 1;
+        }
+        std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+
+        // Add links in the order they were created.
+        std::vector<Linknode> links(offsets.back());
+        std::vector<size_t> next(offsets.begin(), offsets.end() - 1);
+        for (NodeId p = 0; p + 1 < link_offsets_.size(); ++p) {
+            for (size_t k = link_offsets_[p]; k < link_offsets_[p + 1]; ++k) {
+                if (links_[k].q != NONE) {
+                    links[next[p]++] = links_[k];
+                }
+            }
+        }
+        for (size_t k = 0; k < num_links; ++k) {
+            const auto& pq = pending_links_[k];
+            links[next[pq.first]++] = {pq.second, form_factors[k]};
+        }
+
+        links_.swap(links);
+        link_offsets_.swap(offsets);
+
+        num_computed_links_ += num_links;
+        pending_links_.clear();
+    }
+
+    float link_form_factor(Intersector& tree_intersection, const Quadnode& p,
+                           const Quadnode& q) const {
         const auto& p_a = mesh_.point(p.vs[0]);
         const auto& p_b = mesh_.point(p.vs[1]);
         const auto& p_c = mesh_.point(p.vs[2]);
@@ -319,31 +732,26 @@ private:
         const Vector3f q_v = convert_to_vec(q_c - q_a);
         const Normal3f q_normal = Normal3f(normalize(cross(q_u, q_v)));
 
-        float F_pq =
-            form_factor(tree_intersection_, p_pos, p_u, p_v, p_normal, q_pos,
-                        q_u, q_v, q_normal, q.area, q.root_tri_id);
+        float F_pq = form_factor(tree_intersection, p_pos, p_u, p_v, p_normal,
+                                 q_pos, q_u, q_v, q_normal, q.area);
         assert(0 <= F_pq && F_pq < 1);
+        return F_pq;
+    }
 
-        p.gathering_from.emplace_back();
-        auto& link = p.gathering_from.back();
-        link.q = &q;
-        link.form_factor = F_pq;
-    };
-
-    void refine(Quadnode& p, Quadnode& q) {
+    void refine(NodeId p, NodeId q) {
 
-        std::stack<std::pair<Quadnode*, Quadnode*>> node_stack;
-        node_stack.push({&p, &q});
+        std::stack<std::pair<NodeId, NodeId>> node_stack;
+        node_stack.push({p, q});
         while (!node_stack.empty()) {
 
             auto pq = node_stack.top();
             node_stack.pop();
 
-            auto& p = *pq.first;
-            auto& q = *pq.second;
+            NodeId p = pq.first;
+            NodeId q = pq.second;
 
-            float F_pq = estimate_form_factor(p, q);
-            float F_qp = estimate_form_factor(q, p);
+            float F_pq = estimate_form_factor(nodes_[p], nodes_[q]);
+            float F_qp = estimate_form_factor(nodes_[q], nodes_[p]);
             if (F_pq < F_eps_ && F_qp < F_eps_) {
                 link(p, q);
                 continue;
@@ -351,15 +759,17 @@ private:
 
             if (F_qp < F_pq) {
                 if (subdivide(q)) {
-                    for (auto& child : q.children) {
-                        node_stack.push({&p, child.get()});
+                    for (NodeId child = nodes_[q].first_child;
+                         child < nodes_[q].first_child + 4; ++child) {
+                        node_stack.push({p, child});
                     }
                     continue;
                 }
             } else {
                 if (subdivide(p)) {
-                    for (auto& child : p.children) {
-                        node_stack.push({child.get(), &q});
+                    for (NodeId child = nodes_[p].first_child;
+                         child < nodes_[p].first_child + 4; ++child) {
+                        node_stack.push({child, q});
                     }
                     continue;
                 }
@@ -375,12 +785,8 @@ private:
             ProgressBar(std::cerr, "Solving System", max_iterations_);
         while (iteration--) // TODO: need a better convergence criteria
         {
-            for (auto& p : nodes_) {
-                gather_radiosity(p);
-            }
-            for (auto& p : nodes_) {
-                push_pull_radiosity(p, Color());
-            }
+            gather_radiosity();
+            push_pull_radiosity();
 
             progress_bar.update(max_iterations_ - iteration);
         }
@@ -389,52 +795,32 @@ private:
 
     /**
      * Refine all links in all nodes.
+     *
+     * Children are processed before their parents. Links created while
+     * refining are not refined in the same pass.
+     *
      * @return true if at least one link has been refined.
      */
     bool refine_links() {
         bool refined = false;
-        auto progress_bar =
-            ProgressBar(std::cerr, "Refining Links", nodes_.size());
-        for (size_t n = 0; n < nodes_.size(); ++n) {
-            refined |= refine_links(nodes_[n]);
+        const NodeId num_nodes = nodes_.size();
+        auto progress_bar = ProgressBar(std::cerr, "Refining Links", num_nodes);
+        for (NodeId n = 0; n < num_nodes; ++n) {
+            // children are stored after their parents
+            const NodeId p = num_nodes - 1 - n;
+            auto range = link_range(p);
+            for (size_t k = range.first; k < range.second; ++k) {
+                if (refine_link(p, k)) {
+                    // mark the link as removed
+                    links_[k].q = NONE;
+                    refined = true;
+                }
+            }
 
             progress_bar.update(n + 1);
         }
         std::cerr << std::endl;
-
-        return refined;
-    }
-
-    /**
-     * Refine all links in node p.
-     * @return true if at least one link has been refined.
-     */
-    bool refine_links(Quadnode& p) {
-        bool refined = false;
-
-        // Process all child nodes first.
-        if (!p.is_leaf()) {
-            for (auto& child : p.children) {
-                refined |= refine_links(*child.get());
-            }
-        }
-
-        // Post-order: Process links.
-        // Remove link if we refined. Note: new links might be added that's why
-        // we keep track of the old size.
-        std::vector<Linknode>& links = p.gathering_from;
-        size_t size = links.size();
-        size_t i = 0;
-        while (i < size) {
-            if (refine_link(p, links[i])) {
-                links.erase(links.begin() + i);
-                --size;
-
-                refined |= true;
-            } else {
-                ++i;
-            }
-        }
+        compute_links();
 
         return refined;
     }
@@ -443,26 +829,29 @@ private:
      * Refine link of receiver node p.
      *
      * @param p receiver node
-     * @param link link between shooter and receiver node
+     * @param k index of the link between shooter and receiver node in `links_`
      * @return true if a link has been refined.
      */
-    bool refine_link(Quadnode& p, Linknode& link_node) {
-        // Shooter node p
-        Quadnode& q = *link_node.q;
+    bool refine_link(NodeId p, size_t k) {
+        // Shooter node q
+        const NodeId q = links_[k].q;
+        if (q == NONE) {
+            return false;
+        }
 
-        auto oracle = q.rad_shoot * q.area * link_node.form_factor;
+        float F_pq = links_[k].form_factor;
+        auto oracle = nodes_[q].rad_shoot * nodes_[q].area * F_pq;
         if (oracle.r > BF_eps_ || oracle.g > BF_eps_ || oracle.b > BF_eps_) {
-
-            float F_pq = link_node.form_factor;
-            float F_qp = F_pq * p.area / q.area;
+            float F_qp = F_pq * nodes_[p].area / nodes_[q].area;
 
             // Decide which side to subdivide. See refine()
             if (F_pq < F_qp) {
                 if (subdivide(p)) {
                     // We've subdivided reciever node p. So all children of p
                     // should gather from q now.
-                    for (auto& child : p.children) {
-                        link(*child.get(), q);
+                    for (NodeId child = nodes_[p].first_child;
+                         child < nodes_[p].first_child + 4; ++child) {
+                        link(child, q);
                     }
 
                     return true;
@@ -471,8 +860,9 @@ private:
                 if (subdivide(q)) {
                     // We've subdivided shooter node q. So receiver node p
                     // should gather from all children of q now.
-                    for (auto& child : q.children) {
-                        link(p, *child.get());
+                    for (NodeId child = nodes_[q].first_child;
+                         child < nodes_[q].first_child + 4; ++child) {
+                        link(p, child);
                     }
 
                     return true;
@@ -483,44 +873,109 @@ private:
         return false;
     }
 
-    void gather_radiosity(Quadnode& in) {
-        std::stack<Quadnode*> node_stack;
-        node_stack.push(&in);
-        while (!node_stack.empty()) {
-            auto& p = *node_stack.top();
-            node_stack.pop();
-
-            p.rad_gather = Color();
-            for (const auto& link : p.gathering_from) {
-                p.rad_gather += link.form_factor * link.q->rad_shoot;
+    // Gather radiosity over the links of all nodes. The links are stored
+    // contiguously, so this is a single pass over memory.
+    void gather_radiosity() {
+        for (NodeId p = 0; p < nodes_.size(); ++p) {
+            Color rad_gather = Color();
+            auto range = link_range(p);
+            for (size_t k = range.first; k < range.second; ++k) {
+                const auto& link = links_[k];
+                rad_gather += link.form_factor * nodes_[link.q].rad_shoot;
             }
-            p.rad_gather = p.rho * p.rad_gather;
+            nodes_[p].rad_gather = nodes_[p].rho * rad_gather;
+        }
+        gather_cluster_radiosity();
+    }
 
-            if (p.is_leaf()) {
-                continue;
+    // Gather radiosity over the cluster links into the roots of the
+    // gathering clusters. The radiosity of the clusters is pulled up from
+    // their roots first; children are stored after their parents.
+    void gather_cluster_radiosity() {
+        if (cluster_links_.empty()) {
+            return;
+        }
+
+        for (size_t n = 0; n < clusters_.size(); ++n) {
+            auto& cluster = clusters_[clusters_.size() - 1 - n];
+            Color rad = Color();
+            if (cluster.is_leaf()) {
+                for (uint32_t i = cluster.begin; i < cluster.end; ++i) {
+                    const auto& root = nodes_[cluster_roots_[i]];
+                    rad += root.area * root.rad_shoot;
+                }
+            } else {
+                for (ClusterId child = cluster.first_child;
+                     child < cluster.first_child + 2; ++child) {
+                    rad += clusters_[child].area * clusters_[child].rad_shoot;
+                }
             }
+            cluster.rad_shoot = cluster.area > 0 ? rad / cluster.area : rad;
+        }
 
-            for (auto& child : p.children) {
-                node_stack.push(child.get());
+        std::vector<Color> rad_gather(tree_->num_triangles());
+        for (const auto& link : cluster_links_) {
+            const auto& p = clusters_[link.p];
+            const auto& q = clusters_[link.q];
+            const float factor = link.visibility * q.area / (4 * M_PI);
+            const Color rad = factor * q.rad_shoot;
+            for (uint32_t i = p.begin; i < p.end; ++i) {
+                const NodeId r = cluster_roots_[i];
+                const auto& tri = (*tree_)[r];
+                const Vector3f v =
+                    q.center - (tri.vertices[0] + (tri.u + tri.v) / 3.f);
+                const float length_squared = v.length_squared();
+                const float cos_theta =
+                    dot(v, tri.normal) / std::sqrt(length_squared);
+                if (cos_theta > 0) {
+                    rad_gather[r] += cos_theta / length_squared * rad;
+                }
             }
         }
+        for (NodeId r = 0; r < rad_gather.size(); ++r) {
+            nodes_[r].rad_gather += nodes_[r].rho * rad_gather[r];
+        }
     }
 
-    Color push_pull_radiosity(Quadnode& p, const Color& rad_down) {
-        if (p.is_leaf()) {
-            p.rad_shoot = p.emission + p.rad_gather + rad_down;
-        } else {
-            Color rad_up = Color();
-            for (auto& child : p.children) {
-                rad_up += push_pull_radiosity(*child, p.rad_gather + rad_down);
+    // Push gathered radiosity down to the leaves, and pull the average
+    // radiosity of the children up. Since children are stored after their
+    // parents, both are a single pass over the nodes.
+    void push_pull_radiosity() {
+        // rad_down(p) = sum of rad_gather of all ancestors of p
+        std::vector<Color> rad_down(nodes_.size());
+        for (NodeId p = 0; p < nodes_.size(); ++p) {
+            const NodeId parent = nodes_[p].parent;
+            if (parent != NONE) {
+                rad_down[p] = rad_down[parent] + nodes_[parent].rad_gather;
             }
-            p.rad_shoot = rad_up / 4.f;
         }
-        return p.rad_shoot;
+
+        for (NodeId n = 0; n < nodes_.size(); ++n) {
+            auto& p = nodes_[nodes_.size() - 1 - n];
+            if (p.is_leaf()) {
+                p.rad_shoot = p.emission + p.rad_gather +
+                              rad_down[nodes_.size() - 1 - n];
+            } else {
+                Color rad_up = Color();
+                for (NodeId child = p.first_child; child < p.first_child + 4;
+                     ++child) {
+                    rad_up += nodes_[child].rad_shoot;
+                }
+                p.rad_shoot = rad_up / 4.f;
+            }
+        }
+    }
+
+    // Range [begin, end) of the links of node p in `links_`. Nodes created
+    // since the last call of `compute_links` have no links yet.
+    std::pair<size_t, size_t> link_range(NodeId p) const {
+        if (link_offsets_.size() <= p + 1) {
+            return {0, 0};
+        }
+        return {link_offsets_[p], link_offsets_[p + 1]};
     }
 
     // TODO: reconsider design s.t. we can avoid conversion
-    // TODO: profile how much time we actually spend here!
     static Vector3f convert_to_vec(const RadiosityMesh::Point& pt) {
         return Vector3f{pt[0], pt[1], pt[2]};
     };
@@ -535,13 +990,29 @@ private:
 
 private:
     std::vector<Quadnode> nodes_;
-    Triangles subdivided_tris_; // TODO: Remove
+    LeafMesh leaves_;
+    // links of node p are links_[link_offsets_[p]], ...,
+    // links_[link_offsets_[p + 1] - 1]
+    std::vector<Linknode> links_;
+    std::vector<size_t> link_offsets_;
     RadiosityMesh mesh_;
 
     const KDTree* tree_;
-    KDTreeIntersection tree_intersection_;
     float F_eps_;
     float A_eps_;
     float BF_eps_;
     int max_iterations_;
+    size_t num_threads_;
+    bool clustering_;
+    bool verbose_;
+
+    // links (p, q) created by `link`, whose form factors are not computed yet
+    std::vector<std::pair<NodeId, NodeId>> pending_links_;
+    size_t num_computed_links_ = 0;
+
+    std::vector<Cluster> clusters_;
+    std::vector<NodeId> cluster_roots_;
+    std::vector<ClusterLink> cluster_links_;
+    // cluster links (p, q), whose visibility is not estimated yet
+    std::vector<std::pair<ClusterId, ClusterId>> pending_cluster_links_;
 };
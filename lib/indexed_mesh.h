@@ -0,0 +1,189 @@
+/**
+ * Indexed representation of the triangles of a scene.
+ *
+ * A `Triangle` stores copies of its vertices, normals and material colors,
+ * although most of them are shared with neighboring triangles resp. with all
+ * triangles of a mesh. An indexed mesh stores every distinct vertex, normal
+ * and material once, and only 32-bit indices into these tables per triangle.
+ * It is used to load scenes and to store triangles in kd-tree cache files;
+ * the `Triangle`s are materialized from it, when they are needed.
+ */
+
+#pragma once
+
+#include "array_view.h"
+#include "triangle.h"
+#include "types.h"
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Material of a triangle (cf. the material members of `Triangle`).
+ */
+struct Material {
+    Color ambient;
+    Color diffuse;
+    Color emissive;
+    Color reflective;
+    float reflectivity = 0;
+    // Explicit padding up to the alignment of the colors, which is always
+    // zero. Materials are hashed, compared and written bytewise (cf.
+    // `BitwiseIndex` and `KDTree::cache_key`), i.e. they must not contain
+    // uninitialized bytes.
+    float padding[3] = {};
+};
+
+static_assert(sizeof(Material) == 4 * sizeof(Color) + 4 * sizeof(float),
+              "material should not contain implicit padding");
+
+/**
+ * Triangle referencing its vertices, normals and material by index.
+ */
+struct IndexedTriangle {
+    std::array<uint32_t, 3> vertices;
+    std::array<uint32_t, 3> normals;
+    uint32_t material;
+};
+
+static_assert(sizeof(IndexedTriangle) == 28,
+              "indexed triangle should not contain padding");
+
+class IndexedMesh {
+public:
+    IndexedMesh() = default;
+
+    IndexedMesh(std::vector<Point3f> vertices, std::vector<Normal3f> normals,
+                std::vector<Material> materials,
+                std::vector<IndexedTriangle> triangles)
+        : vertices_(std::move(vertices))
+        , normals_(std::move(normals))
+        , materials_(std::move(materials))
+        , triangles_(std::move(triangles)) {}
+
+    /**
+     * Indexed mesh of the triangles, where bitwise equal vertices, normals and
+     * materials are stored once. The materialized triangles are bitwise equal
+     * to the given ones.
+     */
+    explicit IndexedMesh(ArrayView<Triangle> tris) {
+        BitwiseIndex<Point3f> vertex_ids;
+        BitwiseIndex<Normal3f> normal_ids;
+        BitwiseIndex<Material> material_ids;
+
+        triangles_.reserve(tris.size());
+        for (const auto& tri : tris) {
+            IndexedTriangle indexed;
+            for (size_t i = 0; i < 3; ++i) {
+                indexed.vertices[i] =
+                    vertex_ids.add(tri.vertices[i], vertices_);
+                indexed.normals[i] = normal_ids.add(tri.normals[i], normals_);
+            }
+            indexed.material = material_ids.add(
+                {tri.ambient, tri.diffuse, tri.emissive, tri.reflective,
+                 tri.reflectivity},
+                materials_);
+            triangles_.push_back(indexed);
+        }
+    }
+
+    size_t num_triangles() const { return triangles_.size(); }
+    const std::vector<Point3f>& vertices() const { return vertices_; }
+    const std::vector<Normal3f>& normals() const { return normals_; }
+    const std::vector<Material>& materials() const { return materials_; }
+    const std::vector<IndexedTriangle>& indexed_triangles() const {
+        return triangles_;
+    }
+
+    /**
+     * Check that all indices of the triangles are valid.
+     */
+    bool is_valid() const {
+        for (const auto& tri : triangles_) {
+            for (size_t i = 0; i < 3; ++i) {
+                if (tri.vertices[i] >= vertices_.size() ||
+                    tri.normals[i] >= normals_.size()) {
+                    return false;
+                }
+            }
+            if (tri.material >= materials_.size()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    Triangle triangle(size_t id) const {
+        const auto& tri = triangles_[id];
+        const auto& material = materials_[tri.material];
+        return Triangle{// vertices
+                        {vertices_[tri.vertices[0]], vertices_[tri.vertices[1]],
+                         vertices_[tri.vertices[2]]},
+                        // normals
+                        {normals_[tri.normals[0]], normals_[tri.normals[1]],
+                         normals_[tri.normals[2]]},
+                        material.ambient,
+                        material.diffuse,
+                        material.emissive,
+                        material.reflective,
+                        material.reflectivity};
+    }
+
+    /**
+     * Materialize all triangles; the id of a triangle is its index.
+     */
+    Triangles triangles() const {
+        Triangles tris;
+        tris.reserve(triangles_.size());
+        for (size_t id = 0; id < triangles_.size(); ++id) {
+            tris.push_back(triangle(id));
+        }
+        return tris;
+    }
+
+private:
+    // Index of values by their bytes, s.t. -0 and 0 are different values.
+    template <typename T> class BitwiseIndex {
+        struct Key {
+            T value;
+            bool operator==(const Key& other) const {
+                return std::memcmp(&value, &other.value, sizeof(T)) == 0;
+            }
+        };
+        struct Hash {
+            size_t operator()(const Key& key) const {
+                // FNV-1a
+                uint64_t hash = 14695981039346656037ULL;
+                const auto* bytes =
+                    reinterpret_cast<const unsigned char*>(&key.value);
+                for (size_t i = 0; i < sizeof(T); ++i) {
+                    hash ^= bytes[i];
+                    hash *= 1099511628211ULL;
+                }
+                return hash;
+            }
+        };
+
+    public:
+        // Index of the value in values; the value is appended, if it is new.
+        uint32_t add(const T& value, std::vector<T>& values) {
+            auto it = ids_.emplace(Key{value}, values.size());
+            if (it.second) {
+                values.push_back(value);
+            }
+            return it.first->second;
+        }
+
+    private:
+        std::unordered_map<Key, uint32_t, Hash> ids_;
+    };
+
+    std::vector<Point3f> vertices_;
+    std::vector<Normal3f> normals_;
+    std::vector<Material> materials_;
+    std::vector<IndexedTriangle> triangles_;
+};
@@ -0,0 +1,256 @@
+#include "instancing.h"
+
+#include "emitters.h"
+#include "intersection.h"
+#include "profile.h"
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+namespace {
+
+Triangle transform_triangle(const Transform& T, const Triangle& tri) {
+    return Triangle({T(tri.vertices[0]), T(tri.vertices[1]),
+                     T(tri.vertices[2])},
+                    {T(tri.normals[0]), T(tri.normals[1]), T(tri.normals[2])},
+                    tri.ambient, tri.diffuse, tri.emissive, tri.reflective,
+                    tri.reflectivity);
+}
+
+// Does the ray hit the box in [0, t_max]?
+bool hit_box(const PrecomputedRay& ray, const Bbox3f& box, float t_max,
+             float& tenter) {
+    float tleave;
+    return intersect_ray_box(ray, box, tenter, tleave) && 0 <= tleave &&
+           tenter <= t_max;
+}
+
+} // namespace anonymous
+
+InstancedScene::InstancedScene(std::vector<Triangles> meshes,
+                               std::vector<Instance> instances)
+    : instances_(std::move(instances)) {
+    turner::Profile _(turner::ProfCategory::KDTreeBuild);
+    meshes_.reserve(meshes.size());
+    for (auto& tris : meshes) {
+        meshes_.emplace_back(std::move(tris));
+    }
+
+    std::vector<Bbox3f> boxes;
+    std::vector<Point3f> centroids;
+    boxes.reserve(instances_.size());
+    centroids.reserve(instances_.size());
+    to_object_.reserve(instances_.size());
+    first_ids_.reserve(instances_.size() + 1);
+    for (const auto& instance : instances_) {
+        if (meshes_.size() <= instance.mesh) {
+            throw std::runtime_error("instance of missing mesh " +
+                                     std::to_string(instance.mesh));
+        }
+        const auto& mesh = meshes_[instance.mesh];
+        to_object_.push_back(instance.to_world.inverse());
+
+        const size_t last_id = first_ids_.back() + mesh.num_triangles();
+        if (std::numeric_limits<TriangleId>::max() <= last_id) {
+            throw std::runtime_error("too many instanced triangles");
+        }
+        first_ids_.push_back(last_id);
+
+        // Empty meshes do not have a box, and are never hit.
+        if (mesh.num_triangles() == 0) {
+            boxes.push_back(Bbox3f(Point3f(), Point3f()));
+            centroids.push_back(Point3f());
+            continue;
+        }
+        // Enlarge the box, s.t. rounding errors of the transformation do not
+        // let rays miss triangles at its faces.
+        Bbox3f box = instance.to_world(mesh.box());
+        const float pad = EPS * (1 + (box.p_max - box.p_min).length());
+        box.p_min -= Vector3f(pad, pad, pad);
+        box.p_max += Vector3f(pad, pad, pad);
+        boxes.push_back(box);
+        centroids.push_back(
+            boxes.back().p_min +
+            (boxes.back().p_max - boxes.back().p_min) * 0.5f);
+    }
+
+    top_ = detail::BinaryBVH(std::move(boxes), std::move(centroids));
+    if (!top_.nodes.empty()) {
+        box_ = top_.nodes.front().box;
+    }
+}
+
+Triangle InstancedScene::triangle(TriangleId id) const {
+    const size_t index = instance_index(id);
+    const auto& instance = instances_[index];
+    return transform_triangle(instance.to_world,
+                              meshes_[instance.mesh][id - first_ids_[index]]);
+}
+
+Triangles InstancedScene::emissive_triangles() const {
+    Triangles res;
+    for (const auto& instance : instances_) {
+        for (const auto& tri : meshes_[instance.mesh].triangles()) {
+            if (is_emissive(tri)) {
+                res.push_back(transform_triangle(instance.to_world, tri));
+            }
+        }
+    }
+    return res;
+}
+
+size_t InstancedScene::instance_index(TriangleId id) const {
+    assert(id < num_triangles());
+    // the last instance, whose first id is not after id
+    return std::upper_bound(first_ids_.begin(), first_ids_.end(), id) -
+           first_ids_.begin() - 1;
+}
+
+InstancedIntersection::InstancedIntersection(const InstancedScene& scene)
+    : scene_(&scene) {
+    meshes_.reserve(scene.meshes_.size());
+    for (const auto& mesh : scene.meshes_) {
+        meshes_.emplace_back(mesh);
+    }
+}
+
+const Triangle& InstancedIntersection::
+operator[](const TriangleId id) const {
+    auto it = triangles_.find(id);
+    if (it == triangles_.end()) {
+        it = triangles_.emplace(id, scene_->triangle(id)).first;
+    }
+    return it->second;
+}
+
+const Triangle& InstancedIntersection::at(const TriangleId id) const {
+    if (scene_->num_triangles() <= id) {
+        throw std::out_of_range("InstancedIntersection::at");
+    }
+    return (*this)[id];
+}
+
+const InstancedIntersection::OptionalId
+InstancedIntersection::intersect(const Ray& ray, float& r, float& a,
+                                 float& b) {
+    OptionalId res;
+    r = std::numeric_limits<float>::max();
+    const auto& nodes = scene_->top_.nodes;
+    if (nodes.empty()) {
+        return res;
+    }
+
+    // closest hit so far
+    r = ray.t_max;
+    const PrecomputedRay fixed_ray(ray);
+    stack_.clear();
+    stack_.push_back({0, 0});
+    while (!stack_.empty()) {
+        const StackEntry entry = stack_.back();
+        stack_.pop_back();
+        // behind the closest hit
+        if (r < entry.tenter) {
+            continue;
+        }
+
+        const auto& node = nodes[entry.node];
+        if (node.is_leaf()) {
+            for (uint32_t i = node.begin; i < node.end; ++i) {
+                const uint32_t index = scene_->top_.ids[i];
+                const auto& instance = scene_->instances_[index];
+                const Ray object_ray = scene_->to_object_[index](ray);
+                const auto id =
+                    meshes_[instance.mesh].intersect(object_ray, r, r, a, b);
+                if (id) {
+                    res = OptionalId{scene_->first_ids_[index] +
+                                     static_cast<TriangleId>(id)};
+                }
+            }
+            continue;
+        }
+
+        // push the far child first, s.t. the near child is visited first
+        float tenter[2];
+        const bool hit_left = hit_box(fixed_ray, nodes[node.left].box, r,
+                                      tenter[0]);
+        const bool hit_right = hit_box(fixed_ray, nodes[node.right].box, r,
+                                       tenter[1]);
+        const StackEntry left{node.left, tenter[0]};
+        const StackEntry right{node.right, tenter[1]};
+        if (hit_left && hit_right) {
+            const bool left_first = tenter[0] <= tenter[1];
+            stack_.push_back(left_first ? right : left);
+            stack_.push_back(left_first ? left : right);
+        } else if (hit_left) {
+            stack_.push_back(left);
+        } else if (hit_right) {
+            stack_.push_back(right);
+        }
+    }
+    if (!res) {
+        r = std::numeric_limits<float>::max();
+    }
+    return res;
+}
+
+bool InstancedIntersection::occluded(const Ray& ray, float t_max) {
+    const auto& nodes = scene_->top_.nodes;
+    if (nodes.empty()) {
+        return false;
+    }
+
+    const PrecomputedRay fixed_ray(ray);
+    stack_.clear();
+    stack_.push_back({0, 0});
+    while (!stack_.empty()) {
+        const auto& node = nodes[stack_.back().node];
+        stack_.pop_back();
+
+        if (node.is_leaf()) {
+            for (uint32_t i = node.begin; i < node.end; ++i) {
+                const uint32_t index = scene_->top_.ids[i];
+                const auto& instance = scene_->instances_[index];
+                if (meshes_[instance.mesh].occluded(
+                        scene_->to_object_[index](ray), t_max)) {
+                    return true;
+                }
+            }
+            continue;
+        }
+
+        for (const uint32_t child : {node.left, node.right}) {
+            float tenter;
+            if (hit_box(fixed_ray, nodes[child].box, t_max, tenter)) {
+                stack_.push_back({child, tenter});
+            }
+        }
+    }
+    return false;
+}
+
+InstancedIntersection::HitPacket
+InstancedIntersection::intersect_packet(const RayPacket& rays,
+                                        unsigned active) {
+    HitPacket hits;
+    for (size_t i = 0; i < PACKET_SIZE; ++i) {
+        if (active & (1 << i)) {
+            auto& hit = hits[i];
+            hit.id = intersect(rays[i], hit.r, hit.a, hit.b);
+        }
+    }
+    return hits;
+}
+
+unsigned InstancedIntersection::occluded_packet(
+    const RayPacket& rays, const std::array<float, PACKET_SIZE>& t_max,
+    unsigned active) {
+    unsigned occluded_mask = 0;
+    for (size_t i = 0; i < PACKET_SIZE; ++i) {
+        if ((active & (1 << i)) && occluded(rays[i], t_max[i])) {
+            occluded_mask |= 1 << i;
+        }
+    }
+    return occluded_mask;
+}
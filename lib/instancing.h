@@ -0,0 +1,160 @@
+/**
+ * Two-level acceleration structure for scenes, which contain the same mesh
+ * many times, e.g. a forest of a few tree assets.
+ *
+ * Every unique mesh is stored once in object space in its own BVH (cf.
+ * bvh.h). The instances of the meshes are transformations into world space,
+ * over which a top-level BVH is built. A ray is intersected with an instance
+ * by transforming it into the object space of the instance, hence memory and
+ * build time scale with the unique geometry instead of the number of
+ * instances.
+ */
+
+#pragma once
+
+#include "bvh.h"
+#include "intersector.h"
+#include "transform.h"
+#include "triangle.h"
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Instance of a mesh, i.e. the mesh transformed into world space.
+ */
+struct Instance {
+    uint32_t mesh;      // index of the mesh
+    Transform to_world; // from the object space of the mesh to world space
+};
+
+class InstancedIntersection;
+
+class InstancedScene {
+    friend InstancedIntersection;
+
+public:
+    using TriangleId = detail::TriangleId;
+
+    InstancedScene() = default;
+
+    /**
+     * Build up the BVHs of the meshes and of the instances.
+     *
+     * The triangle ids of an instance are consecutive, and ordered by the
+     * instances, i.e. the ids of the first instance are the indices of the
+     * triangles of its mesh, followed by the ids of the second instance, etc.
+     *
+     * Throws std::runtime_error, if an instance references a missing mesh,
+     * if its transformation is not invertible, or if there are more
+     * instanced triangles than triangle ids.
+     *
+     * @param meshes    triangles of every mesh in object space
+     * @param instances
+     */
+    InstancedScene(std::vector<Triangles> meshes,
+                   std::vector<Instance> instances);
+
+    size_t num_meshes() const { return meshes_.size(); }
+    size_t num_instances() const { return instances_.size(); }
+    // number of triangles of all instances, i.e. of triangle ids
+    size_t num_triangles() const { return first_ids_.back(); }
+    const BVH& mesh(size_t index) const { return meshes_[index]; }
+    const Instance& instance(size_t index) const { return instances_[index]; }
+    const Bbox3f& box() const { return box_; }
+
+    /**
+     * Triangle with the given id in world space.
+     */
+    Triangle triangle(TriangleId id) const;
+
+    /**
+     * Emissive triangles of all instances in world space, i.e. the area
+     * lights of the scene (cf. emitters.h).
+     */
+    Triangles emissive_triangles() const;
+
+private:
+    // index of the instance containing the triangle with the given id
+    size_t instance_index(TriangleId id) const;
+
+    std::vector<BVH> meshes_;
+    std::vector<Instance> instances_;
+    std::vector<Transform> to_object_;
+    // the ids [first_ids_[i], first_ids_[i + 1]) belong to instance i
+    std::vector<TriangleId> first_ids_ = {0};
+    // BVH over the world space boxes of the instances
+    detail::BinaryBVH top_{{}, {}};
+    Bbox3f box_;
+};
+
+/**
+ * Wraps an instanced scene and provides an interface for computing
+ * Ray-Triangle intersection.
+ *
+ * The ray is transformed into the object space of every instance, whose box
+ * it hits, and intersected with the BVH of the mesh of the instance. The ray
+ * direction is not normalized, hence the distance r of a hit is the same in
+ * both spaces.
+ */
+class InstancedIntersection : public Intersector {
+public:
+    using TriangleId = InstancedScene::TriangleId;
+    using Intersector::intersect;
+    using Intersector::intersect_packet;
+    using Intersector::occluded_packet;
+
+    explicit InstancedIntersection(const InstancedScene& scene);
+
+    /**
+     * The triangles in world space are computed on demand, and cached in this
+     * intersection, s.t. the references stay valid as long as it exists.
+     * Hence, the memory grows with the number of different triangles looked
+     * up.
+     */
+    const Triangle& operator[](const TriangleId id) const override;
+    const Triangle& at(const TriangleId id) const override;
+
+    /**
+     * The instances are visited front to back, and instances behind the
+     * closest hit found so far are skipped.
+     *
+     * Cf. `Intersector::intersect`
+     */
+    const OptionalId intersect(const Ray& ray, float& r, float& a,
+                               float& b) override;
+
+    /**
+     * Cf. `Intersector::occluded`
+     */
+    bool occluded(const Ray& ray, float t_max) override;
+
+    /**
+     * The rays are intersected one by one.
+     *
+     * Cf. `Intersector::intersect_packet`
+     */
+    HitPacket intersect_packet(const RayPacket& rays,
+                               unsigned active) override;
+
+    /**
+     * The rays are tested one by one.
+     *
+     * Cf. `Intersector::occluded_packet`
+     */
+    unsigned occluded_packet(const RayPacket& rays,
+                             const std::array<float, PACKET_SIZE>& t_max,
+                             unsigned active) override;
+
+private:
+    struct StackEntry {
+        uint32_t node;
+        float tenter; // distance at which the ray enters the box of the node
+    };
+
+    const InstancedScene* scene_;
+    std::vector<BVHIntersection> meshes_;
+    std::vector<StackEntry> stack_;
+    mutable std::unordered_map<TriangleId, Triangle> triangles_;
+};
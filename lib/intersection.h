@@ -3,6 +3,8 @@
 #include "triangle.h"
 #include "types.h"
 
+#include <xmmintrin.h>
+
 /**
  * Test segment and plane intersection
  *
@@ -51,6 +53,11 @@ inline float intersect_ray_plane(const Ray& ray, const Point3f& p0,
 /**
  * Intersect a ray and a triangle
  *
+ * Cf. [MT97], Möller–Trumbore algorithm: the barycentric coordinates of the
+ * intersection point are solved for by Cramer's rule, without intersecting
+ * the plane of the triangle first. Hence, rays missing the triangle are
+ * rejected early.
+ *
  * Args:
  *   ray: ray to intersect
  *   tri: triangle to intersect
@@ -60,37 +67,264 @@ inline float intersect_ray_plane(const Ray& ray, const Point3f& p0,
  * Return:
  *   true, if the ray intersects the triangle, otherwise false
  */
-inline bool intersect_ray_triangle(const Ray& ray, const Triangle& tri,
+inline bool intersect_ray_triangle(const Ray& ray, const CompactTriangle& tri,
                                    float& r, float& s, float& t) {
-    r = intersect_ray_plane(ray, tri.vertices[0], tri.normal);
-    if (r < 0) {
+    // The SSE versions below compute exactly the same in each lane. Hence,
+    // the products are written out in the same order.
+
+    // p = d x v
+    const float px = ray.d.y * tri.v.z - ray.d.z * tri.v.y;
+    const float py = ray.d.z * tri.v.x - ray.d.x * tri.v.z;
+    const float pz = ray.d.x * tri.v.y - ray.d.y * tri.v.x;
+    const float det = tri.u.x * px + tri.u.y * py + tri.u.z * pz;
+    if (det == 0.f) {
+        // ray is parallel to the triangle
         return false;
     }
 
-    Point3f P_int = ray.o + r * ray.d;
-    Vector3f w = P_int - tri.vertices[0];
-
-    // precompute scalar products
-    // other values are precomputed in triangle on construction
-    float wv = dot(w, tri.v);
-    float wu = dot(w, tri.u);
-
-    s = (tri.uv * wv - tri.vv * wu) / tri.denom;
+    // w = o - p0
+    const float wx = ray.o.x - tri.p0.x;
+    const float wy = ray.o.y - tri.p0.y;
+    const float wz = ray.o.z - tri.p0.z;
+    s = (wx * px + wy * py + wz * pz) / det;
     if (s < 0) {
         return false;
     }
 
-    t = (tri.uv * wu - tri.uu * wv) / tri.denom;
+    // q = w x u
+    const float qx = wy * tri.u.z - wz * tri.u.y;
+    const float qy = wz * tri.u.x - wx * tri.u.z;
+    const float qz = wx * tri.u.y - wy * tri.u.x;
+    t = (ray.d.x * qx + ray.d.y * qy + ray.d.z * qz) / det;
     if (t < 0 || 1 < s + t) {
         return false;
     }
 
-    return true;
+    // The distance is computed from the plane of the triangle like in
+    // `intersect_ray_plane`, which is more precise than by Cramer's rule.
+    r = -(tri.normal.x * wx + tri.normal.y * wy + tri.normal.z * wz) /
+        (tri.normal.x * ray.d.x + tri.normal.y * ray.d.y +
+         tri.normal.z * ray.d.z);
+    return 0 <= r;
+}
+
+inline bool intersect_ray_triangle(const Ray& ray, const Triangle& tri,
+                                   float& r, float& s, float& t) {
+    return intersect_ray_triangle(ray, CompactTriangle(tri), r, s, t);
+}
+
+namespace detail {
+
+// Möller–Trumbore in each of the 4 lanes, cf. `intersect_ray_triangle`.
+// Every argument contains the coordinates along x, y, z of either 4 rays or
+// 4 triangles.
+inline __m128 intersect_ray_triangle(const __m128 o[3], const __m128 d[3],
+                                     const __m128 p0[3], const __m128 n[3],
+                                     const __m128 u[3], const __m128 v[3],
+                                     __m128& r, __m128& s, __m128& t) {
+    // p = d x v
+    const __m128 px =
+        _mm_sub_ps(_mm_mul_ps(d[1], v[2]), _mm_mul_ps(d[2], v[1]));
+    const __m128 py =
+        _mm_sub_ps(_mm_mul_ps(d[2], v[0]), _mm_mul_ps(d[0], v[2]));
+    const __m128 pz =
+        _mm_sub_ps(_mm_mul_ps(d[0], v[1]), _mm_mul_ps(d[1], v[0]));
+    const __m128 det = _mm_add_ps(
+        _mm_add_ps(_mm_mul_ps(u[0], px), _mm_mul_ps(u[1], py)),
+        _mm_mul_ps(u[2], pz));
+
+    // w = o - p0
+    const __m128 wx = _mm_sub_ps(o[0], p0[0]);
+    const __m128 wy = _mm_sub_ps(o[1], p0[1]);
+    const __m128 wz = _mm_sub_ps(o[2], p0[2]);
+    s = _mm_div_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(wx, px),
+                                         _mm_mul_ps(wy, py)),
+                              _mm_mul_ps(wz, pz)),
+                   det);
+
+    // q = w x u
+    const __m128 qx =
+        _mm_sub_ps(_mm_mul_ps(wy, u[2]), _mm_mul_ps(wz, u[1]));
+    const __m128 qy =
+        _mm_sub_ps(_mm_mul_ps(wz, u[0]), _mm_mul_ps(wx, u[2]));
+    const __m128 qz =
+        _mm_sub_ps(_mm_mul_ps(wx, u[1]), _mm_mul_ps(wy, u[0]));
+    t = _mm_div_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(d[0], qx),
+                                         _mm_mul_ps(d[1], qy)),
+                              _mm_mul_ps(d[2], qz)),
+                   det);
+    r = _mm_div_ps(
+        _mm_xor_ps(_mm_set1_ps(-0.f),
+                   _mm_add_ps(_mm_add_ps(_mm_mul_ps(n[0], wx),
+                                         _mm_mul_ps(n[1], wy)),
+                              _mm_mul_ps(n[2], wz))),
+        _mm_add_ps(_mm_add_ps(_mm_mul_ps(n[0], d[0]), _mm_mul_ps(n[1], d[1])),
+                   _mm_mul_ps(n[2], d[2])));
+
+    const __m128 zero = _mm_setzero_ps();
+    __m128 mask = _mm_cmpneq_ps(det, zero);
+    mask = _mm_and_ps(mask, _mm_cmpnlt_ps(s, zero));
+    mask = _mm_and_ps(mask, _mm_cmpnlt_ps(t, zero));
+    mask = _mm_and_ps(mask,
+                      _mm_cmpnlt_ps(_mm_set1_ps(1), _mm_add_ps(s, t)));
+    return _mm_and_ps(mask, _mm_cmple_ps(zero, r));
+}
+
+} // namespace detail
+
+/**
+ * Intersect 4 rays and a triangle at once (SSE)
+ *
+ * Computes the same as `intersect_ray_triangle` for each of the rays.
+ *
+ * Args:
+ *   o, d: origins resp. directions of the rays, where o[ax] (d[ax]) contains
+ *         the coordinates along axis ax of all 4 origins (directions)
+ *   tri: triangle to intersect
+ *   r, s, t: cf. `intersect_ray_triangle` (valid in intersecting lanes only)
+ *
+ * Return:
+ *   mask of the rays intersecting the triangle (all bits set in the lane of a
+ *   ray intersecting the triangle)
+ */
+inline __m128 intersect_ray_triangle(const __m128 o[3], const __m128 d[3],
+                                     const CompactTriangle& tri, __m128& r,
+                                     __m128& s, __m128& t) {
+    const __m128 p0[3] = {_mm_set1_ps(tri.p0.x), _mm_set1_ps(tri.p0.y),
+                          _mm_set1_ps(tri.p0.z)};
+    const __m128 n[3] = {_mm_set1_ps(tri.normal.x), _mm_set1_ps(tri.normal.y),
+                         _mm_set1_ps(tri.normal.z)};
+    const __m128 u[3] = {_mm_set1_ps(tri.u.x), _mm_set1_ps(tri.u.y),
+                         _mm_set1_ps(tri.u.z)};
+    const __m128 v[3] = {_mm_set1_ps(tri.v.x), _mm_set1_ps(tri.v.y),
+                         _mm_set1_ps(tri.v.z)};
+    return detail::intersect_ray_triangle(o, d, p0, n, u, v, r, s, t);
+}
+
+/**
+ * Intersect a ray and a bundle of 4 triangles at once (SSE)
+ *
+ * Computes the same as `intersect_ray_triangle` for each of the triangles.
+ *
+ * Args:
+ *   o, d: origin resp. direction of the ray, where o[ax] (d[ax]) contains
+ *         the coordinate along axis ax in all 4 lanes
+ *   bundle: triangles to intersect
+ *   r, s, t: cf. `intersect_ray_triangle` (valid in intersecting lanes only)
+ *
+ * Return:
+ *   mask of the triangles intersected by the ray (all bits set in the lane of
+ *   an intersected triangle)
+ */
+inline __m128 intersect_ray_triangles(const __m128 o[3], const __m128 d[3],
+                                      const TriangleBundle& bundle, __m128& r,
+                                      __m128& s, __m128& t) {
+    const __m128 p0[3] = {_mm_load_ps(bundle.p0[0]), _mm_load_ps(bundle.p0[1]),
+                          _mm_load_ps(bundle.p0[2])};
+    const __m128 n[3] = {_mm_load_ps(bundle.normal[0]),
+                         _mm_load_ps(bundle.normal[1]),
+                         _mm_load_ps(bundle.normal[2])};
+    const __m128 u[3] = {_mm_load_ps(bundle.u[0]), _mm_load_ps(bundle.u[1]),
+                         _mm_load_ps(bundle.u[2])};
+    const __m128 v[3] = {_mm_load_ps(bundle.v[0]), _mm_load_ps(bundle.v[1]),
+                         _mm_load_ps(bundle.v[2])};
+    return detail::intersect_ray_triangle(o, d, p0, n, u, v, r, s, t);
+}
+
+/**
+ * Intersect a ray and consecutive bundles, e.g. the bundles of a leaf.
+ *
+ * Of several triangles at the same distance, the first one is taken, s.t. the
+ * result is the same as testing the triangles one by one.
+ *
+ * Args:
+ *   ray: ray to intersect
+ *   begin, end: range of bundles
+ *   min_r, min_s, min_t: in: distance, before which a hit is considered;
+ *                        out: distance and baricentric coordinates of the
+ *                        closest hit (unchanged, if no triangle is hit)
+ *
+ * Return:
+ *   id of the closest triangle hit, or TriangleBundle::INVALID_ID
+ */
+inline uint32_t intersect_ray_bundles(const Ray& ray,
+                                      const TriangleBundle* begin,
+                                      const TriangleBundle* end, float& min_r,
+                                      float& min_s, float& min_t) {
+    const __m128 o[3] = {_mm_set1_ps(ray.o.x), _mm_set1_ps(ray.o.y),
+                         _mm_set1_ps(ray.o.z)};
+    const __m128 d[3] = {_mm_set1_ps(ray.d.x), _mm_set1_ps(ray.d.y),
+                         _mm_set1_ps(ray.d.z)};
+    uint32_t res = TriangleBundle::INVALID_ID;
+    for (const auto* bundle = begin; bundle != end; ++bundle) {
+        __m128 r, s, t;
+        const __m128 hits = intersect_ray_triangles(o, d, *bundle, r, s, t);
+        const int mask = _mm_movemask_ps(
+            _mm_and_ps(hits, _mm_cmplt_ps(r, _mm_set1_ps(min_r))));
+        if (!mask) {
+            continue;
+        }
+
+        alignas(16) float rs[TriangleBundle::SIZE], ss[TriangleBundle::SIZE],
+            ts[TriangleBundle::SIZE];
+        _mm_store_ps(rs, r);
+        _mm_store_ps(ss, s);
+        _mm_store_ps(ts, t);
+        for (size_t lane = 0; lane < TriangleBundle::SIZE; ++lane) {
+            if ((mask & (1 << lane)) && rs[lane] < min_r) {
+                min_r = rs[lane];
+                min_s = ss[lane];
+                min_t = ts[lane];
+                res = bundle->ids[lane];
+            }
+        }
+    }
+    return res;
+}
+
+/**
+ * Find any triangle of consecutive bundles hit by a ray before t_max, i.e.
+ * the first one found, which is not necessarily the closest one.
+ *
+ * Return:
+ *   id of the triangle hit, or TriangleBundle::INVALID_ID
+ */
+inline uint32_t occluder_in_bundles(const Ray& ray, const TriangleBundle* begin,
+                                    const TriangleBundle* end, float t_max) {
+    const __m128 o[3] = {_mm_set1_ps(ray.o.x), _mm_set1_ps(ray.o.y),
+                         _mm_set1_ps(ray.o.z)};
+    const __m128 d[3] = {_mm_set1_ps(ray.d.x), _mm_set1_ps(ray.d.y),
+                         _mm_set1_ps(ray.d.z)};
+    const __m128 r_max = _mm_set1_ps(t_max);
+    for (const auto* bundle = begin; bundle != end; ++bundle) {
+        __m128 r, s, t;
+        const __m128 hits = intersect_ray_triangles(o, d, *bundle, r, s, t);
+        const int mask =
+            _mm_movemask_ps(_mm_and_ps(hits, _mm_cmplt_ps(r, r_max)));
+        for (size_t lane = 0; lane < TriangleBundle::SIZE; ++lane) {
+            if (mask & (1 << lane)) {
+                return bundle->ids[lane];
+            }
+        }
+    }
+    return TriangleBundle::INVALID_ID;
+}
+
+/**
+ * Test if a ray hits any triangle of consecutive bundles before t_max.
+ */
+inline bool occluded_by_bundles(const Ray& ray, const TriangleBundle* begin,
+                                const TriangleBundle* end, float t_max) {
+    return occluder_in_bundles(ray, begin, end, t_max) !=
+           TriangleBundle::INVALID_ID;
 }
 
 /**
  * Test ray AABB (axis-aligned bounding box) intersection
  *
+ * The near and far slab of every axis are selected by the precomputed signs
+ * of the direction, hence the test needs no branches.
+ *
  * Args:
  *   ray: ray to intersect
  *   box: aabb to intersect
@@ -102,31 +336,33 @@ inline bool intersect_ray_triangle(const Ray& ray, const Triangle& tri,
  *
  * Cf. http://people.csail.mit.edu/amy/papers/box-jgt.pdf
  */
-inline bool intersect_ray_box(const Ray& ray, const Bbox3f& box, float& tmin,
-                              float& tmax) {
-    Vector3f d_inv(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
-
-    float tx1 = (box.p_min.x - ray.o.x) * d_inv.x;
-    float tx2 = (box.p_max.x - ray.o.x) * d_inv.x;
-
-    tmin = std::fmin(tx1, tx2);
-    tmax = std::fmax(tx1, tx2);
+inline bool intersect_ray_box(const PrecomputedRay& ray, const Bbox3f& box,
+                              float& tmin, float& tmax) {
+    tmin = (box[ray.sign[0]].x - ray.o.x) * ray.d_inv.x;
+    tmax = (box[1 - ray.sign[0]].x - ray.o.x) * ray.d_inv.x;
 
-    float ty1 = (box.p_min.y - ray.o.y) * d_inv.y;
-    float ty2 = (box.p_max.y - ray.o.y) * d_inv.y;
+    const float tymin = (box[ray.sign[1]].y - ray.o.y) * ray.d_inv.y;
+    const float tymax = (box[1 - ray.sign[1]].y - ray.o.y) * ray.d_inv.y;
+    tmin = std::max(tmin, tymin);
+    tmax = std::min(tmax, tymax);
 
-    tmin = std::fmax(tmin, std::fmin(ty1, ty2));
-    tmax = std::fmin(tmax, std::fmax(ty1, ty2));
-
-    float tz1 = (box.p_min.z - ray.o.z) * d_inv.z;
-    float tz2 = (box.p_max.z - ray.o.z) * d_inv.z;
-
-    tmin = std::fmax(tmin, std::fmin(tz1, tz2));
-    tmax = std::fmin(tmax, std::fmax(tz1, tz2));
+    const float tzmin = (box[ray.sign[2]].z - ray.o.z) * ray.d_inv.z;
+    const float tzmax = (box[1 - ray.sign[2]].z - ray.o.z) * ray.d_inv.z;
+    tmin = std::max(tmin, tzmin);
+    tmax = std::min(tmax, tzmax);
 
     return !(tmax < tmin);
 }
 
+/**
+ * Cf. above. Note: Zero coordinates of the direction are treated as EPS (cf.
+ * `PrecomputedRay`).
+ */
+inline bool intersect_ray_box(const Ray& ray, const Bbox3f& box, float& tmin,
+                              float& tmax) {
+    return intersect_ray_box(PrecomputedRay(ray), box, tmin, tmax);
+}
+
 inline bool intersect_ray_box(const Ray& ray, const Bbox3f& box) {
     float tmin, tmax;
     return intersect_ray_box(ray, box, tmin, tmax);
@@ -0,0 +1,378 @@
+/**
+ * Common interface of the acceleration structures for intersecting rays with
+ * the triangles of a scene, e.g. of a kd-tree (cf. kdtree.h) or of a BVH (cf.
+ * bvh.h).
+ *
+ * The renderers (cf. trace.h) and the form factor computation (cf.
+ * radiosity.h) only use this interface, s.t. the acceleration structure can
+ * be chosen per scene. The bulk queries of the wavefront tracer and of the
+ * form factors go through the batch queries, which an offloading backend
+ * can answer at once (cf. `Intersector::intersect_batch`).
+ */
+
+#pragma once
+
+#include "array_view.h"
+#include "intersection.h"
+#include "triangle.h"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace detail {
+
+using TriangleId = uint32_t;
+
+class OptionalId {
+public:
+    static constexpr TriangleId INVALID_ID = 0xFFFFFFFF;
+
+    OptionalId() : id_(INVALID_ID){};
+    explicit OptionalId(TriangleId id) : id_(id) {}
+
+    operator bool() const { return id_ != INVALID_ID; }
+    operator TriangleId() const {
+        assert(*this);
+        return id_;
+    }
+    operator size_t() const {
+        assert(*this);
+        return id_;
+    }
+    bool operator==(const OptionalId& other) const { return id_ == other.id_; }
+    bool operator==(const TriangleId& other) const {
+        return this->operator bool() && id_ == other;
+    }
+    bool operator!=(const OptionalId& other) const { return !(*this == other); }
+    bool operator!=(const TriangleId& other) const { return !(*this == other); }
+
+    friend struct std::hash<OptionalId>;
+
+private:
+    TriangleId id_;
+};
+
+// The ids of unused lanes of bundles are invalid optional ids.
+static_assert(OptionalId::INVALID_ID == TriangleBundle::INVALID_ID,
+              "invalid ids must agree");
+
+// Spread the lower 10 bits of x to every third bit, cf. Morton order.
+inline uint32_t spread_bits_3d(uint32_t x) {
+    x &= 0x3FF;
+    x = (x | (x << 16)) & 0x030000FF;
+    x = (x | (x << 8)) & 0x0300F00F;
+    x = (x | (x << 4)) & 0x030C30C3;
+    x = (x | (x << 2)) & 0x09249249;
+    return x;
+}
+
+} // namespace detail
+
+// custom hash for OptionalId
+namespace std {
+
+template <> struct hash<detail::OptionalId> {
+    size_t operator()(const detail::OptionalId& id) const {
+        return std::hash<detail::TriangleId>()(id.id_);
+    }
+};
+
+} // namespace std
+
+/**
+ * Acceleration structure used for rendering.
+ */
+enum class AcceleratorType {
+    KDTREE,
+    BVH,
+    INSTANCED_BVH, // one BVH per unique mesh (cf. instancing.h)
+    BRICKS         // out-of-core kd-trees of spatial bricks (cf. bricks.h)
+};
+
+inline AcceleratorType parse_accelerator_type(const std::string& type) {
+    if (type == "kdtree") {
+        return AcceleratorType::KDTREE;
+    } else if (type == "bvh") {
+        return AcceleratorType::BVH;
+    } else if (type == "instanced") {
+        return AcceleratorType::INSTANCED_BVH;
+    } else if (type == "bricks") {
+        return AcceleratorType::BRICKS;
+    }
+    throw std::runtime_error("unknown acceleration structure: " + type);
+}
+
+inline const char* to_string(AcceleratorType type) {
+    switch (type) {
+    case AcceleratorType::KDTREE:
+        return "kdtree";
+    case AcceleratorType::BVH:
+        return "bvh";
+    case AcceleratorType::INSTANCED_BVH:
+        return "instanced";
+    case AcceleratorType::BRICKS:
+        return "bricks";
+    }
+    return "";
+}
+
+/**
+ * Intersection of rays with the triangles of an acceleration structure.
+ *
+ * An implementation wraps an acceleration structure, and holds the state of
+ * the traversal, e.g. its stack. Hence, every thread uses its own instance,
+ * whereas the acceleration structure is shared.
+ *
+ * Triangles are identified by their index in the triangles the structure was
+ * built from.
+ */
+class Intersector {
+public:
+    using TriangleId = detail::TriangleId;
+    using OptionalId = detail::OptionalId;
+
+    static constexpr size_t PACKET_SIZE = 4;
+    using RayPacket = std::array<Ray, PACKET_SIZE>;
+
+    // Result of an intersection with a ray (cf. `intersect`)
+    struct Hit {
+        OptionalId id;
+        float r = std::numeric_limits<float>::max();
+        float a = 0;
+        float b = 0;
+    };
+    using HitPacket = std::array<Hit, PACKET_SIZE>;
+
+    // Work of the traversals (cf. `traversal_counts`)
+    struct TraversalCounts {
+        size_t nodes = 0; // visited nodes
+        // ray-triangle tests; a test of a bundle counts as one per lane, and
+        // a test of a packet as one
+        size_t triangles = 0;
+    };
+
+    // Shadow rays tested with the last occluders (cf. `light_occluded`)
+    struct OccluderCacheCounts {
+        size_t tests = 0; // shadow rays
+        size_t hits = 0;  // shadow rays blocked by the last occluder
+    };
+
+    virtual ~Intersector() = default;
+
+    /**
+     * Work of all traversals of this instance so far, e.g. to attribute the
+     * cost of a rendering to its tiles (cf. heatmap.h). Only the kd-tree
+     * counts its work; the counts of other structures stay zero.
+     */
+    const TraversalCounts& traversal_counts() const { return counts_; }
+
+    const OccluderCacheCounts& occluder_cache_counts() const {
+        return occluder_counts_;
+    }
+
+    virtual const Triangle& operator[](const TriangleId id) const = 0;
+    virtual const Triangle& at(const TriangleId id) const = 0;
+
+    /**
+     * Find the closest triangle hit by the ray at a distance < ray.t_max.
+     *
+     * @param  ray   Ray for which the intersection will be computed
+     * @param  r     distance from ray to triangle (if intersection
+     *               exists)
+     * @param  a, b  barycentric coordinates of the intersection point
+     * @return       optional id of the triangle hit by the ray
+     */
+    virtual const OptionalId intersect(const Ray& ray, float& r, float& a,
+                                       float& b) = 0;
+
+    const OptionalId intersect(const Ray& ray) {
+        float unused;
+        return intersect(ray, unused, unused, unused);
+    }
+
+    /**
+     * Test if any triangle is hit by the ray before t_max, e.g. for shadow
+     * rays and visibility tests.
+     *
+     * @param  ray   Ray to test
+     * @param  t_max maximum distance (in units of ray.d) of an occluder
+     * @return       true, if there is a triangle hit at distance < t_max
+     */
+    virtual bool occluded(const Ray& ray, float t_max) = 0;
+
+    /**
+     * Find any triangle hit by the ray before t_max (cf. `occluded`), e.g.
+     * to remember the occluder of a shadow ray (cf. `light_occluded`). The
+     * default finds the closest one; structures with an any-hit traversal
+     * override it.
+     *
+     * @return optional id of a triangle hit at distance < t_max
+     */
+    virtual const OptionalId occluder(const Ray& ray, float t_max) {
+        float r, a, b;
+        const OptionalId id = intersect(ray, r, a, b);
+        return id && r < t_max ? id : OptionalId();
+    }
+
+    /**
+     * Occlusion test of a shadow ray towards a light, which first tests the
+     * triangle, which occluded the last shadow ray of the light tested by
+     * this instance. The shadow rays of neighboring pixels are mostly blocked
+     * by the same triangle, and skip the traversal then. Since every thread
+     * uses its own instance, the occluders are kept per thread and light.
+     *
+     * The result is the same as the one of `occluded`.
+     *
+     * @param  light index of the light, e.g. in the lights of the scene
+     * @param  ray   shadow ray towards the light
+     * @param  t_max distance of the light (in units of ray.d)
+     * @return       true, if there is a triangle hit at distance < t_max
+     */
+    bool light_occluded(size_t light, const Ray& ray, float t_max) {
+        occluder_counts_.tests += 1;
+        if (last_occluders_.size() <= light) {
+            last_occluders_.resize(light + 1);
+        }
+        OptionalId& last = last_occluders_[light];
+        float r, s, t;
+        if (last && intersect_ray_triangle(ray, (*this)[last], r, s, t) &&
+            r < t_max) {
+            occluder_counts_.hits += 1;
+            return true;
+        }
+        // an unoccluded ray keeps the last occluder for the next one
+        const OptionalId id = occluder(ray, t_max);
+        if (id) {
+            last = id;
+        }
+        return id;
+    }
+
+    /**
+     * Intersect a packet of rays, e.g. primary rays of neighboring pixels.
+     *
+     * The result is the same as the one of `intersect` for each ray.
+     *
+     * @param  rays   packet of rays
+     * @param  active bit mask of the rays to intersect (bit i for rays[i]);
+     *                the hits of the other rays are invalid
+     * @return        hits of the rays
+     */
+    virtual HitPacket intersect_packet(const RayPacket& rays,
+                                       unsigned active) = 0;
+
+    HitPacket intersect_packet(const RayPacket& rays) {
+        return intersect_packet(rays, (1 << PACKET_SIZE) - 1);
+    }
+
+    /**
+     * Occlusion test (cf. `occluded`) for a packet of rays, e.g. visibility
+     * rays between two patches.
+     *
+     * @param  rays   packet of rays
+     * @param  t_max  maximum distance of an occluder per ray
+     * @param  active bit mask of the rays to test (bit i for rays[i])
+     * @return        bit mask of the active rays, which are occluded
+     */
+    virtual unsigned
+    occluded_packet(const RayPacket& rays,
+                    const std::array<float, PACKET_SIZE>& t_max,
+                    unsigned active) = 0;
+
+    unsigned occluded_packet(const RayPacket& rays,
+                             const std::array<float, PACKET_SIZE>& t_max) {
+        return occluded_packet(rays, t_max, (1 << PACKET_SIZE) - 1);
+    }
+
+    /**
+     * Intersect a batch of rays (cf. `intersect`), e.g. all path rays of a
+     * bounce of the wavefront tracer. The default intersects the rays in
+     * packets in the given order. A structure answering many queries at once
+     * more efficiently overrides it, e.g. the kd-tree, which can reorder the
+     * rays into coherent packets, or a device its nodes and triangles are
+     * uploaded to.
+     *
+     * @param rays rays of the batch
+     * @param hits hit of rays[i] at index i; resized to the number of rays
+     */
+    virtual void intersect_batch(ArrayView<Ray> rays, std::vector<Hit>& hits) {
+        hits.resize(rays.size());
+        for (size_t i = 0; i < rays.size(); i += PACKET_SIZE) {
+            const size_t num_rays = std::min(PACKET_SIZE, rays.size() - i);
+            RayPacket packet;
+            std::copy(rays.begin() + i, rays.begin() + i + num_rays,
+                      packet.begin());
+            const HitPacket packet_hits =
+                intersect_packet(packet, (1 << num_rays) - 1);
+            std::copy(packet_hits.begin(), packet_hits.begin() + num_rays,
+                      hits.begin() + i);
+        }
+    }
+
+    /**
+     * Occlusion test (cf. `occluded`) for a batch of rays, e.g. the shadow
+     * rays of a bounce or the visibility rays between two patches. Like
+     * `intersect_batch`, the default tests the rays in packets.
+     *
+     * @param rays     rays of the batch
+     * @param t_max    maximum distance of an occluder of rays[i] at index i
+     * @param occluded 1 at index i, if rays[i] is occluded, otherwise 0;
+     *                 resized to the number of rays
+     */
+    virtual void occluded_batch(ArrayView<Ray> rays, ArrayView<float> t_max,
+                                std::vector<uint8_t>& occluded) {
+        assert(rays.size() == t_max.size());
+        occluded.resize(rays.size());
+        for (size_t i = 0; i < rays.size(); i += PACKET_SIZE) {
+            const size_t num_rays = std::min(PACKET_SIZE, rays.size() - i);
+            RayPacket packet;
+            std::array<float, PACKET_SIZE> packet_t_max{};
+            std::copy(rays.begin() + i, rays.begin() + i + num_rays,
+                      packet.begin());
+            std::copy(t_max.begin() + i, t_max.begin() + i + num_rays,
+                      packet_t_max.begin());
+            const unsigned mask =
+                occluded_packet(packet, packet_t_max, (1 << num_rays) - 1);
+            for (size_t k = 0; k < num_rays; ++k) {
+                occluded[i + k] = (mask >> k) & 1;
+            }
+        }
+    }
+
+protected:
+    TraversalCounts counts_;
+
+private:
+    OccluderCacheCounts occluder_counts_;
+    // last occluder of the shadow rays of light i at index i
+    std::vector<OptionalId> last_occluders_;
+};
+
+/**
+ * Sort key of a ray: the octant of its direction in the upper bits and the
+ * 27-bit Morton code of its origin quantized in box (9 bits per axis). Hence,
+ * rays with the same octant are sorted along a Z-order curve through their
+ * origins, e.g. for tracing a batch of incoherent rays in coherent packets
+ * (cf. `KDTreeIntersection::intersect_batch`).
+ */
+inline uint32_t ray_sort_key(const Ray& ray, const Bbox3f& box) {
+    const uint32_t octant = (ray.d.x < 0 ? 1 : 0) | (ray.d.y < 0 ? 2 : 0) |
+                            (ray.d.z < 0 ? 4 : 0);
+    uint32_t morton = 0;
+    for (int ax = 0; ax < 3; ++ax) {
+        const float extent = box.p_max[ax] - box.p_min[ax];
+        const float t =
+            0 < extent ? (ray.o[ax] - box.p_min[ax]) / extent : 0.f;
+        const uint32_t cell =
+            static_cast<uint32_t>(std::min(std::max(t, 0.f), 1.f) * 511.f);
+        morton |= detail::spread_bits_3d(cell) << ax;
+    }
+    return octant << 27 | morton;
+}
@@ -2,6 +2,25 @@
 
 #include "clipping.h"
 #include "intersection.h"
+#include "profile.h"
+
+#include <ThreadPool.h>
+#include <algorithm>
+#include <emmintrin.h>
+#include <array>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <future>
+#include <iterator>
+#include <mutex>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <tuple>
+#include <type_traits>
+#include <unistd.h>
 
 namespace {
 
@@ -9,7 +28,8 @@ using TriangleId = detail::TriangleId;
 using TriangleIds = detail::TriangleIds;
 
 /**
- * Dynamically allocated KDTree node.
+ * Dynamically allocated KDTree node. Nodes and their triangle ids are counted
+ * in the memory of the build (cf. `KDTree::BuildMemory`).
  */
 class TreeNode {
 public:
@@ -19,8 +39,8 @@ public:
         , left_or_triangle_ids_(static_cast<void*>(left))
         , right_(right) {}
 
-    explicit TreeNode(const std::vector<TriangleId>& ids) : flags_(ids.size()) {
-        TriangleId* triangle_ids = new TriangleId[ids.size()];
+    explicit TreeNode(const TriangleIds& ids) : flags_(ids.size()) {
+        TriangleId* triangle_ids = IdAllocator().allocate(ids.size());
         ::memcpy(triangle_ids, ids.data(), ids.size() * sizeof(TriangleId));
         left_or_triangle_ids_ = static_cast<void*>(triangle_ids);
     }
@@ -34,10 +54,20 @@ public:
                 delete right();
             }
         } else {
-            delete[] triangle_ids();
+            IdAllocator().deallocate(triangle_ids(), num_tris());
         }
     }
 
+    static void* operator new(size_t size) {
+        assert(size == sizeof(TreeNode));
+        UNUSED(size);
+        return NodeAllocator().allocate(1);
+    }
+
+    static void operator delete(void* ptr) {
+        NodeAllocator().deallocate(static_cast<TreeNode*>(ptr), 1);
+    }
+
     // attributes
 
     bool is_leaf() const { return flags_ <= MAX_ID; }
@@ -89,6 +119,9 @@ public:
         std::numeric_limits<TriangleId>::max() - 3;
 
 private:
+    using IdAllocator = detail::BuildAllocator<TriangleId>;
+    using NodeAllocator = detail::BuildAllocator<TreeNode>;
+
     static constexpr TriangleId FLAG_AXIS_X = MAX_ID + 1;
     static constexpr TriangleId FLAG_AXIS_Y = MAX_ID + 2;
     static constexpr TriangleId FLAG_AXIS_Z = MAX_ID + 3;
@@ -110,21 +143,85 @@ private:
 };
 
 /**
- * Self contained implementation of Algorithm 4 from:
+ * Self contained implementation of Algorithms 4 and 5 from:
  *
  * "On building fast kd-Trees for Ray Tracing, and on doing that in O(N log N)"
  * by Ingo Wald and Vlastimil Havran
  * [WH06]
  *
- * Builds up a kd-tree in O(N log^2 N), however the resulting kd-tree is the
- * same as if it were built with Algorithm 5.
+ * `build` follows Algorithm 4 and builds up a kd-tree in O(N log^2 N), since
+ * the events are sorted again in every node. `build_presorted` follows
+ * Algorithm 5 and builds up the same kd-tree in O(N log N): the events are
+ * sorted only once at the root and are split in linear time when descending.
+ * Only the triangles straddling a splitting plane are clipped again, and their
+ * (few) new events are sorted and merged into the lists of the children.
  *
- * TODO: Replace by Algorithm 5.
+ * Algorithm 5 can also be run in parallel on a thread pool (cf. the overload
+ * of `build_presorted`), which results in the same tree.
  */
 class KDTreeBuildAlgorithm {
+    // auxiliary event structure
+    static constexpr int STARTING = 2;
+    static constexpr int ENDING = 0;
+    static constexpr int PLANAR = 1;
+
+    struct Event {
+        TriangleId id;
+        float point;
+        // auxiliary point
+        // for type == ENDING, point_aux is the starting point
+        // for type == STARTNG, point_aux is the ending point
+        // for type == PLANAR, points_aux is the same point as `point`
+        float point_aux;
+        int type;
+
+        // Total order on events. The ordering of events with the same point
+        // and type does not influence the sweep, however it defines the order
+        // of triangles in the leaves. We need it to be deterministic s.t. both
+        // algorithms produce exactly the same tree.
+        bool operator<(const Event& other) const {
+            return point < other.point ||
+                   (point == other.point &&
+                    (type < other.type ||
+                     (type == other.type && id < other.id)));
+        }
+    };
+
+    using Events = std::vector<Event, detail::BuildAllocator<Event>>;
+    using EventLists = std::array<Events, AXES3.size()>;
+
+    // Reusable buffers of `merge_events`
+    struct MergeBuffers {
+        EventLists new_event_lists;
+        Events merged;
+    };
+
+    enum class Dir { LEFT, RIGHT };
+
+    // Splitting plane with the minimal cost found by the sweep
+    struct Plane {
+        float cost = std::numeric_limits<float>::max();
+        Axis3 ax = Axis3::X;
+        float pos = 0;
+        Dir side = Dir::LEFT;
+        // we also store those for asserts below
+        size_t num_ltris = 0;
+        size_t num_rtris = 0;
+        size_t num_ptris = 0;
+    };
+
+    // Side flags of a triangle w.r.t. the splitting plane (cf. `sides_`)
+    static constexpr uint8_t SIDE_LEFT = 1;
+    static constexpr uint8_t SIDE_RIGHT = 2;
+    static constexpr uint8_t KEEP_LEFT = 4;
+    static constexpr uint8_t KEEP_RIGHT = 8;
+
 public:
     KDTreeBuildAlgorithm(const Triangles& triangles) : triangles_(&triangles) {}
 
+    /**
+     * [WH06], Algorithm 4
+     */
     TreeNode* build(TriangleIds tris, const Bbox3f& box) {
         using Node = TreeNode;
 
@@ -133,7 +230,7 @@ public:
         }
 
         // to few triangles -> terminate
-        if (tris.size() <= 3) {
+        if (tris.size() <= TriangleBundle::SIZE) {
             return new Node(tris);
         }
 
@@ -152,7 +249,7 @@ public:
         // automatic termination
         // remove lambda factor from cost again, otherwise we may stuck in an
         // empty space split forever
-        if (COST_INTERSECTION * tris.size() *
+        if (COST_INTERSECTION * num_bundles(tris.size()) *
                 lambda(ltris.size(), rtris.size()) <
             min_cost) {
             return new Node(tris);
@@ -173,11 +270,362 @@ public:
         return new Node(plane_ax, plane_pos, left, right);
     }
 
+    /**
+     * [WH06], Algorithm 5
+     */
+    TreeNode* build_presorted(TriangleIds tris, const Bbox3f& box) {
+        Job job;
+        job.num_tris = generate_events(tris, box, job.event_lists);
+        for (auto& events : job.event_lists) {
+            std::sort(events.begin(), events.end());
+        }
+        job.tris = std::move(tris);
+        job.box = box;
+
+        sides_.assign(triangles_->size(), 0);
+        return build_presorted(std::move(job));
+    }
+
+    /**
+     * [WH06], Algorithm 5, in parallel
+     *
+     * The upper levels of the tree are built up by the calling thread, where
+     * the event generation, the sweeps and the splitting of the event lists
+     * are distributed over the pool. Below, the subtrees are independent, and
+     * each of them is built up sequentially by a single task in the pool.
+     *
+     * The resulting tree is the same as the one of `build_presorted`.
+     */
+    TreeNode* build_presorted(TriangleIds tris, const Bbox3f& box,
+                              ThreadPool& pool, size_t num_threads) {
+        Job job;
+        job.num_tris =
+            generate_events(tris, box, job.event_lists, pool, num_threads);
+        std::vector<std::future<void>> sorted;
+        for (auto& events : job.event_lists) {
+            sorted.emplace_back(pool.enqueue(
+                [&events] { std::sort(events.begin(), events.end()); }));
+        }
+        for (auto& result : sorted) {
+            result.get();
+        }
+        job.tris = std::move(tris);
+        job.box = box;
+
+        // about 8 subtrees per thread for load balancing
+        size_t subtree_depth = 3;
+        while ((1u << subtree_depth) < 8 * num_threads) {
+            subtree_depth += 1;
+        }
+
+        sides_.assign(triangles_->size(), 0);
+        std::vector<UpperNode*> subtrees;
+        auto root = build_upper(std::move(job), 0, subtree_depth, pool,
+                                subtrees);
+
+        std::vector<std::future<void>> built;
+        for (auto* subtree : subtrees) {
+            built.emplace_back(pool.enqueue([this, subtree] {
+                KDTreeBuildAlgorithm algo(*triangles_);
+                algo.sides_ = acquire_sides();
+                subtree->node = algo.build_presorted(std::move(subtree->job));
+                release_sides(std::move(algo.sides_));
+            }));
+        }
+        for (auto& result : built) {
+            result.get();
+        }
+
+        return join(*root);
+    }
+
 private:
+    /**
+     * Input of the recursive step of Algorithm 5.
+     *
+     * tris        triangles in the node (incl. the ones clipped away)
+     * event_lists sorted events of all triangles which were not clipped away
+     * num_tris    number of triangles which were not clipped away
+     * box         AABB of the node
+     */
+    struct Job {
+        TriangleIds tris;
+        EventLists event_lists;
+        size_t num_tris = 0;
+        Bbox3f box;
+    };
+
+    // Node in the upper levels of the tree in the parallel build: either an
+    // inner node, a leaf, or the root of a subtree which is built up later.
+    struct UpperNode {
+        Axis3 split_axis = Axis3::X;
+        float split_pos = 0;
+        std::unique_ptr<UpperNode> left;
+        std::unique_ptr<UpperNode> right;
+        TreeNode* node = nullptr; // leaf or root of the subtree
+        Job job;                  // input of the subtree
+    };
+
+    /**
+     * Recursive step of Algorithm 5.
+     */
+    TreeNode* build_presorted(Job job) {
+        using Node = TreeNode;
+
+        if (job.tris.size() == 0) {
+            return nullptr;
+        }
+
+        Axis3 plane_ax;
+        float plane_pos;
+        Job ljob, rjob;
+        if (!split(job, plane_ax, plane_pos, ljob, rjob, nullptr)) {
+            return new Node(job.tris);
+        }
+
+        Node* left = build_presorted(std::move(ljob));
+        Node* right = build_presorted(std::move(rjob));
+        assert(left || right);
+
+        if (!left) {
+            return right;
+        } else if (!right) {
+            return left;
+        }
+        return new Node(plane_ax, plane_pos, left, right);
+    }
+
+    /**
+     * Recursive step of Algorithm 5 in the upper levels of the tree.
+     *
+     * Nodes at `subtree_depth` are not built up here, but are collected in
+     * `subtrees`.
+     */
+    std::unique_ptr<UpperNode> build_upper(Job job, size_t depth,
+                                           size_t subtree_depth,
+                                           ThreadPool& pool,
+                                           std::vector<UpperNode*>& subtrees) {
+        auto upper_node = std::make_unique<UpperNode>();
+        if (job.tris.size() == 0) {
+            return upper_node;
+        }
+
+        if (depth == subtree_depth) {
+            upper_node->job = std::move(job);
+            subtrees.push_back(upper_node.get());
+            return upper_node;
+        }
+
+        Job ljob, rjob;
+        if (!split(job, upper_node->split_axis, upper_node->split_pos, ljob,
+                   rjob, &pool)) {
+            upper_node->node = new TreeNode(job.tris);
+            return upper_node;
+        }
+
+        upper_node->left = build_upper(std::move(ljob), depth + 1,
+                                       subtree_depth, pool, subtrees);
+        upper_node->right = build_upper(std::move(rjob), depth + 1,
+                                        subtree_depth, pool, subtrees);
+        return upper_node;
+    }
+
+    /**
+     * Join the upper levels of the tree with the built subtrees.
+     */
+    static TreeNode* join(UpperNode& upper_node) {
+        if (!upper_node.left) {
+            return upper_node.node; // leaf, subtree or empty
+        }
+
+        TreeNode* left = join(*upper_node.left);
+        TreeNode* right = join(*upper_node.right);
+        assert(left || right);
+
+        if (!left) {
+            return right;
+        } else if (!right) {
+            return left;
+        }
+        return new TreeNode(upper_node.split_axis, upper_node.split_pos, left,
+                            right);
+    }
+
+    /**
+     * Find the splitting plane of a node and split its events into the ones
+     * of its children, or determine that the node is a leaf.
+     *
+     * @param  job             input of the node (leaf: untouched)
+     * @param  plane_{ax,pos}  splitting plane
+     * @param  {l,r}job        input of the children
+     * @param  pool            if given, the sweep and the splitting are
+     *                         distributed over the axes
+     * @return false if the node is a leaf
+     */
+    bool split(Job& job, Axis3& plane_ax, float& plane_pos, Job& ljob,
+               Job& rjob, ThreadPool* pool) {
+        const auto& tris = job.tris;
+        assert(!tris.empty());
+
+        // to few triangles -> terminate
+        if (tris.size() <= TriangleBundle::SIZE) {
+            return false;
+        }
+
+        // box too small -> no need to split further -> terminate
+        if (job.box.surface_area() == 0) {
+            return false;
+        }
+
+        // all clipped? -> same as infinite cost below
+        if (job.num_tris == 0) {
+            return false;
+        }
+
+        const Plane plane = pool
+                                ? find_plane(job.event_lists, job.num_tris,
+                                             job.box, *pool)
+                                : find_plane(job.event_lists, job.num_tris,
+                                             job.box);
+        TriangleIds ltris, rtris;
+        std::tie(ltris, rtris) =
+            classify(job.event_lists[static_cast<int>(plane.ax)], plane);
+
+        // automatic termination (cf. `build`)
+        if (COST_INTERSECTION * num_bundles(tris.size()) *
+                lambda(ltris.size(), rtris.size()) <
+            plane.cost) {
+            reset_sides(ltris);
+            reset_sides(rtris);
+            return false;
+        }
+
+        plane_ax = plane.ax;
+        plane_pos = plane.pos;
+        std::tie(ljob.box, rjob.box) = job.box.split(plane.ax, plane.pos);
+
+        // Split events in linear time. The order is preserved, so the lists
+        // of the children are sorted. Events of a triangle are kept only if
+        // the whole triangle lies on one side of the plane. Then clipping it
+        // at the box of the child yields exactly the same events, since the
+        // polygon is clipped at the same planes in the same order, while
+        // clipping at the splitting plane does not remove any point. All other
+        // triangles are clipped again (as in Algorithm 4), and their new
+        // events are merged into the lists of the child.
+        const auto split_ax = static_cast<int>(plane.ax);
+        TriangleIds lclip_tris, rclip_tris;
+        for (const auto& id : ltris) {
+            const auto& tri = (*triangles_)[id];
+            if (sides_[id] == SIDE_LEFT &&
+                max(tri.vertices[0][split_ax], tri.vertices[1][split_ax],
+                    tri.vertices[2][split_ax]) <= plane.pos) {
+                sides_[id] |= KEEP_LEFT;
+            } else {
+                lclip_tris.push_back(id);
+            }
+        }
+        for (const auto& id : rtris) {
+            const auto& tri = (*triangles_)[id];
+            if (sides_[id] == SIDE_RIGHT &&
+                plane.pos <= min(tri.vertices[0][split_ax],
+                                 tri.vertices[1][split_ax],
+                                 tri.vertices[2][split_ax])) {
+                sides_[id] |= KEEP_RIGHT;
+            } else {
+                rclip_tris.push_back(id);
+            }
+        }
+
+        if (pool) {
+            std::vector<std::future<void>> results;
+            for (auto ax : AXES3) {
+                results.emplace_back(pool->enqueue([&, ax] {
+                    split_events(job.event_lists[static_cast<int>(ax)],
+                                 ljob.event_lists[static_cast<int>(ax)],
+                                 rjob.event_lists[static_cast<int>(ax)]);
+                }));
+            }
+            for (auto& result : results) {
+                result.get();
+            }
+        } else {
+            for (auto ax : AXES3) {
+                split_events(job.event_lists[static_cast<int>(ax)],
+                             ljob.event_lists[static_cast<int>(ax)],
+                             rjob.event_lists[static_cast<int>(ax)]);
+            }
+        }
+        job.event_lists = EventLists();
+        reset_sides(ltris);
+        reset_sides(rtris);
+
+        if (pool) {
+            auto num_lclipped = pool->enqueue([&] {
+                return merge_events(lclip_tris, ljob.box, ljob.event_lists,
+                                    merge_buffers_[0]);
+            });
+            auto num_rclipped = pool->enqueue([&] {
+                return merge_events(rclip_tris, rjob.box, rjob.event_lists,
+                                    merge_buffers_[1]);
+            });
+            ljob.num_tris = num_lclipped.get();
+            rjob.num_tris = num_rclipped.get();
+        } else {
+            ljob.num_tris = merge_events(lclip_tris, ljob.box,
+                                         ljob.event_lists, merge_buffers_[0]);
+            rjob.num_tris = merge_events(rclip_tris, rjob.box,
+                                         rjob.event_lists, merge_buffers_[0]);
+        }
+        ljob.num_tris += ltris.size() - lclip_tris.size();
+        rjob.num_tris += rtris.size() - rclip_tris.size();
+
+        ljob.tris = std::move(ltris);
+        rjob.tris = std::move(rtris);
+        return true;
+    }
+
+    // Split the events of kept triangles into the ones of the children.
+    void split_events(const Events& events, Events& levents,
+                      Events& revents) const {
+        levents.reserve(events.size());
+        revents.reserve(events.size());
+        for (const auto& event : events) {
+            uint8_t side = sides_[event.id];
+            if (side & KEEP_LEFT) {
+                levents.push_back(event);
+            } else if (side & KEEP_RIGHT) {
+                revents.push_back(event);
+            }
+        }
+    }
+
+    std::vector<uint8_t> acquire_sides() {
+        {
+            std::lock_guard<std::mutex> lock(sides_buffers_mutex_);
+            if (!sides_buffers_.empty()) {
+                auto sides = std::move(sides_buffers_.back());
+                sides_buffers_.pop_back();
+                return sides;
+            }
+        }
+        return std::vector<uint8_t>(triangles_->size(), 0);
+    }
+
+    void release_sides(std::vector<uint8_t> sides) {
+        std::lock_guard<std::mutex> lock(sides_buffers_mutex_);
+        sides_buffers_.push_back(std::move(sides));
+    }
+
     // Cf. [WH06], 5.2, Table 1
     static constexpr int COST_TRAVERSAL = 15;
     static constexpr int COST_INTERSECTION = 20;
 
+    // Leaf triangles are intersected a bundle at a time, hence the
+    // intersection cost of a leaf is proportional to its number of bundles.
+    static size_t num_bundles(size_t num_tris) {
+        return (num_tris + TriangleBundle::SIZE - 1) / TriangleBundle::SIZE;
+    }
+
     // Cost function bias
     float lambda(size_t num_ltris, size_t num_rtris) const {
         if (num_ltris == 0 || num_rtris == 0) {
@@ -199,11 +647,10 @@ private:
         return lambda(num_ltris, num_rtris) *
                (COST_TRAVERSAL +
                 COST_INTERSECTION *
-                    (larea_ratio * num_ltris + rarea_ratio * num_rtris));
+                    (larea_ratio * num_bundles(num_ltris) +
+                     rarea_ratio * num_bundles(num_rtris)));
     }
 
-    enum class Dir { LEFT, RIGHT };
-
     /**
      * SAH function
      *
@@ -238,38 +685,21 @@ private:
     }
 
     /**
-     * [WH06], Algorithm 4
+     * Clip triangles at box and append their events to event lists.
+     *
+     * @return number of triangles which were not clipped away
      */
-    std::tuple<float /*cost*/, Axis3 /* plane axis */, float /* plane pos */,
-               TriangleIds /*left*/, TriangleIds /*right*/>
-    find_plane_and_classify(const TriangleIds& tris, const Bbox3f& box) const {
-        // The box should have some surface, otherwise the surface area
-        // heuristics
-        // does not make any sense.
-        assert(box.surface_area() != 0);
-
-        // auxiliary event structure
-        static constexpr int STARTING = 2;
-        static constexpr int ENDING = 0;
-        static constexpr int PLANAR = 1;
-
-        struct Event {
-            TriangleId id;
-            float point;
-            // auxiliary point
-            // for type == ENDING, point_aux is the starting point
-            // for type == STARTNG, point_aux is the ending point
-            // for type == PLANAR, points_aux is the same point as `point`
-            float point_aux;
-            int type;
-        };
-
-        // PERF: move out in front of recursion
-        std::vector<Event> event_lists[AXES3.size()];
+    size_t generate_events(const TriangleIds& tris, const Bbox3f& box,
+                           EventLists& event_lists) const {
+        return generate_events(tris.data(), tris.data() + tris.size(), box,
+                               event_lists);
+    }
 
-        // generate events
+    size_t generate_events(const TriangleId* begin, const TriangleId* end,
+                           const Bbox3f& box, EventLists& event_lists) const {
         size_t num_tris = 0;
-        for (const auto& id : tris) {
+        for (const TriangleId* it = begin; it != end; ++it) {
+            const TriangleId id = *it;
             auto clipped_box = clip_triangle_at_aabb((*triangles_)[id], box);
             if (clipped_box.empty()) {
                 continue;
@@ -289,138 +719,344 @@ private:
                 }
             }
         }
+        return num_tris;
+    }
 
-        // all clipped?
-        if (num_tris == 0) {
-            return std::make_tuple(std::numeric_limits<float>::max(), Axis3::X,
-                                   0, TriangleIds(), TriangleIds());
+    /**
+     * Parallel version of `generate_events`. The order of events is not
+     * preserved.
+     */
+    size_t generate_events(const TriangleIds& tris, const Bbox3f& box,
+                           EventLists& event_lists, ThreadPool& pool,
+                           size_t num_chunks) const {
+        std::vector<EventLists> chunk_event_lists(num_chunks);
+        std::vector<std::future<size_t>> chunk_num_tris;
+        size_t chunk_size = (tris.size() + num_chunks - 1) / num_chunks;
+        for (size_t i = 0; i < num_chunks; ++i) {
+            chunk_num_tris.emplace_back(pool.enqueue([&, i] {
+                const TriangleId* begin =
+                    tris.data() + std::min(i * chunk_size, tris.size());
+                const TriangleId* end =
+                    tris.data() + std::min((i + 1) * chunk_size, tris.size());
+                return generate_events(begin, end, box, chunk_event_lists[i]);
+            }));
         }
 
-        // sweep for min_cost
-        float min_cost = std::numeric_limits<float>::max();
-        Axis3 min_plane_ax = Axis3::X;
-        float min_plane_pos = 0;
-        Dir min_side = Dir::LEFT;
-        // we also store those for asserts below
-        size_t min_ltris = 0;
-        size_t min_rtris = 0;
-        size_t min_ptris = 0;
-        UNUSED(min_ptris);
-
+        size_t num_tris = 0;
+        for (auto& result : chunk_num_tris) {
+            num_tris += result.get();
+        }
         for (auto ax : AXES3) {
             auto& events = event_lists[static_cast<int>(ax)];
-            std::sort(events.begin(), events.end(),
-                      [](const Event& e1, const Event& e2) {
-                          return e1.point < e2.point ||
-                                 (e1.point == e2.point && e1.type < e2.type);
-                      });
-
-            size_t num_ltris = 0, num_ptris = 0, num_rtris = num_tris;
-
-            for (size_t i = 0; i < events.size();) {
-                auto& event = events[i];
-
-                auto p = event.point;
-                int point_starting = 0;
-                int point_ending = 0;
-                int point_planar = 0;
-
-                while (i < events.size() && events[i].point == p &&
-                       events[i].type == ENDING) {
-                    point_ending += 1;
-                    i += 1;
-                }
-                while (i < events.size() && events[i].point == p &&
-                       events[i].type == PLANAR) {
-                    point_planar += 1;
-                    i += 1;
-                }
-                while (i < events.size() && events[i].point == p &&
-                       events[i].type == STARTING) {
-                    point_starting += 1;
-                    i += 1;
-                }
+            for (const auto& chunk : chunk_event_lists) {
+                const auto& chunk_events = chunk[static_cast<int>(ax)];
+                events.insert(events.end(), chunk_events.begin(),
+                              chunk_events.end());
+            }
+        }
+        return num_tris;
+    }
 
-                num_ptris = point_planar;
-                num_rtris -= point_planar + point_ending;
-
-                float cost;
-                Dir side;
-                std::tie(cost, side) = surface_area_heuristics(
-                    ax, p, box, num_ltris, num_rtris, num_ptris);
-
-                if (cost < min_cost) {
-                    min_cost = cost;
-                    min_plane_ax = ax;
-                    min_plane_pos = p;
-                    min_side = side;
-                    min_ltris = num_ltris;
-                    min_rtris = num_rtris;
-                    min_ptris = num_ptris;
-                }
+    /**
+     * Generate events of triangles clipped at box, and merge them into the
+     * sorted event lists.
+     *
+     * @param  buffers reusable buffers of the new and the merged events
+     * @return number of triangles which were not clipped away
+     */
+    size_t merge_events(const TriangleIds& tris, const Bbox3f& box,
+                        EventLists& event_lists,
+                        MergeBuffers& buffers) const {
+        for (auto& new_events : buffers.new_event_lists) {
+            new_events.clear();
+        }
+        size_t num_tris = generate_events(tris, box, buffers.new_event_lists);
+        for (auto ax : AXES3) {
+            auto& events = event_lists[static_cast<int>(ax)];
+            auto& new_events = buffers.new_event_lists[static_cast<int>(ax)];
+            if (new_events.empty()) {
+                continue;
+            }
+            std::sort(new_events.begin(), new_events.end());
+
+            auto& merged = buffers.merged;
+            merged.clear();
+            merged.reserve(events.size() + new_events.size());
+            std::merge(events.begin(), events.end(), new_events.begin(),
+                       new_events.end(), std::back_inserter(merged));
+            // the old events become the buffer of the next merge
+            events.swap(merged);
+        }
+        return num_tris;
+    }
 
-                num_ltris += point_starting + point_planar;
-                num_ptris = 0;
+    /**
+     * Sweep over sorted event lists for the plane with minimal cost.
+     *
+     * [WH06], Algorithm 4 resp. 5, FindPlane
+     */
+    Plane find_plane(const EventLists& event_lists, size_t num_tris,
+                     const Bbox3f& box) const {
+        Plane min_plane;
+        for (auto ax : AXES3) {
+            Plane plane = find_plane(event_lists[static_cast<int>(ax)], ax,
+                                     num_tris, box);
+            if (plane.cost < min_plane.cost) {
+                min_plane = plane;
             }
         } // -> min_plane, min_side
 
-        assert(min_cost < std::numeric_limits<float>::max());
+        assert(min_plane.cost < std::numeric_limits<float>::max());
+        return min_plane;
+    }
+
+    /**
+     * Parallel version of `find_plane`: the axes are swept in parallel.
+     */
+    Plane find_plane(const EventLists& event_lists, size_t num_tris,
+                     const Bbox3f& box, ThreadPool& pool) const {
+        std::vector<std::future<Plane>> planes;
+        for (auto ax : AXES3) {
+            planes.emplace_back(pool.enqueue([&, ax] {
+                return find_plane(event_lists[static_cast<int>(ax)], ax,
+                                  num_tris, box);
+            }));
+        }
+
+        // same order of axes as in the sequential version
+        Plane min_plane;
+        for (auto& result : planes) {
+            Plane plane = result.get();
+            if (plane.cost < min_plane.cost) {
+                min_plane = plane;
+            }
+        }
+
+        assert(min_plane.cost < std::numeric_limits<float>::max());
+        return min_plane;
+    }
+
+    /**
+     * Sweep over sorted events along a single axis.
+     */
+    Plane find_plane(const Events& events, Axis3 ax, size_t num_tris,
+                     const Bbox3f& box) const {
+        // The box should have some surface, otherwise the surface area
+        // heuristics
+        // does not make any sense.
+        assert(box.surface_area() != 0);
+        assert(num_tris > 0);
+
+        Plane min_plane;
+        size_t num_ltris = 0, num_ptris = 0, num_rtris = num_tris;
 
-        // classify
+        for (size_t i = 0; i < events.size();) {
+            auto& event = events[i];
+
+            auto p = event.point;
+            int point_starting = 0;
+            int point_ending = 0;
+            int point_planar = 0;
+
+            while (i < events.size() && events[i].point == p &&
+                   events[i].type == ENDING) {
+                point_ending += 1;
+                i += 1;
+            }
+            while (i < events.size() && events[i].point == p &&
+                   events[i].type == PLANAR) {
+                point_planar += 1;
+                i += 1;
+            }
+            while (i < events.size() && events[i].point == p &&
+                   events[i].type == STARTING) {
+                point_starting += 1;
+                i += 1;
+            }
+
+            num_ptris = point_planar;
+            num_rtris -= point_planar + point_ending;
+
+            float cost;
+            Dir side;
+            std::tie(cost, side) = surface_area_heuristics(
+                ax, p, box, num_ltris, num_rtris, num_ptris);
+
+            if (cost < min_plane.cost) {
+                min_plane.cost = cost;
+                min_plane.ax = ax;
+                min_plane.pos = p;
+                min_plane.side = side;
+                min_plane.num_ltris = num_ltris;
+                min_plane.num_rtris = num_rtris;
+                min_plane.num_ptris = num_ptris;
+            }
+
+            num_ltris += point_starting + point_planar;
+            num_ptris = 0;
+        }
+        return min_plane;
+    }
+
+    /**
+     * Classify triangles to the left and right of plane.
+     *
+     * Additionally, the side of each classified triangle is marked in
+     * `sides_`, which is used in Algorithm 5 to split the event lists.
+     *
+     * @param events sorted events along the axis of plane
+     */
+    std::pair<TriangleIds /*left*/, TriangleIds /*right*/>
+    classify(const Events& events, const Plane& plane) {
         TriangleIds ltris, rtris;
-        ltris.reserve(min_ltris);
-        rtris.reserve(min_rtris);
+        ltris.reserve(plane.num_ltris);
+        rtris.reserve(plane.num_rtris);
+
+        auto push_left = [this, &ltris](TriangleId id) {
+            ltris.push_back(id);
+            mark_side(id, SIDE_LEFT);
+        };
+        auto push_right = [this, &rtris](TriangleId id) {
+            rtris.push_back(id);
+            mark_side(id, SIDE_RIGHT);
+        };
 
-        const auto& events = event_lists[static_cast<int>(min_plane_ax)];
         for (const auto& event : events) {
-            if (event.point < min_plane_pos) {
+            if (event.point < plane.pos) {
                 if (event.type == ENDING || event.type == PLANAR) {
-                    ltris.push_back(event.id);
-                } else if (min_plane_pos < event.point_aux) {
+                    push_left(event.id);
+                } else if (plane.pos < event.point_aux) {
                     // STARTING before and ENDING after min_plane
-                    ltris.push_back(event.id);
-                    rtris.push_back(event.id);
+                    push_left(event.id);
+                    push_right(event.id);
                 }
-            } else if (event.point == min_plane_pos) {
+            } else if (event.point == plane.pos) {
                 if (event.type == ENDING) {
-                    ltris.push_back(event.id);
+                    push_left(event.id);
                 } else if (event.type == PLANAR) {
-                    if (min_side == Dir::LEFT) {
-                        ltris.push_back(event.id);
+                    if (plane.side == Dir::LEFT) {
+                        push_left(event.id);
                     } else {
-                        rtris.push_back(event.id);
+                        push_right(event.id);
                     }
                 } else {
-                    rtris.push_back(event.id);
+                    push_right(event.id);
                 }
             } else if (event.type == STARTING || event.type == PLANAR) {
-                rtris.push_back(event.id);
+                push_right(event.id);
             }
         }
 
-        assert(min_ltris + (min_side == Dir::LEFT ? min_ptris : 0) ==
+        assert(plane.num_ltris +
+                   (plane.side == Dir::LEFT ? plane.num_ptris : 0) ==
                ltris.size());
-        assert(min_rtris + (min_side == Dir::RIGHT ? min_ptris : 0) ==
+        assert(plane.num_rtris +
+                   (plane.side == Dir::RIGHT ? plane.num_ptris : 0) ==
                rtris.size());
 
-        return std::make_tuple(min_cost, min_plane_ax, min_plane_pos,
+        return {std::move(ltris), std::move(rtris)};
+    }
+
+    /**
+     * [WH06], Algorithm 4
+     */
+    std::tuple<float /*cost*/, Axis3 /* plane axis */, float /* plane pos */,
+               TriangleIds /*left*/, TriangleIds /*right*/>
+    find_plane_and_classify(const TriangleIds& tris, const Bbox3f& box) {
+        // The events are not needed anymore when descending, hence the lists
+        // are reused in all nodes.
+        auto& event_lists = event_lists_;
+        for (auto& events : event_lists) {
+            events.clear();
+        }
+
+        // generate events
+        size_t num_tris = generate_events(tris, box, event_lists);
+
+        // all clipped?
+        if (num_tris == 0) {
+            return std::make_tuple(std::numeric_limits<float>::max(), Axis3::X,
+                                   0, TriangleIds(), TriangleIds());
+        }
+
+        for (auto& events : event_lists) {
+            std::sort(events.begin(), events.end());
+        }
+
+        const Plane plane = find_plane(event_lists, num_tris, box);
+        TriangleIds ltris, rtris;
+        std::tie(ltris, rtris) =
+            classify(event_lists[static_cast<int>(plane.ax)], plane);
+
+        return std::make_tuple(plane.cost, plane.ax, plane.pos,
                                std::move(ltris), std::move(rtris));
     }
 
+    void mark_side(TriangleId id, uint8_t side) {
+        if (!sides_.empty()) {
+            sides_[id] |= side;
+        }
+    }
+
+    void reset_sides(const TriangleIds& tris) {
+        if (sides_.empty()) {
+            return;
+        }
+        for (const auto& id : tris) {
+            sides_[id] = 0;
+        }
+    }
+
 private:
     const Triangles* triangles_;
+    // Event lists of the current node in Algorithm 4
+    EventLists event_lists_;
+    // Buffers of `merge_events` in Algorithm 5: one per child, since the
+    // children are merged in parallel in the upper levels of the tree.
+    std::array<MergeBuffers, 2> merge_buffers_;
+    // Side flags of triangles w.r.t. the current splitting plane. Used only in
+    // Algorithm 5; indexed by triangle id.
+    std::vector<uint8_t> sides_;
+    // Reusable side flags for the subtrees in the parallel build
+    std::mutex sides_buffers_mutex_;
+    std::vector<std::vector<uint8_t>> sides_buffers_;
 };
 
+static constexpr uint32_t INVALID_INDEX = 0xFFFFFFFF >> 2;
+
 /**
- * Flatten dynamically allocated KDTree into an array.
+ * Append a leaf containing the given triangles, which are packed into
+ * consecutive bundles.
+ */
+void append_leaf(KDTree::Nodes& nodes, KDTree::TriangleBundles& bundles,
+                 const Triangles& tris, const TriangleId* triangle_ids,
+                 size_t num_tris) {
+    const uint32_t begin = bundles.size();
+    for (size_t i = 0; i < num_tris; ++i) {
+        const size_t lane = i % TriangleBundle::SIZE;
+        if (lane == 0) {
+            bundles.emplace_back();
+        }
+        bundles.back().set(lane, tris[triangle_ids[i]], triangle_ids[i]);
+    }
+    assert(bundles.size() < detail::FlatNode::MAX_TRIANGLE_ID);
+    nodes.emplace_back(begin, static_cast<uint32_t>(bundles.size()));
+}
+
+/**
+ * Flatten dynamically allocated KDTree into an array in DFS order.
  *
- * @param  root node of the KDTree
- * @return array of nodes representing flattened KDTree
+ * @param root    node of the KDTree; nullptr for an empty leaf
+ * @param tris    triangles of the tree
+ * @param nodes   the nodes of the flattened KDTree are appended to it
+ * @param bundles bundles of the leaves are appended to it
  */
-std::vector<detail::FlatNode> flatten(std::unique_ptr<TreeNode> root) {
-    static constexpr uint32_t INVALID_INDEX = 0xFFFFFFFF >> 2;
-    const detail::FlatNode sentinel(Axis3::X, 0, 0);
-    std::vector<detail::FlatNode> nodes;
+void flatten(std::unique_ptr<TreeNode> root, const Triangles& tris,
+             KDTree::Nodes& nodes, KDTree::TriangleBundles& bundles) {
+    if (!root) {
+        append_leaf(nodes, bundles, tris, nullptr, 0);
+        return;
+    }
 
     // do DFS through nodes
     std::stack<std::pair<TreeNode*, uint32_t /*parent index*/>> stack;
@@ -446,23 +1082,64 @@ std::vector<detail::FlatNode> flatten(std::unique_ptr<TreeNode> root) {
             stack.emplace(node.right(), node_index);
             stack.emplace(node.left(), INVALID_INDEX);
         } else {
-            const TriangleId* triangle_ids = node.triangle_ids();
-            // create a leaf node for each pair of triangles
-            size_t i = 1;
-            for (; i < node.num_tris(); i += 2) {
-                nodes.emplace_back(triangle_ids[i - 1], triangle_ids[i]);
-            }
-            // a triangle left? => add leaf node with a single triangle
-            if (i - 1 < node.num_tris()) {
-                nodes.emplace_back(triangle_ids[i - 1]);
-                // in that case we don't need a sentinel node, since a
-                // half-empty node can be used as a sentinel
-            } else {
-                // add inner node as sentinel
-                nodes.push_back(sentinel);
+            append_leaf(nodes, bundles, tris, node.triangle_ids(),
+                        node.num_tris());
+        }
+    }
+}
+
+constexpr size_t NODES_PER_CACHE_LINE = 64 / sizeof(detail::FlatNode);
+
+/**
+ * Lay out nodes given in DFS order without gaps (cf. `flatten`) s.t. no right
+ * subtree, which fits into a cache line, straddles two cache lines.
+ *
+ * Left children have to be stored next to their parent, hence only right
+ * subtrees can be moved. A moved subtree starts at the next cache line, and
+ * the gap before it is filled with padding nodes. The nodes of the subtree
+ * are then fetched with a single cache miss. The order of the nodes is still
+ * DFS, and the leaves are unchanged.
+ */
+KDTree::Nodes cluster_nodes(const KDTree::Nodes& dfs_nodes) {
+    // The subtree of node i consists of the nodes [i, i + sizes[i]).
+    std::vector<uint32_t> sizes(dfs_nodes.size());
+    for (size_t i = dfs_nodes.size(); i-- > 0;) {
+        const auto& node = dfs_nodes[i];
+        sizes[i] = node.is_leaf() ? 1 : 1 + sizes[i + 1] + sizes[node.right()];
+    }
+
+    const detail::FlatNode padding(Axis3::X, 0, 0);
+    KDTree::Nodes nodes;
+    nodes.reserve(dfs_nodes.size());
+    std::stack<std::pair<uint32_t /*dfs index*/, uint32_t /*parent index*/>>
+        stack;
+    stack.emplace(0, INVALID_INDEX);
+    while (!stack.empty()) {
+        const uint32_t i = stack.top().first;
+        const uint32_t parent_index = stack.top().second;
+        stack.pop();
+
+        if (parent_index != INVALID_INDEX) {
+            const size_t offset = nodes.size() % NODES_PER_CACHE_LINE;
+            if (sizes[i] <= NODES_PER_CACHE_LINE &&
+                offset + sizes[i] > NODES_PER_CACHE_LINE) {
+                nodes.resize(nodes.size() + NODES_PER_CACHE_LINE - offset,
+                             padding);
             }
+            nodes[parent_index].set_right(nodes.size());
+        }
+
+        const auto& node = dfs_nodes[i];
+        if (node.is_leaf()) {
+            nodes.push_back(node);
+            continue;
         }
+        const uint32_t node_index = nodes.size();
+        nodes.emplace_back(node.split_axis(), node.split_pos(), INVALID_INDEX);
+        stack.emplace(node.right(), node_index);
+        stack.emplace(i + 1, INVALID_INDEX);
     }
+    assert(nodes.size() < detail::FlatNode::MAX_TRIANGLE_ID);
     return nodes;
 }
 } // namespace anonymous
@@ -471,104 +1148,734 @@ std::vector<detail::FlatNode> flatten(std::unique_ptr<TreeNode> root) {
 // KDTree implementation
 //
 
-KDTree::KDTree(Triangles tris) : tris_(std::move(tris)) {
-    assert(tris_.size() > 0);
-    assert(tris_.size() < detail::FlatNode::MAX_TRIANGLE_ID);
+KDTree::KDTree(Triangles tris, BuildStrategy strategy, size_t num_threads) {
+    turner::Profile _(turner::ProfCategory::KDTreeBuild);
+    auto storage = std::make_shared<Storage>();
+    storage->tris = std::move(tris);
+    const Triangles& triangles = storage->tris;
+    assert(triangles.size() > 0);
+    assert(triangles.size() < detail::FlatNode::MAX_TRIANGLE_ID);
 
-    std::vector<TriangleId> ids(tris_.size(), 0);
+    auto& counter = allocation_counter<detail::KDTreeBuildTag>();
+    const size_t num_allocations = counter.num_allocations();
+    const size_t bytes = counter.bytes();
+    counter.reset_peak();
+
+    TriangleIds ids(triangles.size(), 0);
 
     // Compute the bounding box of all triangles and fill in vector of all ids.
-    box_ = tris_.front().bbox();
-    for (size_t i = 1; i < tris_.size(); ++i) {
-        box_ = bbox_union(box_, tris_[i].bbox());
+    box_ = triangles.front().bbox();
+    for (size_t i = 1; i < triangles.size(); ++i) {
+        box_ = bbox_union(box_, triangles[i].bbox());
         ids[i] = i;
     }
 
-    KDTreeBuildAlgorithm algo(tris_);
-    nodes_ =
-        flatten(std::unique_ptr<TreeNode>(algo.build(std::move(ids), box_)));
+    KDTreeBuildAlgorithm algo(triangles);
+    TreeNode* root;
+    if (strategy == BuildStrategy::SORT_PER_NODE) {
+        root = algo.build(std::move(ids), box_);
+    } else if (num_threads <= 1) {
+        root = algo.build_presorted(std::move(ids), box_);
+    } else {
+        ThreadPool pool(num_threads);
+        root = algo.build_presorted(std::move(ids), box_, pool, num_threads);
+    }
+    Nodes nodes;
+    flatten(std::unique_ptr<TreeNode>(root), triangles, nodes,
+            storage->bundles);
+    build_memory_.num_allocations = counter.num_allocations() - num_allocations;
+    build_memory_.peak_bytes = std::max(counter.peak_bytes(), bytes) - bytes;
+
+    storage->nodes = cluster_nodes(nodes);
+    precompute(*storage);
+    set_storage(std::move(storage));
+}
+
+KDTree KDTree::refine(Triangles tris,
+                      const std::vector<TriangleId>& parents) const {
+    assert(tris.size() == parents.size());
+    assert(tris.size() < detail::FlatNode::MAX_TRIANGLE_ID);
+
+    // refined triangles of each triangle of this tree
+    std::vector<std::vector<TriangleId>> children(num_triangles());
+    for (size_t i = 0; i < parents.size(); ++i) {
+        assert(parents[i] < num_triangles());
+        children[parents[i]].push_back(i);
+    }
+
+    auto storage = std::make_shared<Storage>();
+    storage->tris = std::move(tris);
+    const Triangles& triangles = storage->tris;
+
+    // Bounding boxes of the refined triangles, slightly enlarged, s.t. a
+    // triangle touching a cell is never dropped due to rounding.
+    std::vector<Bbox3f> boxes;
+    boxes.reserve(triangles.size());
+    for (const auto& tri : triangles) {
+        auto box = tri.bbox();
+        boxes.emplace_back(box.p_min - Vector3f(EPS, EPS, EPS),
+                           box.p_max + Vector3f(EPS, EPS, EPS));
+    }
+
+    // Copy the nodes in DFS order (cf. flatten). A leaf gets the refined
+    // triangles of its triangles, which overlap the cell of the leaf.
+    using Node = detail::FlatNode;
+    Nodes nodes;
+    nodes.reserve(nodes_.size());
+    const Node* root = nodes_.data();
+    std::stack<std::tuple<const Node*, Bbox3f, uint32_t /*parent index*/>>
+        stack;
+    stack.emplace(root, box_, INVALID_INDEX);
+    std::vector<TriangleId> ids;
+    while (!stack.empty()) {
+        const Node* node = std::get<0>(stack.top());
+        const Bbox3f cell = std::get<1>(stack.top());
+        uint32_t parent_index = std::get<2>(stack.top());
+        stack.pop();
+
+        uint32_t node_index = nodes.size();
+        if (parent_index != INVALID_INDEX) {
+            nodes[parent_index].set_right(node_index);
+        }
+
+        if (node->is_inner()) {
+            nodes.emplace_back(node->split_axis(), node->split_pos(),
+                               INVALID_INDEX);
+            auto cells = cell.split(node->split_axis(), node->split_pos());
+            stack.emplace(root + node->right(), cells.second, node_index);
+            stack.emplace(node + 1, cells.first, INVALID_INDEX);
+            continue;
+        }
+
+        ids.clear();
+        for (uint32_t i = node->bundles_begin(); i < node->bundles_end(); ++i) {
+            for (TriangleId id : bundles_[i].ids) {
+                if (id == TriangleBundle::INVALID_ID) {
+                    break;
+                }
+                for (TriangleId child : children[id]) {
+                    if (overlaps(boxes[child], cell)) {
+                        ids.push_back(child);
+                    }
+                }
+            }
+        }
+        append_leaf(nodes, storage->bundles, triangles, ids.data(), ids.size());
+    }
+
+    storage->nodes = cluster_nodes(nodes);
+    precompute(*storage);
+
+    KDTree tree;
+    tree.box_ = box_;
+    tree.set_storage(std::move(storage));
+    return tree;
+}
+
+KDTree KDTree::update(Triangles tris,
+                      const std::vector<TriangleId>& changed) const {
+    turner::Profile _(turner::ProfCategory::KDTreeBuild);
+    assert(tris.size() == num_triangles());
+
+    // Boxes of the changed triangles before and after the update, slightly
+    // enlarged, s.t. a triangle touching a cell is never missed due to
+    // rounding (cf. `refine`).
+    const Vector3f eps(EPS, EPS, EPS);
+    std::vector<bool> is_changed(tris.size(), false);
+    std::vector<Bbox3f> old_boxes(tris.size()), new_boxes(tris.size());
+    for (TriangleId id : changed) {
+        assert(id < tris.size());
+        is_changed[id] = true;
+        const auto old_box = tris_[id].bbox();
+        const auto new_box = tris[id].bbox();
+        old_boxes[id] = Bbox3f(old_box.p_min - eps, old_box.p_max + eps);
+        new_boxes[id] = Bbox3f(new_box.p_min - eps, new_box.p_max + eps);
+        // The cells of the tree do not cover triangles outside of its box.
+        if (!(bbox_union(box_, new_box) == box_)) {
+            return KDTree(std::move(tris));
+        }
+    }
+
+    auto storage = std::make_shared<Storage>();
+    storage->tris = std::move(tris);
+    const Triangles& triangles = storage->tris;
+    KDTreeBuildAlgorithm algo(triangles);
+
+    // Copy the nodes in DFS order (cf. `refine`). Nodes, whose cells are not
+    // touched by any changed triangle (before or after the update), are
+    // copied as they are. A touched leaf is replaced by a subtree built up
+    // from its unchanged triangles and the changed triangles overlapping its
+    // cell after the update.
+    using Node = detail::FlatNode;
+    struct Entry {
+        const Node* node;
+        Bbox3f cell;
+        uint32_t parent_index;
+        std::vector<TriangleId> changed; // changed triangles touching cell
+    };
+    Nodes nodes;
+    nodes.reserve(nodes_.size());
+    const Node* root = nodes_.data();
+    std::stack<Entry> stack;
+    stack.push({root, box_, INVALID_INDEX, changed});
+    while (!stack.empty()) {
+        Entry entry = std::move(stack.top());
+        stack.pop();
+        const Node* node = entry.node;
+
+        if (entry.parent_index != INVALID_INDEX) {
+            nodes[entry.parent_index].set_right(nodes.size());
+        }
+
+        if (node->is_inner()) {
+            const uint32_t node_index = nodes.size();
+            nodes.emplace_back(node->split_axis(), node->split_pos(),
+                               INVALID_INDEX);
+            auto cells =
+                entry.cell.split(node->split_axis(), node->split_pos());
+            auto touching = [&](const Bbox3f& cell) {
+                std::vector<TriangleId> ids;
+                for (TriangleId id : entry.changed) {
+                    if (overlaps(old_boxes[id], cell) ||
+                        overlaps(new_boxes[id], cell)) {
+                        ids.push_back(id);
+                    }
+                }
+                return ids;
+            };
+            stack.push({root + node->right(), cells.second, node_index,
+                        touching(cells.second)});
+            stack.push({node + 1, cells.first, INVALID_INDEX,
+                        touching(cells.first)});
+            continue;
+        }
+
+        if (entry.changed.empty()) {
+            nodes.emplace_back(static_cast<uint32_t>(storage->bundles.size()),
+                               static_cast<uint32_t>(storage->bundles.size() +
+                                                     node->bundles_end() -
+                                                     node->bundles_begin()));
+            storage->bundles.insert(storage->bundles.end(),
+                                    bundles_.begin() + node->bundles_begin(),
+                                    bundles_.begin() + node->bundles_end());
+            continue;
+        }
+
+        TriangleIds ids;
+        for (uint32_t i = node->bundles_begin(); i < node->bundles_end(); ++i) {
+            for (TriangleId id : bundles_[i].ids) {
+                if (id == TriangleBundle::INVALID_ID) {
+                    break;
+                }
+                if (!is_changed[id]) {
+                    ids.push_back(id);
+                }
+            }
+        }
+        for (TriangleId id : entry.changed) {
+            if (overlaps(new_boxes[id], entry.cell)) {
+                ids.push_back(id);
+            }
+        }
+        flatten(std::unique_ptr<TreeNode>(algo.build(std::move(ids),
+                                                     entry.cell)),
+                triangles, nodes, storage->bundles);
+    }
+
+    storage->nodes = cluster_nodes(nodes);
+    precompute(*storage);
+
+    KDTree tree;
+    tree.box_ = box_;
+    tree.set_storage(std::move(storage));
+    return tree;
+}
+
+KDTree KDTree::replicate() const {
+    auto storage = std::make_shared<Storage>();
+    storage->tris.assign(tris_.begin(), tris_.end());
+    storage->compact_tris.assign(compact_tris_.begin(), compact_tris_.end());
+    storage->nodes.assign(nodes_.begin(), nodes_.end());
+    storage->bundles.assign(bundles_.begin(), bundles_.end());
+
+    KDTree tree;
+    tree.box_ = box_;
+    tree.set_storage(std::move(storage));
+    return tree;
+}
+
+void KDTree::precompute(Storage& storage) {
+    const auto& tris = storage.tris;
+    storage.compact_tris = CompactTriangles(tris.begin(), tris.end());
 }
 
 //
-// KDTreeIntersection implementation
+// Flat binary file format
+//
+// The file consists of a header followed by the arrays of compact triangles,
+// nodes and triangle bundles, and the arrays of the indexed
+// mesh of the triangles (vertices, normals, materials and indexed triangles),
+// each starting at a multiple of FILE_ALIGNMENT. The arrays are stored in the
+// memory layout of the machine, which wrote the file (cf.
+// FileHeader::byte_order), s.t. they can be used in place after mapping.
 //
 
 namespace {
 
+// Bump the version on any change of the file format, or of the build
+// algorithm, which changes the resulting tree.
+constexpr uint32_t FILE_VERSION = 6;
+constexpr char FILE_MAGIC[8] = {'T', 'U', 'R', 'N', 'K', 'D', 'T', '\0'};
+constexpr uint32_t BYTE_ORDER_MARK = 0x01020304;
+constexpr size_t FILE_ALIGNMENT = 64;
+
+static_assert(std::is_trivially_copyable<Point3f>::value &&
+                  std::is_trivially_copyable<Normal3f>::value &&
+                  std::is_trivially_copyable<Material>::value &&
+                  std::is_trivially_copyable<IndexedTriangle>::value,
+              "indexed meshes are stored in place in the file");
+static_assert(std::is_trivially_copyable<CompactTriangle>::value,
+              "compact triangles are stored in place in the file");
+static_assert(std::is_trivially_copyable<detail::FlatNode>::value,
+              "nodes are stored in place in the file");
+static_assert(std::is_trivially_copyable<TriangleBundle>::value,
+              "triangle bundles are stored in place in the file");
+
+struct FileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t key;
+    // sizes of the stored types
+    uint32_t compact_triangle_size;
+    uint32_t node_size;
+    uint32_t bundle_size;
+    uint32_t material_size;
+    uint64_t num_triangles;
+    uint64_t num_nodes;
+    uint64_t num_bundles;
+    uint64_t num_vertices;
+    uint64_t num_normals;
+    uint64_t num_materials;
+    // byte offsets of the arrays from the begin of the file; there is one
+    // indexed triangle per triangle
+    uint64_t compact_triangles_offset;
+    uint64_t nodes_offset;
+    uint64_t bundles_offset;
+    uint64_t vertices_offset;
+    uint64_t normals_offset;
+    uint64_t materials_offset;
+    uint64_t indexed_triangles_offset;
+    uint64_t file_size;
+    float box[6];
+};
+
+size_t align(size_t offset) {
+    return (offset + FILE_ALIGNMENT - 1) / FILE_ALIGNMENT * FILE_ALIGNMENT;
+}
+
 /**
- * Replace all zero coordinates of ray.dir by EPS.
- * @param  ray with direction to fix.
- * @return     new direction.
+ * Read-only memory mapping of a whole file.
  */
-Vector3f fix_direction(const Ray& ray) {
-    Vector3f d = ray.d;
-    for (auto ax : AXES3) {
-        if (d[ax] == 0) {
-            d[ax] = EPS;
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& filename) {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* data =
+                mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED) {
+                data_ = data;
+                size_ = st.st_size;
+            }
         }
+        close(fd);
     }
-    return d;
+
+    ~MappedFile() {
+        if (data_) {
+            munmap(data_, size_);
+        }
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const { return static_cast<const char*>(data_); }
+    size_t size() const { return size_; }
+
+private:
+    void* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+// Check that the header describes a tree with the key in a file of file_size
+// bytes, which was written with the types of this build.
+bool is_valid_header(const FileHeader& header, uint64_t key,
+                     uint64_t file_size) {
+    return std::equal(std::begin(FILE_MAGIC), std::end(FILE_MAGIC),
+                      header.magic) &&
+           header.version == FILE_VERSION &&
+           header.byte_order == BYTE_ORDER_MARK && header.key == key &&
+           header.compact_triangle_size == sizeof(CompactTriangle) &&
+           header.node_size == sizeof(detail::FlatNode) &&
+           header.bundle_size == sizeof(TriangleBundle) &&
+           header.material_size == sizeof(Material) &&
+           header.file_size == file_size && header.num_triangles != 0 &&
+           header.num_nodes != 0;
 }
 
+// Check that the file exists and starts with a valid header (cf. above).
+bool has_valid_header(const std::string& filename, uint64_t key) {
+    std::ifstream in(filename, std::ios::in | std::ios::binary);
+    FileHeader header;
+    if (!in.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+        return false;
+    }
+    in.seekg(0, std::ios::end);
+    return is_valid_header(header, key, static_cast<uint64_t>(in.tellg()));
+}
+
+// Check that the array of count elements of given size at offset resides in
+// a file of file_size bytes.
+bool is_valid_array(uint64_t offset, uint64_t count, uint64_t size,
+                    uint64_t file_size) {
+    return offset % FILE_ALIGNMENT == 0 && offset <= file_size &&
+           count <= (file_size - offset) / size;
+}
+
+// Copy of the array of count elements at offset of the file.
+template <typename T>
+std::vector<T> read_array(const char* data, uint64_t offset, uint64_t count) {
+    const auto* begin = reinterpret_cast<const T*>(data + offset);
+    return std::vector<T>(begin, begin + count);
+}
+
+// The mapped file and the triangles materialized from it.
+struct MappedStorage {
+    std::shared_ptr<const MappedFile> file;
+    Triangles tris;
+};
+
+// FNV-1a on bytes
+class Fnv1a {
+public:
+    void update(const void* data, size_t size) {
+        const auto* bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < size; ++i) {
+            hash_ ^= bytes[i];
+            hash_ *= 1099511628211ULL;
+        }
+    }
+
+    template <typename T> void update(const std::vector<T>& values) {
+        uint64_t size = values.size();
+        update(&size, sizeof(size));
+        update(values.data(), values.size() * sizeof(T));
+    }
+
+    uint64_t hash() const { return hash_; }
+
+private:
+    uint64_t hash_ = 14695981039346656037ULL;
+};
+
 } // namespace anonymous
 
+KDTree KDTree::load_or_build(Triangles tris, const std::string& cache_filename,
+                             BuildStrategy strategy, size_t num_threads) {
+    turner::Profile _(turner::ProfCategory::KDTreeBuild);
+    uint64_t key = cache_key(tris);
+
+    KDTree tree;
+    if (tree.map_file(cache_filename, key)) {
+        return tree;
+    }
+
+    tree = KDTree(std::move(tris), strategy, num_threads);
+    tree.write_file(cache_filename, key);
+    return tree;
+}
+
+KDTree KDTree::load_or_build(const IndexedMesh& mesh,
+                             const std::string& cache_filename,
+                             BuildStrategy strategy, size_t num_threads) {
+    turner::Profile _(turner::ProfCategory::KDTreeBuild);
+    uint64_t key = cache_key(mesh);
+
+    KDTree tree;
+    if (tree.map_file(cache_filename, key)) {
+        return tree;
+    }
+
+    tree = KDTree(mesh.triangles(), strategy, num_threads);
+    tree.write_file(cache_filename, key, mesh);
+    return tree;
+}
+
+uint64_t KDTree::cache_key(const Triangles& tris) {
+    Fnv1a hash;
+    hash.update(&FILE_VERSION, sizeof(FILE_VERSION));
+    hash.update(tris);
+    return hash.hash();
+}
+
+uint64_t KDTree::cache_key(const IndexedMesh& mesh) {
+    // differs from the key of the materialized triangles
+    Fnv1a hash;
+    hash.update(&FILE_VERSION, sizeof(FILE_VERSION));
+    hash.update(mesh.vertices());
+    hash.update(mesh.normals());
+    hash.update(mesh.materials());
+    hash.update(mesh.indexed_triangles());
+    return hash.hash();
+}
+
+void KDTree::write_file(const std::string& filename, uint64_t key) const {
+    write_file(filename, key, IndexedMesh(tris_));
+}
+
+void KDTree::write_file(const std::string& filename, uint64_t key,
+                        const IndexedMesh& mesh) const {
+    assert(mesh.num_triangles() == tris_.size());
+    const auto& vertices = mesh.vertices();
+    const auto& normals = mesh.normals();
+    const auto& materials = mesh.materials();
+    const auto& indexed_tris = mesh.indexed_triangles();
+
+    FileHeader header = {};
+    std::copy(std::begin(FILE_MAGIC), std::end(FILE_MAGIC), header.magic);
+    header.version = FILE_VERSION;
+    header.byte_order = BYTE_ORDER_MARK;
+    header.key = key;
+    header.compact_triangle_size = sizeof(CompactTriangle);
+    header.node_size = sizeof(detail::FlatNode);
+    header.bundle_size = sizeof(TriangleBundle);
+    header.material_size = sizeof(Material);
+    header.num_triangles = tris_.size();
+    header.num_nodes = nodes_.size();
+    header.num_bundles = bundles_.size();
+    header.num_vertices = vertices.size();
+    header.num_normals = normals.size();
+    header.num_materials = materials.size();
+    header.compact_triangles_offset = align(sizeof(FileHeader));
+    header.nodes_offset =
+        align(header.compact_triangles_offset +
+              compact_tris_.size() * sizeof(CompactTriangle));
+    header.bundles_offset =
+        align(header.nodes_offset + nodes_.size() * sizeof(detail::FlatNode));
+    header.vertices_offset = align(
+        header.bundles_offset + bundles_.size() * sizeof(TriangleBundle));
+    header.normals_offset =
+        align(header.vertices_offset + vertices.size() * sizeof(Point3f));
+    header.materials_offset =
+        align(header.normals_offset + normals.size() * sizeof(Normal3f));
+    header.indexed_triangles_offset =
+        align(header.materials_offset + materials.size() * sizeof(Material));
+    header.file_size = header.indexed_triangles_offset +
+                       indexed_tris.size() * sizeof(IndexedTriangle);
+    header.box[0] = box_.p_min.x;
+    header.box[1] = box_.p_min.y;
+    header.box[2] = box_.p_min.z;
+    header.box[3] = box_.p_max.x;
+    header.box[4] = box_.p_max.y;
+    header.box[5] = box_.p_max.z;
+
+    // A unique temporary file, s.t. processes sharing the cache file do not
+    // write to the same temporary file (cf. --kdtree-cache).
+    std::string tmp_filename = filename + ".XXXXXX";
+    const int fd = mkstemp(&tmp_filename[0]);
+    if (fd < 0) {
+        throw std::runtime_error("could not write kd-tree to " + filename);
+    }
+    // mkstemp creates the file only readable by the owner
+    fchmod(fd, 0644);
+    close(fd);
+    {
+        std::ofstream out(tmp_filename, std::ios::out | std::ios::binary);
+        auto write_at = [&out](uint64_t offset, const void* data,
+                               size_t size) {
+            static const char zeros[FILE_ALIGNMENT] = {};
+            auto pos = static_cast<uint64_t>(out.tellp());
+            assert(pos <= offset && offset - pos < FILE_ALIGNMENT);
+            out.write(zeros, offset - pos);
+            out.write(static_cast<const char*>(data), size);
+        };
+
+        write_at(0, &header, sizeof(header));
+        write_at(header.compact_triangles_offset, compact_tris_.data(),
+                 compact_tris_.size() * sizeof(CompactTriangle));
+        write_at(header.nodes_offset, nodes_.data(),
+                 nodes_.size() * sizeof(detail::FlatNode));
+        write_at(header.bundles_offset, bundles_.data(),
+                 bundles_.size() * sizeof(TriangleBundle));
+        write_at(header.vertices_offset, vertices.data(),
+                 vertices.size() * sizeof(Point3f));
+        write_at(header.normals_offset, normals.data(),
+                 normals.size() * sizeof(Normal3f));
+        write_at(header.materials_offset, materials.data(),
+                 materials.size() * sizeof(Material));
+        write_at(header.indexed_triangles_offset, indexed_tris.data(),
+                 indexed_tris.size() * sizeof(IndexedTriangle));
+        if (!out) {
+            std::remove(tmp_filename.c_str());
+            throw std::runtime_error("could not write kd-tree to " +
+                                     tmp_filename);
+        }
+    }
+    if (std::rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+        std::remove(tmp_filename.c_str());
+        // another process may have written the same tree in the meantime
+        if (!has_valid_header(filename, key)) {
+            throw std::runtime_error("could not write kd-tree to " + filename);
+        }
+    }
+}
+
+bool KDTree::map_file(const std::string& filename, uint64_t key) {
+    auto file = std::make_shared<MappedFile>(filename);
+    if (file->size() < sizeof(FileHeader)) {
+        return false;
+    }
+
+    FileHeader header;
+    std::memcpy(&header, file->data(), sizeof(header));
+    if (!is_valid_header(header, key, file->size())) {
+        return false;
+    }
+    if (!is_valid_array(header.compact_triangles_offset, header.num_triangles,
+                        sizeof(CompactTriangle), header.file_size) ||
+        !is_valid_array(header.nodes_offset, header.num_nodes,
+                        sizeof(detail::FlatNode), header.file_size) ||
+        !is_valid_array(header.bundles_offset, header.num_bundles,
+                        sizeof(TriangleBundle), header.file_size) ||
+        !is_valid_array(header.vertices_offset, header.num_vertices,
+                        sizeof(Point3f), header.file_size) ||
+        !is_valid_array(header.normals_offset, header.num_normals,
+                        sizeof(Normal3f), header.file_size) ||
+        !is_valid_array(header.materials_offset, header.num_materials,
+                        sizeof(Material), header.file_size) ||
+        !is_valid_array(header.indexed_triangles_offset, header.num_triangles,
+                        sizeof(IndexedTriangle), header.file_size)) {
+        return false;
+    }
+
+    const char* data = file->data();
+    const IndexedMesh mesh(
+        read_array<Point3f>(data, header.vertices_offset, header.num_vertices),
+        read_array<Normal3f>(data, header.normals_offset, header.num_normals),
+        read_array<Material>(data, header.materials_offset,
+                             header.num_materials),
+        read_array<IndexedTriangle>(data, header.indexed_triangles_offset,
+                                    header.num_triangles));
+    if (!mesh.is_valid()) {
+        return false;
+    }
+    auto storage = std::make_shared<MappedStorage>();
+    storage->tris = mesh.triangles();
+    storage->file = std::move(file);
+
+    tris_ = storage->tris;
+    compact_tris_ = {reinterpret_cast<const CompactTriangle*>(
+                         data + header.compact_triangles_offset),
+                     header.num_triangles};
+    nodes_ = {reinterpret_cast<const detail::FlatNode*>(
+                  data + header.nodes_offset),
+              header.num_nodes};
+    bundles_ = {reinterpret_cast<const TriangleBundle*>(
+                    data + header.bundles_offset),
+                header.num_bundles};
+    box_ = Bbox3f(Point3f(header.box[0], header.box[1], header.box[2]),
+                  Point3f(header.box[3], header.box[4], header.box[5]));
+    height_ = compute_height();
+    memory_ = std::move(storage);
+    return true;
+}
+
+//
+// KDTreeIntersection implementation
+//
+
 const KDTreeIntersection::OptionalId
 KDTreeIntersection::intersect(const Ray& ray, float& r, float& a, float& b) {
-    // A trick to make the traversal robust.
+    turner::Profile _(turner::ProfCategory::Intersect);
+    // The inverse direction is finite, which makes the traversal robust.
     // Cf. [HH11], p. 5, comment about dir classification and robustness.
-    const Ray fixed_ray(ray.o, fix_direction(ray));
+    const PrecomputedRay fixed_ray(ray);
 
+    r = std::numeric_limits<float>::max();
     float tenter, texit;
     if (!intersect_ray_box(fixed_ray, tree_->box(), tenter, texit)) {
         return OptionalId{};
     }
 
-    // Note: No need to clear, since when we leave this function, the stack is
-    // always empty.
-    assert(stack_.empty());
+    // Hits are searched in [tenter, min(ray.t_max, closest hit so far)], i.e.
+    // nodes behind the closest hit are not visited.
+    float max_r = ray.t_max;
+    texit = std::min(texit, max_r);
+    if (texit < tenter) {
+        return OptionalId{};
+    }
+
     const auto* root = tree_->nodes_.data();
-    stack_.emplace(root, tenter, texit);
+    StackEntry* stack = stack_.data();
+    size_t stack_size = 0;
+    stack[stack_size++] = {root, tenter, texit};
 
-    Vector3f d_inv(1 / fixed_ray.d.x, 1 / fixed_ray.d.y, 1 / fixed_ray.d.z);
     const detail::FlatNode* node;
     OptionalId res;
-    r = std::numeric_limits<float>::max();
-    while (!stack_.empty()) {
-        std::tie(node, tenter, texit) = stack_.top();
-        stack_.pop();
+    while (stack_size > 0) {
+        const StackEntry& entry = stack[--stack_size];
+        // behind the closest hit
+        if (max_r < entry.tenter) {
+            continue;
+        }
+        node = entry.node;
+        tenter = entry.tenter;
+        texit = std::min(entry.texit, max_r);
 
+        // nodes are counted once per descent
+        size_t num_nodes = 1;
         while (node->is_inner()) {
+            num_nodes += 1;
             int ax = static_cast<int>(node->split_axis());
             float split_pos = node->split_pos();
 
             // t at split
-            float t = (split_pos - fixed_ray.o[ax]) * d_inv[ax];
+            float t = (split_pos - fixed_ray.o[ax]) * fixed_ray.d_inv[ax];
 
             // classify near/far with respect to t:
-            // left is near if ray.dir[ax] <= 0, else otherwise
-            const auto* near = node + 1;
-            const auto* far = root + node->right();
-            if (fixed_ray.d[ax] <= 0) {
-                std::swap(near, far);
-            }
+            // left is near if ray.dir[ax] > 0, right otherwise
+            const detail::FlatNode* children[2] = {node + 1,
+                                                   root + node->right()};
+            const auto* near = children[fixed_ray.sign[ax]];
+            const auto* far = children[1 - fixed_ray.sign[ax]];
 
             if (texit < t) {
                 node = near;
             } else if (t < tenter) {
                 node = far;
             } else {
-                stack_.emplace(far, t, texit);
+                assert(stack_size < stack_.size());
+                stack[stack_size++] = {far, t, texit};
                 node = near;
                 texit = t;
             }
         }
 
         assert(node->is_leaf());
-        float next_r, next_a, next_b;
+        counts_.nodes += num_nodes;
+        counts_.triangles += TriangleBundle::SIZE *
+                             (node->bundles_end() - node->bundles_begin());
+        float next_r = max_r, next_a, next_b;
         auto next = intersect(node, ray, next_r, next_a, next_b);
-        if (next && next_r < r) {
+        if (next) {
             res = next;
-            r = next_r;
+            r = max_r = next_r;
             a = next_a;
             b = next_b;
         }
@@ -580,28 +1887,483 @@ KDTreeIntersection::intersect(const Ray& ray, float& r, float& a, float& b) {
 const KDTreeIntersection::OptionalId
 KDTreeIntersection::intersect(const detail::FlatNode* node, const Ray& ray,
                               float& min_r, float& min_s, float& min_t) {
-    min_r = std::numeric_limits<float>::max();
-    OptionalId res;
+    const auto* bundles = tree_->bundles_.data();
+    return OptionalId{intersect_ray_bundles(
+        ray, bundles + node->bundles_begin(), bundles + node->bundles_end(),
+        min_r, min_s, min_t)};
+}
+
+const KDTreeIntersection::OptionalId
+KDTreeIntersection::occluder(const Ray& ray, float t_max) {
+    turner::Profile _(turner::ProfCategory::Intersect);
+    const PrecomputedRay fixed_ray(ray);
+
+    float tenter, texit;
+    if (!intersect_ray_box(fixed_ray, tree_->box(), tenter, texit)) {
+        return {};
+    }
+    // nodes behind t_max cannot contain an occluder
+    texit = std::min(texit, t_max);
+    if (texit < tenter) {
+        return {};
+    }
+
+    const auto* root = tree_->nodes_.data();
+    StackEntry* stack = stack_.data();
+    size_t stack_size = 0;
+    stack[stack_size++] = {root, tenter, texit};
+
+    const detail::FlatNode* node;
+    while (stack_size > 0) {
+        const StackEntry& entry = stack[--stack_size];
+        node = entry.node;
+        tenter = entry.tenter;
+        texit = entry.texit;
+
+        // same traversal as in `intersect`
+        size_t num_nodes = 1;
+        while (node->is_inner()) {
+            num_nodes += 1;
+            int ax = static_cast<int>(node->split_axis());
+            float t =
+                (node->split_pos() - fixed_ray.o[ax]) * fixed_ray.d_inv[ax];
+
+            const detail::FlatNode* children[2] = {node + 1,
+                                                   root + node->right()};
+            const auto* near = children[fixed_ray.sign[ax]];
+            const auto* far = children[1 - fixed_ray.sign[ax]];
+
+            if (texit < t) {
+                node = near;
+            } else if (t < tenter) {
+                node = far;
+            } else {
+                assert(stack_size < stack_.size());
+                stack[stack_size++] = {far, t, texit};
+                node = near;
+                texit = t;
+            }
+        }
+
+        assert(node->is_leaf());
+        counts_.nodes += num_nodes;
+        counts_.triangles += TriangleBundle::SIZE *
+                             (node->bundles_end() - node->bundles_begin());
+        const auto id = occluder(node, ray, t_max);
+        if (id) {
+            return id;
+        }
+    }
 
-    const Triangles& triangles = tree_->tris_;
-    auto intersect = [&](uint32_t triangle_id) {
-        const auto& tri = triangles[triangle_id];
-        float r, s, t;
-        bool intersects = intersect_ray_triangle(ray, tri, r, s, t);
-        if (intersects && r < min_r) {
-            min_r = r;
-            min_s = s;
-            min_t = t;
-            res = OptionalId{triangle_id};
+    return {};
+}
+
+const KDTreeIntersection::OptionalId
+KDTreeIntersection::occluder(const detail::FlatNode* node, const Ray& ray,
+                             float t_max) const {
+    const auto* bundles = tree_->bundles_.data();
+    return OptionalId{occluder_in_bundles(ray, bundles + node->bundles_begin(),
+                                          bundles + node->bundles_end(),
+                                          t_max)};
+}
+
+KDTreeIntersection::HitPacket
+KDTreeIntersection::intersect_packet(const RayPacket& rays, unsigned active) {
+    turner::Profile _(turner::ProfCategory::Intersect);
+    HitPacket hits;
+
+    // The inverse directions are finite (cf. `intersect`).
+    std::array<PrecomputedRay, PACKET_SIZE> fixed_rays;
+    for (size_t i = 0; i < PACKET_SIZE; ++i) {
+        fixed_rays[i] = PrecomputedRay(rays[i]);
+    }
+
+    // The near and far children have to be the same for all rays.
+    int first = -1;
+    bool coherent = true;
+    for (size_t i = 0; i < PACKET_SIZE; ++i) {
+        if (!(active & (1 << i))) {
+            continue;
+        }
+        if (first < 0) {
+            first = i;
+            continue;
         }
+        coherent &= fixed_rays[i].sign == fixed_rays[first].sign;
+    }
+    if (first < 0) {
+        return hits;
+    } else if (!coherent) {
+        for (size_t i = 0; i < PACKET_SIZE; ++i) {
+            if (active & (1 << i)) {
+                auto& hit = hits[i];
+                hit.id = intersect(rays[i], hit.r, hit.a, hit.b);
+            }
+        }
+        return hits;
+    }
+
+    // Rays, which do not traverse a node, have an empty interval, i.e.
+    // tenter > texit. Note: In particular, inactive rays have an empty
+    // interval.
+    PacketStackEntry entry;
+    for (size_t i = 0; i < PACKET_SIZE; ++i) {
+        if (!(active & (1 << i)) ||
+            !intersect_ray_box(fixed_rays[i], tree_->box(), entry.tenter[i],
+                               entry.texit[i])) {
+            entry.tenter[i] = std::numeric_limits<float>::infinity();
+            entry.texit[i] = -std::numeric_limits<float>::infinity();
+        }
+    }
+
+    // rays in SoA layout
+    __m128 o[3], d[3], d_inv[3];
+    for (auto ax : AXES3) {
+        const int i = static_cast<int>(ax);
+        o[i] = _mm_setr_ps(rays[0].o[ax], rays[1].o[ax], rays[2].o[ax],
+                           rays[3].o[ax]);
+        d[i] = _mm_setr_ps(rays[0].d[ax], rays[1].d[ax], rays[2].d[ax],
+                           rays[3].d[ax]);
+        d_inv[i] = _mm_setr_ps(fixed_rays[0].d_inv[ax], fixed_rays[1].d_inv[ax],
+                               fixed_rays[2].d_inv[ax],
+                               fixed_rays[3].d_inv[ax]);
+    }
+
+    const auto* root = tree_->nodes_.data();
+    PacketStackEntry* stack = packet_stack_.data();
+    size_t stack_size = 0;
+    entry.node = root;
+    stack[stack_size++] = entry;
+
+    // closest hit so far, or ray.t_max (cf. `intersect`)
+    __m128 min_r = _mm_setr_ps(rays[0].t_max, rays[1].t_max, rays[2].t_max,
+                               rays[3].t_max);
+    __m128 min_a = _mm_setzero_ps();
+    __m128 min_b = _mm_setzero_ps();
+    __m128i min_id = _mm_set1_epi32(-1);
+
+    const auto& triangles = tree_->compact_tris_;
+    auto intersect_triangle = [&](__m128 traversing, uint32_t triangle_id) {
+        __m128 r, a, b;
+        __m128 mask =
+            intersect_ray_triangle(o, d, triangles[triangle_id], r, a, b);
+        mask = _mm_and_ps(_mm_and_ps(mask, traversing), _mm_cmplt_ps(r, min_r));
+        min_r = _mm_or_ps(_mm_and_ps(mask, r), _mm_andnot_ps(mask, min_r));
+        min_a = _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, min_a));
+        min_b = _mm_or_ps(_mm_and_ps(mask, b), _mm_andnot_ps(mask, min_b));
+        __m128i id_mask = _mm_castps_si128(mask);
+        min_id = _mm_or_si128(
+            _mm_and_si128(id_mask, _mm_set1_epi32(triangle_id)),
+            _mm_andnot_si128(id_mask, min_id));
     };
 
-    for (; node->is_leaf(); ++node) {
-        intersect(node->first_triangle_id());
-        if (!node->has_second_triangle_id()) {
+    while (stack_size > 0) {
+        stack_size -= 1;
+        const detail::FlatNode* node = stack[stack_size].node;
+        __m128 tenter = _mm_load_ps(stack[stack_size].tenter);
+        // rays, whose closest hit is before the node, do not traverse it
+        __m128 texit = _mm_min_ps(_mm_load_ps(stack[stack_size].texit), min_r);
+        if (!_mm_movemask_ps(_mm_cmple_ps(tenter, texit))) {
+            continue;
+        }
+
+        size_t num_nodes = 1;
+        while (node->is_inner()) {
+            num_nodes += 1;
+            int ax = static_cast<int>(node->split_axis());
+            __m128 split_pos = _mm_set1_ps(node->split_pos());
+
+            // t at split
+            __m128 t =
+                _mm_mul_ps(_mm_sub_ps(split_pos, o[ax]), d_inv[ax]);
+
+            // classify near/far with respect to t (cf. `intersect`)
+            const detail::FlatNode* children[2] = {node + 1,
+                                                   root + node->right()};
+            const auto* near = children[fixed_rays[first].sign[ax]];
+            const auto* far = children[1 - fixed_rays[first].sign[ax]];
+
+            // Same intervals as in the scalar traversal, e.g. if texit < t,
+            // then the ray traverses only near in [tenter, texit].
+            __m128 near_texit = _mm_min_ps(t, texit);
+            __m128 far_tenter = _mm_max_ps(t, tenter);
+            bool traverse_near =
+                _mm_movemask_ps(_mm_cmple_ps(tenter, near_texit));
+            bool traverse_far =
+                _mm_movemask_ps(_mm_cmple_ps(far_tenter, texit));
+
+            if (traverse_near && traverse_far) {
+                assert(stack_size < packet_stack_.size());
+                auto& far_entry = stack[stack_size++];
+                far_entry.node = far;
+                _mm_store_ps(far_entry.tenter, far_tenter);
+                _mm_store_ps(far_entry.texit, texit);
+                node = near;
+                texit = near_texit;
+            } else if (traverse_near) {
+                node = near;
+                texit = near_texit;
+            } else if (traverse_far) {
+                node = far;
+                tenter = far_tenter;
+            } else {
+                node = nullptr;
+                break;
+            }
+        }
+
+        // the packet does not traverse the last node, if there is none
+        counts_.nodes += num_nodes - (node ? 0 : 1);
+        if (!node) {
+            continue;
+        }
+
+        assert(node->is_leaf());
+        __m128 traversing = _mm_cmple_ps(tenter, texit);
+        const auto* bundles = tree_->bundles_.data();
+        for (uint32_t i = node->bundles_begin(); i < node->bundles_end(); ++i) {
+            for (uint32_t id : bundles[i].ids) {
+                if (id == TriangleBundle::INVALID_ID) {
+                    break;
+                }
+                counts_.triangles += 1;
+                intersect_triangle(traversing, id);
+            }
+        }
+    }
+
+    alignas(16) float rs[PACKET_SIZE], as[PACKET_SIZE], bs[PACKET_SIZE];
+    alignas(16) int32_t ids[PACKET_SIZE];
+    _mm_store_ps(rs, min_r);
+    _mm_store_ps(as, min_a);
+    _mm_store_ps(bs, min_b);
+    _mm_store_si128(reinterpret_cast<__m128i*>(ids), min_id);
+    for (size_t i = 0; i < PACKET_SIZE; ++i) {
+        if (ids[i] >= 0) {
+            hits[i].id = OptionalId(ids[i]);
+            hits[i].r = rs[i];
+            hits[i].a = as[i];
+            hits[i].b = bs[i];
+        }
+    }
+    return hits;
+}
+
+unsigned KDTreeIntersection::occluded_packet(
+    const RayPacket& rays, const std::array<float, PACKET_SIZE>& t_max,
+    unsigned active) {
+    turner::Profile _(turner::ProfCategory::Intersect);
+    // The inverse directions are finite (cf. `intersect`).
+    std::array<PrecomputedRay, PACKET_SIZE> fixed_rays;
+    for (size_t i = 0; i < PACKET_SIZE; ++i) {
+        fixed_rays[i] = PrecomputedRay(rays[i]);
+    }
+
+    // The near and far children have to be the same for all rays (cf.
+    // `intersect_packet`).
+    int first = -1;
+    bool coherent = true;
+    for (size_t i = 0; i < PACKET_SIZE; ++i) {
+        if (!(active & (1 << i))) {
+            continue;
+        }
+        if (first < 0) {
+            first = i;
+            continue;
+        }
+        coherent &= fixed_rays[i].sign == fixed_rays[first].sign;
+    }
+    if (first < 0) {
+        return 0;
+    } else if (!coherent) {
+        unsigned occluded_mask = 0;
+        for (size_t i = 0; i < PACKET_SIZE; ++i) {
+            if ((active & (1 << i)) && occluded(rays[i], t_max[i])) {
+                occluded_mask |= 1 << i;
+            }
+        }
+        return occluded_mask;
+    }
+
+    // Rays, which do not traverse a node, have an empty interval (cf.
+    // `intersect_packet`). Nodes behind t_max cannot contain an occluder.
+    PacketStackEntry entry;
+    for (size_t i = 0; i < PACKET_SIZE; ++i) {
+        if (!(active & (1 << i)) ||
+            !intersect_ray_box(fixed_rays[i], tree_->box(), entry.tenter[i],
+                               entry.texit[i])) {
+            entry.tenter[i] = std::numeric_limits<float>::infinity();
+            entry.texit[i] = -std::numeric_limits<float>::infinity();
+        } else {
+            entry.texit[i] = std::min(entry.texit[i], t_max[i]);
+        }
+    }
+
+    // rays in SoA layout
+    __m128 o[3], d[3], d_inv[3];
+    for (auto ax : AXES3) {
+        const int i = static_cast<int>(ax);
+        o[i] = _mm_setr_ps(rays[0].o[ax], rays[1].o[ax], rays[2].o[ax],
+                           rays[3].o[ax]);
+        d[i] = _mm_setr_ps(rays[0].d[ax], rays[1].d[ax], rays[2].d[ax],
+                           rays[3].d[ax]);
+        d_inv[i] = _mm_setr_ps(fixed_rays[0].d_inv[ax], fixed_rays[1].d_inv[ax],
+                               fixed_rays[2].d_inv[ax],
+                               fixed_rays[3].d_inv[ax]);
+    }
+    const __m128 max_r = _mm_setr_ps(t_max[0], t_max[1], t_max[2], t_max[3]);
+    const __m128 inf = _mm_set1_ps(std::numeric_limits<float>::infinity());
+
+    const auto* root = tree_->nodes_.data();
+    PacketStackEntry* stack = packet_stack_.data();
+    size_t stack_size = 0;
+    entry.node = root;
+    stack[stack_size++] = entry;
+
+    // all bits set in the lanes of occluded rays
+    __m128 occluded_rays = _mm_setzero_ps();
+
+    const auto& triangles = tree_->compact_tris_;
+    auto occlude_triangle = [&](__m128 traversing, uint32_t triangle_id) {
+        __m128 r, a, b;
+        __m128 mask =
+            intersect_ray_triangle(o, d, triangles[triangle_id], r, a, b);
+        mask = _mm_and_ps(_mm_and_ps(mask, traversing), _mm_cmplt_ps(r, max_r));
+        occluded_rays = _mm_or_ps(occluded_rays, mask);
+    };
+
+    while (stack_size > 0) {
+        stack_size -= 1;
+        const detail::FlatNode* node = stack[stack_size].node;
+        __m128 tenter = _mm_load_ps(stack[stack_size].tenter);
+        __m128 texit = _mm_load_ps(stack[stack_size].texit);
+
+        // Occluded rays do not need to traverse the node anymore.
+        tenter = _mm_or_ps(_mm_and_ps(occluded_rays, inf),
+                           _mm_andnot_ps(occluded_rays, tenter));
+
+        // same traversal as in `intersect_packet`
+        size_t num_nodes = 1;
+        while (node->is_inner()) {
+            num_nodes += 1;
+            int ax = static_cast<int>(node->split_axis());
+            __m128 split_pos = _mm_set1_ps(node->split_pos());
+
+            __m128 t =
+                _mm_mul_ps(_mm_sub_ps(split_pos, o[ax]), d_inv[ax]);
+
+            const detail::FlatNode* children[2] = {node + 1,
+                                                   root + node->right()};
+            const auto* near = children[fixed_rays[first].sign[ax]];
+            const auto* far = children[1 - fixed_rays[first].sign[ax]];
+
+            __m128 near_texit = _mm_min_ps(t, texit);
+            __m128 far_tenter = _mm_max_ps(t, tenter);
+            bool traverse_near =
+                _mm_movemask_ps(_mm_cmple_ps(tenter, near_texit));
+            bool traverse_far =
+                _mm_movemask_ps(_mm_cmple_ps(far_tenter, texit));
+
+            if (traverse_near && traverse_far) {
+                assert(stack_size < packet_stack_.size());
+                auto& far_entry = stack[stack_size++];
+                far_entry.node = far;
+                _mm_store_ps(far_entry.tenter, far_tenter);
+                _mm_store_ps(far_entry.texit, texit);
+                node = near;
+                texit = near_texit;
+            } else if (traverse_near) {
+                node = near;
+                texit = near_texit;
+            } else if (traverse_far) {
+                node = far;
+                tenter = far_tenter;
+            } else {
+                node = nullptr;
+                break;
+            }
+        }
+
+        counts_.nodes += num_nodes - (node ? 0 : 1);
+        if (!node) {
+            continue;
+        }
+
+        assert(node->is_leaf());
+        __m128 traversing = _mm_cmple_ps(tenter, texit);
+        const auto* bundles = tree_->bundles_.data();
+        for (uint32_t i = node->bundles_begin(); i < node->bundles_end(); ++i) {
+            for (uint32_t id : bundles[i].ids) {
+                if (id == TriangleBundle::INVALID_ID) {
+                    break;
+                }
+                counts_.triangles += 1;
+                occlude_triangle(traversing, id);
+            }
+        }
+
+        if ((static_cast<unsigned>(_mm_movemask_ps(occluded_rays)) & active) ==
+            active) {
             break;
         }
-        intersect(node->second_triangle_id());
     }
-    return res;
+
+    return static_cast<unsigned>(_mm_movemask_ps(occluded_rays)) & active;
+}
+
+void KDTreeIntersection::sort_batch(ArrayView<Ray> rays) {
+    // the origins are quantized in the box of the tree
+    batch_order_.clear();
+    for (uint32_t i = 0; i < rays.size(); ++i) {
+        batch_order_.emplace_back(ray_sort_key(rays[i], tree_->box()), i);
+    }
+    std::sort(batch_order_.begin(), batch_order_.end());
+}
+
+void KDTreeIntersection::intersect_batch(ArrayView<Ray> rays,
+                                         std::vector<Hit>& hits) {
+    if (!sort_batches_) {
+        Intersector::intersect_batch(rays, hits);
+        return;
+    }
+    sort_batch(rays);
+    hits.resize(rays.size());
+    for (size_t i = 0; i < rays.size(); i += PACKET_SIZE) {
+        const size_t num_rays = std::min(PACKET_SIZE, rays.size() - i);
+        RayPacket packet;
+        for (size_t k = 0; k < num_rays; ++k) {
+            packet[k] = rays[batch_order_[i + k].second];
+        }
+        const HitPacket packet_hits =
+            intersect_packet(packet, (1 << num_rays) - 1);
+        for (size_t k = 0; k < num_rays; ++k) {
+            hits[batch_order_[i + k].second] = packet_hits[k];
+        }
+    }
+}
+
+void KDTreeIntersection::occluded_batch(ArrayView<Ray> rays,
+                                        ArrayView<float> t_max,
+                                        std::vector<uint8_t>& occluded) {
+    if (!sort_batches_) {
+        Intersector::occluded_batch(rays, t_max, occluded);
+        return;
+    }
+    assert(rays.size() == t_max.size());
+    sort_batch(rays);
+    occluded.resize(rays.size());
+    for (size_t i = 0; i < rays.size(); i += PACKET_SIZE) {
+        const size_t num_rays = std::min(PACKET_SIZE, rays.size() - i);
+        RayPacket packet;
+        std::array<float, PACKET_SIZE> packet_t_max{};
+        for (size_t k = 0; k < num_rays; ++k) {
+            packet[k] = rays[batch_order_[i + k].second];
+            packet_t_max[k] = t_max[batch_order_[i + k].second];
+        }
+        const unsigned mask =
+            occluded_packet(packet, packet_t_max, (1 << num_rays) - 1);
+        for (size_t k = 0; k < num_rays; ++k) {
+            occluded[batch_order_[i + k].second] = (mask >> k) & 1;
+        }
+    }
 }
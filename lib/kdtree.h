@@ -8,9 +8,9 @@
  * by Ingo Wald and Vlastimil Havran
  * [WH06]
  *
- * Cf. Algorithm 4, i.e. we build up the kd-tree in O(N log^2 N), however the
- * resulting kd-tree is the same as if it were built with Algorithm 5. TODO:
- * Replace by Algorithm 5.
+ * Cf. Algorithm 5, i.e. we build up the kd-tree in O(N log N). Algorithm 4,
+ * which builds up the same kd-tree in O(N log^2 N), is still available as a
+ * build strategy (cf. KDTree::BuildStrategy).
  *
  * Implementation of the intersection lookup follows the article:
  * "Review: Kd-tree Traversal Algorithms for Ray Tracing"
@@ -20,19 +20,31 @@
 
 #pragma once
 
+#include "aligned_allocator.h"
+#include "array_view.h"
+#include "counting_allocator.h"
+#include "indexed_mesh.h"
+#include "intersector.h"
 #include "triangle.h"
 
+#include <array>
 #include <cereal/types/vector.hpp>
 #include <cstdint>
 #include <functional>
 #include <memory>
 #include <stack>
+#include <string>
+#include <utility>
 #include <vector>
 
 namespace detail {
 
-using TriangleId = uint32_t;
-using TriangleIds = std::vector<TriangleId>;
+// Tag of the allocations of the kd-tree build (cf. `KDTree::BuildMemory`)
+struct KDTreeBuildTag {};
+template <typename T>
+using BuildAllocator = CountingAllocator<T, KDTreeBuildTag>;
+
+using TriangleIds = std::vector<TriangleId, BuildAllocator<TriangleId>>;
 
 inline uint32_t float_to_uint32(float val) {
     uint32_t result;
@@ -53,9 +65,10 @@ inline float uint32_to_float(uint32_t val) {
  * - an inner node containing a split axis and position, and the index of the
  *   right child. The left child is not stored explicitly; it is stored as the
  *   next neighbor in the vector containing nodes. Or,
- * - a leaf containing two triangles ids. Second, may be invalid. A set of
- *   triangles belonging to a leaf node is stored as a contiguous sequence in
- *   vector starting with a leaf node and ending with an inner node.
+ * - a leaf containing two triangles ids. Second, may be invalid. KDTree
+ *   stores the range [begin, end) of the triangle bundles of the leaf in the
+ *   two ids instead (cf. `bundles_begin` and `bundles_end`), s.t. a leaf is
+ *   a single node.
  *
  * The size of the node is 8 bytes. Cf. data_ member for exact memory layout.
  */
@@ -133,6 +146,10 @@ public:
         return (data_ & 0xFFFFFFFF) >> 2;
     }
 
+    // bundles of a leaf of a KDTree
+    uint32_t bundles_begin() const { return first_triangle_id(); }
+    uint32_t bundles_end() const { return second_triangle_id(); }
+
     template <class Archive> void serialize(Archive& archive) {
         archive(data_);
     }
@@ -153,33 +170,6 @@ private:
     uint64_t data_;
 };
 
-class OptionalId {
-public:
-    OptionalId() : id_(FlatNode::MAX_TRIANGLE_ID){};
-    explicit OptionalId(TriangleId id) : id_(id) {}
-
-    operator bool() const { return id_ < FlatNode::MAX_TRIANGLE_ID; }
-    operator TriangleId() const {
-        assert(*this);
-        return id_;
-    }
-    operator size_t() const {
-        assert(*this);
-        return id_;
-    }
-    bool operator==(const OptionalId& other) const { return id_ == other.id_; }
-    bool operator==(const TriangleId& other) const {
-        return this->operator bool() && id_ == other;
-    }
-    bool operator!=(const OptionalId& other) const { return !(*this == other); }
-    bool operator!=(const TriangleId& other) const { return !(*this == other); }
-
-    friend struct std::hash<OptionalId>;
-
-private:
-    TriangleId id_;
-};
-
 } // namespace detail
 
 class KDTreeIntersection;
@@ -190,11 +180,197 @@ class KDTree {
 public:
     using TriangleId = detail::TriangleId;
 
+    /**
+     * Algorithm used to build up the tree. The resulting tree is the same.
+     *
+     * SORT_PER_NODE     Cf. [WH06], Algorithm 4, O(N log^2 N)
+     * PRESORTED_EVENTS  Cf. [WH06], Algorithm 5, O(N log N)
+     */
+    enum class BuildStrategy { SORT_PER_NODE, PRESORTED_EVENTS };
+
+    using CompactTriangles =
+        std::vector<CompactTriangle, AlignedAllocator<CompactTriangle, 64>>;
+    using TriangleBundles =
+        std::vector<TriangleBundle, AlignedAllocator<TriangleBundle, 64>>;
+    using Nodes =
+        std::vector<detail::FlatNode, AlignedAllocator<detail::FlatNode, 64>>;
+
     KDTree() = default;
 
-    explicit KDTree(Triangles tris);
+    /**
+     * Build up the tree.
+     *
+     * @param tris        triangles to store in the tree
+     * @param strategy    build algorithm
+     * @param num_threads number of threads used to build up the tree; only
+     *                    PRESORTED_EVENTS is parallelized. The resulting tree
+     *                    does not depend on the number of threads.
+     */
+    explicit KDTree(Triangles tris,
+                    BuildStrategy strategy = BuildStrategy::PRESORTED_EVENTS,
+                    size_t num_threads = 1);
+
+    /**
+     * Load the tree from a cache file, if the file contains a tree of the same
+     * triangles (cf. `cache_key`). Otherwise, build up the tree and (re)write
+     * the cache file.
+     *
+     * @param tris           triangles to store in the tree
+     * @param cache_filename file used as cache (cf. `write_file`)
+     * @param strategy       cf. constructor
+     * @param num_threads    cf. constructor
+     */
+    static KDTree
+    load_or_build(Triangles tris, const std::string& cache_filename,
+                  BuildStrategy strategy = BuildStrategy::PRESORTED_EVENTS,
+                  size_t num_threads = 1);
+
+    /**
+     * Same as above for the triangles of an indexed mesh, which are only
+     * materialized, if the tree is not found in the cache.
+     */
+    static KDTree
+    load_or_build(const IndexedMesh& mesh, const std::string& cache_filename,
+                  BuildStrategy strategy = BuildStrategy::PRESORTED_EVENTS,
+                  size_t num_threads = 1);
+
+    /**
+     * Build up a tree of a refinement of the triangles of this tree, e.g. of
+     * subdivided triangles, without building up the tree from scratch.
+     *
+     * The tree keeps the inner nodes of this tree. Every triangle in a leaf
+     * is replaced by those of its refined triangles, which overlap the cell of
+     * the leaf.
+     *
+     * @param tris    refined triangles
+     * @param parents triangle of this tree containing the refined triangle,
+     *                one for each refined triangle
+     */
+    KDTree refine(Triangles tris, const std::vector<TriangleId>& parents) const;
+
+    /**
+     * Build up a tree of the triangles of this tree after some of them have
+     * changed, e.g. moved in an animation, by rebuilding only the leaves,
+     * whose cells are touched by a changed triangle.
+     *
+     * The tree keeps the inner nodes of this tree, and every touched leaf is
+     * replaced by a subtree built up from scratch. Hence, the time needed
+     * depends on the number of changed triangles rather than on the size of
+     * the scene. Since the upper splits are not adapted, the quality of the
+     * tree degrades with many updates; then, a full build is due. If a
+     * triangle moves out of the bounding box of this tree, the tree is built
+     * up from scratch.
+     *
+     * @param tris    all triangles with the same ids as in this tree
+     * @param changed ids of the triangles, which differ from those of this tree
+     */
+    KDTree update(Triangles tris, const std::vector<TriangleId>& changed) const;
+
+    /**
+     * Copy of the tree with its own memory, whereas copies of a tree share
+     * it. The pages of the copy are first touched by the calling thread, i.e.
+     * a thread running on a NUMA node places a replica of the tree in the
+     * memory of the node (cf. numa.h).
+     */
+    KDTree replicate() const;
+
+    /**
+     * Hash of the triangles, and of the version of the file format and the
+     * build algorithm. The built tree is a function of these only, e.g. it
+     * does not depend on the build strategy or on the number of threads.
+     */
+    static uint64_t cache_key(const Triangles& tris);
+    static uint64_t cache_key(const IndexedMesh& mesh);
+
+    /**
+     * Write the tree into a file in flat binary format, which is mapped into
+     * memory by `map_file`. The triangles are stored as an indexed mesh (cf.
+     * indexed_mesh.h), everything else in the memory layout of the tree.
+     *
+     * The file is written to a temporary file first, which is renamed
+     * afterwards, s.t. readers never see a partially written file.
+     *
+     * @param filename output file
+     * @param key      key stored in the file, e.g. `cache_key` of triangles
+     * @throw          std::runtime_error, if the file cannot be written
+     */
+    void write_file(const std::string& filename, uint64_t key) const;
+
+    /**
+     * Map a tree written by `write_file` into memory. The tree uses the
+     * mapped nodes and compact triangles in place; only the triangles are
+     * materialized from the stored indexed mesh.
+     *
+     * @param  filename file to map
+     * @param  key      expected key, cf. `write_file`
+     * @return          true, if the file exists, is valid and has the given
+     *                  key; otherwise false, and the tree is unchanged
+     */
+    bool map_file(const std::string& filename, uint64_t key);
+
+    /**
+     * Heap memory of the build: the events, triangle ids and nodes of the
+     * build algorithm, but not the resulting tree. Zero, if the tree was
+     * not built up, e.g. mapped from a cache file. Builds running at the same
+     * time are counted together.
+     */
+    struct BuildMemory {
+        size_t num_allocations = 0;
+        size_t peak_bytes = 0;
+    };
+    const BuildMemory& build_memory() const { return build_memory_; }
+
+    size_t height() const { return height_; }
+    size_t num_nodes() const { return nodes_.size(); }
+    size_t num_triangles() const { return tris_.size(); }
+    ArrayView<Triangle> triangles() const { return tris_; }
+    const Bbox3f& box() const { return box_; }
+    ArrayView<detail::FlatNode> nodes() const { return nodes_; }
+    ArrayView<TriangleBundle> bundles() const { return bundles_; }
+    const Triangle& operator[](const TriangleId id) const { return tris_[id]; }
+    const Triangle& at(const TriangleId id) const { return tris_.at(id); }
+
+    static constexpr size_t node_size() { return sizeof(detail::FlatNode); }
+
+    template <class Archive> void save(Archive& archive) const {
+        archive(Triangles(tris_.begin(), tris_.end()), box_,
+                std::vector<detail::FlatNode>(nodes_.begin(), nodes_.end()),
+                std::vector<TriangleBundle>(bundles_.begin(), bundles_.end()));
+    }
+
+    template <class Archive> void load(Archive& archive) {
+        auto storage = std::make_shared<Storage>();
+        archive(storage->tris, box_, storage->nodes, storage->bundles);
+        precompute(*storage);
+        set_storage(std::move(storage));
+    }
 
-    size_t height() const {
+private:
+    // Memory of a tree, which is built up (and not mapped from a file).
+    struct Storage {
+        Triangles tris;
+        CompactTriangles compact_tris;
+        Nodes nodes;
+        TriangleBundles bundles;
+    };
+
+    // Write the tree with the given indexed mesh of its triangles.
+    void write_file(const std::string& filename, uint64_t key,
+                    const IndexedMesh& mesh) const;
+
+    // Compute the compact triangles from the triangles of the storage.
+    static void precompute(Storage& storage);
+
+    void set_storage(std::shared_ptr<const Storage> storage) {
+        tris_ = storage->tris;
+        compact_tris_ = storage->compact_tris;
+        nodes_ = storage->nodes;
+        bundles_ = storage->bundles;
+        height_ = compute_height();
+        memory_ = std::move(storage);
+    }
+
+    size_t compute_height() const {
         using Node = detail::FlatNode;
         std::stack<std::pair<const Node*, uint32_t /* level */>> stack;
         const Node* root = nodes_.data();
@@ -216,22 +392,20 @@ public:
         }
         return height;
     }
-    size_t num_nodes() const { return nodes_.size(); }
-    size_t num_triangles() const { return tris_.size(); }
-    const Triangles& triangles() const { return tris_; }
-    const Bbox3f& box() const { return box_; }
-    const Triangle& operator[](const TriangleId id) const { return tris_[id]; }
-    const Triangle& at(const TriangleId id) const { return tris_.at(id); }
-
-    static constexpr size_t node_size() { return sizeof(detail::FlatNode); }
-
-    template <class Archive> void serialize(Archive& archive) {
-        archive(tris_, box_, nodes_);
-    }
 
 private:
-    Triangles tris_;
+    // Keeps the memory alive, which the views below point into: either a
+    // Storage or a mapped file and the materialized triangles. The memory is
+    // never modified, so copies of a tree share it.
+    std::shared_ptr<const void> memory_;
+
+    ArrayView<Triangle> tris_;
+    // Same triangles as in tris_ (with the same ids) reduced to the data
+    // needed for intersection. tris_ is only accessed for the final hit.
+    ArrayView<CompactTriangle> compact_tris_;
     Bbox3f box_;
+    size_t height_ = 0;
+    BuildMemory build_memory_;
 
     /**
      * Layout:
@@ -239,82 +413,196 @@ private:
      * We have 2 types of nodes (cf. Node): inner nodes and leaf nodes. All
      * nodes are stored in the DFS order. An inner node has its left child as
      * the next node, and stores an index to its right child. A leaf node
-     * contains at most two valid references into triangles_ array. All triangle
-     * ids are read from the first leaf until the first sentinel. A sentinel is
-     * either an inner node without a parent, or a leaf node containing a single
-     * triangle.
+     * references the bundles of its triangles in bundles_, i.e. the triangle
+     * ids are not stored between the nodes.
+     *
+     * A right subtree, which fits into a cache line, is moved to the start of
+     * the next cache line, if it would straddle two cache lines otherwise.
+     * The gap is filled with padding nodes, which are never visited.
      *
      * Cf. possible layout of the array:
      *
-     * [] - a node, i - inner node, l - leaf, / - sentinel
-     * [i] [i] [l l] [/] [  l] [l /] [  l] [/]
-     * [0] [1] [2 3] [/] [4 5] [6  ] [7 8] [/]
+     * [] - a node, i - inner node, l - leaf, / - padding, | - cache line
+     * | [i] [i] [i] [l] [l] [l] [/] [/] | [i] [l] [l]
+     * |  0   1   2   3   4   5          |  8   9  10
      *
      * representing the following tree:
      *
-     *         0
-     *        / \
-     *       /   \
-     *      1    [7 8]
-     *     / \
-     *    /   \
-     * [2 3]  [4 5 6]
+     *           0
+     *          / \
+     *         1   8
+     *        / \  / \
+     *       2  5 9  10
+     *      / \
+     *     3   4
      */
-    std::vector<detail::FlatNode> nodes_;
+    ArrayView<detail::FlatNode> nodes_;
+
+    // Compact triangles of all leaves in bundles; the triangles of a leaf are
+    // stored in consecutive bundles. The bundles are used for intersecting a
+    // single ray, the compact triangles (of the ids in the bundles) for
+    // intersecting packets.
+    ArrayView<TriangleBundle> bundles_;
 };
 
 /**
  * Wraps a KDTree and provides an interface for computing Ray-Triangle
  * intersection.
  */
-class KDTreeIntersection {
+class KDTreeIntersection : public Intersector {
 public:
     using TriangleId = KDTree::TriangleId;
-    using OptionalId = detail::OptionalId;
+    using Intersector::intersect;
+    using Intersector::intersect_packet;
+    using Intersector::occluded_packet;
 
-    explicit KDTreeIntersection(const KDTree& tree) : tree_(&tree) {}
+    /**
+     * @param tree         kd-tree to intersect
+     * @param sort_batches sort the rays of a batch before tracing them (cf.
+     *                     `intersect_batch`); off for callers, whose batches
+     *                     are coherent or sorted already
+     */
+    explicit KDTreeIntersection(const KDTree& tree, bool sort_batches = false)
+        : tree_(&tree)
+        , stack_(tree.height() + 1)
+        , packet_stack_(tree.height() + 1)
+        , sort_batches_(sort_batches) {}
 
-    const Triangle& operator[](const TriangleId id) const {
+    const Triangle& operator[](const TriangleId id) const override {
         return (*tree_)[id];
     }
-    const Triangle& at(const TriangleId id) const { return tree_->at(id); }
+    const Triangle& at(const TriangleId id) const override {
+        return tree_->at(id);
+    }
 
     /**
      * Cf. [HH11], Algorithm 2
      *
+     * The interval of the ray in a node is clipped to the closest hit found
+     * so far (initially ray.t_max), s.t. nodes behind it are skipped.
+     *
      * @param  ray   Ray for which the intersection will be computed
      * @param  r     distance from ray to triangle (if intersection
      *               exists)
      * @param  a, b  barycentric coordinates of the intersection point
      * @return       optional id of the triangle hit by the ray
      */
-    const OptionalId intersect(const Ray& ray, float& r, float& a, float& b);
+    const OptionalId intersect(const Ray& ray, float& r, float& a,
+                               float& b) override;
 
-    const OptionalId intersect(const Ray& ray) {
-        float unused;
-        return intersect(ray, unused, unused, unused);
+    /**
+     * Test if any triangle is hit by the ray before t_max, e.g. for shadow
+     * rays and visibility tests.
+     *
+     * Contrary to `intersect`, the traversal terminates at the first
+     * triangle found, and nodes behind t_max are not visited at all.
+     *
+     * @param  ray   Ray to test
+     * @param  t_max maximum distance (in units of ray.d) of an occluder
+     * @return       true, if there is a triangle hit at distance < t_max
+     */
+    bool occluded(const Ray& ray, float t_max) override {
+        return static_cast<bool>(occluder(ray, t_max));
     }
 
+    /**
+     * Same traversal as `occluded`, which returns the triangle found.
+     *
+     * Cf. `Intersector::occluder`
+     */
+    const OptionalId occluder(const Ray& ray, float t_max) override;
+
+    /**
+     * Intersect a packet of coherent rays, e.g. primary rays of neighboring
+     * pixels.
+     *
+     * The rays are traversed together through the tree, and are tested at
+     * once (SSE) against the triangles in the leaves. Rays, which do not
+     * traverse a node, are masked out. If the signs of the directions of the
+     * rays differ, the rays are intersected one by one.
+     *
+     * The result is exactly the same as the one of `intersect` for each ray.
+     *
+     * @param  rays   packet of rays
+     * @param  active bit mask of the rays to intersect (bit i for rays[i]);
+     *                the hits of the other rays are invalid
+     * @return        hits of the rays
+     */
+    HitPacket intersect_packet(const RayPacket& rays,
+                               unsigned active) override;
+
+    /**
+     * Occlusion test (cf. `occluded`) for a packet of rays, e.g. visibility
+     * rays between two patches.
+     *
+     * The rays are traversed together (cf. `intersect_packet`). A ray is
+     * masked out as soon as an occluder is found for it, and the traversal
+     * terminates when all rays are occluded.
+     *
+     * @param  rays   packet of rays
+     * @param  t_max  maximum distance of an occluder per ray
+     * @param  active bit mask of the rays to test (bit i for rays[i])
+     * @return        bit mask of the active rays, which are occluded
+     */
+    unsigned occluded_packet(const RayPacket& rays,
+                             const std::array<float, PACKET_SIZE>& t_max,
+                             unsigned active) override;
+
+    /**
+     * If sorting batches is enabled (cf. the constructor), the rays of the
+     * batch are sorted by their octants and origins (cf. `ray_sort_key`),
+     * and are intersected in packets of consecutive rays in this order, s.t.
+     * incoherent rays, e.g. secondary rays, are traced together with rays
+     * traversing the same nodes. Otherwise, the rays are intersected in
+     * packets in the given order.
+     *
+     * Cf. `Intersector::intersect_batch`
+     */
+    void intersect_batch(ArrayView<Ray> rays,
+                         std::vector<Hit>& hits) override;
+
+    /**
+     * Cf. `intersect_batch` and `Intersector::occluded_batch`
+     */
+    void occluded_batch(ArrayView<Ray> rays, ArrayView<float> t_max,
+                        std::vector<uint8_t>& occluded) override;
+
 private:
-    // Helper method which intersects triangles from consecutive nodes (starting
-    // at node) until we reach an inner node.
+    // Sort the indices of the rays of a batch by their sort keys into
+    // batch_order_.
+    void sort_batch(ArrayView<Ray> rays);
+
+    // Helper method which intersects the triangles of a leaf. Only triangles
+    // hit at a distance < min_r are considered; min_r is updated only, if
+    // there is a hit.
     const OptionalId intersect(const detail::FlatNode* node, const Ray& ray,
                                float& min_r, float& min_s, float& min_t);
 
-private:
-    const KDTree* tree_;
-    std::stack<
-        std::tuple<const detail::FlatNode*, float /*tenter*/, float /*texit*/>>
-        stack_;
-};
+    // Helper method which tests the triangles of a leaf until it finds an
+    // occluder.
+    const OptionalId occluder(const detail::FlatNode* node, const Ray& ray,
+                              float t_max) const;
 
-// custom hash for OptionalId
-namespace std {
+private:
+    struct StackEntry {
+        const detail::FlatNode* node;
+        float tenter;
+        float texit;
+    };
+
+    // entry of the traversal stack of packets (one interval per ray)
+    struct PacketStackEntry {
+        alignas(16) float tenter[PACKET_SIZE];
+        alignas(16) float texit[PACKET_SIZE];
+        const detail::FlatNode* node;
+    };
 
-template <> struct hash<KDTreeIntersection::OptionalId> {
-    size_t operator()(const KDTreeIntersection::OptionalId& id) const {
-        return std::hash<detail::TriangleId>()(id.id_);
-    }
+    const KDTree* tree_;
+    // Traversal stack. At most one entry per level of the tree is pushed
+    // while descending, which allows to allocate the stack once upfront.
+    std::vector<StackEntry> stack_;
+    std::vector<PacketStackEntry> packet_stack_;
+    bool sort_batches_;
+    // sort keys and indices of the rays of a batch, reused between batches
+    std::vector<std::pair<uint32_t, uint32_t>> batch_order_;
 };
-
-} // namespace std
@@ -12,8 +12,8 @@
  * @param C Diffuse color information of surface.
  * @param I Intensity of light.
  */
-aiColor4D lambertian(const Vector3f& L, const Normal3f& N, const aiColor4D& C,
-                     const aiColor4D& I) {
+Color lambertian(const Vector3f& L, const Normal3f& N, const Color& C,
+                 const Color& I) {
     float cos_alpha = std::max(0.f, dot(L, N));
     return cos_alpha * C * I;
 }
@@ -1,7 +1,9 @@
 #pragma once
 
+#include <algorithm>
 #include <cassert>
 #include <cstddef>
+#include <cstdint>
 #include <initializer_list>
 #include <vector>
 
@@ -54,4 +56,73 @@ public:
 
     const Number& operator()(size_t index) const { return (*this)(index, 0); }
 };
+
+/**
+ * Sparse matrix in compressed sparse row (CSR) format.
+ *
+ * Only non-zero entries are stored. The matrix is built up row by row, and is
+ * immutable afterwards.
+ */
+template <typename Number> class SparseMatrix {
+public:
+    struct Entry {
+        uint32_t col;
+        Number value;
+    };
+
+    SparseMatrix(size_t rows, size_t cols) : rows_(rows), cols_(cols) {
+        row_offsets_.reserve(rows + 1);
+        row_offsets_.push_back(0);
+    }
+
+    size_t cols() const { return cols_; }
+
+    size_t rows() const { return rows_; }
+
+    size_t num_nonzeros() const { return entries_.size(); }
+
+    /**
+     * Append the next row.
+     *
+     * @param entries entries of the row sorted by column; zeros are skipped
+     */
+    void push_row(const std::vector<Entry>& entries) {
+        assert(row_offsets_.size() <= rows_ && "Too many rows.");
+        for (const auto& entry : entries) {
+            assert(entry.col < cols_ && "Column index out of range.");
+            assert((row_offsets_.back() == entries_.size() ||
+                    entries_.back().col < entry.col) &&
+                   "Entries are not sorted by column.");
+            if (entry.value != 0) {
+                entries_.push_back(entry);
+            }
+        }
+        row_offsets_.push_back(entries_.size());
+    }
+
+    // Non-zero entries of a row.
+    const Entry* row_begin(size_t row) const {
+        assert(row + 1 < row_offsets_.size() && "Row index out of range.");
+        return entries_.data() + row_offsets_[row];
+    }
+
+    const Entry* row_end(size_t row) const {
+        assert(row + 1 < row_offsets_.size() && "Row index out of range.");
+        return entries_.data() + row_offsets_[row + 1];
+    }
+
+    Number operator()(size_t row, size_t col) const {
+        assert(col < cols_ && "Column index out of range.");
+        auto it = std::lower_bound(
+            row_begin(row), row_end(row), col,
+            [](const Entry& entry, size_t col) { return entry.col < col; });
+        return it != row_end(row) && it->col == col ? it->value : Number{};
+    }
+
+private:
+    size_t rows_;
+    size_t cols_;
+    std::vector<size_t> row_offsets_;
+    std::vector<Entry> entries_;
+};
 } // namespace math
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "array_view.h"
 #include "functional.h"
 #include "triangle.h"
 #include "types.h"
@@ -8,8 +9,10 @@
 #include <OpenMesh/Core/Utils/PropertyManager.hh>
 
 #include <array>
+#include <cassert>
+#include <cstdint>
 #include <stack>
-#include <unordered_map>
+#include <vector>
 
 /**
  * Mesh type for storing hierarchical radiosity triangle subdivision.
@@ -79,56 +82,107 @@ auto find_vertex(const RadiosityMesh& mesh, RadiosityMesh::FaceHandle face,
     }
     return index;
 }
+
+/**
+ * Index of vertices given by their coordinates and normal.
+ *
+ * The index is an open addressing hash table with linear probing, storing
+ * 32-bit vertex ids in a flat array. Compared to a node-based map, a lookup
+ * touches mostly a single cache line and adding a vertex does not allocate.
+ */
+class VertexIndex {
+public:
+    static constexpr uint32_t INVALID_ID = 0xFFFFFFFF;
+
+    /**
+     * Index for at most `max_vertices` vertices.
+     */
+    explicit VertexIndex(size_t max_vertices) {
+        // keep the load factor at most 1/2
+        size_t capacity = 16;
+        while (capacity < 2 * max_vertices) {
+            capacity *= 2;
+        }
+        slots_.assign(capacity, INVALID_ID);
+        points_.reserve(max_vertices);
+        normals_.reserve(max_vertices);
+    }
+
+    /**
+     * Id of the vertex; the vertex is added with the next id, if it is new.
+     */
+    uint32_t add(const Point3f& p, const Normal3f& n) {
+        const size_t mask = slots_.size() - 1;
+        size_t seed = 0;
+        hash_combine(seed, p, n);
+        for (size_t slot = seed & mask;; slot = (slot + 1) & mask) {
+            const uint32_t id = slots_[slot];
+            if (id == INVALID_ID) {
+                assert(points_.size() < slots_.size() / 2);
+                slots_[slot] = points_.size();
+                points_.push_back(p);
+                normals_.push_back(n);
+                return slots_[slot];
+            }
+            if (points_[id] == p && normals_[id] == n) {
+                return id;
+            }
+        }
+    }
+
+    size_t size() const { return points_.size(); }
+
+    /**
+     * Coordinates of the vertices by id.
+     */
+    const std::vector<Point3f>& points() const { return points_; }
+
+private:
+    std::vector<uint32_t> slots_;
+    std::vector<Point3f> points_;
+    std::vector<Normal3f> normals_;
+};
 } // namespace detail
 
-// TODO: test
 /**
  * Build RadiosityMesh from a set of triangles.
+ *
+ * Corners with equal coordinates and normals are merged into one vertex.
+ * Vertex ids are computed first, s.t. the vertex and face arrays of the mesh
+ * can be allocated up front.
+ *
  * @param  triangles The set of triangles, to build the mesh from.
  * @return           RadiosityMesh, with faces corresponging to given
  *                   triangles. A face id corresponds exactly to the position
  *                   of the corresponding triangle.
  */
-auto build_mesh(const Triangles& triangles) {
-    RadiosityMesh mesh;
-    // a vertex is uniquely determined by its coordinates and a normal
-    std::unordered_map<std::pair<Point3f, Normal3f>,
-                       RadiosityMesh::VertexHandle>
-        lookup;
+auto build_mesh(ArrayView<Triangle> triangles) {
+    const size_t num_corners = 3 * triangles.size();
+    assert(num_corners < detail::VertexIndex::INVALID_ID);
 
-    auto corners_prop =
-        CornerVerticesProperty::createIfNotExists(mesh, "corner_vertices");
-
-    std::array<RadiosityMesh::VertexHandle, 3> vhandles;
+    // a vertex is uniquely determined by its coordinates and a normal
+    detail::VertexIndex index(num_corners);
+    std::vector<uint32_t> corner_ids;
+    corner_ids.reserve(num_corners);
     for (const auto& tri : triangles) {
-        const Point3f& a = tri.vertices[0];
-        const Point3f& b = tri.vertices[1];
-        const Point3f& c = tri.vertices[2];
-        const Normal3f& na = tri.normals[0];
-        const Normal3f& nb = tri.normals[1];
-        const Normal3f& nc = tri.normals[2];
-
-        auto ita = lookup.emplace(std::make_pair(a, na),
-                                  RadiosityMesh::VertexHandle());
-        RadiosityMesh::VertexHandle& va = ita.first->second;
-        if (ita.second) {
-            va = mesh.add_vertex({a.x, a.y, a.z});
-        }
-
-        auto itb = lookup.emplace(std::make_pair(b, nb),
-                                  RadiosityMesh::VertexHandle());
-        RadiosityMesh::VertexHandle& vb = itb.first->second;
-        if (itb.second) {
-            vb = mesh.add_vertex({b.x, b.y, b.z});
+        for (size_t i = 0; i < 3; ++i) {
+            corner_ids.push_back(index.add(tri.vertices[i], tri.normals[i]));
         }
+    }
 
-        auto itc = lookup.emplace(std::make_pair(c, nc),
-                                  RadiosityMesh::VertexHandle());
-        RadiosityMesh::VertexHandle& vc = itc.first->second;
-        if (itc.second) {
-            vc = mesh.add_vertex({c.x, c.y, c.z});
-        }
+    RadiosityMesh mesh;
+    // Every triangle has at most 3 edges of its own.
+    mesh.reserve(index.size(), num_corners, triangles.size());
+    auto corners_prop =
+        CornerVerticesProperty::createIfNotExists(mesh, "corner_vertices");
 
+    for (const auto& p : index.points()) {
+        mesh.add_vertex({p.x, p.y, p.z});
+    }
+    for (size_t i = 0; i < num_corners; i += 3) {
+        RadiosityMesh::VertexHandle va(corner_ids[i]);
+        RadiosityMesh::VertexHandle vb(corner_ids[i + 1]);
+        RadiosityMesh::VertexHandle vc(corner_ids[i + 2]);
         auto face = mesh.add_face(va, vb, vc);
         corners_prop[face] = {va, vb, vc};
     }
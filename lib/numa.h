@@ -0,0 +1,271 @@
+/**
+ * NUMA-aware placement of the worker threads and of the kd-tree (cf. --numa
+ * of the tracers).
+ *
+ * The workers of a thread pool are pinned to the CPUs of the NUMA nodes, node
+ * after node, i.e. the workers fill the first node before they spill to the
+ * next one. Hence, --threads with the number of CPUs of 1, 2, ... nodes
+ * renders on 1, 2, ... sockets. Every node used by the workers gets a replica
+ * of the kd-tree in its own memory, and a worker traverses the replica of its
+ * node instead of the remote memory, where the tree was built.
+ *
+ * The topology is read from sysfs, i.e. pinning is only supported on Linux.
+ * Elsewhere, there is a single node, and the workers are not pinned.
+ */
+
+#pragma once
+
+#include <ThreadPool.h>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <condition_variable>
+#include <cstddef>
+#include <fstream>
+#include <future>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace numa {
+
+/**
+ * Parse a list of CPUs in the format of sysfs, e.g. "0-3,8,10-11".
+ *
+ * @throw std::runtime_error, if the list is malformed
+ */
+inline std::vector<int> parse_cpu_list(const std::string& list) {
+    std::vector<int> cpus;
+    std::istringstream is(list);
+    std::string range;
+    while (std::getline(is, range, ',')) {
+        range.erase(std::remove_if(range.begin(), range.end(), ::isspace),
+                    range.end());
+        if (range.empty()) {
+            continue;
+        }
+        try {
+            const size_t dash = range.find('-');
+            const int first = std::stoi(range.substr(0, dash));
+            const int last = dash == std::string::npos
+                                 ? first
+                                 : std::stoi(range.substr(dash + 1));
+            if (first < 0 || last < first) {
+                throw std::invalid_argument(range);
+            }
+            for (int cpu = first; cpu <= last; ++cpu) {
+                cpus.push_back(cpu);
+            }
+        } catch (const std::logic_error&) {
+            throw std::runtime_error("invalid CPU list: " + list);
+        }
+    }
+    return cpus;
+}
+
+/**
+ * CPUs of the NUMA nodes of the machine.
+ */
+struct Topology {
+    // CPUs of node i at index i; every node has at least one CPU
+    std::vector<std::vector<int>> node_cpus;
+
+    size_t num_nodes() const { return node_cpus.size(); }
+
+    /**
+     * Read the online nodes from the sysfs directory, i.e. the nodes listed
+     * in "online", whose ids need not be consecutive (e.g. "0,2"). Nodes
+     * without CPUs are skipped. Without any node, e.g. on a system without
+     * sysfs, there is a single node with the CPUs 0, ..., n - 1.
+     */
+    static Topology read(const std::string& dirname =
+                             "/sys/devices/system/node") {
+        Topology topology;
+        std::ifstream online(dirname + "/online");
+        std::string nodes;
+        if (online && std::getline(online, nodes)) {
+            // the node ids have the same format as CPU lists
+            for (int node : parse_cpu_list(nodes)) {
+                std::ifstream file(dirname + "/node" + std::to_string(node) +
+                                   "/cpulist");
+                std::string list;
+                if (!file || !std::getline(file, list)) {
+                    continue;
+                }
+                auto cpus = parse_cpu_list(list);
+                if (!cpus.empty()) {
+                    topology.node_cpus.push_back(std::move(cpus));
+                }
+            }
+        }
+        if (topology.node_cpus.empty()) {
+            std::vector<int> cpus(
+                std::max(1u, std::thread::hardware_concurrency()));
+            for (size_t cpu = 0; cpu < cpus.size(); ++cpu) {
+                cpus[cpu] = cpu;
+            }
+            topology.node_cpus.push_back(std::move(cpus));
+        }
+        return topology;
+    }
+
+    /**
+     * Topology of this machine, which is read once.
+     */
+    static const Topology& system() {
+        static const Topology topology = read();
+        return topology;
+    }
+
+    /**
+     * Node and CPU of the worker: the workers fill the nodes one after
+     * another. More workers than CPUs start over at the first node.
+     */
+    size_t worker_node(size_t worker) const {
+        return worker_slot(worker).first;
+    }
+    int worker_cpu(size_t worker) const {
+        const auto slot = worker_slot(worker);
+        return node_cpus[slot.first][slot.second];
+    }
+
+    /**
+     * Number of nodes, which the workers of a pool run on, i.e. the nodes
+     * 0, ..., n - 1.
+     */
+    size_t num_worker_nodes(size_t num_threads) const {
+        size_t num_nodes = 0;
+        for (size_t worker = 0; worker < num_threads; ++worker) {
+            num_nodes = std::max(num_nodes, worker_node(worker) + 1);
+        }
+        return num_nodes;
+    }
+
+private:
+    std::pair<size_t, size_t> worker_slot(size_t worker) const {
+        assert(!node_cpus.empty());
+        size_t num_cpus = 0;
+        for (const auto& cpus : node_cpus) {
+            num_cpus += cpus.size();
+        }
+        worker %= num_cpus;
+        size_t node = 0;
+        while (node_cpus[node].size() <= worker) {
+            worker -= node_cpus[node].size();
+            node += 1;
+        }
+        return {node, worker};
+    }
+};
+
+namespace detail {
+inline size_t& current_node() {
+    static thread_local size_t node = 0;
+    return node;
+}
+} // namespace detail
+
+/**
+ * Node of the calling thread, which is set by pinning the thread. Threads,
+ * which are not pinned, are on node 0.
+ */
+inline size_t current_node() { return detail::current_node(); }
+
+/**
+ * Pin the calling thread to the CPUs, and make it belong to the node.
+ *
+ * @return false, if the thread could not be pinned, e.g. not on Linux; the
+ *         thread still belongs to the node
+ */
+inline bool pin_thread(const std::vector<int>& cpus, size_t node) {
+    detail::current_node() = node;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        if (cpu < CPU_SETSIZE) {
+            CPU_SET(cpu, &set);
+        }
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)cpus;
+    return false;
+#endif
+}
+
+/**
+ * Pin every worker of the pool to its CPU of the topology (cf.
+ * `Topology::worker_cpu`). Every worker runs exactly one of the pinning tasks,
+ * since they wait for each other.
+ *
+ * @param num_threads number of threads of the pool, which must be idle
+ * @return            false, if a worker could not be pinned
+ */
+inline bool pin_workers(ThreadPool& pool, size_t num_threads,
+                        const Topology& topology) {
+    std::mutex mutex;
+    std::condition_variable all_started;
+    size_t num_started = 0;
+
+    std::vector<std::future<bool>> pinned;
+    for (size_t i = 0; i < num_threads; ++i) {
+        pinned.emplace_back(pool.enqueue([&]() {
+            size_t worker;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                worker = num_started++;
+                if (num_started == num_threads) {
+                    all_started.notify_all();
+                } else {
+                    all_started.wait(
+                        lock, [&]() { return num_started == num_threads; });
+                }
+            }
+            return pin_thread({topology.worker_cpu(worker)},
+                              topology.worker_node(worker));
+        }));
+    }
+    bool all_pinned = true;
+    for (auto& result : pinned) {
+        all_pinned = result.get() && all_pinned;
+    }
+    return all_pinned;
+}
+
+/**
+ * Replicate an object on the first nodes of the topology: the replica of
+ * node i is created by `replicate()` on a thread pinned to the CPUs of the
+ * node, s.t. its memory is first touched on the node.
+ *
+ * @param num_nodes number of nodes, which get a replica
+ * @return          replica of node i at index i
+ */
+template <typename Replicate>
+auto replicate_per_node(const Topology& topology, size_t num_nodes,
+                        Replicate replicate)
+    -> std::vector<decltype(replicate())> {
+    assert(num_nodes <= topology.num_nodes());
+    std::vector<std::future<decltype(replicate())>> futures;
+    for (size_t node = 0; node < num_nodes; ++node) {
+        futures.push_back(std::async(std::launch::async, [&, node]() {
+            pin_thread(topology.node_cpus[node], node);
+            return replicate();
+        }));
+    }
+    std::vector<decltype(replicate())> replicas;
+    for (auto& future : futures) {
+        replicas.push_back(future.get());
+    }
+    return replicas;
+}
+
+} // namespace numa
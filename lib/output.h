@@ -8,6 +8,8 @@
 
 #include <iomanip>
 #include <ostream>
+#include <sstream>
+#include <string>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
@@ -22,7 +24,7 @@ inline std::ostream& operator<<(std::ostream& os, const aiColor3D& c) {
     return os << "Color(" << c.r << ", " << c.g << ", " << c.b << ")";
 }
 
-inline std::ostream& operator<<(std::ostream& os, const aiColor4D& c) {
+inline std::ostream& operator<<(std::ostream& os, const Color& c) {
     return os << "Color(" << c.r << ", " << c.g << ", " << c.b << ", " << c.a
               << ")";
 }
@@ -98,18 +100,95 @@ inline std::ostream& operator<<(std::ostream& os, const aiCamera& cam) {
               << "mUp=" << cam.mUp << ")";
 }
 
+/**
+ * Format the non-empty buckets of the samples per pixel distribution as
+ * " [min, max]: number of pixels" each.
+ */
+inline std::string samples_histogram(const Stats& stats) {
+    std::ostringstream os;
+    for (size_t k = 0; k < Stats::NUM_SAMPLES_BUCKETS; ++k) {
+        const size_t num_pixels = stats.pixels_by_samples[k].value();
+        if (num_pixels == 0) {
+            continue;
+        }
+        os << " [" << (size_t(1) << k) << ", " << (size_t(2) << k) - 1
+           << "]: " << num_pixels;
+    }
+    return os.str();
+}
+
+/**
+ * Format the rays per second (of a single thread) of every bounce of the
+ * wavefront path tracer as " depth: rays/sec" each; the last bucket is
+ * formatted as " depth+".
+ */
+inline std::string bounce_throughput(const Stats& stats) {
+    std::ostringstream os;
+    for (size_t k = 0; k < Stats::NUM_BOUNCE_BUCKETS; ++k) {
+        const size_t num_rays = stats.rays_by_bounce[k].value();
+        const size_t trace_ns = stats.trace_ns_by_bounce[k].value();
+        if (num_rays == 0 || trace_ns == 0) {
+            continue;
+        }
+        os << " " << k << (k + 1 == Stats::NUM_BOUNCE_BUCKETS ? "+" : "")
+           << ": " << static_cast<size_t>(1e9 * num_rays / trace_ns);
+    }
+    return os.str();
+}
+
+/**
+ * Format the hits of the occluder cache as " hits / tests (rate %)".
+ */
+inline std::string occluder_cache_hits(const Stats& stats) {
+    const size_t num_tests = stats.occluder_cache_tests.value();
+    const size_t num_hits = stats.occluder_cache_hits.value();
+    std::ostringstream os;
+    os << " " << num_hits << " / " << num_tests;
+    if (num_tests > 0) {
+        os << " (" << 100.0 * num_hits / num_tests << " %)";
+    }
+    return os.str();
+}
+
+/**
+ * Format the resources of every stage as lines
+ * "  name: wall sec, CPU sec, peak RSS MiB, heap MiB".
+ */
+inline std::string stages_table(const Stats& stats) {
+    std::ostringstream os;
+    for (const auto& stage : stats.stages()) {
+        os << std::endl
+           << "  " << std::left << std::setw(13) << stage.name << ": "
+           << stage.wall_ms / 1000 << " sec, " << stage.cpu_ms / 1000
+           << " sec CPU, " << 1.0 * stage.peak_rss_bytes / (1 << 20)
+           << " MiB peak RSS, " << 1.0 * stage.heap_bytes / (1 << 20)
+           << " MiB heap";
+    }
+    return os.str();
+}
+
 inline std::ostream& operator<<(std::ostream& os, const Stats& stats) {
+    // aggregate the sharded counters only once
+    const size_t num_rays = stats.num_rays.value();
     return os << "Triangles      : " << stats.num_triangles << std::endl
               << "Kd-Tree Height : " << stats.kdtree_height << std::endl
-              << "Rays           : " << stats.num_rays << std::endl
-              << "Rays (primary) : " << stats.num_prim_rays << std::endl
+              << "Kd-Tree Build  : " << stats.kdtree_build_allocations
+              << " allocations, "
+              << 1.0 * stats.kdtree_build_peak_bytes / (1 << 20)
+              << " MiB peak" << std::endl
+              << "Rays           : " << num_rays << std::endl
+              << "Rays (primary) : " << stats.num_prim_rays.value() << std::endl
               << "Rays/sec       : "
-              << (stats.runtime_ms ? 1000 * stats.num_rays / stats.runtime_ms
-                                   : 0)
+              << (stats.runtime_ms ? 1000 * num_rays / stats.runtime_ms : 0)
               << std::endl
               << "Loading time   : " << 1.0 * stats.loading_time_ms / 1000
               << " sec" << std::endl
-              << "Rendering time : " << 1.0 * stats.runtime_ms / 1000 << " sec";
+              << "Rendering time : " << 1.0 * stats.runtime_ms / 1000 << " sec"
+              << std::endl
+              << "Samples/pixel  :" << samples_histogram(stats) << std::endl
+              << "Rays/sec/bounce:" << bounce_throughput(stats) << std::endl
+              << "Occluder cache :" << occluder_cache_hits(stats) << std::endl
+              << "Stages         :" << stages_table(stats);
 }
 
 template <typename X, typename Y>
@@ -10,7 +10,12 @@
 #include <chrono>
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
+#include <fstream>
 #include <iomanip>
+#include <mutex>
+#include <set>
+#include <stdexcept>
 #include <string>
 
 namespace turner {
@@ -18,31 +23,77 @@ namespace turner {
 namespace {
 
 struct ProfilerSample {
-    uint64_t state = 0; // hash table key
+    uint64_t state = 0; // hash table key (with thread)
+    int thread = 0;     // hash table key (with state)
     size_t count = 0;   // hash table value
 };
 
 __thread uint64_t profiler_state;
+__thread int profiler_thread = -1;
 static std::atomic<bool> profiler_running{false};
 static std::chrono::steady_clock::time_point profiler_start_time;
 
-static constexpr int profiler_samples_size = 256;
+static constexpr int profiler_samples_size = 4096;
 // static size hash table (cf. `get_profiler_samples_index`)
 static std::array<ProfilerSample, profiler_samples_size> profiler_samples;
 
+/**
+ * Index of a thread in the profiler results.
+ *
+ * The index is acquired on the first profile of the thread, and released when
+ * the thread exits. Indexes are reused, s.t. the workers of consecutive thread
+ * pools share the indexes.
+ */
+class ProfilerThread {
+public:
+    ProfilerThread() {
+        std::lock_guard<std::mutex> lock(mutex());
+        auto& free = free_indexes();
+        if (free.empty()) {
+            profiler_thread = num_indexes()++;
+        } else {
+            profiler_thread = *free.begin();
+            free.erase(free.begin());
+        }
+    }
+
+    ~ProfilerThread() {
+        std::lock_guard<std::mutex> lock(mutex());
+        free_indexes().insert(profiler_thread);
+        profiler_thread = -1;
+    }
+
+private:
+    static std::mutex& mutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
+    static std::set<int>& free_indexes() {
+        static std::set<int> indexes;
+        return indexes;
+    }
+    static int& num_indexes() {
+        static int num = 0;
+        return num;
+    }
+};
+
 /**
  * Return the index of the bucket in the hash table.
  *
  * The collision resolution strategy is to go to the next bucket on collision.
  *
- * @param  state key
+ * @param  state  key
+ * @param  thread key
  * @return index of the bucket in the hash table.
  */
-size_t get_profiler_samples_index(uint64_t state) {
-    uint64_t i = std::hash<uint64_t>{}(state) % (profiler_samples_size - 1);
+size_t get_profiler_samples_index(uint64_t state, int thread) {
+    const uint64_t key = state ^ (static_cast<uint64_t>(thread) << 48);
+    uint64_t i = std::hash<uint64_t>{}(key) % (profiler_samples_size - 1);
     int num_visited = 0;
     while (num_visited < profiler_samples_size &&
-           profiler_samples[i].state != state &&
+           (profiler_samples[i].state != state ||
+            profiler_samples[i].thread != thread) &&
            profiler_samples[i].state != 0) {
         ++i;
         if (i == profiler_samples_size) {
@@ -64,8 +115,9 @@ void profiler_make_sample(int, siginfo_t*, void*) {
         return;
     }
 
-    uint64_t i = get_profiler_samples_index(profiler_state);
+    uint64_t i = get_profiler_samples_index(profiler_state, profiler_thread);
     profiler_samples[i].state = profiler_state;
+    profiler_samples[i].thread = profiler_thread;
     ++profiler_samples[i].count;
 }
 
@@ -100,6 +152,7 @@ void profiler_start() {
 void profiler_clear() {
     for (auto& ps : profiler_samples) {
         ps.state = 0;
+        ps.thread = 0;
         ps.count = 0;
     }
 }
@@ -123,23 +176,39 @@ std::chrono::seconds profiler_stop() {
     return std::chrono::duration_cast<std::chrono::seconds>(profiler_runtime);
 }
 
-Profile::Profile(ProfCategory category) : bit_(static_cast<size_t>(category)) {
-    profiler_state |= (1ull << bit_);
+Profile::Profile(ProfCategory category) : previous_state_(profiler_state) {
+    if (profiler_thread < 0) {
+        static thread_local ProfilerThread thread;
+    }
+    profiler_state |= (1ull << static_cast<size_t>(category));
 }
-Profile::~Profile() { profiler_state &= ~(1ull << bit_); }
+Profile::~Profile() { profiler_state = previous_state_; }
 
 ProfilerResults profiler_get_results() {
-    std::unordered_map<ProfCategory, size_t> data;
+    ProfilerResults res;
+    // Use `size` of categories to store the total number of samples.
+    res.category_counts[ProfCategory::size] = 0;
     for (const auto& ps : profiler_samples) {
-        // Use `size` of categories to store the total number of samples.
-        data[ProfCategory::size] += ps.count;
+        if (ps.count == 0) {
+            continue;
+        }
+        const size_t thread = ps.thread;
+        res.samples.push_back({thread, ps.state, ps.count});
+        if (res.thread_category_counts.size() <= thread) {
+            res.thread_category_counts.resize(thread + 1);
+        }
+
+        auto& thread_data = res.thread_category_counts[thread];
+        res.category_counts[ProfCategory::size] += ps.count;
+        thread_data[ProfCategory::size] += ps.count;
         for (size_t bit = 0; bit < 64; ++bit) {
             if (ps.state & (1ull << bit)) {
-                data[static_cast<ProfCategory>(bit)] += ps.count;
+                res.category_counts[static_cast<ProfCategory>(bit)] += ps.count;
+                thread_data[static_cast<ProfCategory>(bit)] += ps.count;
             }
         }
     }
-    return {data};
+    return res;
 }
 
 std::ostream& operator<<(std::ostream& os, const ProfilerResults& res) {
@@ -156,10 +225,73 @@ std::ostream& operator<<(std::ostream& os, const ProfilerResults& res) {
             ProfCategoryNames[static_cast<size_t>(kv.first)];
         const double category_percent = (100. * kv.second / total);
 
-        os << std::setw(20) << std::setfill(' ') << std::left << category_name
+        os << std::setw(24) << std::setfill(' ') << std::left << category_name
            << std::setw(7) << std::setfill(' ') << std::right << std::fixed
-           << std::setprecision(2) << category_percent << '%';
+           << std::setprecision(2) << category_percent << '%' << std::endl;
     }
     return os;
 }
+
+namespace {
+
+void write_json_counts(std::ostream& os,
+                       const std::unordered_map<ProfCategory, size_t>& counts) {
+    os << '{';
+    bool first = true;
+    for (size_t i = 0; i < static_cast<size_t>(ProfCategory::size); ++i) {
+        auto it = counts.find(static_cast<ProfCategory>(i));
+        if (it == counts.end()) {
+            continue;
+        }
+        os << (first ? "" : ", ") << '"' << ProfCategoryNames[i]
+           << "\": " << it->second;
+        first = false;
+    }
+    os << '}';
+}
+
+} // namespace
+
+void write_json(std::ostream& os, const ProfilerResults& res) {
+    auto it = res.category_counts.find(ProfCategory::size);
+    os << "{\"total\": "
+       << (it != res.category_counts.end() ? it->second : 0);
+    os << ", \"categories\": ";
+    write_json_counts(os, res.category_counts);
+    os << ", \"threads\": [";
+    for (size_t i = 0; i < res.thread_category_counts.size(); ++i) {
+        os << (i == 0 ? "" : ", ");
+        write_json_counts(os, res.thread_category_counts[i]);
+    }
+    os << "]}" << std::endl;
+}
+
+void write_folded(std::ostream& os, const ProfilerResults& res) {
+    for (const auto& sample : res.samples) {
+        os << "thread " << sample.thread;
+        for (size_t bit = 0; bit < static_cast<size_t>(ProfCategory::size);
+             ++bit) {
+            if (sample.state & (1ull << bit)) {
+                os << ';' << ProfCategoryNames[bit];
+            }
+        }
+        os << ' ' << sample.count << std::endl;
+    }
+}
+
+void write_profile(const std::string& filename, const ProfilerResults& res) {
+    std::ofstream file(filename);
+    const std::string json_ext = ".json";
+    if (filename.size() >= json_ext.size() &&
+        filename.compare(filename.size() - json_ext.size(), json_ext.size(),
+                         json_ext) == 0) {
+        write_json(file, res);
+    } else {
+        write_folded(file, res);
+    }
+    if (!file) {
+        throw std::runtime_error("could not write profile to " + filename);
+    }
+}
+
 } // namespace turner
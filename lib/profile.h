@@ -1,9 +1,12 @@
 #pragma once
 
 #include <chrono>
+#include <cstdint>
 #include <functional>
 #include <ostream>
+#include <string>
 #include <unordered_map>
+#include <vector>
 
 namespace turner {
 
@@ -15,15 +18,42 @@ namespace turner {
  *
  * Each start call should be accompanied by a stop call. Cf. `Profile` to enable
  * profiling for a specific category.
+ *
+ * Samples are recorded per thread. Only threads with an active category are
+ * sampled.
  */
 void profiler_start();
 void profiler_clear();
 std::chrono::seconds profiler_stop();
 
-enum class ProfCategory { Render, Trace, Intersect, SamplingHemisphere, size };
-static const char* ProfCategoryNames[]{"render", "trace()",
-                                       "KDTree::intersect()",
-                                       "sampling::hemisphere()", "total"};
+/**
+ * Profiling categories.
+ *
+ * Categories are nested in the order of their declaration, e.g. the samples of
+ * `Intersect` during `FormFactor` are reported as the stack
+ * `radiosity;form_factor();KDTree::intersect()`.
+ */
+enum class ProfCategory {
+    KDTreeBuild,
+    RadiositySolve,
+    FormFactor,
+    Render,
+    Trace,
+    Intersect,
+    SamplingHemisphere,
+    Output,
+    size
+};
+static const char* const ProfCategoryNames[]{
+    "kd-tree build",
+    "radiosity",
+    "form_factor()",
+    "render",
+    "trace()",
+    "KDTree::intersect()",
+    "sampling::hemisphere()",
+    "output",
+    "total"};
 static_assert(static_cast<size_t>(ProfCategory::size) <= 64,
               "too many profiling categories");
 
@@ -50,14 +80,55 @@ public:
     Profile& operator=(const Profile&) = delete;
 
 private:
-    size_t bit_;
+    // categories active before this one, s.t. nested profiles of the same
+    // category do not end the outer one
+    uint64_t previous_state_;
+};
+
+struct ProfilerSampleCount {
+    size_t thread;  // index of the thread (cf. `profiler_get_results`)
+    uint64_t state; // bit mask of the active categories
+    size_t count;
 };
 
 struct ProfilerResults {
+    // number of samples per category; the total number is at `size`
     std::unordered_map<ProfCategory, size_t> category_counts;
+    // category counts of every thread; threads are indexed in the order of
+    // their first profile, and indexes of exited threads are reused
+    std::vector<std::unordered_map<ProfCategory, size_t>>
+        thread_category_counts;
+    // number of samples per thread and set of active categories
+    std::vector<ProfilerSampleCount> samples;
 };
 
 ProfilerResults profiler_get_results();
 std::ostream& operator<<(std::ostream& os, const ProfilerResults& res);
 
+/**
+ * Write profiler results as JSON.
+ *
+ * ```
+ * {"total": 42, "categories": {"render": 40, ...},
+ *  "threads": [{"render": 20, ...}, ...]}
+ * ```
+ */
+void write_json(std::ostream& os, const ProfilerResults& res);
+
+/**
+ * Write profiler results as folded stacks, one line per thread and set of
+ * active categories, e.g. `thread 0;render;trace() 42`.
+ *
+ * This is the input format of flamegraph.pl.
+ */
+void write_folded(std::ostream& os, const ProfilerResults& res);
+
+/**
+ * Write profiler results to a file, as JSON if the filename ends with `.json`,
+ * otherwise as folded stacks.
+ *
+ * @throw std::runtime_error if the file could not be written
+ */
+void write_profile(const std::string& filename, const ProfilerResults& res);
+
 } // namespace turner
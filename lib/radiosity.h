@@ -3,9 +3,7 @@
 /**
  * Possible improvements of form factor computations:
  *
- * 1. tree.intersect can be replaced by a more performant visibility test
- * algorithm, which e.g. searches for the _first_ triangle between from and to
- * and not for the closest one, and which also tests first intersection with
+ * 1. The visibility test (tree.occluded) could first test intersection with
  * triangles from a given candidate list (if we have found a triangle between
  * from and to, then most probably the next sample ray will also hit it).
  *
@@ -17,10 +15,17 @@
  * 3. Use Poisson disk sampling.
  */
 
-#include "kdtree.h"
+#include "intersector.h"
 #include "mesh.h"
+#include "profile.h"
 #include "sampling.h"
 
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
 /**
  * Numerical integration of form factor from infinitesimal area to finite area.
  *
@@ -39,70 +44,134 @@
  * θ_i - angle between normal of x and vector to y (ω)
  * θ_j - angle between normal of y and vector to x (-ω)
  *
+ * The integral is estimated in batches of sample pairs (x, y). The samples of
+ * a batch are jittered on both triangles (cf. `sampling::stratified_square`),
+ * and the visibility of the pairs is tested with a batch of rays. The
+ * estimation stops as soon as the standard error of the batch means is small
+ * relative to their mean, or all batches of the first half are zero.
+ *
  * @note When the distance from i to j is small relative to the size of j, the
  *       result is inexact.
  *
  * @param  tree        Kd-tree used for determining V(x, y)
  * @param  from        Triangle i (does not need to be contained in tree)
- * @param  to          Triangle j (does not need to be container in tree, cf.
- *                     to_id)
- * @param  to_id       id of a triangle contained in tree, s.t. `to` is its
- *                     subtriangle
- * @param  num_samples Number of samples in Monte Carlo approximation, i.e.
- *                     number random tuples (x, y) s.t. x is on the triangle
- *                     `from` and y is on the triangle `to`.
+ * @param  to          Triangle j (does not need to be contained in tree, but
+ *                     it must not be occluded by the triangles containing it)
+ * @param  num_samples Maximum number of samples in Monte Carlo approximation,
+ *                     i.e. number random tuples (x, y) s.t. x is on the
+ *                     triangle `from` and y is on the triangle `to`.
+ * @param  tolerance   Standard error relative to the result, at which the
+ *                     estimation stops early
  * @return             form factor F_ij
  */
-inline float form_factor(KDTreeIntersection& tree, const Point3f& from_pos,
+inline float form_factor(Intersector& tree, const Point3f& from_pos,
                          const Vector3f& from_u, const Vector3f& from_v,
                          const Normal3f& from_normal, const Point3f& to_pos,
                          const Vector3f& to_u, const Vector3f& to_v,
                          const Normal3f& to_normal, const float to_area,
-                         const KDTree::TriangleId to_id,
-                         const size_t num_samples = 128) {
-    float result = 0;
-    for (size_t i = 0; i < num_samples; ++i) {
-        auto p1 = Point3f(sampling::triangle(from_pos, from_u, from_v));
-        auto p2 = Point3f(sampling::triangle(to_pos, to_u, to_v));
+                         const size_t num_samples = 128,
+                         const float tolerance = 0.01f) {
+    turner::Profile _(turner::ProfCategory::FormFactor);
+    constexpr size_t NUM_STRATA = 4; // per dimension
+    constexpr size_t BATCH_SIZE = NUM_STRATA * NUM_STRATA;
 
-        Vector3f v = p2 - p1;
-        if (tree.intersect({p1 + Vector3f(EPS * from_normal), v}) != to_id) {
-            continue;
+    const size_t num_batches =
+        std::max<size_t>(1, (num_samples + BATCH_SIZE - 1) / BATCH_SIZE);
+    const size_t min_batches = std::max<size_t>(2, num_batches / 2);
+
+    // visibility rays of the sample pairs of a batch with their geometry
+    // terms, which are tested together (cf. `Intersector::occluded_batch`)
+    std::vector<Ray> rays;
+    std::vector<float> t_max;
+    std::vector<float> G;
+    std::vector<uint8_t> occluded;
+    rays.reserve(BATCH_SIZE);
+    t_max.reserve(BATCH_SIZE);
+    G.reserve(BATCH_SIZE);
+
+    // sum of the batch means and of their squares
+    float sum = 0;
+    float sum_squares = 0;
+    size_t batch = 0;
+    while (batch < num_batches) {
+        auto from_samples = sampling::stratified_square<NUM_STRATA>();
+        auto to_samples = sampling::stratified_square<NUM_STRATA>();
+
+        rays.clear();
+        t_max.clear();
+        G.clear();
+        for (size_t k = 0; k < BATCH_SIZE; ++k) {
+            const auto& r = from_samples[k];
+            const auto& s = to_samples[k];
+            auto p1 = sampling::triangle(from_pos, from_u, from_v, r[0], r[1]);
+            auto p2 = sampling::triangle(to_pos, to_u, to_v, s[0], s[1]);
+
+            Vector3f v = p2 - p1;
+            float length_squared = v.length_squared();
+            if (length_squared == 0) {
+                continue;
+            }
+
+            float length = sqrt(length_squared);
+
+            float cos_theta1 = dot(v, from_normal) / length;
+            if (cos_theta1 <= 0) {
+                continue;
+            }
+
+            float cos_theta2 = dot(-v, to_normal) / length;
+            if (cos_theta2 <= 0) {
+                continue;
+            }
+
+            G.push_back(cos_theta1 * cos_theta2 /
+                        (PI * length_squared + to_area / num_samples));
+
+            // y is visible from x, if nothing is hit before reaching y
+            Point3f origin = p1 + Vector3f(EPS * from_normal);
+            rays.push_back(Ray(origin, p2 - origin));
+            t_max.push_back(1 - EPS);
         }
 
-        float length_squared = v.length_squared();
-        if (length_squared == 0) {
-            continue;
+        float batch_sum = 0;
+        if (!rays.empty()) {
+            tree.occluded_batch(rays, t_max, occluded);
+            for (size_t k = 0; k < rays.size(); ++k) {
+                if (!occluded[k]) {
+                    batch_sum += G[k];
+                }
+            }
         }
 
-        float length = sqrt(length_squared);
+        float batch_mean = batch_sum / BATCH_SIZE;
+        sum += batch_mean;
+        sum_squares += batch_mean * batch_mean;
+        batch += 1;
 
-        float cos_theta1 = dot(v, from_normal) / length;
-        if (cos_theta1 <= 0) {
+        if (batch < min_batches) {
             continue;
         }
-
-        float cos_theta2 = dot(-v, to_normal) / length;
-        if (cos_theta2 <= 0) {
-            continue;
+        float mean = sum / batch;
+        if (mean == 0) {
+            break;
+        }
+        float variance =
+            std::max(0.f, (sum_squares - batch * mean * mean) / (batch - 1));
+        if (std::sqrt(variance / batch) <= tolerance * mean) {
+            break;
         }
-
-        float G = cos_theta1 * cos_theta2 /
-                  (PI * length_squared + to_area / num_samples);
-        result += G;
     }
 
-    return result * to_area / num_samples;
+    return sum / batch * to_area;
 }
 
 /*
  * Same as above, with explicitly defined triangles.
  */
-inline float form_factor(KDTreeIntersection& tree, const Triangle& from,
-                         const Triangle& to, const KDTree::TriangleId to_id,
-                         const size_t num_samples = 128) {
+inline float form_factor(Intersector& tree, const Triangle& from,
+                         const Triangle& to, const size_t num_samples = 128) {
     return form_factor(tree, from.vertices[0], from.u, from.v, from.normal,
-                       to.vertices[0], to.u, to.v, to.normal, to.area(), to_id,
+                       to.vertices[0], to.u, to.v, to.normal, to.area(),
                        num_samples);
 }
 
@@ -110,15 +179,15 @@ inline float form_factor(KDTreeIntersection& tree, const Triangle& from,
  * Same as above, except the triangles are contained in tree and defined by
  * corresponding ids.
  */
-inline float form_factor(KDTreeIntersection& tree,
-                         const KDTree::TriangleId from_id,
-                         const KDTree::TriangleId to_id,
+inline float form_factor(Intersector& tree,
+                         const Intersector::TriangleId from_id,
+                         const Intersector::TriangleId to_id,
                          const size_t num_samples = 128) {
     assert(from_id != to_id);
     const auto& from = tree[from_id];
     const auto& to = tree[to_id];
 
-    return form_factor(tree, from, to, to_id, num_samples);
+    return form_factor(tree, from, to, num_samples);
 }
 
 /**
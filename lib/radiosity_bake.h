@@ -0,0 +1,109 @@
+/**
+ * Bake of a radiosity solution.
+ *
+ * Radiosity does not depend on the camera. Hence, the solution of a scene is
+ * computed once, written to a bake file, and every further view of the scene
+ * is only raycast with the radiosity of the bake.
+ *
+ * The file is a portable binary archive (cf. cereal) of a magic number, the
+ * version of the format and the bake.
+ */
+
+#pragma once
+
+#include "hierarchical.h"
+#include "types.h"
+
+#include <cereal/archives/portable_binary.hpp>
+#include <cereal/types/array.hpp>
+#include <cereal/types/vector.hpp>
+
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+struct RadiosityBake {
+    // key of the scene (cf. `KDTree::cache_key`)
+    uint64_t scene_key = 0;
+    // solver which computed the radiosity, and its parameters; the solution
+    // of other parameters is computed anew
+    uint32_t mode = 0;
+    std::vector<float> parameters;
+    // radiosity of the scene triangles (exact and progressive solver)
+    std::vector<Color> radiosity;
+    // refined mesh with its radiosity (hierarchical solver)
+    HierarchicalRadiosity::LeafMesh leaves;
+
+    bool matches(uint64_t scene_key, uint32_t mode,
+                 const std::vector<float>& parameters) const {
+        return this->scene_key == scene_key && this->mode == mode &&
+               this->parameters == parameters;
+    }
+
+    template <class Archive> void serialize(Archive& archive) {
+        archive(scene_key, mode, parameters, radiosity, leaves);
+    }
+};
+
+namespace detail {
+
+// Bump the version on any change of the format, or of the solvers, which
+// changes their solution.
+constexpr uint32_t BAKE_VERSION = 3;
+constexpr std::array<char, 8> BAKE_MAGIC = {
+    {'T', 'U', 'R', 'N', 'R', 'A', 'D', '\0'}};
+
+} // namespace detail
+
+/**
+ * Read a bake written by `write_bake`.
+ *
+ * @return false, if the file does not exist, or is not a bake of this version
+ */
+inline bool read_bake(const std::string& filename, RadiosityBake& bake) {
+    std::ifstream in(filename, std::ios::in | std::ios::binary);
+    if (!in) {
+        return false;
+    }
+    try {
+        cereal::PortableBinaryInputArchive archive(in);
+        std::array<char, 8> magic;
+        uint32_t version;
+        archive(magic, version);
+        if (magic != detail::BAKE_MAGIC || version != detail::BAKE_VERSION) {
+            return false;
+        }
+        archive(bake);
+    } catch (const cereal::Exception&) {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Write the bake to a file. The file is replaced at once, s.t. a concurrent
+ * `read_bake` does not see a partially written bake.
+ */
+inline void write_bake(const std::string& filename,
+                       const RadiosityBake& bake) {
+    const std::string tmp_filename = filename + ".tmp";
+    {
+        std::ofstream out(tmp_filename, std::ios::out | std::ios::binary);
+        {
+            cereal::PortableBinaryOutputArchive archive(out);
+            archive(detail::BAKE_MAGIC, detail::BAKE_VERSION, bake);
+        }
+        if (!out) {
+            throw std::runtime_error("could not write bake to " +
+                                     tmp_filename);
+        }
+    }
+    if (std::rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+        std::remove(tmp_filename.c_str());
+        throw std::runtime_error("could not write bake to " + filename);
+    }
+}
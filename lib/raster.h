@@ -1,10 +1,18 @@
 #pragma once
+#include "aligned_allocator.h"
 #include "types.h"
 
+#include <algorithm>
+#include <array>
 #include <assert.h>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <iomanip>
+#include <istream>
 #include <ostream>
+#include <stdexcept>
+#include <string>
 #include <vector>
 
 /**
@@ -59,6 +67,9 @@ public:
         return image_data_[y * width_ + x];
     }
 
+    Color* data() { return image_data_.data(); }
+    const Color* data() const { return image_data_.data(); }
+
     auto end() { return image_data_.end(); }
     auto begin() { return image_data_.begin(); }
 
@@ -71,6 +82,195 @@ private:
     std::vector<Color> image_data_;
 };
 
+namespace detail {
+
+/**
+ * Convert a float to IEEE 754 half precision with rounding to nearest even.
+ * Values beyond the range of half precision become infinite.
+ */
+inline uint16_t float_to_half(float f) {
+    uint32_t x;
+    std::memcpy(&x, &f, sizeof(x));
+    const uint16_t sign = (x >> 16) & 0x8000;
+    x &= 0x7FFFFFFF;
+
+    if (x >= 0x7F800000) { // infinity or NaN
+        return sign | 0x7C00 | (x > 0x7F800000 ? 0x200 : 0);
+    }
+    if (x >= 0x477FF000) { // rounds to 65520 or more
+        return sign | 0x7C00;
+    }
+    if (x < 0x33000000) { // rounds to 0, i.e. less or equal to 2^-25
+        return sign;
+    }
+
+    uint32_t h, rest, halfway;
+    if (x < 0x38800000) {
+        // subnormal half: the mantissa with the implicit bit in units of 2^-24
+        const uint32_t shift = 126 - (x >> 23);
+        const uint32_t mantissa = (x & 0x7FFFFF) | 0x800000;
+        h = mantissa >> shift;
+        rest = mantissa & ((1u << shift) - 1);
+        halfway = 1u << (shift - 1);
+    } else {
+        // rebias the exponent from 127 to 15
+        h = (x >> 13) - (112 << 10);
+        rest = x & 0x1FFF;
+        halfway = 0x1000;
+    }
+    // A carry into the exponent gives the next power of 2 (resp. the smallest
+    // normal number).
+    if (rest > halfway || (rest == halfway && (h & 1))) {
+        h += 1;
+    }
+    return sign | h;
+}
+
+inline float half_to_float(uint16_t h) {
+    const uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+    const uint32_t exponent = (h >> 10) & 0x1F;
+    const uint32_t mantissa = h & 0x3FF;
+
+    uint32_t x;
+    if (exponent == 0x1F) {
+        x = sign | 0x7F800000 | (mantissa << 13);
+    } else if (exponent == 0) {
+        const float f = std::ldexp(static_cast<float>(mantissa), -24);
+        return sign ? -f : f;
+    } else {
+        x = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    }
+    float f;
+    std::memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+} // namespace detail
+
+/**
+ * Color stored in half precision, e.g. for large frame buffers, which need
+ * half of the memory (and bandwidth) of `Color`.
+ */
+struct HalfColor {
+    HalfColor() : channels{{0, 0, 0, 0}} {}
+    explicit HalfColor(const Color& color)
+        : channels{{detail::float_to_half(color.r),
+                    detail::float_to_half(color.g),
+                    detail::float_to_half(color.b),
+                    detail::float_to_half(color.a)}} {}
+
+    explicit operator Color() const {
+        return {detail::half_to_float(channels[0]),
+                detail::half_to_float(channels[1]),
+                detail::half_to_float(channels[2]),
+                detail::half_to_float(channels[3])};
+    }
+
+    std::array<uint16_t, 4> channels;
+};
+
+/**
+ * Image stored in square tiles, e.g. the render target of tiled rendering
+ * (cf. tiles.h).
+ *
+ * The pixels of a tile are stored contiguously row by row, and every tile
+ * starts at a cache line. Hence, tasks writing disjoint tiles never write to
+ * the same cache line, and the task owning a tile accumulates samples into it
+ * without locks or atomics. The image is converted into a row-major `Image`
+ * by a separate pass (cf. `resolve`).
+ *
+ * @tparam Pixel storage of a pixel: `Color` or `HalfColor`
+ */
+template <typename Pixel = Color> class TiledImage {
+public:
+    TiledImage(size_t width, size_t height, size_t tile_size)
+        : width_(width)
+        , height_(height)
+        , tile_size_(tile_size)
+        , num_tiles_x_((width + tile_size - 1) / tile_size)
+        // round up to whole cache lines
+        , tile_stride_((tile_size * tile_size + PIXELS_PER_CACHE_LINE - 1) /
+                       PIXELS_PER_CACHE_LINE * PIXELS_PER_CACHE_LINE)
+        , pixels_(num_tiles_x_ * ((height + tile_size - 1) / tile_size) *
+                  tile_stride_) {
+        assert(0 < tile_size);
+    }
+
+    size_t width() const { return width_; }
+    size_t height() const { return height_; }
+    size_t tile_size() const { return tile_size_; }
+
+    Color operator()(size_t x, size_t y) const {
+        return static_cast<Color>(pixels_[index(x, y)]);
+    }
+
+    void set(size_t x, size_t y, const Color& color) {
+        pixels_[index(x, y)] = Pixel(color);
+    }
+
+    /**
+     * Add a sample to a pixel.
+     *
+     * Not synchronized: concurrent writers have to write disjoint tiles, e.g.
+     * the tiles of `make_tiles` with the same tile size.
+     */
+    void add(size_t x, size_t y, const Color& color) {
+        Pixel& pixel = pixels_[index(x, y)];
+        pixel = Pixel(static_cast<Color>(pixel) + color);
+    }
+
+    /**
+     * Reset all pixels to black, e.g. before the next pass.
+     */
+    void clear() { std::fill(pixels_.begin(), pixels_.end(), Pixel()); }
+
+    /**
+     * Convert the pixels [x0, x1) × [y0, y1) into the row-major image.
+     */
+    void resolve(size_t x0, size_t y0, size_t x1, size_t y1,
+                 Image& image) const {
+        assert(image.width() == width_ && image.height() == height_);
+        assert(x1 <= width_ && y1 <= height_);
+        for (size_t y = y0; y < y1; ++y) {
+            for (size_t x = x0; x < x1; ++x) {
+                image(x, y) = (*this)(x, y);
+            }
+        }
+    }
+
+    /**
+     * Row-major image of the pixels.
+     */
+    Image resolve() const {
+        Image image(width_, height_);
+        resolve(0, 0, width_, height_, image);
+        return image;
+    }
+
+private:
+    static_assert(64 % sizeof(Pixel) == 0,
+                  "pixels must not straddle cache lines");
+    static constexpr size_t PIXELS_PER_CACHE_LINE = 64 / sizeof(Pixel);
+
+    size_t index(size_t x, size_t y) const {
+        assert(x < width_ && "x out of image bounds");
+        assert(y < height_ && "y out of image bounds");
+        const size_t tile_x = x / tile_size_;
+        const size_t tile_y = y / tile_size_;
+        const size_t tile = tile_y * num_tiles_x_ + tile_x;
+        return tile * tile_stride_ +
+               (y - tile_y * tile_size_) * tile_size_ + x -
+               tile_x * tile_size_;
+    }
+
+    size_t width_;
+    size_t height_;
+    size_t tile_size_;
+    size_t num_tiles_x_;
+    size_t tile_stride_; // number of pixels from one tile to the next
+    std::vector<Pixel, AlignedAllocator<Pixel, 64>> pixels_;
+};
+
 /**
  * Output image in PBM format.
  *
@@ -98,3 +298,193 @@ inline std::ostream& operator<<(std::ostream& os, const Image& img) {
 
     return os;
 }
+
+/**
+ * Output formats of images.
+ *
+ * PPM_ASCII  PPM with ASCII data (P3), cf. `operator<<`
+ * PPM        PPM with binary 8-bit data (P6)
+ * PFM        Portable float map with 32-bit float data, i.e. HDR colors are
+ *            written without clamping and quantization
+ */
+enum class ImageFormat { PPM_ASCII, PPM, PFM };
+
+inline ImageFormat parse_image_format(const std::string& format) {
+    if (format == "ppm-ascii") {
+        return ImageFormat::PPM_ASCII;
+    } else if (format == "ppm") {
+        return ImageFormat::PPM;
+    } else if (format == "pfm") {
+        return ImageFormat::PFM;
+    }
+    throw std::runtime_error("unknown image format: " + format);
+}
+
+inline const char* to_string(ImageFormat format) {
+    switch (format) {
+    case ImageFormat::PPM_ASCII:
+        return "ppm-ascii";
+    case ImageFormat::PPM:
+        return "ppm";
+    case ImageFormat::PFM:
+        return "pfm";
+    }
+    return "";
+}
+
+/**
+ * Output image in binary PPM format (P6).
+ *
+ * The pixels are converted in one go into a buffer, which is written at once.
+ */
+inline void write_ppm(std::ostream& os, const Image& img) {
+    os << "P6\n" << img.width() << " " << img.height() << "\n255\n";
+
+    std::vector<uint8_t> data(3 * img.width() * img.height());
+    uint8_t* out = data.data();
+    for (const auto& color : img) {
+        *out++ = static_cast<uint8_t>(clamp(255 * color.r * color.a));
+        *out++ = static_cast<uint8_t>(clamp(255 * color.g * color.a));
+        *out++ = static_cast<uint8_t>(clamp(255 * color.b * color.a));
+    }
+    os.write(reinterpret_cast<const char*>(data.data()), data.size());
+}
+
+/**
+ * Output image in PFM format (color, 32-bit floats in native byte order).
+ *
+ * Cf. http://netpbm.sourceforge.net/doc/pfm.html. Note that PFM stores the
+ * rows from bottom to top.
+ */
+inline void write_pfm(std::ostream& os, const Image& img) {
+    const uint16_t byte_order_mark = 1;
+    uint8_t first_byte;
+    std::memcpy(&first_byte, &byte_order_mark, 1);
+    const bool little_endian = first_byte == 1;
+    os << "PF\n"
+       << img.width() << " " << img.height() << "\n"
+       << (little_endian ? "-1.0" : "1.0") << "\n";
+
+    std::vector<float> data(3 * img.width() * img.height());
+    float* out = data.data();
+    for (size_t y = img.height(); y-- > 0;) {
+        for (size_t x = 0; x < img.width(); ++x) {
+            const auto& color = img(x, y);
+            *out++ = color.r * color.a;
+            *out++ = color.g * color.a;
+            *out++ = color.b * color.a;
+        }
+    }
+    os.write(reinterpret_cast<const char*>(data.data()),
+             data.size() * sizeof(float));
+}
+
+inline void write_image(std::ostream& os, const Image& img,
+                        ImageFormat format) {
+    switch (format) {
+    case ImageFormat::PPM_ASCII:
+        os << img << std::endl;
+        break;
+    case ImageFormat::PPM:
+        write_ppm(os, img);
+        break;
+    case ImageFormat::PFM:
+        write_pfm(os, img);
+        break;
+    }
+    os.flush();
+}
+
+/**
+ * Sums of the samples of every pixel, e.g. accumulated by the passes of a
+ * progressive rendering. Every pass adds one sample to each pixel.
+ */
+class AccumulationBuffer {
+public:
+    AccumulationBuffer(const size_t width, const size_t height)
+        : sums_(width, height) {}
+
+    size_t width() const { return sums_.width(); }
+    size_t height() const { return sums_.height(); }
+    size_t num_passes() const { return num_passes_; }
+
+    /**
+     * Add a pass, i.e. an image with one sample per pixel of the same size.
+     */
+    void add(const Image& pass) {
+        assert(pass.width() == width() && pass.height() == height());
+        auto sum = sums_.begin();
+        for (const auto& color : pass) {
+            *sum++ += color;
+        }
+        num_passes_ += 1;
+    }
+
+    /**
+     * Add the passes of another buffer of the same size, e.g. rendered on
+     * another node.
+     */
+    void merge(const AccumulationBuffer& other) {
+        assert(other.width() == width() && other.height() == height());
+        auto sum = sums_.begin();
+        for (const auto& color : other.sums_) {
+            *sum++ += color;
+        }
+        num_passes_ += other.num_passes_;
+    }
+
+    /**
+     * Mean of the samples of every pixel.
+     */
+    Image mean() const {
+        Image result(width(), height());
+        if (num_passes_ == 0) {
+            return result;
+        }
+        auto out = result.begin();
+        for (const auto& sum : sums_) {
+            *out++ = sum / num_passes_;
+        }
+        return result;
+    }
+
+    /**
+     * Write the buffer in a binary format (native byte order), which is read
+     * by `read`.
+     */
+    void write(std::ostream& os) const {
+        os << "TACC\n"
+           << width() << " " << height() << " " << num_passes_ << "\n";
+        static_assert(sizeof(Color) == 4 * sizeof(float),
+                      "colors must be stored as 4 floats");
+        os.write(reinterpret_cast<const char*>(&*sums_.begin()),
+                 width() * height() * sizeof(Color));
+    }
+
+    /**
+     * Read a buffer written by `write`.
+     *
+     * @throws std::runtime_error if the data is malformed
+     */
+    static AccumulationBuffer read(std::istream& is) {
+        std::string magic;
+        size_t width = 0, height = 0, num_passes = 0;
+        is >> magic >> width >> height >> num_passes;
+        if (!is || magic != "TACC" || is.get() != '\n') {
+            throw std::runtime_error("malformed accumulation buffer");
+        }
+
+        AccumulationBuffer buffer(width, height);
+        buffer.num_passes_ = num_passes;
+        is.read(reinterpret_cast<char*>(&*buffer.sums_.begin()),
+                width * height * sizeof(Color));
+        if (!is) {
+            throw std::runtime_error("truncated accumulation buffer");
+        }
+        return buffer;
+    }
+
+private:
+    Image sums_;
+    size_t num_passes_ = 0;
+};
@@ -0,0 +1,249 @@
+/**
+ * Samplers generating the random numbers of pixel samples.
+ *
+ * A sample of a pixel is a point in the unit hypercube, e.g. its first two
+ * dimensions jitter the primary ray, and the following ones are consumed by
+ * the hemisphere and light samples along the path. The numbers of a sample
+ * only depend on the pixel, the index of the sample and the dimension. Hence,
+ * an image is the same, no matter which thread renders which pixel.
+ */
+
+#pragma once
+
+#include "xorshift.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+enum class SamplerType {
+    // independent uniform random numbers
+    RANDOM,
+    // Owen-scrambled Sobol points, scrambled independently per pixel
+    SOBOL,
+    // Owen-scrambled Sobol points, scrambled the same way in all pixels and
+    // shifted per pixel by a dither mask, s.t. the error is distributed as
+    // blue noise over the image
+    BLUE_NOISE,
+};
+
+inline SamplerType parse_sampler_type(const std::string& type) {
+    if (type == "random") {
+        return SamplerType::RANDOM;
+    } else if (type == "sobol") {
+        return SamplerType::SOBOL;
+    } else if (type == "blue-noise") {
+        return SamplerType::BLUE_NOISE;
+    }
+    throw std::runtime_error("unknown sampler: " + type);
+}
+
+inline const char* to_string(SamplerType type) {
+    switch (type) {
+    case SamplerType::RANDOM:
+        return "random";
+    case SamplerType::SOBOL:
+        return "sobol";
+    case SamplerType::BLUE_NOISE:
+        return "blue-noise";
+    }
+    return "";
+}
+
+class Sampler {
+public:
+    virtual ~Sampler() = default;
+
+    /**
+     * Start a sample of a pixel. The following calls of `next` return its
+     * dimensions `dimension`, `dimension + 1`, ...
+     *
+     * @param x, y      pixel
+     * @param index     index of the sample in the pixel
+     * @param dimension first dimension to return, e.g. to continue a sample
+     */
+    virtual void start_sample(uint32_t x, uint32_t y, uint32_t index,
+                              uint32_t dimension) = 0;
+
+    /**
+     * Next dimension of the current sample in [0, 1).
+     */
+    virtual float next() = 0;
+
+    std::array<float, 2> next_2d() {
+        const float u1 = next();
+        const float u2 = next();
+        return {{u1, u2}};
+    }
+};
+
+namespace detail {
+
+// Finalizer of SplitMix64
+inline uint64_t mix(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+inline uint64_t hash(uint64_t seed) { return mix(seed); }
+
+template <typename... Ts> uint64_t hash(uint64_t seed, uint64_t v, Ts... vs) {
+    return hash(mix(seed ^ (v + 0x9E3779B97F4A7C15ULL)), vs...);
+}
+
+inline uint32_t reverse_bits(uint32_t x) {
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+    x = ((x >> 8) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+/**
+ * Owen scrambling of the bits of x, i.e. a random permutation of every
+ * elementary interval, which keeps the stratification of a point set.
+ *
+ * Cf. [Bur20] B. Burley, Practical Hash-based Owen Scrambling, JCGT 2020.
+ */
+inline uint32_t owen_scramble(uint32_t x, uint32_t seed) {
+    // Laine-Karras permutation of the reversed bits
+    x = reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6C50B47Cu;
+    x ^= x * 0xB82F1E52u;
+    x ^= x * 0xC7AFE638u;
+    x ^= x * 0x8D22F6E6u;
+    return reverse_bits(x);
+}
+
+/**
+ * The first two dimensions of the Sobol sequence in 0.32 fixed point.
+ */
+inline uint32_t sobol(uint32_t index, uint32_t dimension) {
+    if (dimension == 0) {
+        return reverse_bits(index);
+    }
+    // direction numbers of the primitive polynomial x + 1
+    uint32_t x = 0;
+    for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1) {
+        if (index & 1) {
+            x ^= v;
+        }
+    }
+    return x;
+}
+
+inline float to_unit_float(uint32_t x) {
+    // the upper 24 bits are exactly representable, i.e. x < 1
+    return (x >> 8) * (1.f / (1 << 24));
+}
+
+} // namespace detail
+
+/**
+ * Independent uniform random numbers per pixel sample.
+ */
+class RandomSampler : public Sampler {
+public:
+    explicit RandomSampler(uint64_t seed = 0) : seed_(seed), gen_(1) {}
+
+    void start_sample(uint32_t x, uint32_t y, uint32_t index,
+                      uint32_t dimension) override {
+        // xorshift needs a non-zero seed
+        gen_ = xorshift64star<float>(detail::hash(seed_, x, y, index) | 1);
+        while (dimension--) {
+            gen_();
+        }
+    }
+
+    float next() override { return gen_(); }
+
+private:
+    uint64_t seed_;
+    xorshift64star<float> gen_;
+};
+
+/**
+ * Owen-scrambled Sobol sampler (cf. [Bur20]).
+ *
+ * Dimensions are taken in pairs from the first two dimensions of the Sobol
+ * sequence, which are well stratified in 2d. Every pair gets its own
+ * scrambling, and its own shuffling of the sample indices, s.t. the pairs are
+ * decorrelated. The first n samples of a pixel are stratified in every pair of
+ * dimensions, if n is a power of 2.
+ */
+class SobolSampler : public Sampler {
+public:
+    /**
+     * @param blue_noise scramble all pixels the same way, and shift them by
+     *                   a dither mask instead (cf. `SamplerType::BLUE_NOISE`)
+     */
+    explicit SobolSampler(bool blue_noise, uint64_t seed = 0)
+        : blue_noise_(blue_noise), seed_(seed) {}
+
+    void start_sample(uint32_t x, uint32_t y, uint32_t index,
+                      uint32_t dimension) override {
+        x_ = x;
+        y_ = y;
+        index_ = index;
+        dimension_ = dimension;
+        if (blue_noise_) {
+            // Interleaved gradient noise (J. Jimenez, Next Generation Post
+            // Processing in Call of Duty: Advanced Warfare, 2014): a dither
+            // mask with little energy at low frequencies, i.e. neighboring
+            // pixels get different shifts.
+            const float v = 0.06711056f * x + 0.00583715f * y;
+            const float w = 52.9829189f * (v - std::floor(v));
+            dither_ = w - std::floor(w);
+        }
+    }
+
+    float next() override {
+        const uint32_t dimension = dimension_++;
+        const uint32_t pair = dimension / 2;
+        const uint32_t seed = blue_noise_
+                                  ? detail::hash(seed_, pair)
+                                  : detail::hash(seed_, x_, y_, pair);
+        const uint32_t index = detail::owen_scramble(index_, seed);
+        const uint32_t value = detail::owen_scramble(
+            detail::sobol(index, dimension % 2),
+            detail::hash(seed, dimension % 2));
+        float u = detail::to_unit_float(value);
+        if (blue_noise_) {
+            // Cranley-Patterson rotation by the dither, decorrelated between
+            // the dimensions with the golden ratio
+            const float shift = dither_ + 0.618034f * dimension;
+            u += shift - std::floor(shift);
+            u -= u >= 1 ? 1 : 0;
+            // rounding may give exactly 1
+            u = std::min(u, std::nextafter(1.f, 0.f));
+        }
+        return u;
+    }
+
+private:
+    bool blue_noise_;
+    uint64_t seed_;
+    uint32_t x_ = 0, y_ = 0;
+    uint32_t index_ = 0;
+    uint32_t dimension_ = 0;
+    float dither_ = 0;
+};
+
+inline std::unique_ptr<Sampler> make_sampler(SamplerType type,
+                                             uint64_t seed = 0) {
+    switch (type) {
+    case SamplerType::RANDOM:
+        return std::unique_ptr<Sampler>(new RandomSampler(seed));
+    case SamplerType::SOBOL:
+        return std::unique_ptr<Sampler>(new SobolSampler(false, seed));
+    case SamplerType::BLUE_NOISE:
+        return std::unique_ptr<Sampler>(new SobolSampler(true, seed));
+    }
+    throw std::runtime_error("unknown sampler");
+}
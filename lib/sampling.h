@@ -1,26 +1,75 @@
 #pragma once
 
+#include "profile.h"
+#include "sampler.h"
 #include "triangle.h"
 #include "types.h"
 #include "xorshift.h"
 
+#include <algorithm>
+#include <array>
+#include <cassert>
 #include <cmath>
 #include <tuple>
+#include <vector>
 
 namespace sampling {
 namespace detail {
 static __thread xorshift64star<float> uniform{4};
+// sampler of the calling thread, if any (cf. ScopedSampler)
+static __thread Sampler* sampler = nullptr;
 } // namespace detail
 
 static constexpr float M_2PI = 2.f * M_PI;
 
 /**
- * Sample a point on a hemisphere.
+ * Reseed the random number generator of the calling thread.
+ *
+ * Use it to make the samples independent of the thread they are drawn on.
+ *
+ * @param seed non-zero seed
+ */
+inline void seed(uint64_t seed) {
+    detail::uniform = xorshift64star<float>(seed);
+}
+
+/**
+ * Draw the numbers of the calling thread from the sampler while in scope,
+ * e.g. the dimensions of the current pixel sample (cf. `Sampler`).
+ */
+class ScopedSampler {
+public:
+    explicit ScopedSampler(Sampler& sampler) : previous_(detail::sampler) {
+        detail::sampler = &sampler;
+    }
+    ~ScopedSampler() { detail::sampler = previous_; }
+
+    ScopedSampler(const ScopedSampler&) = delete;
+    ScopedSampler& operator=(const ScopedSampler&) = delete;
+
+private:
+    Sampler* previous_;
+};
+
+/**
+ * Sample a uniformly distributed number in [0, 1).
+ *
+ * The number is the next dimension of the sampler of the calling thread, if
+ * there is one, otherwise it is drawn from its random number generator.
+ */
+inline float uniform() {
+    return detail::sampler ? detail::sampler->next() : detail::uniform();
+}
+
+/**
+ * Sample a point on a hemisphere uniformly, i.e. with a density of 1/2π.
  */
 inline std::pair<Vector3f, float> hemisphere() {
+    turner::Profile _(turner::ProfCategory::SamplingHemisphere);
+
     // draw coordinates
-    float u1 = detail::uniform();
-    float u2 = detail::uniform();
+    float u1 = uniform();
+    float u2 = uniform();
 
     // u1 is cos(theta)
     auto z = u1;
@@ -31,6 +80,110 @@ inline std::pair<Vector3f, float> hemisphere() {
     return {{x, y, z}, u1};
 }
 
+namespace detail {
+/**
+ * Sine and cosine of 2π u for u in [0, 1).
+ *
+ * The angle is reduced to [-π/4, π/4] around the nearest multiple of π/2,
+ * where the Taylor polynomials are accurate to about 3e-7. The quadrant is
+ * applied without branches, s.t. loops over arrays are vectorized.
+ */
+inline void sincos_2pi(float u, float& s, float& c) {
+    const float q = std::floor(4 * u + 0.5f);
+    const float a = M_2PI * (u - 0.25f * q);
+    const float a2 = a * a;
+    const float sin_a =
+        a * (1 + a2 * (-1.f / 6 + a2 * (1.f / 120 + a2 * (-1.f / 5040))));
+    const float cos_a =
+        1 + a2 * (-0.5f +
+                  a2 * (1.f / 24 + a2 * (-1.f / 720 + a2 * (1.f / 40320))));
+    // rotate by q quarters: (sin, cos) -> (cos, -sin) -> (-sin, -cos) -> ...
+    const int quadrant = static_cast<int>(q) & 3;
+    const bool swap = quadrant & 1;
+    const float sign_s = (quadrant & 2) ? -1.f : 1.f;
+    const float sign_c = ((quadrant + 1) & 2) ? -1.f : 1.f;
+    s = sign_s * (swap ? cos_a : sin_a);
+    c = sign_c * (swap ? sin_a : cos_a);
+}
+} // namespace detail
+
+/**
+ * Orthonormal basis (b1, b2, n) of the unit vector n without branches.
+ *
+ * Cf. T. Duff et al., Building an Orthonormal Basis, Revisited, JCGT 2017.
+ */
+inline void orthonormal_basis(const Vector3f& n, Vector3f& b1, Vector3f& b2) {
+    const float sign = std::copysign(1.f, n.z);
+    const float a = -1.f / (sign + n.z);
+    const float b = n.x * n.y * a;
+    b1 = Vector3f(1.f + sign * n.x * n.x * a, sign * b, -sign * n.x);
+    b2 = Vector3f(b, sign + n.y * n.y * a, -n.y);
+}
+
+/**
+ * Map a point of the unit square onto the hemisphere around (0, 0, 1) with a
+ * density of cos(θ)/π w.r.t. solid angle, i.e. the z coordinate of the
+ * direction is cos(θ).
+ *
+ * A uniformly distributed point of the unit disk is projected up onto the
+ * hemisphere (Malley's method).
+ *
+ * @param  u1, u2 point in [0, 1)²
+ * @return        unit direction
+ */
+inline Vector3f cosine_hemisphere(float u1, float u2) {
+    const float r = std::sqrt(u1);
+    float sin_phi, cos_phi;
+    detail::sincos_2pi(u2, sin_phi, cos_phi);
+    return {r * cos_phi, r * sin_phi, std::sqrt(std::max(0.f, 1.f - u1))};
+}
+
+/**
+ * Sample a cosine-weighted direction on the hemisphere around (0, 0, 1) (cf.
+ * above).
+ */
+inline Vector3f cosine_hemisphere() {
+    turner::Profile _(turner::ProfCategory::SamplingHemisphere);
+    const float u1 = uniform();
+    const float u2 = uniform();
+    return cosine_hemisphere(u1, u2);
+}
+
+/**
+ * Map n points of the unit square onto the hemisphere (cf. above), e.g. the
+ * samples of all paths of a bounce. The directions are stored in SoA form.
+ */
+inline void cosine_hemisphere(size_t n, const float* u1, const float* u2,
+                              float* x, float* y, float* z) {
+    for (size_t i = 0; i < n; ++i) {
+        const float r = std::sqrt(u1[i]);
+        float sin_phi, cos_phi;
+        detail::sincos_2pi(u2[i], sin_phi, cos_phi);
+        x[i] = r * cos_phi;
+        y[i] = r * sin_phi;
+        z[i] = std::sqrt(std::max(0.f, 1.f - u1[i]));
+    }
+}
+
+/**
+ * Map a point of the unit square onto the triangle.
+ *
+ * Uniformly distributed points are mapped to uniformly distributed points, and
+ * the mapping is continuous, i.e. strata of the unit square are mapped onto
+ * strata of the triangle.
+ *
+ * @param  pos    position of a corner of the triangle
+ * @param  u      a side starting at pos
+ * @param  v      a side (different from u) starting at pos
+ * @param  r1, r2 point in [0, 1]²
+ * @return        point in world space
+ */
+inline Point3f triangle(const Point3f& pos, const Vector3f& u,
+                        const Vector3f& v, float r1, float r2) {
+    const float sqrt_r1 = std::sqrt(r1);
+    return pos + (sqrt_r1 * (1 - r2)) * u + (sqrt_r1 * r2) * v;
+}
+
 /**
  * Sample a point on the triangle.
  *
@@ -41,14 +194,9 @@ inline std::pair<Vector3f, float> hemisphere() {
  */
 inline Point3f triangle(const Point3f& pos, const Vector3f& u,
                         const Vector3f& v) {
-    while (true) {
-        float r1 = detail::uniform();
-        float r2 = detail::uniform();
-
-        if ((r1 + r2) <= 1.f) {
-            return pos + r1 * u + r2 * v;
-        }
-    }
+    float r1 = uniform();
+    float r2 = uniform();
+    return triangle(pos, u, v, r1, r2);
 }
 
 /**
@@ -59,4 +207,108 @@ inline Point3f triangle(const Point3f& pos, const Vector3f& u,
 inline Point3f triangle(const Triangle& tri) {
     return triangle(tri.vertices[0], tri.u, tri.v);
 }
+
+/**
+ * Jittered samples of the unit square, i.e. one uniformly distributed sample
+ * in each of the N × N strata.
+ *
+ * The samples are in random order, s.t. the i-th samples of two such sets form
+ * a random pairing of the strata.
+ *
+ * @tparam N number of strata per dimension
+ * @return   N² samples in [0, 1]²
+ */
+template <size_t N> std::array<std::array<float, 2>, N * N> stratified_square() {
+    std::array<std::array<float, 2>, N * N> samples;
+    for (size_t y = 0; y < N; ++y) {
+        for (size_t x = 0; x < N; ++x) {
+            samples[y * N + x] = {{(x + uniform()) / N, (y + uniform()) / N}};
+        }
+    }
+    // Fisher-Yates shuffle
+    for (size_t i = samples.size() - 1; i > 0; --i) {
+        size_t j = std::min<size_t>(uniform() * (i + 1), i);
+        std::swap(samples[i], samples[j]);
+    }
+    return samples;
+}
+
+/**
+ * Alias table for sampling of discrete distributions in constant time.
+ *
+ * Cf. Vose's variant of Walker's alias method: Every slot has the same
+ * probability. A slot i is either i itself or its alias, where the probability
+ * of i is stored in the slot.
+ */
+class AliasTable {
+public:
+    AliasTable() = default;
+
+    /**
+     * @param weights non-negative weights of the indexes (not all zero)
+     */
+    explicit AliasTable(const std::vector<float>& weights)
+        : prob_(weights.size(), 1)
+        , alias_(weights.size())
+        , pdf_(weights.size()) {
+        assert(!weights.empty());
+        const size_t n = weights.size();
+        double total = 0;
+        for (float weight : weights) {
+            assert(0 <= weight);
+            total += weight;
+        }
+        assert(0 < total);
+
+        std::vector<double> scaled(n);
+        std::vector<uint32_t> small, large;
+        for (size_t i = 0; i < n; ++i) {
+            pdf_[i] = weights[i] / total;
+            scaled[i] = weights[i] / total * n;
+            alias_[i] = i;
+            (scaled[i] < 1 ? small : large).push_back(i);
+        }
+        while (!small.empty() && !large.empty()) {
+            uint32_t s = small.back();
+            small.pop_back();
+            uint32_t l = large.back();
+            prob_[s] = scaled[s];
+            alias_[s] = l;
+            scaled[l] = (scaled[l] + scaled[s]) - 1;
+            if (scaled[l] < 1) {
+                large.pop_back();
+                small.push_back(l);
+            }
+        }
+        // Remaining slots are full up to rounding errors (prob_ is 1).
+    }
+
+    size_t size() const { return pdf_.size(); }
+
+    /**
+     * Probability of the index i.
+     */
+    float pdf(size_t i) const { return pdf_[i]; }
+
+    /**
+     * Sample an index.
+     *
+     * @param  u1, u2 uniformly distributed numbers in [0, 1)
+     * @return        index i with probability pdf(i)
+     */
+    size_t sample(float u1, float u2) const {
+        size_t i = std::min<size_t>(u1 * size(), size() - 1);
+        return u2 < prob_[i] ? i : alias_[i];
+    }
+
+    /**
+     * Sample an index with the random number generator of the calling thread.
+     */
+    size_t sample() const { return sample(uniform(), uniform()); }
+
+private:
+    std::vector<float> prob_;
+    std::vector<uint32_t> alias_;
+    std::vector<float> pdf_;
+};
 } // namespace sampling
@@ -0,0 +1,228 @@
+#include "scene.h"
+
+#include "range.h"
+
+#include <ThreadPool.h>
+
+#include <atomic>
+#include <cassert>
+#include <future>
+#include <limits>
+#include <stdexcept>
+
+namespace {
+
+void collect_instances(const aiNode* node, const aiMatrix4x4& parent,
+                       std::vector<MeshInstance>& instances) {
+    const aiMatrix4x4 T = parent * node->mTransformation;
+    for (auto mesh_index : make_range(node->mMeshes, node->mNumMeshes)) {
+        instances.push_back({mesh_index, T});
+    }
+    for (auto child : make_range(node->mChildren, node->mNumChildren)) {
+        collect_instances(child, T, instances);
+    }
+}
+
+/**
+ * Call f(i) for all i in [0, n) on num_threads threads.
+ */
+template <typename F> void parallel_for(size_t n, size_t num_threads, F f) {
+    assert(0 < num_threads);
+    if (num_threads == 1 || n <= 1) {
+        for (size_t i = 0; i < n; ++i) {
+            f(i);
+        }
+        return;
+    }
+
+    std::atomic<size_t> next(0);
+    ThreadPool pool(num_threads);
+    std::vector<std::future<void>> workers;
+    for (size_t worker = 0; worker < num_threads; ++worker) {
+        workers.emplace_back(pool.enqueue([&]() {
+            for (size_t i = next++; i < n; i = next++) {
+                f(i);
+            }
+        }));
+    }
+    for (auto& worker : workers) {
+        worker.get();
+    }
+}
+
+} // namespace anonymous
+
+aiMatrix4x4 world_transformation(const aiNode* node) {
+    aiMatrix4x4 T;
+    for (; node; node = node->mParent) {
+        T = node->mTransformation * T;
+    }
+    return T;
+}
+
+aiMatrix4x4 look_at_transformation(const aiVector3D& eye,
+                                   const aiVector3D& target,
+                                   const aiVector3D& up) {
+    aiVector3D forward = target - eye;
+    forward.Normalize();
+    aiVector3D right = forward ^ up;
+    right.Normalize();
+    const aiVector3D camera_up = right ^ forward;
+    return aiMatrix4x4(right.x, camera_up.x, -forward.x, eye.x,
+                       right.y, camera_up.y, -forward.y, eye.y,
+                       right.z, camera_up.z, -forward.z, eye.z,
+                       0, 0, 0, 1);
+}
+
+std::vector<MeshInstance> mesh_instances(const aiScene* scene) {
+    std::vector<MeshInstance> instances;
+    if (scene->mRootNode) {
+        collect_instances(scene->mRootNode, aiMatrix4x4(), instances);
+    }
+    return instances;
+}
+
+Material convert_material(const aiMaterial& material) {
+    // the colors are read as assimp's, which are zero if missing
+    aiColor4D ambient, diffuse, emissive, reflective;
+    material.Get(AI_MATKEY_COLOR_AMBIENT, ambient);
+    material.Get(AI_MATKEY_COLOR_DIFFUSE, diffuse);
+    material.Get(AI_MATKEY_COLOR_EMISSIVE, emissive);
+    material.Get(AI_MATKEY_COLOR_REFLECTIVE, reflective);
+
+    Material result;
+    result.ambient = Color(ambient);
+    result.diffuse = Color(diffuse);
+    result.emissive = Color(emissive);
+    result.reflective = Color(reflective);
+    material.Get(AI_MATKEY_REFLECTIVITY, result.reflectivity);
+    return result;
+}
+
+void convert_mesh(const aiScene* scene, const aiMesh& mesh,
+                  const aiMatrix4x4& T, Triangle* out) {
+    const aiMatrix3x3 Tp(T); // trafo without translation
+    const Material material =
+        convert_material(*scene->mMaterials[mesh.mMaterialIndex]);
+
+    for (aiFace face : make_range(mesh.mFaces, mesh.mNumFaces)) {
+        assert(face.mNumIndices == 3);
+
+        // convert to our internal Vec = Vector3f type
+        aiVector3D aiv0 = T * mesh.mVertices[face.mIndices[0]];
+        aiVector3D aiv1 = T * mesh.mVertices[face.mIndices[1]];
+        aiVector3D aiv2 = T * mesh.mVertices[face.mIndices[2]];
+
+        aiVector3D ain0 = Tp * mesh.mNormals[face.mIndices[0]];
+        aiVector3D ain1 = Tp * mesh.mNormals[face.mIndices[1]];
+        aiVector3D ain2 = Tp * mesh.mNormals[face.mIndices[2]];
+
+        Point3f v0(aiv0.x, aiv0.y, aiv0.z);
+        Point3f v1(aiv1.x, aiv1.y, aiv1.z);
+        Point3f v2(aiv2.x, aiv2.y, aiv2.z);
+
+        Normal3f n0(ain0.x, ain0.y, ain0.z);
+        Normal3f n1(ain1.x, ain1.y, ain1.z);
+        Normal3f n2(ain2.x, ain2.y, ain2.z);
+
+        *out++ = Triangle{// vertices
+                          {v0, v1, v2},
+                          // normals
+                          {n0, n1, n2},
+                          material.ambient,
+                          material.diffuse,
+                          material.emissive,
+                          material.reflective,
+                          material.reflectivity};
+    }
+}
+
+Triangles triangles_from_scene(const aiScene* scene, size_t num_threads) {
+    const auto instances = mesh_instances(scene);
+
+    // The triangles of instance i start at offsets[i].
+    std::vector<size_t> offsets(instances.size() + 1, 0);
+    for (size_t i = 0; i < instances.size(); ++i) {
+        offsets[i + 1] =
+            offsets[i] + scene->mMeshes[instances[i].mesh]->mNumFaces;
+    }
+
+    Triangles triangles(offsets.back());
+    parallel_for(instances.size(), num_threads, [&](size_t i) {
+        convert_mesh(scene, *scene->mMeshes[instances[i].mesh],
+                     instances[i].to_world, triangles.data() + offsets[i]);
+    });
+    return triangles;
+}
+
+IndexedMesh indexed_mesh_from_scene(const aiScene* scene,
+                                    size_t num_threads) {
+    const auto instances = mesh_instances(scene);
+
+    std::vector<Material> materials;
+    materials.reserve(scene->mNumMaterials);
+    for (auto material : make_range(scene->mMaterials, scene->mNumMaterials)) {
+        materials.push_back(convert_material(*material));
+    }
+
+    // The vertices resp. triangles of instance i start at vertex_offsets[i]
+    // resp. triangle_offsets[i].
+    std::vector<size_t> vertex_offsets(instances.size() + 1, 0);
+    std::vector<size_t> triangle_offsets(instances.size() + 1, 0);
+    for (size_t i = 0; i < instances.size(); ++i) {
+        const auto& mesh = *scene->mMeshes[instances[i].mesh];
+        vertex_offsets[i + 1] = vertex_offsets[i] + mesh.mNumVertices;
+        triangle_offsets[i + 1] = triangle_offsets[i] + mesh.mNumFaces;
+    }
+    if (vertex_offsets.back() > std::numeric_limits<uint32_t>::max()) {
+        throw std::runtime_error("too many vertices for 32-bit indices");
+    }
+
+    std::vector<Point3f> vertices(vertex_offsets.back());
+    std::vector<Normal3f> normals(vertex_offsets.back());
+    std::vector<IndexedTriangle> triangles(triangle_offsets.back());
+    parallel_for(instances.size(), num_threads, [&](size_t i) {
+        const auto& mesh = *scene->mMeshes[instances[i].mesh];
+        const auto& T = instances[i].to_world;
+        const aiMatrix3x3 Tp(T); // trafo without translation
+
+        const size_t first_vertex = vertex_offsets[i];
+        for (size_t v = 0; v < mesh.mNumVertices; ++v) {
+            const aiVector3D p = T * mesh.mVertices[v];
+            const aiVector3D n = Tp * mesh.mNormals[v];
+            vertices[first_vertex + v] = Point3f(p.x, p.y, p.z);
+            normals[first_vertex + v] = Normal3f(n.x, n.y, n.z);
+        }
+
+        // vertices and normals share the indices of assimp
+        auto* out = triangles.data() + triangle_offsets[i];
+        for (aiFace face : make_range(mesh.mFaces, mesh.mNumFaces)) {
+            assert(face.mNumIndices == 3);
+            IndexedTriangle tri;
+            for (size_t k = 0; k < 3; ++k) {
+                tri.vertices[k] = first_vertex + face.mIndices[k];
+                tri.normals[k] = tri.vertices[k];
+            }
+            tri.material = mesh.mMaterialIndex;
+            *out++ = tri;
+        }
+    });
+    return {std::move(vertices), std::move(normals), std::move(materials),
+            std::move(triangles)};
+}
+
+InstancedScene instanced_scene_from_scene(const aiScene* scene,
+                                          size_t num_threads) {
+    std::vector<Triangles> meshes(scene->mNumMeshes);
+    parallel_for(meshes.size(), num_threads, [&](size_t i) {
+        const auto& mesh = *scene->mMeshes[i];
+        meshes[i].resize(mesh.mNumFaces);
+        convert_mesh(scene, mesh, aiMatrix4x4(), meshes[i].data());
+    });
+
+    std::vector<Instance> instances;
+    for (const auto& instance : mesh_instances(scene)) {
+        instances.push_back({instance.mesh, to_transform(instance.to_world)});
+    }
+    return {std::move(meshes), std::move(instances)};
+}
@@ -0,0 +1,95 @@
+/**
+ * Conversion of the meshes of an assimp scene into triangles.
+ *
+ * The whole node hierarchy is walked, and the transformation of a node into
+ * world space is the product of the transformations of all nodes on the path
+ * from the root to it (cf. `world_transformation`).
+ */
+
+#pragma once
+
+#include "indexed_mesh.h"
+#include "instancing.h"
+#include "transform.h"
+#include "triangle.h"
+
+#include <assimp/scene.h>
+
+#include <vector>
+
+/**
+ * Reference of a node to a mesh, i.e. an instance of the mesh.
+ */
+struct MeshInstance {
+    unsigned mesh;
+    aiMatrix4x4 to_world; // transformation of the node into world space
+};
+
+/**
+ * Transformation of a node into world space.
+ */
+aiMatrix4x4 world_transformation(const aiNode* node);
+
+/**
+ * Transformation of a camera at eye looking at target into world space. The
+ * camera looks along -z with the up vector y in camera space (cf. `Camera`).
+ */
+aiMatrix4x4 look_at_transformation(const aiVector3D& eye,
+                                   const aiVector3D& target,
+                                   const aiVector3D& up);
+
+inline Transform to_transform(const aiMatrix4x4& T) {
+    return Transform({T.a1, T.a2, T.a3, T.a4, T.b1, T.b2, T.b3, T.b4, T.c1,
+                      T.c2, T.c3, T.c4});
+}
+
+/**
+ * The mesh references of all nodes of the scene in depth-first order.
+ */
+std::vector<MeshInstance> mesh_instances(const aiScene* scene);
+
+/**
+ * Colors and reflectivity of an assimp material.
+ */
+Material convert_material(const aiMaterial& material);
+
+/**
+ * Convert the faces of a mesh transformed by T to triangles.
+ *
+ * @param out array of mesh.mNumFaces triangles, which are overwritten
+ */
+void convert_mesh(const aiScene* scene, const aiMesh& mesh,
+                  const aiMatrix4x4& T, Triangle* out);
+
+/**
+ * Triangles of all mesh instances of the scene in world space.
+ *
+ * The instances are converted in parallel, and written directly into the
+ * resulting triangles, which are e.g. moved into the kd-tree afterwards.
+ *
+ * @param num_threads number of threads converting instances
+ */
+Triangles triangles_from_scene(const aiScene* scene, size_t num_threads = 1);
+
+/**
+ * Indexed mesh of all mesh instances of the scene in world space.
+ *
+ * The vertices and normals of an instance are shared by its triangles as
+ * joined by assimp (cf. aiProcess_JoinIdenticalVertices), and the material
+ * table is the one of the scene. The triangles are in the same order as the
+ * ones of `triangles_from_scene`.
+ *
+ * @param num_threads number of threads converting instances
+ * @throw             std::runtime_error, if there are too many vertices for
+ *                    32-bit indices
+ */
+IndexedMesh indexed_mesh_from_scene(const aiScene* scene,
+                                    size_t num_threads = 1);
+
+/**
+ * Meshes of the scene in object space, and their instances.
+ *
+ * @param num_threads number of threads converting meshes
+ */
+InstancedScene instanced_scene_from_scene(const aiScene* scene,
+                                          size_t num_threads = 1);
@@ -0,0 +1,237 @@
+/**
+ * Building blocks of a render service (cf. tracer_server.h): TCP connections
+ * on localhost, which exchange lines of text and binary data, and the
+ * splitting of a request line into command line arguments.
+ */
+
+#pragma once
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Split a line into arguments at whitespace like a shell, e.g. a request of
+ * the service. Arguments may be quoted with double quotes, e.g.
+ * `--look-at="0 1 5 0 0 0 0 1 0"` is a single argument without the quotes.
+ */
+inline std::vector<std::string> split_arguments(const std::string& line) {
+    std::vector<std::string> arguments;
+    std::string argument;
+    bool in_argument = false;
+    bool quoted = false;
+    for (char c : line) {
+        if (c == '"') {
+            quoted = !quoted;
+            in_argument = true;
+        } else if (!quoted && std::isspace(static_cast<unsigned char>(c))) {
+            if (in_argument) {
+                arguments.push_back(argument);
+                argument.clear();
+                in_argument = false;
+            }
+        } else {
+            argument += c;
+            in_argument = true;
+        }
+    }
+    if (quoted) {
+        throw std::runtime_error("unterminated quote: " + line);
+    }
+    if (in_argument) {
+        arguments.push_back(argument);
+    }
+    return arguments;
+}
+
+namespace detail {
+
+inline std::runtime_error socket_error(const std::string& what) {
+    return std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+} // namespace detail
+
+/**
+ * Connection of a TCP socket, which is closed on destruction.
+ */
+class TcpConnection {
+public:
+    explicit TcpConnection(int fd) : fd_(fd) {}
+    TcpConnection(TcpConnection&& other)
+        : fd_(other.fd_), buffer_(std::move(other.buffer_)) {
+        other.fd_ = -1;
+    }
+    TcpConnection(const TcpConnection&) = delete;
+    TcpConnection& operator=(const TcpConnection&) = delete;
+    ~TcpConnection() {
+        if (fd_ >= 0) {
+            ::close(fd_);
+        }
+    }
+
+    /**
+     * Connect to the port of localhost.
+     */
+    static TcpConnection connect(uint16_t port) {
+        TcpConnection connection(::socket(AF_INET, SOCK_STREAM, 0));
+        if (connection.fd_ < 0) {
+            throw detail::socket_error("could not create socket");
+        }
+        const sockaddr_in address = loopback_address(port);
+        if (::connect(connection.fd_,
+                      reinterpret_cast<const sockaddr*>(&address),
+                      sizeof(address)) != 0) {
+            throw detail::socket_error("could not connect to port " +
+                                       std::to_string(port));
+        }
+        return connection;
+    }
+
+    /**
+     * Read the next line without the line break.
+     *
+     * @return false, if the peer closed the connection before a line
+     */
+    bool read_line(std::string& line) {
+        size_t end;
+        while ((end = buffer_.find('\n')) == std::string::npos) {
+            if (!fill_buffer()) {
+                return false;
+            }
+        }
+        line = buffer_.substr(0, end);
+        buffer_.erase(0, end + 1);
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        return true;
+    }
+
+    /**
+     * Read exactly size bytes, e.g. an image following a response line.
+     *
+     * @return false, if the peer closed the connection before
+     */
+    bool read(std::string& data, size_t size) {
+        while (buffer_.size() < size) {
+            if (!fill_buffer()) {
+                return false;
+            }
+        }
+        data = buffer_.substr(0, size);
+        buffer_.erase(0, size);
+        return true;
+    }
+
+    void write(const std::string& data) {
+        size_t written = 0;
+        while (written < data.size()) {
+            // no SIGPIPE, if the peer has gone
+            const ssize_t n = ::send(fd_, data.data() + written,
+                                     data.size() - written, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw detail::socket_error("could not send");
+            }
+            written += n;
+        }
+    }
+
+    static sockaddr_in loopback_address(uint16_t port) {
+        sockaddr_in address;
+        std::memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        return address;
+    }
+
+private:
+    bool fill_buffer() {
+        char chunk[4096];
+        ssize_t n;
+        do {
+            n = ::recv(fd_, chunk, sizeof(chunk), 0);
+        } while (n < 0 && errno == EINTR);
+        if (n < 0) {
+            throw detail::socket_error("could not receive");
+        }
+        buffer_.append(chunk, n);
+        return n > 0;
+    }
+
+    int fd_;
+    std::string buffer_; // received, but not yet read
+};
+
+/**
+ * TCP socket listening on a port of localhost. Other hosts cannot connect,
+ * since the requests of a service are not authenticated.
+ */
+class TcpListener {
+public:
+    /**
+     * @param port port to listen on, or 0 for any free port (cf. `port`)
+     */
+    explicit TcpListener(uint16_t port)
+        : fd_(::socket(AF_INET, SOCK_STREAM, 0)) {
+        if (fd_ < 0) {
+            throw detail::socket_error("could not create socket");
+        }
+        // restart a service without waiting for the old socket to time out
+        const int reuse = 1;
+        ::setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        const sockaddr_in address = TcpConnection::loopback_address(port);
+        if (::bind(fd_, reinterpret_cast<const sockaddr*>(&address),
+                   sizeof(address)) != 0 ||
+            ::listen(fd_, SOMAXCONN) != 0) {
+            const auto error = detail::socket_error(
+                "could not listen on port " + std::to_string(port));
+            ::close(fd_);
+            throw error;
+        }
+    }
+    TcpListener(const TcpListener&) = delete;
+    TcpListener& operator=(const TcpListener&) = delete;
+    ~TcpListener() { ::close(fd_); }
+
+    uint16_t port() const {
+        sockaddr_in address;
+        socklen_t size = sizeof(address);
+        if (::getsockname(fd_, reinterpret_cast<sockaddr*>(&address),
+                          &size) != 0) {
+            throw detail::socket_error("could not get port");
+        }
+        return ntohs(address.sin_port);
+    }
+
+    /**
+     * Wait for the next connection.
+     */
+    TcpConnection accept() {
+        int fd;
+        do {
+            fd = ::accept(fd_, nullptr, nullptr);
+        } while (fd < 0 && errno == EINTR);
+        if (fd < 0) {
+            throw detail::socket_error("could not accept connection");
+        }
+        return TcpConnection(fd);
+    }
+
+private:
+    int fd_;
+};
@@ -1,6 +1,175 @@
 #pragma once
 
+#include <sys/resource.h>
+#ifdef __linux__
+#include <malloc.h>
+#endif
+
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Counter, which is incremented concurrently by many threads.
+ *
+ * Every thread increments its own shard, which lies in its own cache line.
+ * Hence, threads do not contend for the same cache line, when counting e.g.
+ * traced rays. The shards are summed up only when the value is read.
+ */
+class ShardedCounter {
+public:
+    // Threads share a shard only if there are more threads than shards.
+    static constexpr size_t NUM_SHARDS = 64;
+
+    ShardedCounter() = default;
+    ShardedCounter(const ShardedCounter&) = delete;
+    ShardedCounter& operator=(const ShardedCounter&) = delete;
+
+    ShardedCounter& operator+=(size_t value) {
+        if (paused().load(std::memory_order_relaxed)) {
+            return *this;
+        }
+        shards_[shard_index()].value.fetch_add(value,
+                                               std::memory_order_relaxed);
+        return *this;
+    }
+
+    size_t value() const {
+        size_t sum = 0;
+        for (const auto& shard : shards_) {
+            sum += shard.value.load(std::memory_order_relaxed);
+        }
+        return sum;
+    }
+
+    operator size_t() const { return value(); }
+
+    /**
+     * Are increments of all counters by all threads ignored (cf.
+     * `PausedStats`)?
+     */
+    static std::atomic<bool>& paused() {
+        static std::atomic<bool> paused{false};
+        return paused;
+    }
+
+private:
+    struct alignas(64) Shard {
+        std::atomic<size_t> value{0};
+    };
+
+    static size_t shard_index() {
+        static std::atomic<size_t> num_threads{0};
+        thread_local size_t index = num_threads++ % NUM_SHARDS;
+        return index;
+    }
+
+    std::array<Shard, NUM_SHARDS> shards_;
+};
+
+/**
+ * Running mean and variance of a sequence of values, cf. Welford's algorithm.
+ */
+class RunningVariance {
+public:
+    void add(float x) {
+        count_ += 1;
+        const float delta = x - mean_;
+        mean_ += delta / count_;
+        m2_ += delta * (x - mean_);
+    }
+
+    size_t count() const { return count_; }
+    float mean() const { return mean_; }
+
+    // sample variance (0 for less than two values)
+    float variance() const { return count_ < 2 ? 0 : m2_ / (count_ - 1); }
+
+    // standard error of the mean
+    float std_error() const {
+        return count_ == 0 ? 0 : std::sqrt(variance() / count_);
+    }
+
+private:
+    size_t count_ = 0;
+    float mean_ = 0;
+    float m2_ = 0; // sum of squared differences from the mean
+};
+
+/**
+ * CPU time (user and system) of all threads of the process in ms.
+ */
+inline double process_cpu_ms() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return 1e3 * (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) +
+           1e-3 * (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+}
+
+/**
+ * Peak resident memory of the process in bytes.
+ */
+inline size_t process_peak_rss_bytes() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss;
+#else
+    return usage.ru_maxrss * size_t(1024);
+#endif
+}
+
+/**
+ * Bytes allocated on the heap of the process and not yet freed, or 0 if the
+ * C library does not tell.
+ */
+inline size_t process_heap_bytes() {
+#if defined(__GLIBC__) &&                                                      \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    const struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * Resources used by a stage of a program, e.g. the scene import or the
+ * rendering (cf. `StageTimer`). The runs of a stage, e.g. the renderings of
+ * a batch, are accumulated.
+ */
+struct StageStats {
+    std::string name;
+    size_t count = 0; // number of runs
+    double wall_ms = 0;
+    // CPU time of the process while the stage ran, including the time of
+    // concurrent stages
+    double cpu_ms = 0;
+    // peak resident memory of the process at the end of the stage
+    size_t peak_rss_bytes = 0;
+    // bytes allocated on the heap minus the bytes freed during the stage
+    int64_t heap_bytes = 0;
+
+    StageStats& operator+=(const StageStats& other) {
+        count += other.count;
+        wall_ms += other.wall_ms;
+        cpu_ms += other.cpu_ms;
+        peak_rss_bytes = std::max(peak_rss_bytes, other.peak_rss_bytes);
+        heap_bytes += other.heap_bytes;
+        return *this;
+    }
+};
 
 class Stats {
 public:
@@ -11,13 +180,272 @@ public:
 
     size_t num_triangles;
     size_t kdtree_height;
-    std::atomic<size_t> num_rays;      // all rays
-    std::atomic<size_t> num_prim_rays; // primary rays
+    // heap allocations and peak heap memory of the kd-tree build
+    size_t kdtree_build_allocations;
+    size_t kdtree_build_peak_bytes;
+    ShardedCounter num_rays;      // all rays
+    ShardedCounter num_prim_rays; // primary rays
+    // shadow rays tested with the last occluder of their light, and the ones
+    // blocked by it (cf. `Intersector::light_occluded`)
+    ShardedCounter occluder_cache_tests;
+    ShardedCounter occluder_cache_hits;
     size_t runtime_ms;
     size_t loading_time_ms;
 
+    // Number of pixels by samples per pixel: bucket k counts the pixels with
+    // [2^k, 2^(k+1)) samples.
+    static constexpr size_t NUM_SAMPLES_BUCKETS = 16;
+    std::array<ShardedCounter, NUM_SAMPLES_BUCKETS> pixels_by_samples;
+
+    static size_t samples_bucket(size_t num_samples) {
+        size_t bucket = 0;
+        while (1 < num_samples && bucket + 1 < NUM_SAMPLES_BUCKETS) {
+            num_samples >>= 1;
+            bucket += 1;
+        }
+        return bucket;
+    }
+
+    void count_pixel_samples(size_t num_samples) {
+        pixels_by_samples[samples_bucket(num_samples)] += 1;
+    }
+
+    // Rays traced by the wavefront path tracer and the time spent on tracing
+    // them (summed over all threads) by bounce; the last bucket counts all
+    // deeper bounces.
+    static constexpr size_t NUM_BOUNCE_BUCKETS = 8;
+    std::array<ShardedCounter, NUM_BOUNCE_BUCKETS> rays_by_bounce;
+    std::array<ShardedCounter, NUM_BOUNCE_BUCKETS> trace_ns_by_bounce;
+
+    void count_bounce(size_t depth, size_t num_rays, size_t trace_ns) {
+        const size_t bucket = std::min(depth, NUM_BOUNCE_BUCKETS - 1);
+        rays_by_bounce[bucket] += num_rays;
+        trace_ns_by_bounce[bucket] += trace_ns;
+    }
+
+    /**
+     * Add a run of a stage, which may be called concurrently.
+     */
+    void add_stage(const StageStats& stage) {
+        std::lock_guard<std::mutex> lock(stages_mutex_);
+        for (auto& other : stages_) {
+            if (other.name == stage.name) {
+                other += stage;
+                return;
+            }
+        }
+        stages_.push_back(stage);
+    }
+
+    // stages in the order of their first run
+    std::vector<StageStats> stages() const {
+        std::lock_guard<std::mutex> lock(stages_mutex_);
+        return stages_;
+    }
+
 private:
     Stats() {}
     Stats(const Stats&) = delete;
     Stats operator=(const Stats&) = delete;
+
+    mutable std::mutex stages_mutex_;
+    std::vector<StageStats> stages_;
 };
+
+/**
+ * Measure the resources of a stage by using RAII, and add them to the stats.
+ *
+ * Usage:
+ *
+ * ```
+ * {
+ *     StageTimer _("build");
+ *     // ... build the kd-tree
+ * }
+ * ```
+ */
+class StageTimer {
+public:
+    explicit StageTimer(std::string name)
+        : name_(std::move(name)), cpu_ms_(process_cpu_ms()),
+          heap_bytes_(process_heap_bytes()) {}
+
+    StageTimer(const StageTimer&) = delete;
+    StageTimer& operator=(const StageTimer&) = delete;
+
+    ~StageTimer() { stop(); }
+
+    /**
+     * End the stage before the end of the block.
+     */
+    void stop() {
+        if (stopped_) {
+            return;
+        }
+        stopped_ = true;
+        if (paused()) {
+            return;
+        }
+        StageStats stage;
+        stage.name = name_;
+        stage.count = 1;
+        stage.wall_ms = std::chrono::duration<double, std::milli>(
+                            std::chrono::steady_clock::now() - started_)
+                            .count();
+        stage.cpu_ms = process_cpu_ms() - cpu_ms_;
+        stage.peak_rss_bytes = process_peak_rss_bytes();
+        stage.heap_bytes = static_cast<int64_t>(process_heap_bytes()) -
+                           static_cast<int64_t>(heap_bytes_);
+        Stats::instance().add_stage(stage);
+    }
+
+    /**
+     * Are the stages stopped on the calling thread not recorded (cf.
+     * `PausedStats`)?
+     */
+    static bool& paused() {
+        thread_local bool paused = false;
+        return paused;
+    }
+
+private:
+    std::string name_;
+    std::chrono::steady_clock::time_point started_ =
+        std::chrono::steady_clock::now();
+    double cpu_ms_;
+    size_t heap_bytes_;
+    bool stopped_ = false;
+};
+
+/**
+ * Pause the recording of the stats in a scope by using RAII, e.g. while a
+ * preview is rendered, whose rays should not count as the ones of the image.
+ * The counters are not incremented by any thread, the stages stopped on the
+ * calling thread are not recorded, and the runtime is restored at the end of
+ * the scope. Stages of other threads, e.g. of a concurrent build, are still
+ * recorded. Scopes must not be nested.
+ */
+class PausedStats {
+public:
+    PausedStats() : runtime_ms_(Stats::instance().runtime_ms) {
+        ShardedCounter::paused() = true;
+        StageTimer::paused() = true;
+    }
+
+    PausedStats(const PausedStats&) = delete;
+    PausedStats& operator=(const PausedStats&) = delete;
+
+    ~PausedStats() {
+        ShardedCounter::paused() = false;
+        StageTimer::paused() = false;
+        Stats::instance().runtime_ms = runtime_ms_;
+    }
+
+private:
+    size_t runtime_ms_;
+};
+
+/**
+ * Write the stats as JSON, e.g.
+ *
+ * ```
+ * {"triangles": 42, "kdtree_height": 7, "rays": 1000, "primary_rays": 100,
+ *  "loading_time_ms": 12, "runtime_ms": 345,
+ *  "stages": [{"name": "import", "count": 1, "wall_ms": 10.5,
+ *              "cpu_ms": 9.8, "peak_rss_bytes": 1234, "heap_bytes": 567},
+ *             ...]}
+ * ```
+ */
+inline void write_stats_json(std::ostream& os, const Stats& stats) {
+    os << "{\"triangles\": " << stats.num_triangles
+       << ", \"kdtree_height\": " << stats.kdtree_height
+       << ", \"rays\": " << stats.num_rays.value()
+       << ", \"primary_rays\": " << stats.num_prim_rays.value()
+       << ", \"occluder_cache_tests\": " << stats.occluder_cache_tests.value()
+       << ", \"occluder_cache_hits\": " << stats.occluder_cache_hits.value()
+       << ", \"loading_time_ms\": " << stats.loading_time_ms
+       << ", \"runtime_ms\": " << stats.runtime_ms << ", \"stages\": [";
+    const auto stages = stats.stages();
+    for (size_t i = 0; i < stages.size(); ++i) {
+        const auto& stage = stages[i];
+        os << (i == 0 ? "" : ", ") << "{\"name\": \"" << stage.name
+           << "\", \"count\": " << stage.count
+           << ", \"wall_ms\": " << stage.wall_ms
+           << ", \"cpu_ms\": " << stage.cpu_ms
+           << ", \"peak_rss_bytes\": " << stage.peak_rss_bytes
+           << ", \"heap_bytes\": " << stage.heap_bytes << '}';
+    }
+    os << "]}" << std::endl;
+}
+
+/**
+ * Write the stats in the Prometheus text format, e.g. for the textfile
+ * collector of the node exporter. The metrics of the stages are labeled with
+ * the stage, e.g. `turner_stage_wall_seconds{stage="render"} 1.5`.
+ */
+inline void write_stats_prometheus(std::ostream& os, const Stats& stats) {
+    auto gauge = [&os](const char* name, const char* help) {
+        os << "# HELP " << name << ' ' << help << std::endl
+           << "# TYPE " << name << " gauge" << std::endl;
+    };
+    gauge("turner_triangles", "Number of triangles of the scene.");
+    os << "turner_triangles " << stats.num_triangles << std::endl;
+    gauge("turner_kdtree_height", "Height of the kd-tree.");
+    os << "turner_kdtree_height " << stats.kdtree_height << std::endl;
+    gauge("turner_rays", "Number of traced rays.");
+    os << "turner_rays " << stats.num_rays.value() << std::endl;
+    gauge("turner_primary_rays", "Number of traced primary rays.");
+    os << "turner_primary_rays " << stats.num_prim_rays.value() << std::endl;
+    gauge("turner_occluder_cache_tests",
+          "Number of shadow rays tested with the last occluder of the light.");
+    os << "turner_occluder_cache_tests " << stats.occluder_cache_tests.value()
+       << std::endl;
+    gauge("turner_occluder_cache_hits",
+          "Number of shadow rays blocked by the last occluder of the light.");
+    os << "turner_occluder_cache_hits " << stats.occluder_cache_hits.value()
+       << std::endl;
+
+    const auto stages = stats.stages();
+    auto stage_metric = [&os, &gauge, &stages](const char* name,
+                                               const char* help, auto value) {
+        gauge(name, help);
+        for (const auto& stage : stages) {
+            os << name << "{stage=\"" << stage.name << "\"} " << value(stage)
+               << std::endl;
+        }
+    };
+    stage_metric("turner_stage_runs", "Number of runs of the stage.",
+                 [](const StageStats& s) { return s.count; });
+    stage_metric("turner_stage_wall_seconds", "Wall time of the stage.",
+                 [](const StageStats& s) { return s.wall_ms / 1000; });
+    stage_metric("turner_stage_cpu_seconds",
+                 "CPU time of the process during the stage.",
+                 [](const StageStats& s) { return s.cpu_ms / 1000; });
+    stage_metric("turner_stage_peak_rss_bytes",
+                 "Peak resident memory at the end of the stage.",
+                 [](const StageStats& s) { return s.peak_rss_bytes; });
+    stage_metric("turner_stage_heap_bytes",
+                 "Heap bytes allocated and not freed during the stage.",
+                 [](const StageStats& s) { return s.heap_bytes; });
+}
+
+/**
+ * Write the stats to a file, as JSON if the filename ends with `.json`,
+ * otherwise in the Prometheus text format.
+ *
+ * @throw std::runtime_error if the file could not be written
+ */
+inline void write_stats(const std::string& filename, const Stats& stats) {
+    std::ofstream file(filename);
+    const std::string json_ext = ".json";
+    if (filename.size() >= json_ext.size() &&
+        filename.compare(filename.size() - json_ext.size(), json_ext.size(),
+                         json_ext) == 0) {
+        write_stats_json(file, stats);
+    } else {
+        write_stats_prometheus(file, stats);
+    }
+    if (!file) {
+        throw std::runtime_error("could not write stats to " + filename);
+    }
+}
@@ -0,0 +1,284 @@
+#pragma once
+
+/**
+ * Tile-based scheduling of image rendering.
+ *
+ * The image is split into square tiles, which are ordered by a space-filling
+ * curve or a spiral, s.t. consecutive tiles are close to each other in the
+ * image (and thus mostly in the scene). Initially, every worker thread owns a
+ * contiguous range of tiles in that order. When its range is exhausted, the
+ * worker steals the back half of the range of another worker. This keeps the
+ * load balanced on scenes with uneven cost, while every worker mostly renders
+ * neighboring tiles.
+ */
+
+#include <ThreadPool.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+enum class TileOrder { SCANLINE, MORTON, SPIRAL };
+
+inline TileOrder parse_tile_order(const std::string& order) {
+    if (order == "scanline") {
+        return TileOrder::SCANLINE;
+    } else if (order == "morton") {
+        return TileOrder::MORTON;
+    } else if (order == "spiral") {
+        return TileOrder::SPIRAL;
+    }
+    throw std::runtime_error("unknown tile order: " + order);
+}
+
+inline const char* to_string(TileOrder order) {
+    switch (order) {
+    case TileOrder::SCANLINE:
+        return "scanline";
+    case TileOrder::MORTON:
+        return "morton";
+    case TileOrder::SPIRAL:
+        return "spiral";
+    }
+    return "";
+}
+
+/**
+ * Rectangle of pixels [x0, x1) x [y0, y1) of an image.
+ */
+struct Tile {
+    size_t x0, y0;
+    size_t x1, y1;
+
+    size_t width() const { return x1 - x0; }
+    size_t height() const { return y1 - y0; }
+};
+
+namespace detail {
+
+// Interleave bits of x and y (x in the even bits), cf. Morton order.
+inline uint64_t morton_code(uint32_t x, uint32_t y) {
+    uint64_t code = 0;
+    for (int bit = 0; bit < 32; ++bit) {
+        code |= static_cast<uint64_t>((x >> bit) & 1) << (2 * bit);
+        code |= static_cast<uint64_t>((y >> bit) & 1) << (2 * bit + 1);
+    }
+    return code;
+}
+
+// Tile coordinates (in units of tiles) in traversal order.
+inline std::vector<std::pair<size_t, size_t>>
+tile_coordinates(size_t num_x, size_t num_y, TileOrder order) {
+    std::vector<std::pair<size_t, size_t>> coords;
+    coords.reserve(num_x * num_y);
+
+    if (order == TileOrder::SPIRAL) {
+        // Walk a square spiral from the center tile outwards, and skip all
+        // positions outside of the image.
+        long x = (num_x - 1) / 2;
+        long y = (num_y - 1) / 2;
+        long dx = 1, dy = 0;
+        for (long leg = 1; coords.size() < num_x * num_y; ++leg) {
+            // two legs of the same length, then the length increases
+            for (int turn = 0; turn < 2; ++turn) {
+                for (long step = 0; step < leg; ++step) {
+                    if (0 <= x && x < static_cast<long>(num_x) && 0 <= y &&
+                        y < static_cast<long>(num_y)) {
+                        coords.emplace_back(x, y);
+                    }
+                    x += dx;
+                    y += dy;
+                }
+                std::swap(dx, dy);
+                dx = -dx;
+            }
+        }
+        return coords;
+    }
+
+    for (size_t y = 0; y < num_y; ++y) {
+        for (size_t x = 0; x < num_x; ++x) {
+            coords.emplace_back(x, y);
+        }
+    }
+    if (order == TileOrder::MORTON) {
+        std::sort(coords.begin(), coords.end(),
+                  [](const std::pair<size_t, size_t>& a,
+                     const std::pair<size_t, size_t>& b) {
+                      return morton_code(a.first, a.second) <
+                             morton_code(b.first, b.second);
+                  });
+    }
+    return coords;
+}
+
+// Range of tile indexes owned by a worker. The owner takes tiles from the
+// front, other workers steal from the back.
+struct TileRange {
+    std::mutex mutex;
+    size_t begin = 0;
+    size_t end = 0;
+};
+
+} // namespace detail
+
+/**
+ * Split an image into square tiles.
+ *
+ * Tiles at the right and bottom border of the image are cropped.
+ *
+ * @param  width, height image size in pixels
+ * @param  tile_size     side length of a tile in pixels
+ * @param  order         order of the resulting tiles
+ * @return               tiles covering the image, each pixel exactly once
+ */
+inline std::vector<Tile> make_tiles(size_t width, size_t height,
+                                    size_t tile_size, TileOrder order) {
+    assert(tile_size > 0);
+    size_t num_x = (width + tile_size - 1) / tile_size;
+    size_t num_y = (height + tile_size - 1) / tile_size;
+
+    std::vector<Tile> tiles;
+    tiles.reserve(num_x * num_y);
+    for (const auto& coord : detail::tile_coordinates(num_x, num_y, order)) {
+        size_t x0 = coord.first * tile_size;
+        size_t y0 = coord.second * tile_size;
+        tiles.push_back({x0, y0, std::min(x0 + tile_size, width),
+                         std::min(y0 + tile_size, height)});
+    }
+    return tiles;
+}
+
+/**
+ * Render tiles on a pool of worker threads with work stealing.
+ *
+ * Every worker creates its own context (e.g. a KDTreeIntersection with its
+ * traversal stack) exactly once, and reuses it for all tiles it renders.
+ *
+ * @param pool         thread pool running the workers, e.g. kept for all
+ *                     renderings of a service (cf. tracer_server.h)
+ * @param tiles        tiles to render
+ * @param num_threads  number of worker threads
+ * @param make_context called once per worker; creates the worker context
+ * @param render_tile  called as `render_tile(context, tile, tile_index)` for
+ *                     each tile exactly once
+ * @param on_progress  called with the number of rendered tiles after each
+ *                     tile; calls are serialized
+ */
+template <typename MakeContext, typename RenderTile>
+void render_tiles(ThreadPool& pool, const std::vector<Tile>& tiles,
+                  size_t num_threads, MakeContext make_context,
+                  RenderTile render_tile,
+                  std::function<void(size_t)> on_progress = {}) {
+    assert(num_threads > 0);
+    std::unique_ptr<detail::TileRange[]> ranges(
+        new detail::TileRange[num_threads]);
+    for (size_t i = 0; i < num_threads; ++i) {
+        ranges[i].begin = i * tiles.size() / num_threads;
+        ranges[i].end = (i + 1) * tiles.size() / num_threads;
+    }
+
+    // Take the next tile from the own range, or steal one.
+    auto next_tile = [&ranges, num_threads](size_t worker, size_t& index) {
+        auto& own = ranges[worker];
+        {
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (own.begin < own.end) {
+                index = own.begin++;
+                return true;
+            }
+        }
+
+        for (size_t i = 1; i < num_threads; ++i) {
+            auto& victim = ranges[(worker + i) % num_threads];
+            size_t begin, end;
+            {
+                std::lock_guard<std::mutex> lock(victim.mutex);
+                if (victim.begin == victim.end) {
+                    continue;
+                }
+                // the back half, s.t. the victim keeps the tiles next to the
+                // ones it has just rendered
+                end = victim.end;
+                begin = end - (end - victim.begin + 1) / 2;
+                victim.end = begin;
+            }
+
+            std::lock_guard<std::mutex> lock(own.mutex);
+            index = begin;
+            own.begin = begin + 1;
+            own.end = end;
+            return true;
+        }
+        return false;
+    };
+
+    std::mutex progress_mutex;
+    size_t num_completed = 0;
+    // set by a failing worker, s.t. the others stop taking tiles
+    std::atomic<bool> failed(false);
+
+    std::vector<std::future<void>> workers;
+    std::exception_ptr error;
+    try {
+        for (size_t worker = 0; worker < num_threads; ++worker) {
+            workers.emplace_back(pool.enqueue([&, worker]() {
+                try {
+                    auto context = make_context();
+                    size_t index;
+                    while (!failed && next_tile(worker, index)) {
+                        render_tile(context, tiles[index], index);
+
+                        std::lock_guard<std::mutex> lock(progress_mutex);
+                        num_completed += 1;
+                        if (on_progress) {
+                            on_progress(num_completed);
+                        }
+                    }
+                } catch (...) {
+                    failed = true;
+                    throw;
+                }
+            }));
+        }
+    } catch (...) {
+        failed = true;
+        error = std::current_exception();
+    }
+
+    // The workers access the ranges and the progress on this stack, i.e.
+    // all of them have to finish, before the first error is rethrown.
+    for (auto& worker : workers) {
+        try {
+            worker.get();
+        } catch (...) {
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+/**
+ * Render tiles on a new pool of `num_threads` threads (cf. above).
+ */
+template <typename MakeContext, typename RenderTile>
+void render_tiles(const std::vector<Tile>& tiles, size_t num_threads,
+                  MakeContext make_context, RenderTile render_tile,
+                  std::function<void(size_t)> on_progress = {}) {
+    ThreadPool pool(num_threads);
+    render_tiles(pool, tiles, num_threads, make_context, render_tile,
+                 on_progress);
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include "types.h"
+
+#include <array>
+#include <cmath>
+#include <stdexcept>
+
+/**
+ * Affine transformation x -> A x + t of points, vectors and normals, e.g.
+ * from the object space of an instanced mesh into world space (cf.
+ * instancing.h).
+ *
+ * Vectors are only transformed by A, and normals by the inverse transpose of
+ * A, s.t. they stay perpendicular to the transformed surface.
+ */
+class Transform {
+public:
+    // identity
+    Transform() : Transform({1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0}) {}
+
+    /**
+     * @param m rows of the 3x4 matrix [A | t]
+     */
+    explicit Transform(const std::array<float, 12>& m) {
+        for (size_t row = 0; row < 3; ++row) {
+            for (size_t col = 0; col < 3; ++col) {
+                a_[row][col] = m[4 * row + col];
+            }
+            t_[row] = m[4 * row + 3];
+        }
+
+        // cofactor matrix, which is the inverse transpose times det(A)
+        for (size_t row = 0; row < 3; ++row) {
+            for (size_t col = 0; col < 3; ++col) {
+                const size_t r0 = (row + 1) % 3, r1 = (row + 2) % 3;
+                const size_t c0 = (col + 1) % 3, c1 = (col + 2) % 3;
+                cof_[row][col] =
+                    a_[r0][c0] * a_[r1][c1] - a_[r0][c1] * a_[r1][c0];
+            }
+        }
+        det_ = a_[0][0] * cof_[0][0] + a_[0][1] * cof_[0][1] +
+               a_[0][2] * cof_[0][2];
+    }
+
+    static Transform translation(const Vector3f& t) {
+        return Transform({1, 0, 0, t.x, 0, 1, 0, t.y, 0, 0, 1, t.z});
+    }
+
+    static Transform scale(float s) {
+        return Transform({s, 0, 0, 0, 0, s, 0, 0, 0, 0, s, 0});
+    }
+
+    float det() const { return det_; }
+
+    Point3f operator()(const Point3f& p) const {
+        const Vector3f v = (*this)(Vector3f(p));
+        return {v.x + t_[0], v.y + t_[1], v.z + t_[2]};
+    }
+
+    Vector3f operator()(const Vector3f& v) const {
+        return {a_[0][0] * v.x + a_[0][1] * v.y + a_[0][2] * v.z,
+                a_[1][0] * v.x + a_[1][1] * v.y + a_[1][2] * v.z,
+                a_[2][0] * v.x + a_[2][1] * v.y + a_[2][2] * v.z};
+    }
+
+    /**
+     * The result is not normalized; its orientation is flipped, if the
+     * transformation mirrors.
+     */
+    Normal3f operator()(const Normal3f& n) const {
+        const float s = det_ < 0 ? -1 : 1;
+        return {s * (cof_[0][0] * n.x + cof_[0][1] * n.y + cof_[0][2] * n.z),
+                s * (cof_[1][0] * n.x + cof_[1][1] * n.y + cof_[1][2] * n.z),
+                s * (cof_[2][0] * n.x + cof_[2][1] * n.y + cof_[2][2] * n.z)};
+    }
+
+    /**
+     * The direction is not normalized, s.t. the ray parameter of a point is
+     * the same in both spaces.
+     */
+    Ray operator()(const Ray& ray) const {
+        return Ray((*this)(ray.o), (*this)(ray.d), ray.t_max);
+    }
+
+    /**
+     * Box containing the transformed box, i.e. the box of its transformed
+     * corners.
+     */
+    Bbox3f operator()(const Bbox3f& box) const {
+        Bbox3f res((*this)(box.p_min), (*this)(box.p_min));
+        for (size_t corner = 1; corner < 8; ++corner) {
+            const Point3f p((corner & 1 ? box.p_max : box.p_min).x,
+                            (corner & 2 ? box.p_max : box.p_min).y,
+                            (corner & 4 ? box.p_max : box.p_min).z);
+            res = bbox_union(res, (*this)(p));
+        }
+        return res;
+    }
+
+    /**
+     * Throws std::runtime_error, if the transformation is not invertible.
+     */
+    Transform inverse() const {
+        if (det_ == 0 || !std::isfinite(det_)) {
+            throw std::runtime_error("transformation is not invertible");
+        }
+        std::array<float, 12> m;
+        for (size_t row = 0; row < 3; ++row) {
+            // the inverse of A is the transposed cofactor matrix over det(A)
+            for (size_t col = 0; col < 3; ++col) {
+                m[4 * row + col] = cof_[col][row] / det_;
+            }
+            m[4 * row + 3] = -(m[4 * row] * t_[0] + m[4 * row + 1] * t_[1] +
+                               m[4 * row + 2] * t_[2]);
+        }
+        return Transform(m);
+    }
+
+private:
+    float a_[3][3];
+    float t_[3];
+    float cof_[3][3];
+    float det_;
+};
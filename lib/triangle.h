@@ -6,8 +6,13 @@
 #include <cereal/types/array.hpp>
 #include <cereal/types/vector.hpp>
 
+#include <algorithm>
 #include <array>
+#include <cassert>
+#include <cstdint>
+#include <iterator>
 #include <vector>
+#include <xmmintrin.h>
 
 //
 // Do NOT modify data in the triangle after its construction! The precomputed
@@ -20,15 +25,15 @@ public:
     Triangle() = default;
 
     Triangle(std::array<Point3f, 3> vs, std::array<Normal3f, 3> ns,
-             const aiColor4D& ambient, const aiColor4D& diffuse,
-             const aiColor4D& emissive, const aiColor4D& reflective,
+             const Color& ambient, const Color& diffuse,
+             const Color& emissive, const Color& reflective,
              const float reflectivity)
-        : vertices(vs)
-        , normals(ns)
-        , ambient(ambient)
+        : ambient(ambient)
         , diffuse(diffuse)
         , emissive(emissive)
-        , reflective(reflective)     // reflective color
+        , reflective(reflective) // reflective color
+        , vertices(vs)
+        , normals(ns)
         , reflectivity(reflectivity) // reflectivity factor
         , u(vertices[1] - vertices[0])
         , v(vertices[2] - vertices[0])
@@ -43,8 +48,7 @@ public:
         : Triangle(vs, {Normal3f{}, Normal3f{}, Normal3f{}}, {}, {}, {}, {},
                    0) {}
 
-    friend bool intersect_ray_triangle(const Ray& ray, const Triangle& tri,
-                                       float& r, float& s, float& t);
+    friend class CompactTriangle;
 
     /**
      * Interpolate normal using barycentric coordinates.
@@ -92,12 +96,13 @@ public:
     }
 
     // members
+    // the colors are first, s.t. they are aligned without padding
+    Color ambient;
+    Color diffuse;
+    Color emissive;
+    Color reflective;
     std::array<Point3f, 3> vertices;
     std::array<Normal3f, 3> normals;
-    aiColor4D ambient;
-    aiColor4D diffuse;
-    aiColor4D emissive;
-    aiColor4D reflective;
     float reflectivity;
 
     // precomputed
@@ -119,3 +124,77 @@ private:
 };
 
 using Triangles = std::vector<Triangle>;
+
+/**
+ * The part of a triangle needed to intersect it with a ray.
+ *
+ * A `Triangle` also carries normals and materials, which are only needed for
+ * shading the final hit. Intersection tests in the hot path use this compact
+ * representation instead, which fits exactly into one cache line.
+ */
+class alignas(64) CompactTriangle {
+public:
+    CompactTriangle() = default;
+
+    explicit CompactTriangle(const Triangle& tri)
+        : p0(tri.vertices[0]), normal(tri.normal), u(tri.u), v(tri.v) {}
+
+    friend bool intersect_ray_triangle(const Ray& ray,
+                                       const CompactTriangle& tri, float& r,
+                                       float& s, float& t);
+    friend __m128 intersect_ray_triangle(const __m128 o[3], const __m128 d[3],
+                                         const CompactTriangle& tri, __m128& r,
+                                         __m128& s, __m128& t);
+
+private:
+    Point3f p0;
+    Normal3f normal;
+    // edges from p0 to the other two vertices
+    Vector3f u, v;
+};
+
+static_assert(sizeof(CompactTriangle) == 64,
+              "compact triangle should fill exactly one cache line");
+
+/**
+ * Up to 4 compact triangles in SoA layout, s.t. a ray is intersected with all
+ * of them at once (SSE), cf. `intersect_ray_triangles`.
+ *
+ * The triangles of a kd-tree leaf are stored in consecutive bundles. Unused
+ * lanes contain a degenerate triangle, which is never hit.
+ */
+struct alignas(16) TriangleBundle {
+    static constexpr size_t SIZE = 4;
+    static constexpr uint32_t INVALID_ID = 0xFFFFFFFF;
+
+    TriangleBundle() {
+        std::fill(std::begin(ids), std::end(ids), INVALID_ID);
+    }
+
+    /**
+     * Put a triangle into a lane of the bundle.
+     */
+    void set(size_t lane, const Triangle& tri, uint32_t id) {
+        assert(lane < SIZE);
+        for (size_t ax = 0; ax < 3; ++ax) {
+            p0[ax][lane] = tri.vertices[0][ax];
+            normal[ax][lane] = tri.normal[ax];
+            u[ax][lane] = tri.u[ax];
+            v[ax][lane] = tri.v[ax];
+        }
+        ids[lane] = id;
+    }
+
+    template <class Archive> void serialize(Archive& archive) {
+        archive(p0, normal, u, v, ids);
+    }
+
+    // coordinates along each axis of the vertex p0, of the normal and of the
+    // edges u, v of all triangles (cf. CompactTriangle)
+    float p0[3][SIZE] = {};
+    float normal[3][SIZE] = {};
+    float u[3][SIZE] = {};
+    float v[3][SIZE] = {};
+    // id of the triangle in each lane, or INVALID_ID
+    uint32_t ids[SIZE];
+};
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "../src/geometry.h"
+#include "color.h"
 
 #include <assimp/camera.h>
 #include <assimp/types.h>
@@ -52,13 +53,12 @@ using turner::Point3f;
 using turner::Normal3f;
 using turner::Bbox3f;
 using turner::Ray;
+using turner::PrecomputedRay;
 using turner::Vector2f;
 using turner::Vector2i;
 
 static constexpr auto AXES3 = turner::AXES3;
 
-using Color = aiColor4D;
-
 inline Color operator/(const Color& c, size_t x) {
     return c / static_cast<float>(x);
 }
@@ -0,0 +1,305 @@
+/**
+ * Rasterized primary visibility.
+ *
+ * A visibility buffer stores the id of the triangle visible at one raster
+ * point of every pixel. It is computed by rasterizing all triangles with a
+ * depth test instead of traversing the acceleration structure with a primary
+ * ray per pixel. The hit of a primary ray is then the intersection of the ray
+ * with this single triangle (cf. `VisibilityBuffer::hit`), which is exactly
+ * the hit of the traced ray.
+ *
+ * The raster point of the pixel (x, y) is (x + jitter_x, y + jitter_y) with a
+ * jitter in [0, 1)², like the primary rays of the tracers. The point p of the
+ * primary ray o + t * d(x, y) through the raster point (cf. camera_rays.h)
+ * satisfies
+ *
+ *     p - o = t * (base + x * step_x + y * step_y) = M * (t x, t y, t)
+ *
+ * with the matrix M = (step_x, step_y, base). Hence, M^-1 (p - o) are
+ * homogeneous raster coordinates, and 1/t is affine in raster space. The
+ * depth test keeps the largest 1/t.
+ */
+
+#pragma once
+
+#include "array_view.h"
+#include "camera_rays.h"
+#include "intersection.h"
+#include "intersector.h"
+#include "triangle.h"
+#include "types.h"
+
+#include <ThreadPool.h>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <future>
+#include <vector>
+
+namespace detail {
+
+// Triangle projected into raster space
+struct RasterTriangle {
+    std::array<float, 3> x, y;
+    // reciprocal distance of the corners in units of the ray direction
+    std::array<float, 3> inv_t;
+    Intersector::TriangleId id;
+};
+
+// Triangles are clipped at this distance from the camera in units of the ray
+// direction, since the raster coordinates of the camera plane are infinite.
+constexpr float NEAR_T = 1e-4f;
+
+/**
+ * Project the triangle into raster space. The triangle is clipped at NEAR_T,
+ * which gives a polygon with up to 4 corners. It is triangulated as a fan.
+ *
+ * @param inverse rows of M^-1 (cf. above)
+ */
+inline void project_triangle(const Triangle& triangle,
+                             Intersector::TriangleId id, const Point3f& origin,
+                             const std::array<Vector3f, 3>& inverse,
+                             std::vector<RasterTriangle>& raster_triangles) {
+    // homogeneous raster coordinates of the corners
+    std::array<Vector3f, 3> q;
+    for (int i = 0; i < 3; ++i) {
+        const Vector3f v = triangle.vertices[i] - origin;
+        q[i] = Vector3f(dot(inverse[0], v), dot(inverse[1], v),
+                        dot(inverse[2], v));
+    }
+
+    // Sutherland-Hodgman clipping at t = NEAR_T
+    std::array<Vector3f, 4> polygon;
+    int num_corners = 0;
+    for (int i = 0; i < 3; ++i) {
+        const Vector3f& a = q[i];
+        const Vector3f& b = q[(i + 1) % 3];
+        if (a.z >= NEAR_T) {
+            polygon[num_corners++] = a;
+        }
+        if ((a.z >= NEAR_T) != (b.z >= NEAR_T)) {
+            const float s = (NEAR_T - a.z) / (b.z - a.z);
+            polygon[num_corners++] = a + s * (b - a);
+        }
+    }
+
+    for (int i = 1; i + 1 < num_corners; ++i) {
+        RasterTriangle raster_triangle;
+        raster_triangle.id = id;
+        const std::array<int, 3> corners = {{0, i, i + 1}};
+        for (int k = 0; k < 3; ++k) {
+            const Vector3f& corner = polygon[corners[k]];
+            raster_triangle.inv_t[k] = 1 / corner.z;
+            raster_triangle.x[k] = corner.x * raster_triangle.inv_t[k];
+            raster_triangle.y[k] = corner.y * raster_triangle.inv_t[k];
+        }
+        raster_triangles.push_back(raster_triangle);
+    }
+}
+
+// Twice the signed area of the triangle (a, b, p)
+inline float edge_function(float ax, float ay, float bx, float by, float px,
+                           float py) {
+    return (bx - ax) * (py - ay) - (by - ay) * (px - ax);
+}
+
+// floor(v) clamped to [0, size], i.e. the raster points of the pixel i are
+// in [i, i + 1)
+inline size_t clamped_floor(float v, size_t size) {
+    if (!(v > 0)) {
+        return 0;
+    }
+    return v < size ? static_cast<size_t>(v) : size;
+}
+
+} // namespace detail
+
+/**
+ * Triangle visible at a raster point of every pixel (cf. above).
+ */
+class VisibilityBuffer {
+public:
+    using Hit = Intersector::Hit;
+    using OptionalId = Intersector::OptionalId;
+
+    VisibilityBuffer(size_t width, size_t height)
+        : width_(width), height_(height), ids_(width * height) {}
+
+    size_t width() const { return width_; }
+    size_t height() const { return height_; }
+
+    OptionalId& operator()(size_t x, size_t y) {
+        assert(x < width_ && y < height_);
+        return ids_[y * width_ + x];
+    }
+    const OptionalId& operator()(size_t x, size_t y) const {
+        assert(x < width_ && y < height_);
+        return ids_[y * width_ + x];
+    }
+
+    /**
+     * Hit of the primary ray through the raster point of the pixel.
+     *
+     * The ray is only intersected with the visible triangle. If the raster
+     * point is exactly on an edge, the ray may miss the triangle due to
+     * rounding, and it is traced instead.
+     */
+    Hit hit(size_t x, size_t y, const Ray& ray,
+            Intersector& intersector) const {
+        Hit hit;
+        const OptionalId id = (*this)(x, y);
+        if (!id) {
+            return hit;
+        }
+        if (intersect_ray_triangle(ray, intersector[id], hit.r, hit.a,
+                                   hit.b)) {
+            hit.id = id;
+        } else {
+            hit.id = intersector.intersect(ray, hit.r, hit.a, hit.b);
+        }
+        return hit;
+    }
+
+private:
+    size_t width_;
+    size_t height_;
+    std::vector<OptionalId> ids_;
+};
+
+/**
+ * Rasterize the triangles into the visibility buffer of the camera.
+ *
+ * The triangles are projected in parallel, and the image is rasterized in
+ * bands of rows, one task per band. Every band is rasterized in the order of
+ * the triangles. Hence, the buffer does not depend on the number of threads.
+ *
+ * @param triangles   triangles identified by their index
+ * @param camera_rays primary rays of the image
+ * @param make_jitter called once per task; creates the function
+ *                    `jitter(x, y)`, which returns the jitter of the raster
+ *                    point of the pixel (x, y) in [0, 1)²
+ * @param pool        thread pool running the tasks
+ * @param num_threads number of threads of the pool
+ */
+template <typename MakeJitter>
+VisibilityBuffer
+rasterize_visibility(ArrayView<Triangle> triangles,
+                     const CameraRays& camera_rays, size_t width,
+                     size_t height, MakeJitter make_jitter, ThreadPool& pool,
+                     size_t num_threads) {
+    assert(num_threads > 0);
+
+    // rows of M^-1
+    const Vector3f& step_x = camera_rays.step_x();
+    const Vector3f& step_y = camera_rays.step_y();
+    const Vector3f& base = camera_rays.base();
+    const float det = dot(step_x, cross(step_y, base));
+    const std::array<Vector3f, 3> inverse = {{cross(step_y, base) / det,
+                                              cross(base, step_x) / det,
+                                              cross(step_x, step_y) / det}};
+
+    std::vector<std::future<std::vector<detail::RasterTriangle>>> chunks;
+    for (size_t chunk = 0; chunk < num_threads; ++chunk) {
+        chunks.emplace_back(pool.enqueue([&, chunk]() {
+            std::vector<detail::RasterTriangle> raster_triangles;
+            const size_t end = (chunk + 1) * triangles.size() / num_threads;
+            for (size_t id = chunk * triangles.size() / num_threads; id < end;
+                 ++id) {
+                detail::project_triangle(triangles[id], id,
+                                         camera_rays.origin(), inverse,
+                                         raster_triangles);
+            }
+            return raster_triangles;
+        }));
+    }
+    std::vector<detail::RasterTriangle> raster_triangles;
+    for (auto& chunk : chunks) {
+        const auto projected = chunk.get();
+        raster_triangles.insert(raster_triangles.end(), projected.begin(),
+                                projected.end());
+    }
+
+    // More bands than threads balance the bands with many triangles.
+    VisibilityBuffer buffer(width, height);
+    const size_t num_bands = std::min(height, 4 * num_threads);
+    std::vector<std::future<void>> bands;
+    for (size_t band = 0; band < num_bands; ++band) {
+        bands.emplace_back(pool.enqueue([&, band]() {
+            const size_t y0 = band * height / num_bands;
+            const size_t y1 = (band + 1) * height / num_bands;
+
+            // raster points and depths of the pixels of the band
+            auto jitter = make_jitter();
+            std::vector<float> xs((y1 - y0) * width), ys(xs.size());
+            for (size_t y = y0; y < y1; ++y) {
+                for (size_t x = 0; x < width; ++x) {
+                    const std::array<float, 2> offset = jitter(x, y);
+                    xs[(y - y0) * width + x] = x + offset[0];
+                    ys[(y - y0) * width + x] = y + offset[1];
+                }
+            }
+            std::vector<float> depths(xs.size(), 0);
+
+            for (const auto& tri : raster_triangles) {
+                // twice the signed area; skip triangles without area in
+                // raster space
+                const float area =
+                    detail::edge_function(tri.x[0], tri.y[0], tri.x[1],
+                                          tri.y[1], tri.x[2], tri.y[2]);
+                if (!std::isnormal(area)) {
+                    continue;
+                }
+                const float sign = area > 0 ? 1 : -1;
+
+                const auto x_range =
+                    std::minmax({tri.x[0], tri.x[1], tri.x[2]});
+                const auto y_range =
+                    std::minmax({tri.y[0], tri.y[1], tri.y[2]});
+                const size_t x_begin =
+                    detail::clamped_floor(x_range.first, width);
+                const size_t x_end =
+                    detail::clamped_floor(x_range.second + 1, width);
+                const size_t y_begin =
+                    std::max(y0, detail::clamped_floor(y_range.first, height));
+                const size_t y_end = std::min(
+                    y1, detail::clamped_floor(y_range.second + 1, height));
+
+                for (size_t y = y_begin; y < y_end; ++y) {
+                    for (size_t x = x_begin; x < x_end; ++x) {
+                        // Raster points on an edge are covered, s.t. there
+                        // are no holes between adjacent triangles.
+                        const size_t i = (y - y0) * width + x;
+                        const float w0 = sign * detail::edge_function(
+                                                    tri.x[1], tri.y[1],
+                                                    tri.x[2], tri.y[2], xs[i],
+                                                    ys[i]);
+                        const float w1 = sign * detail::edge_function(
+                                                    tri.x[2], tri.y[2],
+                                                    tri.x[0], tri.y[0], xs[i],
+                                                    ys[i]);
+                        const float w2 = sign * detail::edge_function(
+                                                    tri.x[0], tri.y[0],
+                                                    tri.x[1], tri.y[1], xs[i],
+                                                    ys[i]);
+                        if (w0 < 0 || w1 < 0 || w2 < 0) {
+                            continue;
+                        }
+                        const float inv_t =
+                            (w0 * tri.inv_t[0] + w1 * tri.inv_t[1] +
+                             w2 * tri.inv_t[2]) /
+                            (sign * area);
+                        if (depths[i] < inv_t) {
+                            depths[i] = inv_t;
+                            buffer(x, y) = Intersector::OptionalId(tri.id);
+                        }
+                    }
+                }
+            }
+        }));
+    }
+    for (auto& band : bands) {
+        band.get();
+    }
+    return buffer;
+}
@@ -0,0 +1,298 @@
+#pragma once
+
+/**
+ * Wavefront path tracing.
+ *
+ * Instead of tracing every path recursively to its end, all paths of a batch
+ * (e.g. all pixel samples of a tile) are advanced together by one bounce at a
+ * time. Every bounce consists of stages, each of which is a loop over a queue
+ * of rays:
+ *
+ * 1. extend: intersect the path rays with the scene in one batch,
+ * 2. shade: add the background to the paths leaving the scene, and the
+ *    emission of the emitters hit, create one shadow ray per point light and
+ *    one to a sampled point on the emitters, and continue the path with a
+ *    single sampled ray,
+ * 3. shadow: test the shadow rays for occlusion in one batch, and add the
+ *    direct light of the unoccluded ones.
+ *
+ * The batch is generated by the caller, e.g. from primary rays. Paths are
+ * terminated at the maximum depth or by Russian roulette.
+ *
+ * Secondary rays are incoherent: neighbors in the queue start at distant
+ * points in different directions. Optionally, the queues of secondary rays
+ * are sorted by the direction octant and the Morton code of the origin (cf.
+ * `ray_sort_key` of intersector.h) before they are traced, s.t. the rays of
+ * a packet, and consecutive packets, traverse the same nodes of the tree.
+ */
+
+#include "emitters.h"
+#include "intersector.h"
+#include "profile.h"
+#include "sampling.h"
+#include "stats.h"
+#include "types.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace wavefront {
+
+/**
+ * State of a path between two bounces.
+ */
+struct Path {
+    Ray ray;
+    // weight of the radiance arriving along the ray
+    Color throughput;
+    // index of the pixel the path contributes to
+    uint32_t pixel;
+    // density of the ray direction w.r.t. solid angle, if it was sampled on
+    // the hemisphere of the previous bounce, 0 for primary rays
+    float pdf = 0;
+};
+
+/**
+ * Shadow ray with the direct light it contributes, if it is unoccluded.
+ */
+struct ShadowRay {
+    Ray ray;
+    float t_max;
+    Color radiance;
+    uint32_t pixel;
+};
+
+// Paths are terminated by Russian roulette starting at this depth.
+static constexpr int RUSSIAN_ROULETTE_DEPTH = 2;
+
+/**
+ * Sort rays (e.g. paths or shadow rays) by their sort keys. Rays with the
+ * same key keep their order.
+ *
+ * @param rays   items with a member `ray`
+ * @param keys   buffer of the keys and indices
+ * @param sorted buffer of the sorted rays; swapped with rays
+ */
+template <typename T>
+void sort_rays(std::vector<T>& rays,
+               std::vector<std::pair<uint32_t, uint32_t>>& keys,
+               std::vector<T>& sorted) {
+    if (rays.size() < 2) {
+        return;
+    }
+
+    // the origins are quantized in their bounding box
+    Bbox3f box(rays.front().ray.o);
+    for (const auto& item : rays) {
+        box = bbox_union(box, item.ray.o);
+    }
+
+    keys.clear();
+    for (uint32_t i = 0; i < rays.size(); ++i) {
+        keys.emplace_back(ray_sort_key(rays[i].ray, box), i);
+    }
+    std::sort(keys.begin(), keys.end());
+
+    sorted.clear();
+    for (const auto& key : keys) {
+        sorted.push_back(rays[key.second]);
+    }
+    std::swap(rays, sorted);
+}
+
+/**
+ * Trace paths until all of them are terminated.
+ *
+ * Estimates the same light equation as the recursive pathtracer (cf.
+ * pathtracer.cpp), with a single continuation ray per bounce instead of
+ * `num_monte_carlo_samples` ones. As there, the emitters are sampled
+ * explicitly as well as hit by the continuation rays, and both estimates are
+ * weighted by the power heuristic.
+ *
+ * @param tree_intersection kd-tree containing the scene
+ * @param lights            point lights of the scene
+ * @param emitters          emissive triangles of the scene
+ * @param paths             initial paths, e.g. primary rays
+ * @param max_depth         maximum number of bounces of a path
+ * @param bg_color          radiance of rays leaving the scene
+ * @param radiance          radiance of every path is added to
+ *                          radiance[path.pixel]
+ * @param sort              sort the secondary rays before tracing them (cf.
+ *                          `sort_rays`)
+ */
+inline void trace_paths(Intersector& tree_intersection,
+                        const std::vector<Light>& lights,
+                        const Emitters& emitters, std::vector<Path> paths,
+                        int max_depth,
+                        const Color& bg_color, std::vector<Color>& radiance,
+                        bool sort = false) {
+    turner::Profile _(turner::ProfCategory::Trace);
+    using Clock = std::chrono::steady_clock;
+
+    // The rays of a stage are traced as one batch (cf.
+    // `Intersector::intersect_batch`).
+    std::vector<Ray> rays;
+    std::vector<float> t_max;
+    std::vector<Intersector::Hit> hits;
+    std::vector<uint8_t> occluded;
+    std::vector<ShadowRay> shadow_rays;
+    std::vector<Path> next_paths;
+    std::vector<ShadowRay> sorted_shadow_rays;
+    std::vector<std::pair<uint32_t, uint32_t>> keys;
+
+    for (int depth = 0; !paths.empty(); ++depth) {
+        Stats::instance().num_rays += paths.size();
+        // The sorting is part of the cost of tracing the rays.
+        const auto start = Clock::now();
+
+        // extend (the primary rays are coherent already)
+        if (sort && 0 < depth) {
+            sort_rays(paths, keys, next_paths);
+        }
+        rays.clear();
+        for (const auto& path : paths) {
+            rays.push_back(path.ray);
+        }
+        tree_intersection.intersect_batch(rays, hits);
+        const auto extended = Clock::now();
+
+        // shade
+        shadow_rays.clear();
+        next_paths.clear();
+        for (size_t i = 0; i < paths.size(); ++i) {
+            const auto& path = paths[i];
+            const auto& hit = hits[i];
+            if (!hit.id) {
+                radiance[path.pixel] += path.throughput * bg_color;
+                continue;
+            }
+
+            const auto& triangle = tree_intersection[hit.id];
+            const Point3f p = path.ray.o + hit.r * path.ray.d;
+            const Normal3f normal =
+                triangle.interpolate_normal(1.f - hit.a - hit.b, hit.a, hit.b);
+            const Point3f p2 = p + Vector3f(normal * 0.0001f);
+            const Color weight = path.throughput * triangle.diffuse;
+
+            // Emission: completely for primary rays, and weighted against
+            // the explicit sample of the previous bounce (cf. below) for
+            // continuation rays.
+            if (is_emissive(triangle)) {
+                if (depth == 0) {
+                    if (dot(path.ray.d, normal) < 0) {
+                        radiance[path.pixel] +=
+                            path.throughput * triangle.emissive;
+                    }
+                } else if (!emitters.empty()) {
+                    const float cos_light = -dot(path.ray.d, normal);
+                    if (0 < cos_light) {
+                        // the direction is normalized, i.e. r is the
+                        // distance to the emitter
+                        const float pdf =
+                            emitters.pdf() * hit.r * hit.r / cos_light;
+                        radiance[path.pixel] +=
+                            power_heuristic(1, path.pdf, 1, pdf) *
+                            path.throughput * triangle.emissive;
+                    }
+                }
+            }
+
+            // Direct lighting (lambertian): ρ/π cos(θ) L_light
+            for (const auto& light : lights) {
+                const Vector3f to_light = light.position - p2;
+                const float dist_to_light = to_light.length();
+                const Vector3f light_dir = to_light / dist_to_light;
+                const float cos_theta = dot(light_dir, normal);
+                if (cos_theta <= 0) {
+                    continue;
+                }
+                shadow_rays.push_back(
+                    {Ray(p2, light_dir), dist_to_light,
+                     weight * light.color *
+                         (cos_theta * static_cast<float>(M_1_PI)),
+                     path.pixel});
+            }
+
+            // Area lights: ρ/π cos(θ) L_emitter / pdf, with the density of
+            // the sample w.r.t. solid angle
+            if (!emitters.empty()) {
+                const auto sample = emitters.sample();
+                const Vector3f to_light = sample.position - p2;
+                const float dist_squared = to_light.length_squared();
+                const Vector3f light_dir = to_light / std::sqrt(dist_squared);
+                const float cos_theta = dot(light_dir, normal);
+                const float cos_light = -dot(light_dir, sample.normal);
+                if (0 < cos_theta && 0 < cos_light) {
+                    const float pdf = emitters.pdf() * dist_squared / cos_light;
+                    // the continuation ray is the other strategy, if any
+                    const float num_samples = depth < max_depth ? 1 : 0;
+                    const float mis = power_heuristic(
+                        1, pdf, num_samples, hemisphere_pdf(cos_theta));
+                    shadow_rays.push_back(
+                        {Ray(p2, to_light), 1 - EPS,
+                         weight * sample.emission *
+                             (mis * cos_theta / pdf *
+                              static_cast<float>(M_1_PI)),
+                         path.pixel});
+                }
+            }
+
+            if (depth >= max_depth) {
+                continue;
+            }
+
+            // Indirect lighting with a single cosine-weighted sample of the
+            // hemisphere: ρ/π cos(θ) L(ω) / (cos(θ)/π) = ρ L(ω)
+            Vector3f b1, b2;
+            const Vector3f n(normal);
+            sampling::orthonormal_basis(n, b1, b2);
+            const Vector3f local = sampling::cosine_hemisphere();
+            const Vector3f dir = local.x * b1 + local.y * b2 + local.z * n;
+            Color throughput = weight;
+
+            if (depth + 1 >= RUSSIAN_ROULETTE_DEPTH) {
+                const float survival = std::min(
+                    1.f, std::max({throughput.r, throughput.g, throughput.b}));
+                if (sampling::uniform() >= survival) {
+                    continue;
+                }
+                throughput /= survival;
+            }
+
+            next_paths.push_back({Ray(p2, dir), throughput, path.pixel,
+                                  hemisphere_pdf(local.z)});
+        }
+
+        // shadow
+        const auto shaded = Clock::now();
+        if (sort) {
+            sort_rays(shadow_rays, keys, sorted_shadow_rays);
+        }
+        rays.clear();
+        t_max.clear();
+        for (const auto& shadow_ray : shadow_rays) {
+            rays.push_back(shadow_ray.ray);
+            t_max.push_back(shadow_ray.t_max);
+        }
+        tree_intersection.occluded_batch(rays, t_max, occluded);
+        for (size_t i = 0; i < shadow_rays.size(); ++i) {
+            if (!occluded[i]) {
+                radiance[shadow_rays[i].pixel] += shadow_rays[i].radiance;
+            }
+        }
+
+        Stats::instance().count_bounce(
+            depth, paths.size() + shadow_rays.size(),
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                (extended - start) + (Clock::now() - shaded))
+                .count());
+        std::swap(paths, next_paths);
+    }
+}
+
+} // namespace wavefront
@@ -0,0 +1,56 @@
+#include "lib/raster.h"
+
+#include <docopt/docopt.h>
+
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+static const char* USAGE =
+    R"(Usage: merge <output> <accumulation>...
+
+Merge the accumulation buffers of progressive renderings of the same image,
+e.g. rendered on different nodes (cf. --node and --nodes of the tracers), into
+the accumulation buffer <output>. A tracer resumed from <output> renders the
+final image.
+)";
+
+int main(int argc, char const* argv[]) {
+    std::map<std::string, docopt::value> args =
+        docopt::docopt(USAGE, {argv + 1, argv + argc});
+    const auto& filenames = args.at("<accumulation>").asStringList();
+
+    std::vector<AccumulationBuffer> buffers;
+    for (const auto& filename : filenames) {
+        std::ifstream file(filename, std::ios::binary);
+        if (!file) {
+            std::cerr << "Could not open " << filename << std::endl;
+            return 1;
+        }
+        buffers.push_back(AccumulationBuffer::read(file));
+        if (buffers.back().width() != buffers.front().width() ||
+            buffers.back().height() != buffers.front().height()) {
+            std::cerr << filename << " has a different image size"
+                      << std::endl;
+            return 1;
+        }
+    }
+
+    AccumulationBuffer merged(buffers.front().width(),
+                              buffers.front().height());
+    for (const auto& buffer : buffers) {
+        merged.merge(buffer);
+    }
+    std::cerr << "Merged " << merged.num_passes() << " passes" << std::endl;
+
+    const std::string output = args.at("<output>").asString();
+    std::ofstream file(output, std::ios::binary);
+    merged.write(file);
+    if (!file) {
+        std::cerr << "Could not write " << output << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -1,8 +1,22 @@
 #include "pathtracer.h"
+#include "lib/emitters.h"
 #include "lib/lambertian.h"
+#include "lib/profile.h"
 #include "lib/sampling.h"
 #include "lib/stats.h"
 #include "trace.h"
+#include "tracer_main.h"
+
+struct Pathtracer {
+    // cf. wavefront.h, which traces the same paths
+    static constexpr bool WAVEFRONT = true;
+
+    static Color shade(const Ray& ray, const Intersector::Hit& hit,
+                       Intersector& tree_intersection,
+                       const std::vector<Light>& lights,
+                       const Emitters& emitters, int depth,
+                       const TracerConfig& conf);
+};
 
 /**
  * Return color of the object hit by (origin, dir) ray.
@@ -10,24 +24,28 @@
  * The color is calculated using the Monte-Carlo approximation of the light
  * equation, thefore it is not guaranteed that the calculated color values are
  * less than 1. E.g. an approximation of value 1 may be greater than 1.
+ *
+ * Area lights (emissive triangles) are sampled explicitly at every hit point
+ * in addition to the hemisphere samples. Both estimates of their light are
+ * combined with multiple importance sampling. Hence, the emission of a hit
+ * triangle is only added directly for primary rays.
  */
-Color trace(const Ray& ray, KDTreeIntersection& tree_intersection,
-            const std::vector<Light>& lights, int depth,
-            const TracerConfig& conf) {
-    if (depth > conf.max_recursion_depth) {
-        return {};
-    }
-
+inline Color Pathtracer::shade(const Ray& ray, const Intersector::Hit& hit,
+                               Intersector& tree_intersection,
+                               const std::vector<Light>& lights,
+                               const Emitters& emitters, int depth,
+                               const TracerConfig& conf) {
+    turner::Profile _(turner::ProfCategory::Trace);
     Stats::instance().num_rays += 1;
 
     // intersection
-    float dist_to_triangle, s, t;
-    auto triangle_id = tree_intersection.intersect(ray, dist_to_triangle, s, t);
-    if (!triangle_id) {
+    if (!hit.id) {
         return conf.bg_color;
     }
+    const auto triangle_id = hit.id;
+    float s = hit.a, t = hit.b;
 
-    Point3f p = ray.o + dist_to_triangle * ray.d;
+    Point3f p = ray.o + hit.r * ray.d;
 
     // interpolate normal
     const auto& triangle = tree_intersection[triangle_id];
@@ -35,68 +53,132 @@ Color trace(const Ray& ray, KDTreeIntersection& tree_intersection,
 
     Point3f p2 = p + Vector3f(normal * 0.0001f);
 
+    // emission seen by primary rays (cf. above)
+    Color emitted;
+    if (depth == 0 && dot(ray.d, normal) < 0) {
+        emitted = triangle.emissive;
+    }
+
+    // Hemisphere samples are taken only if the paths are continued.
+    const int num_samples =
+        depth < conf.max_recursion_depth ? conf.num_monte_carlo_samples : 0;
+
     //
     // Direct lightning
     //
 
     Color direct_lightning;
 
-    for (auto& light : lights) {
+    for (size_t i = 0; i < lights.size(); ++i) {
+        const auto& light = lights[i];
         // light direction
         auto light_dir = normalize(light.position - p);
         float dist_to_light = (light.position - p2).length();
-        float dist_to_next_triangle;
-        auto has_shadow = tree_intersection.intersect(
-            {p2, light_dir}, dist_to_next_triangle, s, t);
 
         // Do we get direct light?
-        if (!has_shadow || dist_to_next_triangle > dist_to_light) {
+        if (!tree_intersection.light_occluded(i, {p2, light_dir},
+                                              dist_to_light)) {
             // lambertian
             direct_lightning =
                 std::max(0.f, dot(light_dir, normal)) * light.color;
         }
     }
 
+    //
+    // Area lights (via explicit light sampling)
+    //
+
+    Color area_lightning;
+    if (!emitters.empty()) {
+        const auto sample = emitters.sample();
+        const Vector3f to_light = sample.position - p2;
+        const float dist_squared = to_light.length_squared();
+        const Vector3f light_dir = to_light / std::sqrt(dist_squared);
+        const float cos_theta = dot(light_dir, normal);
+        const float cos_light = -dot(light_dir, sample.normal);
+        // the area lights share the occluder cache slot after the point lights
+        if (0 < cos_theta && 0 < cos_light &&
+            !tree_intersection.light_occluded(lights.size(), {p2, to_light},
+                                              1 - EPS)) {
+            // density w.r.t. solid angle
+            const float pdf = emitters.pdf() * dist_squared / cos_light;
+            area_lightning =
+                power_heuristic(1, pdf, num_samples,
+                                hemisphere_pdf(cos_theta)) *
+                cos_theta / pdf * sample.emission;
+        }
+    }
+
     //
     // Indirect lightning (via Monte Carlo sampling)
     //
 
     Color indirect_lightning;
 
-    // Turn hemisphere according normal, i.e. Up(0, 0, 1) is turned so that
-    // it lies on normal of the hit point.
-    aiMatrix3x3 mTrafo;
-    aiMatrix3x3::FromToMatrix(aiVector3D(0, 0, 1),
-                              aiVector3D(normal.x, normal.y, normal.z), mTrafo);
-
-    for (int run = 0; run < conf.num_monte_carlo_samples; run++) {
-        auto dir_theta = sampling::hemisphere();
-        aiVector3D ai_dir =
-            mTrafo *
-            aiVector3D(dir_theta.first.x, dir_theta.first.y, dir_theta.first.z);
-        Vector3f dir(ai_dir.x, ai_dir.y, ai_dir.z);
-        auto cos_theta = dir_theta.second;
-
-        const auto indirect_light =
-            trace({p2, dir}, tree_intersection, lights, depth + 1, conf);
-
-        // lambertian
-        indirect_lightning += cos_theta * indirect_light;
+    // Basis, in which the normal is Up(0, 0, 1) of the hemisphere.
+    Vector3f b1, b2;
+    const Vector3f n(normal);
+    sampling::orthonormal_basis(n, b1, b2);
+
+    for (int run = 0; run < num_samples; run++) {
+        const Vector3f local = sampling::cosine_hemisphere();
+        const Vector3f dir = local.x * b1 + local.y * b2 + local.z * n;
+        const float cos_theta = local.z;
+
+        const Ray indirect_ray(p2, dir);
+        Intersector::Hit indirect_hit;
+        indirect_hit.id = tree_intersection.intersect(
+            indirect_ray, indirect_hit.r, indirect_hit.a, indirect_hit.b);
+        auto indirect_light = shade(indirect_ray, indirect_hit,
+                                    tree_intersection, lights, emitters,
+                                    depth + 1, conf);
+
+        // hit an area light, cf. explicit light sampling above
+        if (indirect_hit.id && !emitters.empty()) {
+            const auto& emitter = tree_intersection[indirect_hit.id];
+            const float cos_light = -dot(
+                dir, emitter.interpolate_normal(
+                         1.f - indirect_hit.a - indirect_hit.b,
+                         indirect_hit.a, indirect_hit.b));
+            if (is_emissive(emitter) && 0 < cos_light) {
+                // dir is normalized, i.e. r is the distance to the emitter
+                const float pdf = emitters.pdf() * indirect_hit.r *
+                                  indirect_hit.r / cos_light;
+                indirect_light +=
+                    power_heuristic(num_samples, hemisphere_pdf(cos_theta),
+                                    1, pdf) *
+                    emitter.emissive;
+            }
+        }
+
+        // lambertian: the cosine cancels out with the density (cf. below)
+        indirect_lightning += indirect_light;
+    }
+    if (0 < num_samples) {
+        indirect_lightning /= static_cast<float>(num_samples);
     }
-    // We don't divide by CDF 1/2π here, since it is better to do it in the
-    // next expression.
-    indirect_lightning /= static_cast<float>(conf.num_monte_carlo_samples);
 
     //
     // Light equation
     //
     // ∫ L(p,ω) ρ/π dω
-    //   ≈ ρ/π (L_direct(p,ω_light) + 1/N ∑ L(p,ω_sample)/(1/2π))
-    //   = ρ (L_direct(p,ω_light)/π + 2/N ∑ L(p,ω_sample))
+    //   ≈ ρ/π (L_direct(p,ω_light) + L_area(p,ω_area)/pdf(ω_area)
+    //          + 1/N ∑ L(p,ω_sample) cos(θ_sample)/(cos(θ_sample)/π))
+    //   = ρ ((L_direct(p,ω_light) + L_area(p,ω_area)/pdf(ω_area))/π
+    //        + 1/N ∑ L(p,ω_sample))
     //
     // N - number of samples
     // ρ - material color
     //
-    return triangle.diffuse * (direct_lightning * static_cast<float>(M_1_PI) +
-                               indirect_lightning * 2.f);
+    // Here, the MIS weights are already contained in L_area and L.
+    //
+    return emitted +
+           triangle.diffuse *
+               ((direct_lightning + area_lightning) *
+                    static_cast<float>(M_1_PI) +
+                indirect_lightning);
+}
+
+int main(int argc, char const* argv[]) {
+    return tracer_main<Pathtracer>(argc, argv, USAGE);
 }
@@ -15,11 +15,97 @@ Options:
                                     [default: 0.454545].
   --no-gamma-correction             Disables gamma correction.
   --exposure=<float>                Exposure [default: 1].
+  --tone-mapping=<op>               Tone mapping of the exposed light: exposure,
+                                    reinhard or aces [default: exposure].
   -v --verbose                      Verbose output.
+  --tile-size=<px>                  Size of the square tiles rendered by one
+                                    thread [default: 16].
+  --tile-order=<order>              Order of the tiles: scanline, morton or
+                                    spiral [default: morton].
+  --format=<format>                 Output image format: ppm (binary), ppm-ascii
+                                    or pfm (HDR) [default: ppm].
+  --accelerator=<type>              Acceleration structure: kdtree, bvh,
+                                    instanced (one BVH per unique mesh) or
+                                    bricks (kd-trees of spatial bricks, which
+                                    are mapped on demand from files next to the
+                                    kd-tree cache) [default: kdtree].
+  --kdtree-cache=<file>             Cache of the kd-tree, which is loaded if it
+                                    was built from the same scene
+                                    [default: kdtree.cache].
+  --profile=<file>                  Profile the rendering, and write the samples
+                                    to <file> (JSON if it ends with .json,
+                                    otherwise folded stacks, e.g. for
+                                    flamegraph.pl).
+  --stats=<file>                    Write the stats with the time and memory of
+                                    every stage to <file> (JSON if it ends with
+                                    .json, otherwise Prometheus text).
+  --heatmap=<file>                  Write the cost of every tile per pixel (wall
+                                    time in microseconds, visited kd-tree nodes
+                                    and triangle tests) as PFM heatmap to
+                                    <file>.
+  --preview=<file>                  Write a preview at a quarter of the width
+                                    with one sample per pixel to <file>, which
+                                    is rendered with a BVH, while the
+                                    acceleration structure is built.
+  --numa                            Pin the threads to the CPUs of the NUMA
+                                    nodes, node after node, and replicate the
+                                    kd-tree per node.
+  --brick-cache=<MB>                Memory budget in MB of the bricks, which are
+                                    mapped for the bricks accelerator
+                                    [default: 1024].
+  --raster-primary                  Resolve the primary visibility of the first
+                                    sample of every pixel in a pass by
+                                    rasterizing the triangles instead of tracing
+                                    the primary rays (kdtree and bvh only).
+
+Batch options:
+  --batch=<pattern>                 Render a frame of every camera of the scene,
+                                    or of the camera list, in one process, and
+                                    write frame i to the file of the pattern
+                                    with its first run of # replaced by i.
+  --camera-list=<file>              Cameras of the batch, one per line:
+                                    position, target and up vector.
+
+Service options:
+  --look-at=<9x float>              Camera position, target and up vector, which
+                                    replace the camera of the scene.
+  --serve=<port>                    Keep the scene loaded, and render the
+                                    requests received on the port of localhost
+                                    (cf. tracer_server.h).
+
+Progressive options:
+  --progressive                     Render passes of one sample per pixel until
+                                    there are -p samples per pixel.
+  --accumulation=<file>             Accumulation buffer of the passes. A
+                                    rendering is resumed from it, and it is
+                                    saved with every snapshot.
+  --snapshot=<file>                 Image written with every snapshot.
+  --snapshot-seconds=<sec>          Minimal time between two snapshots
+                                    [default: 10].
+  --node=<int>                      Index of this node in a distributed
+                                    rendering; renders only every --nodes-th
+                                    pass starting at this index [default: 0].
+  --nodes=<int>                     Number of nodes in a distributed rendering
+                                    [default: 1].
 
 Pathtracer options:
   -d --max-depth=<int>              Maximum recursion depth for raytracing
                                     [default: 3].
   -p --pixel-samples=<int>          Number of samples per pixel [default: 1].
   -m --monte-carlo-samples=<int>    Monto Carlo samples per ray [default: 8].
+  --sampler=<type>                  Sampler of the pixel samples: random, sobol
+                                    (Owen-scrambled) or blue-noise (sobol with
+                                    a dither mask) [default: sobol].
+  --wavefront                       Trace the paths of a tile together with a
+                                    single continuation ray per bounce and
+                                    Russian roulette (ignores -m).
+  --sort-rays                       Sort the secondary rays of --wavefront by
+                                    direction and origin before tracing them.
+  --adaptive-threshold=<float>      Sample a pixel in further passes of -p
+                                    samples, until the standard error of its
+                                    luminance is below this fraction of its
+                                    luminance; 0 disables adaptive sampling
+                                    [default: 0].
+  --max-pixel-samples=<int>         Maximum number of samples per pixel in
+                                    adaptive sampling [default: 64].
 )";
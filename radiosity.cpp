@@ -1,334 +1,313 @@
 #include "radiosity.h"
 #include "config.h"
+#include "lib/algorithm.h"
 #include "lib/effects.h"
 #include "lib/hierarchical.h"
+#include "lib/kdtree.h"
 #include "lib/matrix.h"
 #include "lib/mesh.h"
 #include "lib/output.h"
+#include "lib/profile.h"
 #include "lib/progress_bar.h"
 #include "lib/radiosity.h"
+#include "lib/radiosity_bake.h"
 #include "lib/range.h"
 #include "lib/raster.h"
 #include "lib/runtime.h"
+#include "lib/scene.h"
 #include "lib/stats.h"
+#include "lib/tiles.h"
 #include "lib/triangle.h"
+#include "lib/visibility.h"
 #include "lib/xorshift.h"
 #include "trace.h"
 
-#include <ThreadPool.h>
 #include <assimp/Importer.hpp>  // C++ importer interface
 #include <assimp/postprocess.h> // Post processing flags
 #include <assimp/scene.h>       // Output data structure
+#include <ThreadPool.h>
 #include <docopt/docopt.h>
 
 #include <array>
+#include <atomic>
+#include <fstream>
+#include <future>
 #include <iostream>
 #include <map>
 #include <math.h>
+#include <memory>
+#include <string>
 #include <unordered_set>
 #include <vector>
 
 using Point2f = turner::Point2f;
 
-Color trace(const Ray& ray, KDTreeIntersection& tree_intersection,
-            const std::vector<Color>& radiosity, const RadiosityConfig& conf) {
+/**
+ * Hit of the primary ray through the pixel (x, y), which is looked up in the
+ * visibility buffer, if there is one (cf. --raster-primary).
+ */
+Intersector::Hit primary_hit(size_t x, size_t y, const Ray& ray,
+                             Intersector& tree_intersection,
+                             const VisibilityBuffer* visibility) {
     Stats::instance().num_rays += 1;
-
-    // intersection
-    float dist_to_triangle, s, t;
-    auto triangle_id = tree_intersection.intersect(ray, dist_to_triangle, s, t);
-    if (!triangle_id) {
-        return conf.bg_color;
+    if (visibility) {
+        return visibility->hit(x, y, ray, tree_intersection);
     }
+    Intersector::Hit hit;
+    hit.id = tree_intersection.intersect(ray, hit.r, hit.a, hit.b);
+    return hit;
+}
 
-    return radiosity[triangle_id];
+/**
+ * Rasterize the primary visibility of the image, if it is enabled.
+ */
+std::unique_ptr<VisibilityBuffer>
+rasterize_primary(const KDTree& tree, const Camera& cam, const Image& image,
+                  const RadiosityConfig& conf, ThreadPool& pool) {
+    if (!conf.raster_primary_enabled) {
+        return nullptr;
+    }
+    const CameraRays camera_rays(cam, image.width(), image.height());
+    // the primary rays go through the corners of the pixels
+    auto make_jitter = []() {
+        return [](size_t, size_t) { return std::array<float, 2>{{0, 0}}; };
+    };
+    return std::unique_ptr<VisibilityBuffer>(
+        new VisibilityBuffer(rasterize_visibility(
+            tree.triangles(), camera_rays, image.width(), image.height(),
+            make_jitter, pool, conf.num_threads)));
 }
 
-Color trace(const Ray& ray, KDTreeIntersection& tree_intersection,
-            const RadiosityMesh& mesh, const FaceRadiosityHandle& rad,
+Color shade(const Intersector::Hit& hit, const std::vector<Color>& radiosity,
             const RadiosityConfig& conf) {
-    Stats::instance().num_rays += 1;
-
-    // intersection
-    float dist_to_triangle, s, t;
-    auto triangle_id = tree_intersection.intersect(ray, dist_to_triangle, s, t);
-    if (!triangle_id) {
+    if (!hit.id) {
         return conf.bg_color;
     }
-
-    auto face = RadiosityMesh::FaceHandle(static_cast<size_t>(triangle_id));
-    return mesh.property(rad, face);
+    return radiosity[hit.id];
 }
 
-Color trace_gouraud(const Ray& ray, KDTreeIntersection& tree_intersection,
-                    const RadiosityMesh& mesh,
-                    const VertexRadiosityHandle& vrad,
+/**
+ * Radiosity of the hit point interpolated between the radiosity of the
+ * corners of the hit face (cf. `LeafMesh::corner_radiosity`).
+ */
+Color shade_gouraud(const Intersector::Hit& hit,
+                    const std::vector<std::array<Color, 3>>& corner_radiosity,
                     const RadiosityConfig& conf) {
-    Stats::instance().num_rays += 1;
-
-    // intersection
-    float dist_to_triangle, s, t;
-    auto triangle_id = tree_intersection.intersect(ray, dist_to_triangle, s, t);
-    if (!triangle_id) {
+    if (!hit.id) {
         return conf.bg_color;
     }
 
-    // TODO: Use vertices directly. Beware of ordering!
-    CornerVertices corners;
-    auto exists = mesh.get_property_handle(corners, "corner_vertices");
-    assert(exists);
-    UNUSED(exists);
-    RadiosityMesh::FaceHandle face(static_cast<size_t>(triangle_id));
-    const auto& vs = mesh.property(corners, face);
+    // The vertices of the triangle are the corners of the face in the same
+    // order, cf. LeafMesh::triangles.
+    const auto& rad_abc = corner_radiosity[hit.id];
 
     // color interpolation
-    const auto& rad_a = mesh.property(vrad, vs[0]);
-    const auto& rad_b = mesh.property(vrad, vs[1]);
-    const auto& rad_c = mesh.property(vrad, vs[2]);
-
-    auto rad = (1 - s - t) * rad_a + s * rad_b + t * rad_c;
-    rad.a = 1; // TODO
+    const float s = hit.a, t = hit.b;
+    auto rad = (1 - s - t) * rad_abc[0] + s * rad_abc[1] + t * rad_abc[2];
+    rad.a = 1; // opaque, cf. `HierarchicalRadiosity::build_leaf_mesh`
     return rad;
 }
 
-std::vector<Color> compute_radiosity(KDTree& tree) {
-    using MatrixF = math::Matrix<float>;
-    using VectorF = math::Vector<float>;
-    size_t num_triangles = tree.num_triangles();
+/**
+ * Form factor F_ij between triangles of the tree.
+ *
+ * F_ij is only sampled for i < j, and the samples are determined by the pair.
+ * For i > j, F_ij is derived from F_ji by reciprocity. Hence F_ij is the same,
+ * no matter on which thread, or in which order the form factors are computed.
+ */
+float pair_form_factor(Intersector& tree_intersection, size_t num_triangles,
+                       size_t i, size_t j) {
+    if (j < i) {
+        return tree_intersection[j].area() / tree_intersection[i].area() *
+               pair_form_factor(tree_intersection, num_triangles, j, i);
+    }
+    sampling::seed((i * num_triangles + j + 1) * 0x9E3779B97F4A7C15ULL);
+    return form_factor(tree_intersection, i, j);
+}
 
-    // compute matrices
-    MatrixF F(num_triangles, num_triangles);
-    VectorF rho_r(num_triangles);
-    VectorF rho_g(num_triangles);
-    VectorF rho_b(num_triangles);
-    VectorF E_r(num_triangles);
-    VectorF E_g(num_triangles);
-    VectorF E_b(num_triangles);
+std::vector<Color> compute_radiosity(KDTree& tree,
+                                     const RadiosityConfig& conf) {
+    turner::Profile _(turner::ProfCategory::RadiositySolve);
+    using SparseMatrixF = math::SparseMatrix<float>;
+    using RGB = std::array<float, 3>;
+    size_t num_triangles = tree.num_triangles();
+    size_t num_threads = conf.num_threads;
+
+    // Compute the upper triangle of the form factor matrix (F_ij with i < j).
+    // Workers take the rows in order, s.t. the long rows at the top are
+    // computed first.
+    std::vector<std::vector<SparseMatrixF::Entry>> upper(num_triangles);
+    std::atomic<size_t> next_row(0);
+    StageTimer stage("form_factors");
+    {
+        ThreadPool pool(num_threads);
+        std::vector<std::future<void>> workers;
+        for (size_t worker = 0; worker < num_threads; ++worker) {
+            workers.emplace_back(pool.enqueue([&]() {
+                KDTreeIntersection tree_intersection(tree);
+                for (size_t i = next_row++; i < num_triangles;
+                     i = next_row++) {
+                    for (size_t j = i + 1; j < num_triangles; ++j) {
+                        float F_ij = pair_form_factor(tree_intersection,
+                                                      num_triangles, i, j);
+                        if (F_ij != 0) {
+                            upper[i].push_back(
+                                {static_cast<uint32_t>(j), F_ij});
+                        }
+                    }
+                }
+            }));
+        }
+        for (auto& worker : workers) {
+            worker.get();
+        }
+    }
 
-    KDTreeIntersection tree_intersection(tree);
+    // Construct form factor matrix (F_ij). Only non-zero form factors are
+    // stored, and F_ji is derived from F_ij by reciprocity. Row i collects
+    // the entries of all rows above (with column < i) before its own ones,
+    // so that every row is sorted by column.
+    std::vector<std::vector<SparseMatrixF::Entry>> rows(num_triangles);
     for (size_t i = 0; i < num_triangles; ++i) {
-        // construct form factor matrix (F_ij)
-        for (size_t j = i; j < num_triangles; ++j) {
-            if (i == j) {
-                F(i, i) = 0;
-            } else {
-                F(i, j) = form_factor(tree_intersection, i, j);
-                F(j, i) = tree[i].area() / tree[j].area() * F(i, j);
-            }
+        for (const auto& entry : upper[i]) {
+            rows[entry.col].push_back(
+                {static_cast<uint32_t>(i),
+                 tree[i].area() / tree[entry.col].area() * entry.value});
         }
+        rows[i].insert(rows[i].end(), upper[i].begin(), upper[i].end());
+        std::vector<SparseMatrixF::Entry>().swap(upper[i]);
+    }
 
-        const auto& triangle = tree[i];
-
-        // construct material diagonal matrix (ρ_i)
-        rho_r(i) = triangle.diffuse.r;
-        rho_g(i) = triangle.diffuse.g;
-        rho_b(i) = triangle.diffuse.b;
-
-        // construct vector of emitters
-        E_r(i) = triangle.emissive.r;
-        E_g(i) = triangle.emissive.g;
-        E_b(i) = triangle.emissive.b;
+    SparseMatrixF F(num_triangles, num_triangles);
+    for (auto& row : rows) {
+        F.push_row(row);
+        std::vector<SparseMatrixF::Entry>().swap(row);
     }
+    stage.stop();
 
-    // solve radiosity equation with Gauß-Seidel Iteration
-    MatrixF K_r(num_triangles, num_triangles);
-    MatrixF K_g(num_triangles, num_triangles);
-    MatrixF K_b(num_triangles, num_triangles);
-    // I - rho.asDiagonal * F
-    for (size_t r = 0; r < num_triangles; ++r) {
-        for (size_t c = 0; c < num_triangles; ++c) {
-            if (r != c) {
-                K_r(r, c) = -rho_r(r) * F(r, c);
-                K_g(r, c) = -rho_g(r) * F(r, c);
-                K_b(r, c) = -rho_b(r) * F(r, c);
-            } else {
-                K_r(r, c) = 1.0f - rho_r(r) * F(r, c);
-                K_g(r, c) = 1.0f - rho_g(r) * F(r, c);
-                K_b(r, c) = 1.0f - rho_b(r) * F(r, c);
-            }
-        }
+    // construct material diagonal matrix (ρ_i) and vector of emitters
+    std::vector<RGB> rho(num_triangles);
+    std::vector<RGB> E(num_triangles);
+    for (size_t i = 0; i < num_triangles; ++i) {
+        const auto& triangle = tree[i];
+        rho[i] = {{triangle.diffuse.r, triangle.diffuse.g, triangle.diffuse.b}};
+        E[i] = {{triangle.emissive.r, triangle.emissive.g,
+                 triangle.emissive.b}};
     }
 
-    // We intialize B with emitter values.
-    auto B_r = gauss_seidel(K_r, E_r, E_r, 10);
-    auto B_g = gauss_seidel(K_g, E_g, E_g, 10);
-    auto B_b = gauss_seidel(K_b, E_b, E_g, 10);
+    // Solve radiosity equation (I - ρF) B = E for all channels at once. We
+    // intialize B with emitter values.
+    auto on_iteration = [](int iteration, float residual) {
+        std::cerr << "\rSolving: " << iteration
+                  << " iterations, residual: " << residual << "     "
+                  << std::flush;
+        return true;
+    };
+    StageTimer solve_stage("solve");
+    auto B_rgb = solve_radiosity(F, rho, E, conf.solver_order, num_threads,
+                                 conf.max_solver_iterations, conf.solver_eps,
+                                 on_iteration);
+    std::cerr << std::endl;
+    solve_stage.stop();
 
     // combine results in a vector
     std::vector<Color> B;
-    for (size_t i = 0; i != num_triangles; ++i) {
-        B.emplace_back(B_r(i) > 0 ? B_r(i) : 0, B_g(i) > 0 ? B_g(i) : 0,
-                       B_b(i) > 0 ? B_b(i) : 0, 1.f);
+    for (const auto& b : B_rgb) {
+        B.emplace_back(b[0] > 0 ? b[0] : 0, b[1] > 0 ? b[1] : 0,
+                       b[2] > 0 ? b[2] : 0, 1.f);
     }
     return B;
 }
 
-Triangles triangles_from_scene(const aiScene* scene) {
-    Triangles triangles;
-    for (auto node : make_range(scene->mRootNode->mChildren,
-                                scene->mRootNode->mNumChildren)) {
-        if (node->mNumMeshes == 0) {
-            continue;
-        }
-
-        const auto& T = node->mTransformation;
-        const aiMatrix3x3 Tp(T); // trafo without translation
-
-        for (auto mesh_index : make_range(node->mMeshes, node->mNumMeshes)) {
-            const auto& mesh = *scene->mMeshes[mesh_index];
-            const auto& material = scene->mMaterials[mesh.mMaterialIndex];
-
-            aiColor4D ambient, diffuse, reflective, emissive;
-            material->Get(AI_MATKEY_COLOR_AMBIENT, ambient);
-            material->Get(AI_MATKEY_COLOR_DIFFUSE, diffuse);
-            material->Get(AI_MATKEY_COLOR_REFLECTIVE, reflective);
-            material->Get(AI_MATKEY_COLOR_EMISSIVE, emissive);
-
-            float reflectivity = 0.f;
-            material->Get(AI_MATKEY_REFLECTIVITY, reflectivity);
-
-            for (aiFace face : make_range(mesh.mFaces, mesh.mNumFaces)) {
-                assert(face.mNumIndices == 3);
-
-                // convert to our internal Vec = Vector3f type
-                aiVector3D aiv0 = T * mesh.mVertices[face.mIndices[0]];
-                aiVector3D aiv1 = T * mesh.mVertices[face.mIndices[1]];
-                aiVector3D aiv2 = T * mesh.mVertices[face.mIndices[2]];
-
-                aiVector3D ain0 = Tp * mesh.mNormals[face.mIndices[0]];
-                aiVector3D ain1 = Tp * mesh.mNormals[face.mIndices[1]];
-                aiVector3D ain2 = Tp * mesh.mNormals[face.mIndices[2]];
-
-                Point3f v0(aiv0.x, aiv0.y, aiv0.z);
-                Point3f v1(aiv1.x, aiv1.y, aiv1.z);
-                Point3f v2(aiv2.x, aiv2.y, aiv2.z);
-
-                Normal3f n0(ain0.x, ain0.y, ain0.z);
-                Normal3f n1(ain1.x, ain1.y, ain1.z);
-                Normal3f n2(ain2.x, ain2.y, ain2.z);
-
-                triangles.push_back(Triangle{// vertices
-                                             {v0, v1, v2},
-                                             // normals
-                                             {n0, n1, n2},
-                                             ambient,
-                                             diffuse,
-                                             emissive,
-                                             reflective,
-                                             reflectivity});
-            }
-        }
-    }
-    return triangles;
-}
-
 Image raycast(const KDTree& tree, const RadiosityConfig& conf,
               const Camera& cam, const std::vector<Color>& radiosity,
               Image&& image) {
+    turner::Profile _(turner::ProfCategory::Render);
     Runtime rt(Stats::instance().runtime_ms);
+    StageTimer stage("render");
 
     std::cerr << "Rendering          ";
 
-    ThreadPool pool(conf.num_threads);
-    std::vector<std::future<void>> tasks;
-
     Point3f cam_pos(cam.mPosition.x, cam.mPosition.y, cam.mPosition.z);
 
-    for (size_t y = 0; y < image.height(); ++y) {
-        tasks.emplace_back(pool.enqueue(
-            [&image, &cam, &tree, &radiosity, y, &conf, &cam_pos]() {
-                // TODO: we need only one tree intersection per thread, not task
-                KDTreeIntersection tree_intersection(tree);
-
-                for (size_t x = 0; x < image.width(); ++x) {
-                    auto cam_dir = cam.raster2cam(
-                        {static_cast<float>(x), static_cast<float>(y)},
-                        image.width(), image.height());
-
-                    Stats::instance().num_prim_rays += 1;
-                    image(x, y) += trace({cam_pos, cam_dir}, tree_intersection,
-                                         radiosity, conf);
+    ThreadPool pool(conf.num_threads);
+    const auto visibility = rasterize_primary(tree, cam, image, conf, pool);
 
-                    image(x, y) = exposure(image(x, y), conf.exposure);
+    auto render_tile = [&image, &cam, &radiosity, &conf, &cam_pos,
+                        &visibility](Intersector& tree_intersection,
+                                     const Tile& tile, size_t) {
+        for (size_t y = tile.y0; y < tile.y1; ++y) {
+            for (size_t x = tile.x0; x < tile.x1; ++x) {
+                auto cam_dir = cam.raster2cam(
+                    {static_cast<float>(x), static_cast<float>(y)},
+                    image.width(), image.height());
 
-                    // gamma correction
-                    if (conf.gamma_correction_enabled) {
-                        image(x, y) = gamma(image(x, y), conf.inverse_gamma);
-                    }
-                }
-            }));
-    }
+                Stats::instance().num_prim_rays += 1;
+                const auto hit = primary_hit(x, y, {cam_pos, cam_dir},
+                                             tree_intersection,
+                                             visibility.get());
+                image(x, y) += shade(hit, radiosity, conf);
+            }
+        }
+    };
 
-    long completed = 0;
-    auto progress_bar = ProgressBar(std::cerr, "Rendering", tasks.size());
-    for (auto& task : tasks) {
-        task.get();
-        completed += 1;
-        progress_bar.update(completed);
-    }
+    auto tiles = make_tiles(image.width(), image.height(), conf.tile_size,
+                            conf.tile_order);
+    auto progress_bar = ProgressBar(std::cerr, "Rendering", tiles.size());
+    render_tiles(pool, tiles, conf.num_threads,
+                 [&tree]() { return KDTreeIntersection(tree); }, render_tile,
+                 [&progress_bar](size_t num_completed) {
+                     progress_bar.update(num_completed);
+                 });
     std::cerr << std::endl;
+    stage.stop();
 
+    StageTimer postprocess_stage("postprocess");
+    conf.postprocessor()(image);
     return image;
 }
 
 Image raycast(const KDTree& tree, const RadiosityConfig& conf,
-              const Camera& cam, const RadiosityMesh& mesh, Image&& image) {
+              const Camera& cam, const HierarchicalRadiosity::LeafMesh& leaves,
+              Image&& image) {
+    turner::Profile _(turner::ProfCategory::Render);
     Runtime rt(Stats::instance().runtime_ms);
+    StageTimer stage("render");
 
     std::cerr << "Rendering          ";
 
-    ThreadPool pool(conf.num_threads);
-    std::vector<std::future<void>> tasks;
-
-    FaceRadiosityHandle frad;
-    bool exists = false;
-    exists = mesh.get_property_handle(frad, "face_radiosity");
-    assert(exists);
-    VertexRadiosityHandle vrad;
-    exists = mesh.get_property_handle(vrad, "vertex_radiosity");
-    assert(exists);
-    UNUSED(exists);
-
     Point3f cam_pos(cam.mPosition.x, cam.mPosition.y, cam.mPosition.z);
 
-    for (size_t y = 0; y < image.height(); ++y) {
-        tasks.emplace_back(pool.enqueue([&image, &cam, &tree, &mesh, &frad,
-                                         &vrad, y, &conf, &cam_pos]() {
-            // TODO: we need only one tree intersection per thread, not task
-            KDTreeIntersection tree_intersection(tree);
+    ThreadPool pool(conf.num_threads);
+    const auto visibility = rasterize_primary(tree, cam, image, conf, pool);
 
-            for (size_t x = 0; x < image.width(); ++x) {
+    auto render_tile = [&image, &cam, &leaves, &conf, &cam_pos, &visibility](
+        Intersector& tree_intersection, const Tile& tile, size_t) {
+        for (size_t y = tile.y0; y < tile.y1; ++y) {
+            for (size_t x = tile.x0; x < tile.x1; ++x) {
                 auto cam_dir = cam.raster2cam(
                     {static_cast<float>(x), static_cast<float>(y)},
                     image.width(), image.height());
 
                 Stats::instance().num_prim_rays += 1;
+                const auto hit = primary_hit(x, y, {cam_pos, cam_dir},
+                                             tree_intersection,
+                                             visibility.get());
 
                 if (!conf.gouraud_enabled) {
-                    image(x, y) += trace({cam_pos, cam_dir}, tree_intersection,
-                                         mesh, frad, conf);
+                    image(x, y) += shade(hit, leaves.face_radiosity, conf);
                 } else {
                     image(x, y) +=
-                        trace_gouraud({cam_pos, cam_dir}, tree_intersection,
-                                      mesh, vrad, conf);
-                }
-
-                image(x, y) = exposure(image(x, y), conf.exposure);
-
-                // gamma correction
-                if (conf.gamma_correction_enabled) {
-                    image(x, y) = gamma(image(x, y), conf.inverse_gamma);
+                        shade_gouraud(hit, leaves.corner_radiosity, conf);
                 }
             }
-        }));
-    }
-
-    long completed = 0;
+        }
+    };
 
-    for (auto& task : tasks) {
-        task.get();
-        completed += 1;
-        float progress = static_cast<float>(completed) / tasks.size();
+    auto tiles = make_tiles(image.width(), image.height(), conf.tile_size,
+                            conf.tile_order);
+    auto print_progress = [&tiles](size_t completed) {
+        float progress = static_cast<float>(completed) / tiles.size();
         int bar_width = progress * 20;
         std::cerr << "\rRendering          "
                   << "[" << std::string(bar_width, '-')
@@ -336,9 +315,15 @@ Image raycast(const KDTree& tree, const RadiosityConfig& conf,
                   << std::setfill(' ') << std::setw(6) << std::fixed
                   << std::setprecision(2) << (progress * 100.0) << '%';
         std::cerr.flush();
-    }
+    };
+    render_tiles(pool, tiles, conf.num_threads,
+                 [&tree]() { return KDTreeIntersection(tree); }, render_tile,
+                 print_progress);
     std::cerr << std::endl;
+    stage.stop();
 
+    StageTimer postprocess_stage("postprocess");
+    conf.postprocessor()(image);
     return image;
 }
 
@@ -355,20 +340,14 @@ Image render_feature_lines(const KDTree& tree, const RadiosityConfig& conf,
         Point2f{0.f, offset / 2},    Point2f{offset / 2, offset},
         Point2f{offset, offset / 2}, Point2f{offset / 2, 0.f}};
 
-    ThreadPool pool(conf.num_threads);
-    std::vector<std::future<void>> mesh_tasks;
-
     Point3f cam_pos(cam.mPosition.x, cam.mPosition.y, cam.mPosition.z);
 
-    for (size_t y = 0; y < image.height(); ++y) {
-        mesh_tasks.emplace_back(pool.enqueue([&image, offsets, &cam, &tree, y,
-                                              &conf, &cam_pos]() {
-            // TODO: we need only one tree intersection per thread, not task
-            KDTreeIntersection tree_intersection(tree);
-
-            for (size_t x = 0; x < image.width(); ++x) {
+    auto render_tile = [&image, offsets, &cam, &cam_pos](
+        Intersector& tree_intersection, const Tile& tile, size_t) {
+        for (size_t y = tile.y0; y < tile.y1; ++y) {
+            for (size_t x = tile.x0; x < tile.x1; ++x) {
                 float dist_to_triangle, s, t;
-                std::unordered_set<KDTreeIntersection::OptionalId> triangle_ids;
+                std::unordered_set<Intersector::OptionalId> triangle_ids;
 
                 // Shoot center ray.
                 auto cam_dir = cam.raster2cam({x + 0.5f, y + 0.5f},
@@ -393,14 +372,13 @@ Image render_feature_lines(const KDTree& tree, const RadiosityConfig& conf,
                 float e = std::pow(std::abs(m - M_2) / M_2, 10);
                 image(x, y) = image(x, y) * e;
             }
-        }));
-    }
+        }
+    };
 
-    size_t completed = 0;
-    for (auto& task : mesh_tasks) {
-        task.get();
-        completed += 1;
-        float progress = static_cast<float>(completed) / mesh_tasks.size();
+    auto tiles = make_tiles(image.width(), image.height(), conf.tile_size,
+                            conf.tile_order);
+    auto print_progress = [&tiles](size_t completed) {
+        float progress = static_cast<float>(completed) / tiles.size();
         int bar_width = progress * 20;
         std::cerr << "\rDrawing mesh lines "
                   << "[" << std::string(bar_width, '-')
@@ -408,13 +386,16 @@ Image render_feature_lines(const KDTree& tree, const RadiosityConfig& conf,
                   << std::setfill(' ') << std::setw(6) << std::fixed
                   << std::setprecision(2) << (progress * 100.0) << '%';
         std::cerr.flush();
-    }
+    };
+    render_tiles(tiles, conf.num_threads,
+                 [&tree]() { return KDTreeIntersection(tree); }, render_tile,
+                 print_progress);
     std::cerr << std::endl;
 
     return image;
 }
 
-Image render_mesh(const Triangles& triangles, const Camera& cam,
+Image render_mesh(ArrayView<Triangle> triangles, const Camera& cam,
                   Image&& image) {
     auto draw_pixel = [&image](int x, int y) {
         if (0 <= x && static_cast<size_t>(x) < image.width() && 0 <= y &&
@@ -484,16 +465,132 @@ Image render_radiosity_mesh(const RadiosityMesh& mesh, const Camera& cam,
     return image;
 }
 
+/**
+ * Compute radiosity with progressive refinement.
+ *
+ * Only the rows of the form factor matrix of shooting triangles are computed,
+ * each one in parallel. If enabled, an intermediate image is written every
+ * `conf.snapshot_interval` shots.
+ */
+std::vector<Color> compute_progressive_radiosity(const KDTree& tree,
+                                                 const RadiosityConfig& conf,
+                                                 const Camera& cam, int width,
+                                                 int height) {
+    turner::Profile _(turner::ProfCategory::RadiositySolve);
+    // form factors are computed per shot
+    StageTimer stage("solve");
+    using RGB = std::array<float, 3>;
+    size_t num_triangles = tree.num_triangles();
+
+    std::vector<float> area(num_triangles);
+    std::vector<RGB> rho(num_triangles);
+    std::vector<RGB> E(num_triangles);
+    for (size_t i = 0; i < num_triangles; ++i) {
+        const auto& triangle = tree[i];
+        area[i] = triangle.area();
+        rho[i] = {{triangle.diffuse.r, triangle.diffuse.g, triangle.diffuse.b}};
+        E[i] = {{triangle.emissive.r, triangle.emissive.g,
+                 triangle.emissive.b}};
+    }
+
+    auto to_colors = [](const std::vector<RGB>& B_rgb) {
+        std::vector<Color> B;
+        for (const auto& b : B_rgb) {
+            B.emplace_back(b[0] > 0 ? b[0] : 0, b[1] > 0 ? b[1] : 0,
+                           b[2] > 0 ? b[2] : 0, 1.f);
+        }
+        return B;
+    };
+
+    // Every worker computes a fixed chunk of a row with its own context.
+    size_t num_threads = conf.num_threads;
+    std::vector<KDTreeIntersection> contexts;
+    for (size_t worker = 0; worker < num_threads; ++worker) {
+        contexts.emplace_back(tree);
+    }
+    ThreadPool pool(num_threads);
+
+    auto form_factors = [&](size_t i, std::vector<float>& F_i) {
+        std::vector<std::future<void>> workers;
+        for (size_t worker = 0; worker < num_threads; ++worker) {
+            workers.emplace_back(pool.enqueue([&, worker]() {
+                size_t begin = worker * num_triangles / num_threads;
+                size_t end = (worker + 1) * num_triangles / num_threads;
+                for (size_t j = begin; j < end; ++j) {
+                    F_i[j] = i == j ? 0 : pair_form_factor(contexts[worker],
+                                                           num_triangles, i, j);
+                }
+            }));
+        }
+        for (auto& worker : workers) {
+            worker.get();
+        }
+    };
+
+    auto on_shot = [&](size_t num_shots, const std::vector<RGB>& B,
+                       float unshot) {
+        std::cerr << "\rShooting: " << num_shots
+                  << " shots, unshot power: " << unshot << "     "
+                  << std::flush;
+
+        if (conf.snapshot_interval != 0 &&
+            num_shots % conf.snapshot_interval == 0) {
+            std::cerr << std::endl;
+            auto snapshot = raycast(tree, conf, cam, to_colors(B),
+                                    Image(width, height));
+            std::ofstream file("snapshot-" + std::to_string(num_shots) +
+                                   (conf.image_format == ImageFormat::PFM
+                                        ? ".pfm"
+                                        : ".ppm"),
+                               std::ios::binary);
+            write_image(file, snapshot, conf.image_format);
+        }
+        return true;
+    };
+
+    auto B_rgb = progressive_refinement(area, rho, E, form_factors,
+                                        conf.shoot_eps, conf.max_shots,
+                                        on_shot);
+    std::cerr << std::endl;
+    return to_colors(B_rgb);
+}
+
+/**
+ * Parameters of the solver of the mode, which determine its solution, cf.
+ * `RadiosityBake::matches`.
+ */
+std::vector<float> solver_parameters(const RadiosityConfig& conf) {
+    switch (conf.mode) {
+    case RadiosityConfig::EXACT:
+        return {static_cast<float>(conf.solver_order), conf.solver_eps,
+                static_cast<float>(conf.max_solver_iterations)};
+    case RadiosityConfig::PROGRESSIVE:
+        return {conf.shoot_eps, static_cast<float>(conf.max_shots)};
+    case RadiosityConfig::HIERARCHICAL:
+        return {conf.F_eps, conf.BF_eps,
+                static_cast<float>(conf.max_subdivisions),
+                static_cast<float>(conf.max_iterations),
+                conf.clustering_enabled ? 1.f : 0.f};
+    }
+    return {};
+}
+
 int main(int argc, char const* argv[]) {
     RadiosityConfig conf = RadiosityConfig::from_docopt(
         docopt::docopt(USAGE, {argv + 1, argv + argc}, true, "radiosity"));
+    if (!conf.profile_filename.empty()) {
+        turner::profiler_start();
+    }
+
     // import scene
     Assimp::Importer importer;
+    StageTimer import_stage("import");
     const aiScene* scene =
         importer.ReadFile(conf.filename.c_str(),
                           aiProcess_CalcTangentSpace | aiProcess_Triangulate |
                               aiProcess_JoinIdenticalVertices |
                               aiProcess_GenNormals | aiProcess_SortByPType);
+    import_stage.stop();
 
     if (!scene) {
         std::cout << importer.GetErrorString() << std::endl;
@@ -510,12 +607,45 @@ int main(int argc, char const* argv[]) {
     }
     auto* camNode = scene->mRootNode->FindNode(sceneCam.mName);
     assert(camNode != nullptr);
-    const Camera cam(camNode->mTransformation, sceneCam);
+    const Camera cam(world_transformation(camNode), sceneCam);
 
     // Scene triangles
-    auto triangles = triangles_from_scene(scene);
-    Stats::instance().num_triangles = triangles.size();
-    KDTree tree(std::move(triangles));
+    StageTimer triangles_stage("triangles");
+    const auto mesh = indexed_mesh_from_scene(scene, conf.num_threads);
+    triangles_stage.stop();
+    StageTimer build_stage("build");
+    KDTree tree = KDTree::load_or_build(
+        mesh, conf.kdtree_cache_filename,
+        KDTree::BuildStrategy::PRESORTED_EVENTS, conf.num_threads);
+    build_stage.stop();
+    Stats::instance().num_triangles = tree.num_triangles();
+
+    // Bake of the solution
+    const uint64_t scene_key = KDTree::cache_key(mesh);
+    RadiosityBake bake;
+    bool baked = !conf.bake_filename.empty() &&
+                 read_bake(conf.bake_filename, bake) &&
+                 (conf.render_bake
+                      ? bake.scene_key == scene_key
+                      : bake.matches(scene_key, conf.mode,
+                                     solver_parameters(conf)));
+    if (conf.render_bake) {
+        if (!baked) {
+            std::cerr << "Error: " << conf.bake_filename
+                      << " is not a bake of the scene" << std::endl;
+            return 1;
+        }
+        conf.mode = static_cast<RadiosityConfig::Mode>(bake.mode);
+    }
+    auto save_bake = [&conf, &bake, scene_key]() {
+        if (conf.bake_filename.empty()) {
+            return;
+        }
+        bake.scene_key = scene_key;
+        bake.mode = conf.mode;
+        bake.parameters = solver_parameters(conf);
+        write_bake(conf.bake_filename, bake);
+    };
 
     // Image
     int width = conf.width;
@@ -533,7 +663,29 @@ int main(int argc, char const* argv[]) {
             std::cerr << conf << std::endl;
         }
 
-        radiosity = compute_radiosity(tree);
+        if (!baked) {
+            bake.radiosity = compute_radiosity(tree, conf);
+            save_bake();
+        }
+        radiosity = std::move(bake.radiosity);
+        image = raycast(tree, conf, cam, radiosity, std::move(image));
+        if (conf.mesh == RadiosityConfig::SIMPLE_MESH) {
+            image = render_mesh(tree.triangles(), cam, std::move(image));
+        } else if (conf.mesh == RadiosityConfig::FEATURE_MESH) {
+            image = render_feature_lines(tree, conf, cam, std::move(image));
+        }
+    } else if (conf.mode == RadiosityConfig::PROGRESSIVE) {
+        if (conf.verbose) {
+            std::cerr << "Mode: progressive" << std::endl;
+            std::cerr << conf << std::endl;
+        }
+
+        if (!baked) {
+            bake.radiosity =
+                compute_progressive_radiosity(tree, conf, cam, width, height);
+            save_bake();
+        }
+        radiosity = std::move(bake.radiosity);
         image = raycast(tree, conf, cam, radiosity, std::move(image));
         if (conf.mesh == RadiosityConfig::SIMPLE_MESH) {
             image = render_mesh(tree.triangles(), cam, std::move(image));
@@ -556,28 +708,45 @@ int main(int argc, char const* argv[]) {
                       << std::endl;
         }
 
-        HierarchicalRadiosity model(tree, conf.F_eps, conf.min_area,
-                                    conf.BF_eps, conf.max_iterations);
-        try {
-            model.compute();
-        } catch (std::runtime_error e) {
-            std::cerr << "Error: " << e.what() << std::endl;
-            image = render_radiosity_mesh(model.mesh(), cam, std::move(image));
-            std::cout << image << std::endl;
-            return 1;
+        // The model is only kept for the visualization of its links.
+        std::unique_ptr<HierarchicalRadiosity> model;
+        if (!baked) {
+            model.reset(new HierarchicalRadiosity(
+                tree, conf.F_eps, conf.min_area, conf.BF_eps,
+                conf.max_iterations, conf.num_threads,
+                conf.clustering_enabled, conf.verbose));
+            try {
+                turner::Profile _(turner::ProfCategory::RadiositySolve);
+                model->compute();
+            } catch (std::runtime_error e) {
+                std::cerr << "Error: " << e.what() << std::endl;
+                image = render_radiosity_mesh(model->mesh(), cam,
+                                              std::move(image));
+                write_image(std::cout, image, conf.image_format);
+                return 1;
+            }
+            if (!conf.bake_filename.empty()) {
+                bake.leaves = model->leaves();
+                save_bake();
+            }
         }
 
-        KDTree refined_tree(model.triangles());
+        // The leaves are contained in the scene triangles, so we refine the
+        // kd-tree of the scene instead of building up a new one.
+        const auto& leaves = model ? model->leaves() : bake.leaves;
+        StageTimer tree_stage("build");
+        KDTree refined_tree =
+            tree.refine(leaves.triangles(tree), leaves.root_ids);
+        tree_stage.stop();
         Stats::instance().num_triangles = refined_tree.num_triangles();
         Stats::instance().kdtree_height = refined_tree.height();
 
         if (conf.exact_hierarchical_enabled) {
-            radiosity = compute_radiosity(refined_tree);
+            radiosity = compute_radiosity(refined_tree, conf);
             image =
                 raycast(refined_tree, conf, cam, radiosity, std::move(image));
         } else {
-            image = raycast(refined_tree, conf, cam, model.mesh(),
-                            std::move(image));
+            image = raycast(refined_tree, conf, cam, leaves, std::move(image));
         }
 
         if (conf.mesh == RadiosityConfig::SIMPLE_MESH) {
@@ -587,15 +756,38 @@ int main(int argc, char const* argv[]) {
         }
 
         if (conf.links_enabled) {
-            image = model.visualize_links(cam, std::move(image));
+            if (model) {
+                image = model->visualize_links(cam, std::move(image));
+            } else {
+                std::cerr << "Warning: the links of a bake are not rendered"
+                          << std::endl;
+            }
         }
     }
 
+    // output image
+    {
+        turner::Profile _(turner::ProfCategory::Output);
+        StageTimer stage("output");
+        write_image(std::cout, image, conf.image_format);
+    }
+
     // output stats
     std::cerr << Stats::instance() << std::endl;
+    if (!conf.stats_filename.empty()) {
+        try {
+            write_stats(conf.stats_filename, Stats::instance());
+        } catch (const std::runtime_error& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    }
 
-    // output image
-    std::cout << image << std::endl;
-
+    if (!conf.profile_filename.empty()) {
+        turner::profiler_stop();
+        const auto results = turner::profiler_get_results();
+        std::cerr << results;
+        turner::write_profile(conf.profile_filename, results);
+    }
     return 0;
 }
@@ -2,7 +2,8 @@
 
 static const char* USAGE =
     R"(Usage:
-  radiosity (exact|hierarchical) [options] <filename>
+  radiosity (exact|hierarchical|progressive) [options] <filename>
+  radiosity render --bake=<file> [options] <filename>
 
 Options:
   -w --width=<px>               Width of the image [default: 640].
@@ -15,7 +16,43 @@ Options:
                                 [default: 0.454545].
   --no-gamma-correction         Disables gamma correction.
   -e --exposure=<float>         Exposure of the image [default: 1.0].
+  --tone-mapping=<op>           Tone mapping of the exposed light: exposure,
+                                reinhard or aces [default: exposure].
   -v --verbose                  Verbose output.
+  --tile-size=<px>              Size of the square tiles rendered by one thread
+                                [default: 16].
+  --tile-order=<order>          Order of the tiles: scanline, morton or spiral
+                                [default: morton].
+  --format=<format>             Output image format: ppm (binary), ppm-ascii or
+                                pfm (HDR) [default: ppm].
+  --kdtree-cache=<file>         Cache of the kd-tree, which is loaded if it was
+                                built from the same scene
+                                [default: kdtree.cache].
+  --profile=<file>              Profile the rendering, and write the samples to
+                                <file> (JSON if it ends with .json, otherwise
+                                folded stacks, e.g. for flamegraph.pl).
+  --stats=<file>                Write the stats with the time and memory of
+                                every stage to <file> (JSON if it ends with
+                                .json, otherwise Prometheus text).
+  --raster-primary              Resolve the primary visibility by rasterizing
+                                the triangles instead of tracing the primary
+                                rays.
+
+  --bake=<file>                 Bake of the radiosity solution. It is loaded,
+                                if it was computed for the same scene with the
+                                same mode and parameters. Otherwise, radiosity
+                                is computed and the bake is (re)written. The
+                                render command only loads the bake, whatever
+                                mode and parameters it was computed with.
+
+Exact radiosity options:
+  --solver=<order>              Order of the solver: gauss-seidel (sequential),
+                                jacobi or red-black (parallel)
+                                [default: red-black].
+  --solver-eps=<float>          Stop when the largest change of an iteration
+                                is below this fraction of the largest emission
+                                [default: 1e-4].
+  --solver-iterations=<int>     Maximum number of iterations [default: 100].
 
 Hierarchical radiosity options:
   --form-factor-eps=<float>     Link when form factor estimate is below
@@ -25,6 +62,16 @@ Hierarchical radiosity options:
   --max-subdivisions=<int>      Maximum number of subdivisions for smallest
                                 triangle [default: 3].
   --max-iterations=<int>        Maximum iterations to solve system [default: 3].
+  --no-clustering               Link all pairs of scene triangles, instead of
+                                linking distant groups of them as clusters.
+
+Progressive radiosity options:
+  --shoot-eps=<float>           Stop when the unshot power is below this
+                                fraction of the emitted power [default: 0.01].
+  --max-shots=<int>             Maximum number of shots [default: 100000].
+  --snapshot-interval=<int>     Write an intermediate image snapshot-<n>.ppm
+                                (or .pfm) every n shots; 0 disables snapshots
+                                [default: 0].
 
 Radiosity options:
   -g --gouraud                  Enable gouraud shading for hierarchical
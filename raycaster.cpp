@@ -1,24 +1,43 @@
 #include "raycaster.h"
 #include "config.h"
+#include "lib/profile.h"
 #include "lib/stats.h"
 #include "lib/triangle.h"
 #include "trace.h"
+#include "tracer_main.h"
 
-Color trace(const Ray& ray, KDTreeIntersection& tree_intersection,
-            const std::vector<Light>& /* lights */, int /* depth */,
-            const TracerConfig& conf) {
-    // intersection
-    float dist_to_triangle, s, t;
-    auto triangle_id = tree_intersection.intersect(ray, dist_to_triangle, s, t);
-    if (!triangle_id) {
+/**
+ * Color of the hit triangle, which fades out with the distance.
+ */
+struct Raycaster {
+    static constexpr bool WAVEFRONT = false;
+
+    static Color shade(const Ray& ray, const Intersector::Hit& hit,
+                       Intersector& tree_intersection,
+                       const std::vector<Light>& lights,
+                       const Emitters& emitters, int depth,
+                       const TracerConfig& conf);
+};
+
+inline Color Raycaster::shade(const Ray& /* ray */, const Intersector::Hit& hit,
+                              Intersector& tree_intersection,
+                              const std::vector<Light>& /* lights */,
+                              const Emitters& /* emitters */, int /* depth */,
+                              const TracerConfig& conf) {
+    turner::Profile _(turner::ProfCategory::Trace);
+    if (!hit.id) {
         return conf.bg_color;
     }
 
     Stats::instance().num_rays += 1;
-    auto res = tree_intersection[triangle_id].diffuse;
+    auto res = tree_intersection[hit.id].diffuse;
 
     // The light is at camera position. The farther away an object the darker it
     // is. It's not visible beyond max visibility.
-    res.a = clamp(1.f - (dist_to_triangle / conf.max_visibility), 0.f, 1.f);
+    res.a = clamp(1.f - (hit.r / conf.max_visibility), 0.f, 1.f);
     return res;
 }
+
+int main(int argc, char const* argv[]) {
+    return tracer_main<Raycaster>(argc, argv, USAGE);
+}
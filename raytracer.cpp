@@ -1,28 +1,43 @@
 #include "raytracer.h"
 #include "lib/lambertian.h"
+#include "lib/profile.h"
 #include "lib/stats.h"
 #include "trace.h"
+#include "tracer_main.h"
 
-Color trace(const Ray& ray, KDTreeIntersection& tree_intersection,
-            const std::vector<Light>& lights, int depth,
-            const TracerConfig& conf) {
-    Stats::instance().num_rays += 1;
+/**
+ * Whitted-style ray tracing of the point light with reflections and hard
+ * shadows.
+ */
+struct Raytracer {
+    static constexpr bool WAVEFRONT = false;
 
-    if (depth > conf.max_recursion_depth) {
-        return {};
-    }
+    static Color shade(const Ray& ray, const Intersector::Hit& hit,
+                       Intersector& tree_intersection,
+                       const std::vector<Light>& lights,
+                       const Emitters& emitters, int depth,
+                       const TracerConfig& conf);
+};
+
+inline Color Raytracer::shade(const Ray& ray, const Intersector::Hit& hit,
+                              Intersector& tree_intersection,
+                              const std::vector<Light>& lights,
+                              const Emitters& emitters, int depth,
+                              const TracerConfig& conf) {
+    turner::Profile _(turner::ProfCategory::Trace);
+    Stats::instance().num_rays += 1;
 
     auto& light = lights.front();
 
     // intersection
-    float dist_to_triangle, s, t;
-    auto triangle_id = tree_intersection.intersect(ray, dist_to_triangle, s, t);
-    if (!triangle_id) {
+    if (!hit.id) {
         return conf.bg_color;
     }
+    const auto triangle_id = hit.id;
+    float s = hit.a, t = hit.b;
 
     // light direction
-    Point3f p = ray.o + dist_to_triangle * ray.d;
+    Point3f p = ray.o + hit.r * ray.d;
     Vector3f light_dir = normalize(
         Point3f(light.position.x, light.position.y, light.position.z) - p);
 
@@ -44,24 +59,25 @@ Color trace(const Ray& ray, KDTreeIntersection& tree_intersection,
         // compute reflected ray from incident ray
         auto reflected_ray_dir =
             ray.d - Vector3f(2.f * dot(normal, ray.d) * normal);
-        auto reflected_color = trace({p2, reflected_ray_dir}, tree_intersection,
-                                     lights, depth + 1, conf);
+        auto reflected_color =
+            trace<Raytracer>({p2, reflected_ray_dir}, tree_intersection,
+                             lights, emitters, depth + 1, conf);
 
         color = (1.f - triangle.reflectivity) * direct_lightning +
                 triangle.reflectivity * triangle.reflective * reflected_color;
     }
 
     // shadow
-    float dist_to_next_triangle;
     light_dir = normalize(light.position - p2);
     float dist_to_light = (light.position - p2).length();
 
-    auto has_shadow = tree_intersection.intersect({p2, light_dir},
-                                                  dist_to_next_triangle, s, t);
-
-    if (has_shadow && dist_to_next_triangle < dist_to_light) {
+    if (tree_intersection.light_occluded(0, {p2, light_dir}, dist_to_light)) {
         color -= color * conf.shadow_intensity;
     }
 
     return color;
 }
+
+int main(int argc, char const* argv[]) {
+    return tracer_main<Raytracer>(argc, argv, USAGE);
+}
@@ -0,0 +1,33 @@
+#!/bin/sh
+# Render the scenes with every renderer, and print the rays/sec and the
+# rendering time of each run as one JSON object per line, e.g.
+#
+#   scripts/benchmark.sh build scenes/*.blend > macro.json
+#
+# Results of two commits are compared by scripts/compare-benchmarks.py.
+set -e
+
+build=$1
+shift
+commit=$(git rev-parse --short HEAD)
+stats=$(mktemp)
+trap 'rm -f $stats' EXIT
+
+run() {
+  name=$1
+  shift
+  "$@" 2> $stats > /dev/null
+  rays_per_second=$(sed -n 's/^Rays\/sec *: *//p' $stats)
+  seconds=$(sed -n 's/^Rendering time *: *\([0-9.]*\) sec/\1/p' $stats)
+  echo "{\"name\": \"$name\", \"commit\": \"$commit\"," \
+       "\"rays_per_second\": ${rays_per_second:-0}," \
+       "\"seconds\": ${seconds:-0}}"
+}
+
+for scene in "$@"; do
+  filename=$(basename $scene)
+  run raycaster/$filename $build/raycaster -w 256 $scene
+  run raytracer/$filename $build/raytracer -w 256 $scene
+  run pathtracer/$filename $build/pathtracer -w 128 -p1 -m1 $scene
+  run radiosity-exact/$filename $build/radiosity exact -w 128 $scene
+done
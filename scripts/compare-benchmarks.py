@@ -0,0 +1,41 @@
+#!/usr/bin/env python
+"""
+Compare the results of two benchmark runs, e.g. of two commits.
+
+The results are JSON objects, one per line and benchmark, as printed by
+bench_kernels --json and scripts/benchmark.sh. For every benchmark in both
+runs, prints the ratio new/old of its timing.
+"""
+from __future__ import print_function
+
+import argparse
+import json
+
+# timing of a benchmark, lower is better
+TIME_KEYS = ["ns_per_op", "seconds"]
+
+
+def load(filename):
+    with open(filename) as f:
+        results = (json.loads(line) for line in f if line.strip())
+        return dict((res["name"], res) for res in results)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("old", help="results of the baseline")
+    parser.add_argument("new", help="results to compare with the baseline")
+    args = parser.parse_args()
+
+    old = load(args.old)
+    new = load(args.new)
+    for name in sorted(set(old) & set(new)):
+        for key in TIME_KEYS:
+            if key in old[name] and old[name][key] > 0:
+                ratio = new[name][key] / old[name][key]
+                print("{:48} {:>14.1f} {:>14.1f} {:>+8.1%}".format(
+                    name, old[name][key], new[name][key], ratio - 1))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,224 @@
+#!/usr/bin/env python
+"""
+Render the bundled scenes with every renderer, and compare the images and the
+performance with the references, e.g.
+
+    scripts/regression.py build
+
+The samples are seeded per tile (cf. tracer_render.h), i.e. a renderer, whose
+results did not change, renders the reference exactly. An image fails, if its
+relative mean squared error exceeds the tolerance of its renderer. A run fails,
+if its rays/sec drop, or its build time or peak memory grow by more than
+--perf-tolerance compared to the budgets of the scene. An image without a
+reference or a budget fails as well, unless --allow-missing is given, e.g. for
+a new scene, whose references are not recorded yet.
+
+The references are rendered as PFM to scenes/references/, and the budgets are
+recorded in scenes/references/budgets.json by --update. Budgets depend on the
+machine, and are only compared, if they were recorded with the same number of
+threads.
+"""
+from __future__ import print_function
+
+import argparse
+import array
+import glob
+import json
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+
+ROOT = os.path.join(os.path.dirname(os.path.abspath(__file__)), os.pardir)
+SCENES = os.path.join(ROOT, "scenes")
+REFERENCES = os.path.join(SCENES, "references")
+BUDGETS = os.path.join(REFERENCES, "budgets.json")
+
+# renderer, its arguments, and the maximum relative MSE of its images
+RENDERERS = [
+    ("raycaster", ["-w", "128"], 1e-4),
+    ("raytracer", ["-w", "128"], 1e-4),
+    ("pathtracer", ["-w", "64", "-p4", "-m1"], 1e-2),
+    ("radiosity-exact", ["exact", "-w", "64"], 1e-3),
+]
+
+# performance of a run; True, if higher is better
+PERF_KEYS = [
+    ("rays_per_second", True),
+    ("build_ms", False),
+    ("peak_rss_bytes", False),
+]
+
+
+def read_pfm(filename):
+    """Read a color PFM as (width, height, flat list of floats)."""
+    with open(filename, "rb") as f:
+        header = []
+        while len(header) < 4:
+            header.extend(f.readline().split())
+        if header[0] != b"PF":
+            raise ValueError("not a color PFM: " + filename)
+        width, height = int(header[1]), int(header[2])
+        data = array.array("f")
+        data.fromfile(f, 3 * width * height)
+        if (float(header[3]) < 0) != (sys.byteorder == "little"):
+            data.byteswap()
+        return width, height, data
+
+
+def relative_mse(image, reference):
+    """Mean of (x - r)^2 / (r^2 + 0.01) over all pixels and channels."""
+    if image[:2] != reference[:2]:
+        return float("inf")
+    pairs = zip(image[2], reference[2])
+    return sum((x - r)**2 / (r * r + 0.01)
+               for x, r in pairs) / max(1, len(image[2]))
+
+
+def render(build, renderer, args, scene, threads, image_filename):
+    """Render the scene, and return the performance read from its stats."""
+    binary = renderer.split("-")[0]
+    tmp = tempfile.mkdtemp()
+    try:
+        stats_filename = os.path.join(tmp, "stats.json")
+        # a fresh kd-tree cache, s.t. the tree is always built
+        command = [os.path.join(build, binary)] + args + [
+            "-t", str(threads), "--format", "pfm",
+            "--kdtree-cache", os.path.join(tmp, "kdtree.cache"),
+            "--stats", stats_filename, scene]
+        with open(image_filename, "wb") as image, \
+                open(os.devnull, "w") as devnull:
+            subprocess.check_call(command, stdout=image, stderr=devnull)
+        with open(stats_filename) as f:
+            stats = json.load(f)
+    finally:
+        shutil.rmtree(tmp)
+
+    stages = stats["stages"]
+    runtime_ms = stats["runtime_ms"]
+    return {
+        "rays_per_second":
+        1000.0 * stats["rays"] / runtime_ms if runtime_ms > 0 else 0,
+        "build_ms": sum(s["wall_ms"] for s in stages if s["name"] == "build"),
+        "peak_rss_bytes": max([s["peak_rss_bytes"] for s in stages] or [0]),
+    }
+
+
+def best_of(runs):
+    """Best performance of repeated runs, which filters out noise."""
+    return dict((key, (max if higher else min)(run[key] for run in runs))
+                for key, higher in PERF_KEYS)
+
+
+def check_perf(perf, budget, tolerance):
+    """Names of the performance keys exceeding the budget."""
+    failed = []
+    for key, higher in PERF_KEYS:
+        if budget.get(key, 0) <= 0:
+            continue
+        ratio = float(perf[key]) / budget[key]
+        if (ratio < 1 - tolerance) if higher else (ratio > 1 + tolerance):
+            failed.append("{} {:+.1%}".format(key, ratio - 1))
+    return failed
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("build", help="build directory of the renderers")
+    parser.add_argument("scenes", nargs="*",
+                        help="scenes [default: scenes/*.blend]")
+    parser.add_argument("-t", "--threads", type=int, default=1,
+                        help="threads of the renderers [default: 1]")
+    parser.add_argument("-r", "--repeat", type=int, default=1,
+                        help="runs per image, the best performance counts "
+                        "[default: 1]")
+    parser.add_argument("--perf-tolerance", type=float, default=0.25,
+                        help="tolerated relative regression of the "
+                        "performance [default: 0.25]")
+    parser.add_argument("--allow-missing", action="store_true",
+                        help="skip the comparisons of images without a "
+                        "reference or a budget instead of failing")
+    parser.add_argument("--update", action="store_true",
+                        help="render the references and record the budgets")
+    args = parser.parse_args()
+
+    scenes = args.scenes or sorted(glob.glob(os.path.join(SCENES, "*.blend")))
+    budgets = {}
+    if os.path.exists(BUDGETS):
+        with open(BUDGETS) as f:
+            budgets = json.load(f)
+    if args.update and not os.path.isdir(REFERENCES):
+        os.makedirs(REFERENCES)
+    tmp = tempfile.mkdtemp()
+
+    num_failed = 0
+    num_skipped = 0
+    try:
+        for scene in scenes:
+            filename = os.path.splitext(os.path.basename(scene))[0]
+            for renderer, renderer_args, max_error in RENDERERS:
+                name = renderer + "/" + filename
+                reference = os.path.join(REFERENCES,
+                                         renderer + "-" + filename + ".pfm")
+                image = os.path.join(tmp, "image.pfm")
+                perf = best_of([
+                    render(args.build, renderer, renderer_args, scene,
+                           args.threads, image) for _ in range(args.repeat)
+                ])
+
+                if args.update:
+                    shutil.copyfile(image, reference)
+                    budgets[name] = dict(perf, threads=args.threads)
+                    print("{:40} updated".format(name))
+                    continue
+
+                failed = []
+                missing = []
+                if os.path.exists(reference):
+                    error = relative_mse(read_pfm(image), read_pfm(reference))
+                    if not error <= max_error:
+                        failed.append("relMSE {:.2e} > {:.0e}".format(
+                            error, max_error))
+                else:
+                    missing.append("no reference")
+                budget = budgets.get(name)
+                if budget is None:
+                    missing.append("no budget")
+                elif budget.get("threads") == args.threads:
+                    failed += check_perf(perf, budget, args.perf_tolerance)
+                skipped = bool(missing) and args.allow_missing
+                if not args.allow_missing:
+                    failed += missing
+
+                if failed:
+                    result = "FAILED: " + ", ".join(failed)
+                elif skipped:
+                    result = "skipped: " + ", ".join(missing)
+                else:
+                    result = "ok"
+                print("{:40} {:>14.0f} rays/s {:>10.1f} ms {:>8.1f} MB  {}".
+                      format(name, perf["rays_per_second"], perf["build_ms"],
+                             perf["peak_rss_bytes"] / 2.0**20, result))
+                num_failed += bool(failed)
+                num_skipped += skipped and not failed
+    finally:
+        shutil.rmtree(tmp)
+
+    if args.update:
+        with open(BUDGETS, "w") as f:
+            json.dump(budgets, f, indent=2, sort_keys=True)
+            f.write("\n")
+        return
+    if num_skipped:
+        print("{} images without reference or budget (cf. --update)".format(
+            num_skipped))
+    if num_failed:
+        print("{} regressions".format(num_failed))
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
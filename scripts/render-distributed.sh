@@ -0,0 +1,66 @@
+#!/bin/sh
+# Render a progressive image on several hosts.
+#
+# Every host renders every n-th pass into its own accumulation buffer in the
+# shared working directory, then the buffers are merged and the final image is
+# written from the merged buffer. The working directory must be shared by all
+# hosts (e.g. NFS), and contain the tracer, the merge tool and the scene.
+#
+# Only the progressive tracers are distributed. The radiosity solvers are not,
+# i.e. the row blocks of the exact form-factor matrix are not split across
+# hosts.
+#
+# Usage: render-distributed.sh <tracer> <scene> <output> <host>... -- <options>
+#
+# e.g. render-distributed.sh build/pathtracer scene.blend out.ppm a b -- -p64
+set -e
+
+tracer=$1
+scene=$2
+output=$3
+shift 3
+
+case $(basename $tracer) in
+radiosity*)
+  echo "$0: radiosity cannot be rendered distributed" >&2
+  exit 1
+  ;;
+esac
+
+hosts=""
+while [ $# -gt 0 ] && [ "$1" != "--" ]; do
+  hosts="$hosts $1"
+  shift
+done
+[ $# -gt 0 ] && shift
+num_nodes=$(echo $hosts | wc -w)
+dir=$(pwd)
+
+# Build the kd-tree once, s.t. all nodes load it from the cache. The options
+# are passed on, since they may select the cache.
+$tracer -w 1 "$@" $scene > /dev/null
+
+# A node resumes from an existing buffer, i.e. buffers of a previous rendering
+# are removed first.
+node=0
+buffers=""
+for host in $hosts; do
+  rm -f node-$node.acc
+  buffers="$buffers node-$node.acc"
+  node=$((node + 1))
+done
+
+node=0
+pids=""
+for host in $hosts; do
+  ssh $host "cd $dir && $tracer --progressive --node=$node \
+      --nodes=$num_nodes --accumulation=node-$node.acc $* $scene > /dev/null" &
+  pids="$pids $!"
+  node=$((node + 1))
+done
+for pid in $pids; do
+  wait "$pid" || exit 1
+done
+
+$(dirname $tracer)/merge merged.acc $buffers
+$tracer --progressive --accumulation=merged.acc "$@" $scene > $output
@@ -821,6 +821,31 @@ public:
     float t_max = std::numeric_limits<float>::max(); // max ray extension
 };
 
+/**
+ * Ray with precomputed inverse direction and direction signs.
+ *
+ * Used for the slab tests against boxes and splitting planes, which are done
+ * for every node a ray traverses. Zero coordinates of the direction are
+ * replaced by EPS before inverting, s.t. the inverse direction is always
+ * finite (cf. [HH11] in lib/kdtree.h, p. 5, comment about robustness).
+ */
+class PrecomputedRay : public Ray {
+public:
+    PrecomputedRay() = default;
+    explicit PrecomputedRay(const Ray& ray) : Ray(ray) {
+        for (auto ax : AXES3) {
+            const float d_ax = d[ax] == 0 ? EPS : d[ax];
+            d_inv[ax] = 1 / d_ax;
+            sign[static_cast<int>(ax)] = d_ax < 0;
+        }
+    }
+
+public:
+    Vector3f d_inv;
+    // 1 if the (fixed) direction is negative along an axis, otherwise 0
+    std::array<int, 3> sign;
+};
+
 /**
  * Bounding box in 2d space.
  */
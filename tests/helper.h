@@ -3,6 +3,7 @@
 
 #include <math.h>
 #include <random>
+#include <vector>
 
 // Construct a triangle with trivial normals and colors.
 Triangle test_triangle(Point3f a, Point3f b, Point3f c) {
@@ -16,6 +17,21 @@ Triangle test_triangle(Point3f a, Point3f b, Point3f c, Normal3f na,
                     0);
 }
 
+// Construct a camera at (1, 2, 3) rotated around the y-axis, whose image is
+// wider than high.
+inline Camera test_camera() {
+    aiCamera ai_cam;
+    ai_cam.mHorizontalFOV = 0.6f;
+    ai_cam.mAspect = 1.5f;
+    ai_cam.mLookAt = aiVector3D(0, 0, -1);
+    aiMatrix4x4 trafo;
+    aiMatrix4x4::RotationY(0.3f, trafo);
+    trafo.a4 = 1;
+    trafo.b4 = 2;
+    trafo.c4 = 3;
+    return Camera(trafo, ai_cam);
+}
+
 Vector3f random_vec() {
     static std::default_random_engine gen(0);
     static std::uniform_real_distribution<float> rnd(-10.f, 10.f);
@@ -55,6 +71,57 @@ Triangle random_triangle() {
     return test_triangle(random_point(), random_point(), random_point());
 }
 
+// Construct random triangles with a size of at most 0.6 per axis, e.g. for
+// building acceleration structures, whose leaves contain few triangles.
+inline Triangles random_small_triangles(size_t count) {
+    static std::default_random_engine gen;
+    static std::uniform_real_distribution<float> rnd(-0.3f, 0.3f);
+
+    Triangles triangles;
+    triangles.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        Point3f center = random_point();
+        Point3f p0 = center + (Vector3f{rnd(gen), rnd(gen), rnd(gen)});
+        Point3f p1 = center + (Vector3f{rnd(gen), rnd(gen), rnd(gen)});
+        Point3f p2 = center + (Vector3f{rnd(gen), rnd(gen), rnd(gen)});
+        triangles.push_back(test_triangle(p0, p1, p2));
+    }
+    return triangles;
+}
+
+// Construct random rays with origins in a cube of the given size around
+// center, and directions in [-0.5, 0.5]^3, e.g. for comparing traversals of
+// the scenes of random_small_triangles.
+inline std::vector<Ray> random_rays(std::default_random_engine& gen,
+                                    size_t count, float size = 20,
+                                    const Point3f& center = {0, 0, 0}) {
+    std::uniform_real_distribution<float> rnd(-0.5f, 0.5f);
+
+    std::vector<Ray> rays;
+    rays.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        const Point3f origin =
+            center + Vector3f{size * rnd(gen), size * rnd(gen),
+                              size * rnd(gen)};
+        rays.emplace_back(origin, Vector3f{rnd(gen), rnd(gen), rnd(gen)});
+    }
+    return rays;
+}
+
+// Construct random distances in [0, 40], e.g. the maximum distances of
+// occluders of random_rays.
+inline std::vector<float> random_distances(std::default_random_engine& gen,
+                                           size_t count) {
+    std::uniform_real_distribution<float> rnd(0, 40);
+
+    std::vector<float> distances;
+    distances.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        distances.push_back(rnd(gen));
+    }
+    return distances;
+}
+
 // Construct a random triangle with vertices lying on the unit sphere in the
 // plane ax = pos.
 Triangle random_triangle_on_unit_sphere(Axis3 ax, float pos) {
@@ -83,3 +83,213 @@ TEST_CASE("Solve random equation", "[solver]") {
     REQUIRE(x_actual(0) == Approx(x(0)));
     REQUIRE(x_actual(1) == Approx(x(1)));
 }
+
+TEST_CASE("Sparse matrix stores only non-zero entries", "[solver]") {
+    using SparseMatrixF = math::SparseMatrix<float>;
+
+    SparseMatrixF F(3, 3);
+    F.push_row({{1, 0.5f}, {2, 0}});
+    F.push_row({});
+    F.push_row({{0, 0.25f}, {1, 0.75f}});
+
+    REQUIRE(F.num_nonzeros() == 3);
+    REQUIRE(F(0, 0) == 0);
+    REQUIRE(F(0, 1) == 0.5f);
+    REQUIRE(F(0, 2) == 0);
+    REQUIRE(F(1, 1) == 0);
+    REQUIRE(F(2, 0) == 0.25f);
+    REQUIRE(F(2, 1) == 0.75f);
+    REQUIRE(F.row_end(1) - F.row_begin(1) == 0);
+}
+
+TEST_CASE("Sparse radiosity solver equals dense solver", "[solver]") {
+    using MatrixF = math::Matrix<float>;
+    using VectorF = math::Vector<float>;
+    using SparseMatrixF = math::SparseMatrix<float>;
+    constexpr size_t N = 20;
+
+    xorshift64star<float> uniform(42);
+
+    // random form factors with row sums < 1 and about half of them zero
+    SparseMatrixF F(N, N);
+    MatrixF F_dense(N, N);
+    for (size_t i = 0; i < N; ++i) {
+        std::vector<SparseMatrixF::Entry> row;
+        for (size_t j = 0; j < N; ++j) {
+            if (i != j && uniform() < 0.5f) {
+                row.push_back({static_cast<uint32_t>(j), uniform() / N});
+                F_dense(i, j) = row.back().value;
+            }
+        }
+        F.push_row(row);
+    }
+
+    std::vector<std::array<float, 3>> rho(N);
+    std::vector<std::array<float, 3>> E(N);
+    for (size_t i = 0; i < N; ++i) {
+        rho[i] = {{uniform(), uniform(), uniform()}};
+        E[i] = {{uniform(), uniform(), uniform()}};
+    }
+
+    auto B = gauss_seidel(F, rho, E, 10);
+    REQUIRE(B.size() == N);
+
+    for (size_t c = 0; c < 3; ++c) {
+        MatrixF K(N, N);
+        VectorF E_c(N);
+        for (size_t i = 0; i < N; ++i) {
+            for (size_t j = 0; j < N; ++j) {
+                K(i, j) = (i == j ? 1.f : 0.f) - rho[i][c] * F_dense(i, j);
+            }
+            E_c(i) = E[i][c];
+        }
+
+        auto B_c = gauss_seidel(K, E_c, E_c, 10);
+        for (size_t i = 0; i < N; ++i) {
+            REQUIRE(B[i][c] == Approx(B_c(i)));
+        }
+    }
+}
+
+TEST_CASE("Parallel radiosity solvers converge to Gauss-Seidel solution",
+          "[solver]") {
+    using SparseMatrixF = math::SparseMatrix<float>;
+    constexpr size_t N = 50;
+
+    xorshift64star<float> uniform(42);
+
+    SparseMatrixF F(N, N);
+    for (size_t i = 0; i < N; ++i) {
+        std::vector<SparseMatrixF::Entry> row;
+        for (size_t j = 0; j < N; ++j) {
+            if (i != j && uniform() < 0.5f) {
+                row.push_back({static_cast<uint32_t>(j), uniform() / N});
+            }
+        }
+        F.push_row(row);
+    }
+
+    std::vector<std::array<float, 3>> rho(N);
+    std::vector<std::array<float, 3>> E(N);
+    for (size_t i = 0; i < N; ++i) {
+        rho[i] = {{uniform(), uniform(), uniform()}};
+        E[i] = {{uniform(), uniform(), uniform()}};
+    }
+    auto expected = gauss_seidel(F, rho, E, 100);
+
+    for (auto order : {SolverOrder::GAUSS_SEIDEL, SolverOrder::JACOBI,
+                       SolverOrder::RED_BLACK}) {
+        std::vector<std::array<float, 3>> first;
+        for (size_t num_threads : {1, 3}) {
+            std::vector<float> residuals;
+            auto on_iteration = [&residuals](int iteration, float residual) {
+                REQUIRE(static_cast<size_t>(iteration) ==
+                        residuals.size() + 1);
+                residuals.push_back(residual);
+                return true;
+            };
+            auto B = solve_radiosity(F, rho, E, order, num_threads, 100, 1e-6f,
+                                     on_iteration);
+
+            // stops on convergence
+            REQUIRE(residuals.size() < 100);
+            REQUIRE(residuals.back() <= 1e-6f);
+            for (size_t i = 0; i < N; ++i) {
+                for (size_t c = 0; c < 3; ++c) {
+                    REQUIRE(B[i][c] == Approx(expected[i][c]).epsilon(1e-5));
+                }
+            }
+
+            // independent of the number of threads
+            if (first.empty()) {
+                first = B;
+            } else {
+                REQUIRE(B == first);
+            }
+        }
+    }
+
+    SECTION("stops after max iterations") {
+        int num_iterations = 0;
+        solve_radiosity(F, rho, E, SolverOrder::JACOBI, 2, 3, 0.f,
+                        [&num_iterations](int iteration, float) {
+                            num_iterations = iteration;
+                            return true;
+                        });
+        REQUIRE(num_iterations == 3);
+    }
+}
+
+TEST_CASE("Progressive refinement converges to Gauss-Seidel solution",
+          "[solver]") {
+    using MatrixF = math::Matrix<float>;
+    using SparseMatrixF = math::SparseMatrix<float>;
+    constexpr size_t N = 20;
+
+    xorshift64star<float> uniform(42);
+
+    // Random areas and form factors, s.t. the form factors are reciprocal,
+    // i.e. A_i F_ij = A_j F_ji, and the row sums are < 1.
+    std::vector<float> area(N);
+    for (auto& a : area) {
+        a = 0.5f + uniform();
+    }
+    MatrixF F(N, N);
+    for (size_t i = 0; i < N; ++i) {
+        for (size_t j = i + 1; j < N; ++j) {
+            F(i, j) = uniform() / (4 * N);
+            F(j, i) = area[i] / area[j] * F(i, j);
+        }
+    }
+
+    std::vector<std::array<float, 3>> rho(N);
+    std::vector<std::array<float, 3>> E(N);
+    for (size_t i = 0; i < N; ++i) {
+        rho[i] = {{uniform(), uniform(), uniform()}};
+        E[i] = i < 2 ? std::array<float, 3>{{1, 1, 1}}
+                     : std::array<float, 3>{{0, 0, 0}};
+    }
+
+    SparseMatrixF F_sparse(N, N);
+    for (size_t i = 0; i < N; ++i) {
+        std::vector<SparseMatrixF::Entry> row;
+        for (size_t j = 0; j < N; ++j) {
+            row.push_back({static_cast<uint32_t>(j), F(i, j)});
+        }
+        F_sparse.push_row(row);
+    }
+    auto expected = gauss_seidel(F_sparse, rho, E, 100);
+
+    size_t num_rows = 0;
+    auto form_factors = [&F, &num_rows](size_t i, std::vector<float>& F_i) {
+        num_rows += 1;
+        for (size_t j = 0; j < N; ++j) {
+            F_i[j] = F(i, j);
+        }
+    };
+
+    size_t num_shots = 0;
+    float last_unshot = 1;
+    auto on_shot = [&num_shots, &last_unshot](
+        size_t shot, const std::vector<std::array<float, 3>>&, float unshot) {
+        num_shots = shot;
+        last_unshot = unshot;
+        return true;
+    };
+
+    auto B = progressive_refinement(area, rho, E, form_factors, 1e-6f, 10000,
+                                    on_shot);
+    REQUIRE(num_rows == num_shots);
+    REQUIRE(last_unshot <= 1e-6f);
+    for (size_t i = 0; i < N; ++i) {
+        for (size_t c = 0; c < 3; ++c) {
+            REQUIRE(B[i][c] == Approx(expected[i][c]).epsilon(1e-4));
+        }
+    }
+
+    SECTION("stops after max shots") {
+        num_rows = 0;
+        progressive_refinement(area, rho, E, form_factors, 0.f, 3, on_shot);
+        REQUIRE(num_rows == 3);
+    }
+}
@@ -0,0 +1,34 @@
+#include "../lib/batch.h"
+#include <catch.hpp>
+
+#include <sstream>
+
+TEST_CASE("Parse a camera", "[batch]") {
+    const LookAt camera = parse_look_at(" 1 2 3\t4 5 6  7 8 9 ");
+    REQUIRE(camera.eye == aiVector3D(1, 2, 3));
+    REQUIRE(camera.target == aiVector3D(4, 5, 6));
+    REQUIRE(camera.up == aiVector3D(7, 8, 9));
+    REQUIRE_THROWS(parse_look_at("1 2 3 4 5 6 7 8"));
+    REQUIRE_THROWS(parse_look_at("1 2 3 4 5 6 7 8 9 10"));
+}
+
+TEST_CASE("Read a camera list", "[batch]") {
+    std::istringstream is("# turntable\n"
+                          "0 0 5 0 0 0 0 1 0\n"
+                          "\n"
+                          "  \r\n"
+                          "5 0 0 0 0 0 0 1 0\r\n");
+    const auto cameras = read_camera_list(is);
+    REQUIRE(cameras.size() == 2);
+    REQUIRE(cameras[0].eye == aiVector3D(0, 0, 5));
+    REQUIRE(cameras[1].eye == aiVector3D(5, 0, 0));
+    REQUIRE(cameras[1].up == aiVector3D(0, 1, 0));
+}
+
+TEST_CASE("Files of the frames", "[batch]") {
+    REQUIRE(frame_filename("shot_###.ppm", 7) == "shot_007.ppm");
+    REQUIRE(frame_filename("shot_#.ppm", 42) == "shot_42.ppm");
+    REQUIRE(frame_filename("####", 12345) == "12345");
+    REQUIRE(frame_filename("a##_b##", 3) == "a03_b##");
+    REQUIRE(frame_filename("frame", 3) == "frame3");
+}
@@ -0,0 +1,112 @@
+#include "../lib/bricks.h"
+#include "../lib/kdtree.h"
+#include "helper.h"
+#include <catch.hpp>
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace {
+
+const std::string PREFIX = "test_bricks.cache";
+
+void remove_bricks(const BrickedScene& scene) {
+    for (size_t i = 0; i < scene.num_bricks(); ++i) {
+        std::remove(scene.brick(i).filename.c_str());
+    }
+}
+
+} // namespace
+
+TEST_CASE("Bricks partition the triangles", "[bricks]") {
+    const auto triangles = random_small_triangles(1000);
+    const BrickedScene scene(IndexedMesh(triangles), PREFIX, 100);
+    REQUIRE(scene.num_triangles() == triangles.size());
+    REQUIRE(scene.num_bricks() >= 10);
+
+    size_t num_triangles = 0;
+    for (size_t i = 0; i < scene.num_bricks(); ++i) {
+        const auto& brick = scene.brick(i);
+        REQUIRE(brick.first_id == num_triangles);
+        REQUIRE(0 < brick.num_triangles);
+        REQUIRE(brick.num_triangles <= 100);
+        num_triangles += brick.num_triangles;
+        REQUIRE(scene.brick_index(brick.first_id) == i);
+        REQUIRE(scene.brick_index(num_triangles - 1) == i);
+    }
+    REQUIRE(num_triangles == triangles.size());
+    remove_bricks(scene);
+}
+
+TEST_CASE("Bricks find the same hits as a single kd-tree", "[bricks]") {
+    const auto triangles = random_small_triangles(1000);
+    const BrickedScene scene(IndexedMesh(triangles), PREFIX, 100);
+    BrickCache cache(scene, size_t(1) << 30);
+    BrickIntersection intersection(scene, cache);
+    const KDTree tree(triangles);
+    KDTreeIntersection tree_intersection(tree);
+
+    std::default_random_engine gen;
+    const auto rays = random_rays(gen, 1000);
+    std::vector<float> t_max;
+    for (size_t i = 0; i < rays.size(); ++i) {
+        t_max.push_back(i % 2 ? 1.f : 100.f);
+    }
+    std::vector<Intersector::Hit> hits;
+    intersection.intersect_batch(rays, hits);
+    std::vector<uint8_t> occluded;
+    intersection.occluded_batch(rays, t_max, occluded);
+
+    for (size_t i = 0; i < rays.size(); ++i) {
+        float r, a, b;
+        const auto id = tree_intersection.intersect(rays[i], r, a, b);
+        REQUIRE(static_cast<bool>(hits[i].id) == static_cast<bool>(id));
+
+        float brick_r, brick_a, brick_b;
+        const auto brick_id =
+            intersection.intersect(rays[i], brick_r, brick_a, brick_b);
+        REQUIRE(brick_id == hits[i].id);
+        if (id) {
+            // the ids differ, but not the triangles
+            REQUIRE(hits[i].r == r);
+            REQUIRE(brick_r == r);
+            REQUIRE(intersection[hits[i].id].vertices ==
+                    tree_intersection[id].vertices);
+        }
+
+        const bool expected = tree_intersection.occluded(rays[i], t_max[i]);
+        REQUIRE(static_cast<bool>(occluded[i]) == expected);
+        REQUIRE(intersection.occluded(rays[i], t_max[i]) == expected);
+    }
+    remove_bricks(scene);
+}
+
+TEST_CASE("Brick cache keeps its budget", "[bricks]") {
+    const auto triangles = random_small_triangles(1000);
+    const BrickedScene scene(IndexedMesh(triangles), PREFIX, 100);
+
+    // the budget holds a single brick
+    size_t max_bytes = 0;
+    for (size_t i = 0; i < scene.num_bricks(); ++i) {
+        KDTree tree;
+        REQUIRE(tree.map_file(scene.brick(i).filename, scene.brick(i).key));
+        max_bytes = std::max(max_bytes, BrickCache::tree_bytes(tree));
+    }
+    BrickCache cache(scene, max_bytes);
+    BrickIntersection intersection(scene, cache);
+
+    std::vector<Intersector::Hit> hits;
+    std::default_random_engine gen;
+    const auto rays = random_rays(gen, 1000);
+    intersection.intersect_batch(rays, hits);
+    REQUIRE(cache.bytes() <= max_bytes);
+    // every brick is mapped at most once per batch
+    REQUIRE(cache.num_loads() <= scene.num_bricks());
+
+    // a tree, which is used, survives being dropped
+    const auto tree = cache.tree(0);
+    cache.tree(1);
+    REQUIRE(tree->num_triangles() == scene.brick(0).num_triangles);
+    remove_bricks(scene);
+}
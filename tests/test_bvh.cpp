@@ -0,0 +1,119 @@
+#include "../lib/bvh.h"
+#include "../lib/kdtree.h"
+#include "helper.h"
+#include <catch.hpp>
+
+#include <algorithm>
+#include <random>
+
+TEST_CASE("Empty BVH", "[bvh]") {
+    BVH bvh(Triangles{});
+    REQUIRE(bvh.num_nodes() == 0);
+    REQUIRE(bvh.height() == 0);
+
+    BVHIntersection bvh_intersection(bvh);
+    const Ray ray({0, 0, 0}, {0, 0, 1});
+    REQUIRE(!bvh_intersection.intersect(ray));
+    REQUIRE(!bvh_intersection.occluded(ray, 1000));
+}
+
+TEST_CASE("Four separated triangles in BVH", "[bvh]") {
+    auto a = test_triangle({0, 0, 1}, {0, 1, 1}, {1, 0, 1});
+    auto b = test_triangle({2, 0, 1}, {3, 0, 1}, {3, 1, 1});
+    auto c = test_triangle({0, 2, 1}, {0, 3, 1}, {1, 3, 1});
+    auto d = test_triangle({3, 2, 1}, {3, 3, 1}, {2, 3, 1});
+    BVH bvh(Triangles{a, b, c, d});
+    // all triangles fit into a single bundle
+    REQUIRE(bvh.num_nodes() == 1);
+    REQUIRE(bvh.height() == 1);
+
+    BVHIntersection bvh_intersection(bvh);
+    BVHIntersection::OptionalId hit;
+    float r, s, t;
+
+    hit = bvh_intersection.intersect({{0, 0, 0}, {0.5f, 0.5f, 1}}, r, s, t);
+    REQUIRE(hit);
+    REQUIRE(bvh_intersection.at(hit) == a);
+    REQUIRE(r == 1);
+    REQUIRE(s == 0.5f);
+    REQUIRE(t == 0.5f);
+
+    hit = bvh_intersection.intersect({{0, 0, 0}, {2.5f, 2.5f, 1}}, r, s, t);
+    REQUIRE(hit);
+    REQUIRE(bvh_intersection.at(hit) == d);
+
+    hit = bvh_intersection.intersect({{0, 0, 0}, {1.5f, 1.5f, 1}}, r, s, t);
+    REQUIRE(!hit);
+}
+
+TEST_CASE("BVH and kd-tree find the same triangles", "[bvh]") {
+    const auto triangles = random_small_triangles(1000);
+    BVH bvh(triangles);
+    KDTree tree(triangles);
+    REQUIRE(1 < bvh.height());
+
+    BVHIntersection bvh_intersection(bvh);
+    KDTreeIntersection tree_intersection(tree);
+
+    std::default_random_engine gen;
+    const auto rays = random_rays(gen, 10000);
+    const auto distances = random_distances(gen, rays.size());
+    for (size_t i = 0; i < rays.size(); ++i) {
+        const Ray& ray = rays[i];
+        const float t_max = distances[i];
+
+        float r, s, t;
+        const auto id = bvh_intersection.intersect(ray, r, s, t);
+        float tree_r, tree_s, tree_t;
+        const auto tree_id = tree_intersection.intersect(ray, tree_r, tree_s,
+                                                         tree_t);
+        REQUIRE(id == tree_id);
+        if (id) {
+            REQUIRE(r == tree_r);
+            REQUIRE(s == tree_s);
+            REQUIRE(t == tree_t);
+        }
+        REQUIRE(bvh_intersection.occluded(ray, t_max) == (id && r < t_max));
+    }
+}
+
+TEST_CASE("BVH packet traversal equals scalar traversal", "[bvh]") {
+    BVH bvh(random_small_triangles(1000));
+    BVHIntersection bvh_intersection(bvh);
+
+    std::default_random_engine gen;
+    for (unsigned n = 0; n < 1000; ++n) {
+        BVHIntersection::RayPacket rays;
+        std::array<float, BVHIntersection::PACKET_SIZE> t_max;
+        const auto random = random_rays(gen, rays.size());
+        const auto distances = random_distances(gen, rays.size());
+        std::copy(random.begin(), random.end(), rays.begin());
+        std::copy(distances.begin(), distances.end(), t_max.begin());
+
+        const unsigned active = n % 16;
+        const auto hits = bvh_intersection.intersect_packet(rays, active);
+        const unsigned occluded =
+            bvh_intersection.occluded_packet(rays, t_max, active);
+        for (size_t i = 0; i < rays.size(); ++i) {
+            if (!(active & (1 << i))) {
+                REQUIRE(!hits[i].id);
+                REQUIRE(!(occluded & (1 << i)));
+                continue;
+            }
+            REQUIRE(hits[i].id == bvh_intersection.intersect(rays[i]));
+            REQUIRE(static_cast<bool>(occluded & (1 << i)) ==
+                    bvh_intersection.occluded(rays[i], t_max[i]));
+        }
+    }
+}
+
+TEST_CASE("BVH of coincident triangles", "[bvh]") {
+    // all centroids coincide, hence the builder cannot bin them
+    const auto tri = test_triangle({0, 0, 1}, {0, 1, 1}, {1, 0, 1});
+    BVH bvh(Triangles(100, tri));
+    REQUIRE(bvh.num_triangles() == 100);
+
+    BVHIntersection bvh_intersection(bvh);
+    REQUIRE(bvh_intersection.intersect({{0, 0, 0}, {0.25f, 0.25f, 1}}));
+    REQUIRE(!bvh_intersection.intersect({{0, 0, 0}, {1, 1, 1}}));
+}
@@ -0,0 +1,49 @@
+#include "../lib/camera_rays.h"
+#include "helper.h"
+#include <catch.hpp>
+
+namespace {
+
+void require_close(const Vector3f& v, const Vector3f& w) {
+    REQUIRE((v - w).length() < 1e-4f * w.length());
+}
+
+} // namespace
+
+TEST_CASE("Camera rays agree with raster2cam", "[camera_rays]") {
+    const Camera cam = test_camera();
+    const int width = 640, height = 480;
+    const CameraRays camera_rays(cam, width, height);
+
+    REQUIRE(camera_rays.origin() == Point3f(1, 2, 3));
+    for (float y : {0.f, 0.5f, 123.25f, 479.9f}) {
+        for (float x : {0.f, 0.5f, 321.75f, 639.9f}) {
+            require_close(camera_rays.direction(x, y),
+                          cam.raster2cam({x, y}, width, height));
+        }
+    }
+}
+
+TEST_CASE("Batch of camera rays equals single camera rays",
+          "[camera_rays]") {
+    const Camera cam = test_camera();
+    const CameraRays camera_rays(cam, 640, 480);
+
+    RayDirections::Floats xs, ys;
+    for (int i = 0; i < 64; ++i) {
+        xs.push_back(i * 9.75f);
+        ys.push_back(i * 7.25f + 0.5f);
+    }
+    RayDirections dirs;
+    camera_rays.directions(xs, ys, dirs);
+    REQUIRE(dirs.size() == xs.size());
+    for (size_t i = 0; i < xs.size(); ++i) {
+        require_close(dirs[i], camera_rays.direction(xs[i], ys[i]));
+    }
+
+    const auto rays = camera_rays.packet(dirs, 8);
+    for (size_t k = 0; k < CameraRays::PACKET_SIZE; ++k) {
+        REQUIRE(rays[k].o == camera_rays.origin());
+        REQUIRE(rays[k].d == dirs[8 + k]);
+    }
+}
@@ -21,6 +21,16 @@ TEST_CASE("Clip polygon at a plane", "[clipping]") {
     REQUIRE(res == expected);
 }
 
+TEST_CASE("Clip fixed-capacity polygon at a plane", "[clipping]") {
+    const std::array<Point3f, 3> tri = {{{0, 0, 0}, {1, 0, 0}, {1, 1, 0}}};
+    ClipPolygon clipped;
+    clip_polygon_at_plane(ClipPolygon(tri), {1, 0, 0}, 0.5f, clipped);
+
+    const auto expected = clip_polygon_at_plane(
+        std::vector<Point3f>(tri.begin(), tri.end()), {1, 0, 0}, 0.5f);
+    REQUIRE(std::vector<Point3f>(clipped.begin(), clipped.end()) == expected);
+}
+
 TEST_CASE("Simple line clipping test", "[clipping]") {
     Bbox3f box{{-1, -1, -1}, {1, 1, 1}};
 
@@ -81,6 +91,13 @@ TEST_CASE("Simple triangle clipping at aabb", "[clipping]") {
     REQUIRE(res == (Bbox3f{{0, 0, 0}, {0.5, 0.5, 0.5}}));
 }
 
+TEST_CASE("Triangle touching aabb in a corner", "[clipping]") {
+    Bbox3f box{{-1, -1, -1}, {1, 1, 1}};
+    auto tri = test_triangle({1, 1, 1}, {2, 1, 2}, {2, 2, 1});
+    auto res = clip_triangle_at_aabb(tri, box);
+    REQUIRE(res.empty());
+}
+
 TEST_CASE("Random triangle clipping at aabb", "[clipping]") {
     Bbox3f box{{-1, -1, -1}, {1, 1, 1}};
     for (int i = 0; i < 10000; ++i) {
@@ -40,17 +40,26 @@ void test_common_config(const char* usage) {
     REQUIRE(conf.gamma_correction_enabled == false);
     REQUIRE(conf.exposure == 1.5);
     REQUIRE(conf.filename == "file");
+    REQUIRE(conf.tile_size == 16);
+    REQUIRE(conf.tile_order == TileOrder::MORTON);
+    REQUIRE(conf.image_format == ImageFormat::PPM);
+    REQUIRE(conf.accelerator == AcceleratorType::KDTREE);
+    REQUIRE(conf.kdtree_cache_filename == "kdtree.cache");
 }
 
 TEST_CASE("Create config from raycaster USAGE", "[config]") {
     test_common_config(raycaster::USAGE);
 
-    const char* argv[] = {"./exec", "--max-visibility", "4.5", "file"};
+    const char* argv[] = {"./exec",       "--max-visibility", "4.5",
+                          "--tile-size",  "8",                "--tile-order",
+                          "spiral",       "file"};
     std::map<std::string, docopt::value> args =
-        docopt::docopt(raycaster::USAGE, {argv + 1, argv + 4});
+        docopt::docopt(raycaster::USAGE, {argv + 1, argv + 8});
     auto conf = TracerConfig::from_docopt(args);
 
     REQUIRE(conf.max_visibility == 4.5);
+    REQUIRE(conf.tile_size == 8);
+    REQUIRE(conf.tile_order == TileOrder::SPIRAL);
 
     std::ostringstream os;
     os << conf;
@@ -73,17 +82,75 @@ TEST_CASE("Create config from raytracer USAGE", "[config]") {
     REQUIRE(os.str().size() > 0);
 }
 
+TEST_CASE("PFM images are not post-processed", "[config]") {
+    const char* argv[] = {"./exec", "--format", "pfm", "file"};
+    std::map<std::string, docopt::value> args =
+        docopt::docopt(raycaster::USAGE, {argv + 1, argv + 4});
+    auto conf = TracerConfig::from_docopt(args);
+
+    Image image(1, 1);
+    image(0, 0) = Color(2.5f, 0.5f, 0.25f, 1);
+    conf.postprocessor()(image);
+    REQUIRE(image(0, 0) == Color(2.5f, 0.5f, 0.25f, 1));
+
+    conf.image_format = ImageFormat::PPM;
+    conf.postprocessor()(image);
+    REQUIRE(image(0, 0).r <= 1);
+}
+
+TEST_CASE("Camera and service of the tracers", "[config]") {
+    for (const char* usage :
+         {raycaster::USAGE, raytracer::USAGE, pathtracer::USAGE}) {
+        const char* argv[] = {"./exec", "--look-at=1 2 3  0 0 0 0 0 1",
+                              "--serve=5123", "file"};
+        auto conf = TracerConfig::from_docopt(
+            docopt::docopt(usage, {argv + 1, argv + 4}));
+        REQUIRE(conf.look_at_enabled);
+        REQUIRE(conf.look_at.eye == aiVector3D(1, 2, 3));
+        REQUIRE(conf.look_at.target == aiVector3D(0, 0, 0));
+        REQUIRE(conf.look_at.up == aiVector3D(0, 0, 1));
+        REQUIRE(conf.serve_port == 5123);
+
+        const char* defaults[] = {"./exec", "file"};
+        conf = TracerConfig::from_docopt(
+            docopt::docopt(usage, {defaults + 1, defaults + 2}));
+        REQUIRE(!conf.look_at_enabled);
+        REQUIRE(conf.serve_port == 0);
+
+        const char* invalid[] = {"./exec", "--look-at=1 2 3", "file"};
+        REQUIRE_THROWS(TracerConfig::from_docopt(
+            docopt::docopt(usage, {invalid + 1, invalid + 3})));
+    }
+}
+
 TEST_CASE("Create config from pathtracer USAGE", "[config]") {
     test_common_config(pathtracer::USAGE);
 
-    const char* argv[] = {"./exec", "-d", "42", "-p", "42", "-m", "42", "file"};
+    const char* argv[] = {"./exec",
+                          "-d",
+                          "42",
+                          "-p",
+                          "42",
+                          "-m",
+                          "42",
+                          "--wavefront",
+                          "--adaptive-threshold=0.05",
+                          "--max-pixel-samples=128",
+                          "--node=1",
+                          "--nodes=3",
+                          "file"};
     std::map<std::string, docopt::value> args =
-        docopt::docopt(pathtracer::USAGE, {argv + 1, argv + 8});
+        docopt::docopt(pathtracer::USAGE, {argv + 1, argv + 13});
     auto conf = TracerConfig::from_docopt(args);
 
     REQUIRE(conf.max_recursion_depth == 42);
     REQUIRE(conf.num_pixel_samples == 42);
     REQUIRE(conf.num_monte_carlo_samples == 42);
+    REQUIRE(conf.wavefront_enabled);
+    REQUIRE(conf.adaptive_threshold == 0.05f);
+    REQUIRE(conf.max_pixel_samples == 128);
+    REQUIRE(conf.node_index == 1);
+    REQUIRE(conf.num_nodes == 3);
 
     std::ostringstream os;
     os << conf;
@@ -144,6 +211,10 @@ TEST_CASE("Create config from radiosity USAGE", "[config]") {
     REQUIRE(conf.BF_eps == 0.1f);
     REQUIRE(conf.max_subdivisions == 42);
     REQUIRE(conf.max_iterations == 42);
+    REQUIRE(conf.clustering_enabled);
+    REQUIRE(conf.solver_order == SolverOrder::RED_BLACK);
+    REQUIRE(conf.solver_eps == 1e-4f);
+    REQUIRE(conf.max_solver_iterations == 100);
 
     // test standard values of flags
     REQUIRE(!conf.gouraud_enabled);
@@ -175,6 +246,39 @@ TEST_CASE("Test mode in radiosity USAGE", "[config]") {
 
         REQUIRE(conf.mode == RadiosityConfig::HIERARCHICAL);
     }
+    {
+        const char* argv[] = {"./exec", "progressive", "file"};
+
+        std::map<std::string, docopt::value> args =
+            docopt::docopt(radiosity::USAGE, {argv + 1, argv + 3});
+        auto conf = RadiosityConfig::from_docopt(args);
+
+        REQUIRE(conf.mode == RadiosityConfig::PROGRESSIVE);
+        REQUIRE(conf.shoot_eps == 0.01f);
+        REQUIRE(conf.max_shots == 100000);
+        REQUIRE(conf.snapshot_interval == 0);
+    }
+}
+
+TEST_CASE("Test progressive options in radiosity USAGE", "[config]") {
+    const char* argv[] = {"./exec",
+                          "progressive",
+                          "--shoot-eps",
+                          "0.5",
+                          "--max-shots",
+                          "42",
+                          "--snapshot-interval",
+                          "7",
+                          "file"};
+
+    std::map<std::string, docopt::value> args =
+        docopt::docopt(radiosity::USAGE, {argv + 1, argv + 9});
+    auto conf = RadiosityConfig::from_docopt(args);
+
+    REQUIRE(conf.mode == RadiosityConfig::PROGRESSIVE);
+    REQUIRE(conf.shoot_eps == 0.5f);
+    REQUIRE(conf.max_shots == 42);
+    REQUIRE(conf.snapshot_interval == 7);
 }
 
 TEST_CASE("Test mesh flag in radiosity USAGE", "[config]") {
@@ -200,13 +304,61 @@ TEST_CASE("Test mesh flag in radiosity USAGE", "[config]") {
 
 TEST_CASE("Test flags in radiosity USAGE", "[config]") {
     const char* argv[] = {"./exec",  "hierarchical", "-g",
-                          "--links", "--exact",      "file"};
+                          "--links", "--exact",      "--no-clustering",
+                          "file"};
 
     std::map<std::string, docopt::value> args =
-        docopt::docopt(radiosity::USAGE, {argv + 1, argv + 6});
+        docopt::docopt(radiosity::USAGE, {argv + 1, argv + 7});
     auto conf = RadiosityConfig::from_docopt(args);
 
     REQUIRE(conf.gouraud_enabled);
     REQUIRE(conf.links_enabled);
     REQUIRE(conf.exact_hierarchical_enabled);
+    REQUIRE(!conf.clustering_enabled);
+}
+
+TEST_CASE("Test bake in radiosity USAGE", "[config]") {
+    {
+        const char* argv[] = {"./exec", "exact", "--bake=scene.bake", "file"};
+        std::map<std::string, docopt::value> args =
+            docopt::docopt(radiosity::USAGE, {argv + 1, argv + 4});
+        auto conf = RadiosityConfig::from_docopt(args);
+
+        REQUIRE(conf.mode == RadiosityConfig::EXACT);
+        REQUIRE(conf.bake_filename == "scene.bake");
+        REQUIRE(!conf.render_bake);
+    }
+    {
+        const char* argv[] = {"./exec", "render", "--bake=scene.bake", "file"};
+        std::map<std::string, docopt::value> args =
+            docopt::docopt(radiosity::USAGE, {argv + 1, argv + 4});
+        auto conf = RadiosityConfig::from_docopt(args);
+
+        REQUIRE(conf.bake_filename == "scene.bake");
+        REQUIRE(conf.render_bake);
+    }
+    {
+        const char* argv[] = {"./exec", "hierarchical", "file"};
+        std::map<std::string, docopt::value> args =
+            docopt::docopt(radiosity::USAGE, {argv + 1, argv + 3});
+        auto conf = RadiosityConfig::from_docopt(args);
+
+        REQUIRE(conf.bake_filename.empty());
+        REQUIRE(!conf.render_bake);
+    }
+}
+
+TEST_CASE("Test solver options in radiosity USAGE", "[config]") {
+    const char* argv[] = {"./exec",       "exact",
+                          "--solver",     "jacobi",
+                          "--solver-eps", "0.5",
+                          "--solver-iterations=7", "file"};
+
+    std::map<std::string, docopt::value> args =
+        docopt::docopt(radiosity::USAGE, {argv + 1, argv + 8});
+    auto conf = RadiosityConfig::from_docopt(args);
+
+    REQUIRE(conf.solver_order == SolverOrder::JACOBI);
+    REQUIRE(conf.solver_eps == 0.5f);
+    REQUIRE(conf.max_solver_iterations == 7);
 }
@@ -1,6 +1,11 @@
 #include "../lib/effects.h"
 #include <catch.hpp>
 
+#include <cmath>
+#include <sstream>
+#include <string>
+#include <vector>
+
 SCENARIO("Zero exposure", "[effects]") {
     GIVEN("A light") {
         float light = 0.5f;
@@ -70,3 +75,99 @@ SCENARIO("Default gamma correction applied to color", "[effects]") {
         REQUIRE(color.a == correct_color.a);
     }}}}
 }
+
+SCENARIO("Gamma lookup table", "[effects]") {
+    GIVEN("A gamma lookup table") {
+        const float inverse_gamma = 1 / 2.2f;
+        const GammaLUT lut(inverse_gamma);
+    WHEN("correcting lights in [0, 1]") {
+    THEN("the table approximates powf") {
+        for (int i = 0; i <= 10000; ++i) {
+            const float light = i / 10000.f;
+            REQUIRE(std::abs(lut(light) - gamma(light, inverse_gamma)) <
+                    1e-4f);
+        }
+    }}
+    WHEN("correcting four lights at once") {
+        alignas(16) float lights[4] = {0.f, 0.001f, 0.5f, 1.f};
+        alignas(16) float corrected[4];
+        _mm_store_ps(corrected, lut(_mm_load_ps(lights)));
+    THEN("the result equals the scalar one") {
+        for (int i = 0; i < 4; ++i) {
+            REQUIRE(corrected[i] == Approx(lut(lights[i])));
+        }
+    }}}
+}
+
+SCENARIO("Post-processing of an image", "[effects]") {
+    GIVEN("An image with linear colors") {
+        Image original(7, 3);
+        int i = 0;
+        for (auto& color : original) {
+            const float v = 0.1f * i++;
+            color = Color{v, 2 * v, 0.5f * v, 0.25f};
+        }
+    WHEN("post-processing the image with every tone mapping operator") {
+    THEN("every channel is the gamma corrected tone mapped light, and the "
+         "alpha channel has not changed") {
+        for (auto op : {ToneMapping::EXPOSURE, ToneMapping::REINHARD,
+                        ToneMapping::ACES}) {
+            Image image = original;
+            const PostProcessor postprocess(op, 1.5f, true, 1 / 2.2f);
+            postprocess(image);
+            for (size_t y = 0; y < image.height(); ++y) {
+                for (size_t x = 0; x < image.width(); ++x) {
+                    const Color& c = original(x, y);
+                    const Color& p = image(x, y);
+                    for (int k = 0; k < 3; ++k) {
+                        const float expected =
+                            gamma(tone_map((&c.r)[k], op, 1.5f), 1 / 2.2f);
+                        REQUIRE(std::abs((&p.r)[k] - expected) < 1e-4f);
+                    }
+                    REQUIRE(p.a == c.a);
+                }
+            }
+        }
+    }}}
+}
+
+SCENARIO("Post-processing without gamma correction", "[effects]") {
+    GIVEN("A color") {
+        Color color{0.5f, 1.f, 8.f, 1};
+    WHEN("applying the exposure without gamma correction") {
+        const PostProcessor postprocess(ToneMapping::EXPOSURE, 2.f, false,
+                                        1 / 2.2f);
+        Color mapped = color;
+        postprocess(&mapped, 1);
+    THEN("the result is the exposed color") {
+        const Color expected = exposure(color, 2.f);
+        REQUIRE(mapped.r == Approx(expected.r));
+        REQUIRE(mapped.g == Approx(expected.g));
+        REQUIRE(mapped.b == Approx(expected.b));
+        REQUIRE(mapped.a == 1);
+    }}}
+}
+
+SCENARIO("Parse tone mapping operators", "[effects]") {
+    for (auto op :
+         {ToneMapping::EXPOSURE, ToneMapping::REINHARD, ToneMapping::ACES}) {
+        REQUIRE(parse_tone_mapping(to_string(op)) == op);
+    }
+    REQUIRE_THROWS(parse_tone_mapping("filmic"));
+}
+
+TEST_CASE("HDR colors survive a linear PFM round trip", "[effects]") {
+    Image image(1, 1);
+    image(0, 0) = Color(2.5f, 0.5f, 8.f, 1);
+    PostProcessor()(image);
+
+    std::stringstream ss;
+    write_pfm(ss, image);
+    std::string magic, scale;
+    size_t width, height;
+    ss >> magic >> width >> height >> scale;
+    ss.get(); // single whitespace before data
+    std::vector<float> data(3);
+    ss.read(reinterpret_cast<char*>(data.data()), 3 * sizeof(float));
+    REQUIRE(data == std::vector<float>({2.5f, 0.5f, 8.f}));
+}
@@ -0,0 +1,57 @@
+#include "../lib/heatmap.h"
+#include "../lib/kdtree.h"
+#include "helper.h"
+#include <catch.hpp>
+
+#include <vector>
+
+TEST_CASE("Kd-tree counts its traversal work", "[heatmap]") {
+    Triangles triangles;
+    for (int i = 0; i < 100; ++i) {
+        triangles.push_back(random_triangle());
+    }
+    const KDTree tree(triangles);
+    KDTreeIntersection intersection(tree);
+    REQUIRE(intersection.traversal_counts().nodes == 0);
+    REQUIRE(intersection.traversal_counts().triangles == 0);
+
+    // a ray through the scene
+    const Ray ray({0, 0, -20}, {0, 0, 1});
+    TileCost cost;
+    {
+        TileCostTimer timer(intersection, cost);
+        intersection.intersect(ray);
+    }
+    REQUIRE(cost.nodes == intersection.traversal_counts().nodes);
+    REQUIRE(cost.triangles == intersection.traversal_counts().triangles);
+    REQUIRE(cost.nodes > 0);
+    REQUIRE(cost.triangles > 0);
+    REQUIRE(cost.ms >= 0);
+
+    // the cost is added
+    {
+        TileCostTimer timer(intersection, cost);
+        intersection.occluded(ray, 40);
+        intersection.intersect_packet({{ray, ray, ray, ray}});
+    }
+    REQUIRE(cost.nodes == intersection.traversal_counts().nodes);
+    REQUIRE(cost.triangles == intersection.traversal_counts().triangles);
+}
+
+TEST_CASE("Cost of a tile is spread over its pixels", "[heatmap]") {
+    const std::vector<Tile> tiles = {{0, 0, 2, 1}, {2, 0, 3, 1}};
+    std::vector<TileCost> costs(2);
+    costs[0].ms = 0.004;
+    costs[0].nodes = 10;
+    costs[0].triangles = 20;
+    costs[1].nodes = 3;
+
+    const Image heatmap = cost_heatmap(tiles, costs, 3, 1);
+    REQUIRE(heatmap(0, 0).r == Approx(2));
+    REQUIRE(heatmap(0, 0).g == 5);
+    REQUIRE(heatmap(0, 0).b == 10);
+    REQUIRE(heatmap(1, 0) == heatmap(0, 0));
+    REQUIRE(heatmap(2, 0).r == 0);
+    REQUIRE(heatmap(2, 0).g == 3);
+    REQUIRE(heatmap(2, 0).b == 0);
+}
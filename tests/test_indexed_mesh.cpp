@@ -0,0 +1,67 @@
+#include "../lib/indexed_mesh.h"
+#include "helper.h"
+#include <catch.hpp>
+
+#include <cstring>
+#include <new>
+
+TEST_CASE("Indexed mesh shares vertices, normals and materials",
+          "[indexed_mesh]") {
+    // two triangles of a quad sharing an edge
+    const Point3f a(0, 0, 0), b(1, 0, 0), c(1, 1, 0), d(0, 1, 0);
+    const Normal3f n(0, 0, 1);
+    const Triangles tris{test_triangle(a, b, c, n, n, n),
+                         test_triangle(a, c, d, n, n, n)};
+
+    const IndexedMesh mesh(tris);
+    REQUIRE(mesh.num_triangles() == 2);
+    REQUIRE(mesh.vertices().size() == 4);
+    REQUIRE(mesh.normals().size() == 1);
+    REQUIRE(mesh.materials().size() == 1);
+    REQUIRE(mesh.is_valid());
+    REQUIRE(mesh.indexed_triangles()[1].vertices[0] ==
+            mesh.indexed_triangles()[0].vertices[0]);
+}
+
+TEST_CASE("Materialized triangles are bitwise equal", "[indexed_mesh]") {
+    Triangles tris;
+    for (size_t i = 0; i < 100; ++i) {
+        tris.push_back(test_triangle(random_point(), random_point(),
+                                     random_point(), random_normal(),
+                                     random_normal(), random_normal()));
+    }
+    // distinguish -0 from 0
+    tris.push_back(test_triangle({0, 0, 0}, {1, 0, 0}, {0, 1, 0}));
+    tris.push_back(test_triangle({-0.f, 0, 0}, {1, 0, 0}, {0, 1, 0}));
+
+    const IndexedMesh mesh(tris);
+    const auto materialized = mesh.triangles();
+    REQUIRE(materialized.size() == tris.size());
+    REQUIRE(std::memcmp(materialized.data(), tris.data(),
+                        tris.size() * sizeof(Triangle)) == 0);
+}
+
+TEST_CASE("Indexed mesh with invalid indices", "[indexed_mesh]") {
+    IndexedTriangle tri = {{0, 1, 2}, {0, 0, 0}, 0};
+    const IndexedMesh valid({{0, 0, 0}, {1, 0, 0}, {0, 1, 0}}, {{0, 0, 1}},
+                            {Material()}, {tri});
+    REQUIRE(valid.is_valid());
+
+    tri.material = 1;
+    const IndexedMesh invalid({{0, 0, 0}, {1, 0, 0}, {0, 1, 0}}, {{0, 0, 1}},
+                              {Material()}, {tri});
+    REQUIRE(!invalid.is_valid());
+}
+
+TEST_CASE("Equal materials are bitwise equal", "[indexed_mesh]") {
+    // materials constructed in memory with different garbage
+    alignas(Material) unsigned char a_bytes[sizeof(Material)];
+    alignas(Material) unsigned char b_bytes[sizeof(Material)];
+    std::memset(a_bytes, 0x00, sizeof(a_bytes));
+    std::memset(b_bytes, 0xFF, sizeof(b_bytes));
+    auto* a = new (a_bytes) Material;
+    auto* b = new (b_bytes) Material;
+    a->diffuse = b->diffuse = Color(0.5f, 0.25f, 0.125f, 1);
+    a->reflectivity = b->reflectivity = 0.5f;
+    REQUIRE(std::memcmp(a, b, sizeof(Material)) == 0);
+}
@@ -0,0 +1,148 @@
+#include "../lib/bvh.h"
+#include "../lib/instancing.h"
+#include "helper.h"
+#include <catch.hpp>
+
+#include <limits>
+#include <random>
+
+namespace {
+
+// Unit square in the plane z = 0 consisting of two triangles.
+Triangles unit_square() {
+    return {test_triangle({0, 0, 0}, {1, 0, 0}, {1, 1, 0}),
+            test_triangle({0, 0, 0}, {1, 1, 0}, {0, 1, 0})};
+}
+
+} // namespace
+
+TEST_CASE("Transform points, vectors and normals", "[transform]") {
+    // rotation by 90 degrees around z, scaling by 2 and translation
+    const Transform T({0, -2, 0, 1, 2, 0, 0, 2, 0, 0, 2, 3});
+    REQUIRE(T.det() == 8);
+    REQUIRE(T(Point3f(1, 0, 0)) == Point3f(1, 4, 3));
+    REQUIRE(T(Vector3f(1, 0, 0)) == Vector3f(0, 2, 0));
+    REQUIRE(normalize(T(Normal3f(0, 0, 1))) == Normal3f(0, 0, 1));
+
+    const Transform inv = T.inverse();
+    REQUIRE(inv(Point3f(1, 4, 3)) == Point3f(1, 0, 0));
+    REQUIRE(inv(T(Vector3f(1, 2, 3))) == Vector3f(1, 2, 3));
+
+    const Bbox3f box(Point3f(0, 0, 0), Point3f(1, 1, 1));
+    REQUIRE(T(box).p_min == Point3f(-1, 2, 3));
+    REQUIRE(T(box).p_max == Point3f(1, 4, 5));
+
+    REQUIRE_THROWS_AS(Transform::scale(0).inverse(), std::runtime_error);
+}
+
+TEST_CASE("Empty instanced scene", "[instancing]") {
+    InstancedScene scene({}, {});
+    REQUIRE(scene.num_triangles() == 0);
+
+    InstancedIntersection intersection(scene);
+    const Ray ray({0, 0, 0}, {0, 0, 1});
+    REQUIRE(!intersection.intersect(ray));
+    REQUIRE(!intersection.occluded(ray, 1000));
+}
+
+TEST_CASE("Instances of a mesh", "[instancing]") {
+    // 3 translated squares, and one twice as large
+    InstancedScene scene(
+        {unit_square()},
+        {{0, Transform::translation({0, 0, 1})},
+         {0, Transform::translation({2, 0, 1})},
+         {0, Transform::translation({0, 0, 2})},
+         {0, Transform({2, 0, 0, 4, 0, 2, 0, 0, 0, 0, 2, 1})}});
+    REQUIRE(scene.num_meshes() == 1);
+    REQUIRE(scene.num_instances() == 4);
+    REQUIRE(scene.num_triangles() == 8);
+
+    InstancedIntersection intersection(scene);
+    float r, a, b;
+
+    // the closest instance is hit
+    auto hit =
+        intersection.intersect({{0.75f, 0.25f, 3}, {0, 0, -1}}, r, a, b);
+    REQUIRE(hit);
+    REQUIRE(static_cast<size_t>(hit) == 4);
+    REQUIRE(r == 1);
+    REQUIRE(intersection[hit].vertices[1] == Point3f(1, 0, 2));
+
+    hit = intersection.intersect({{0.75f, 0.25f, 0}, {0, 0, 1}}, r, a, b);
+    REQUIRE(hit);
+    REQUIRE(static_cast<size_t>(hit) == 0);
+    REQUIRE(r == 1);
+
+    hit = intersection.intersect({{2.25f, 0.75f, 0}, {0, 0, 1}}, r, a, b);
+    REQUIRE(hit);
+    REQUIRE(static_cast<size_t>(hit) == 3);
+
+    // the direction of the ray is not normalized in object space
+    hit = intersection.intersect({{5, 1.5f, 0}, {0, 0, 2}}, r, a, b);
+    REQUIRE(hit);
+    REQUIRE(static_cast<size_t>(hit) == 7);
+    REQUIRE(r == 0.5f);
+    REQUIRE(intersection[hit].vertices[2] == Point3f(4, 2, 1));
+
+    REQUIRE(!intersection.intersect({{1.5f, 0.5f, 0}, {0, 0, 1}}, r, a, b));
+    REQUIRE(intersection.occluded({{2.25f, 0.75f, 0}, {0, 0, 1}}, 1.5f));
+    REQUIRE(!intersection.occluded({{2.25f, 0.75f, 0}, {0, 0, 1}}, 0.5f));
+}
+
+TEST_CASE("Instanced scene equals flat scene", "[instancing]") {
+    std::vector<Triangles> meshes = {random_small_triangles(100),
+                                     random_small_triangles(50)};
+    std::vector<Instance> instances;
+    Triangles flat;
+    for (uint32_t i = 0; i < 8; ++i) {
+        const uint32_t mesh = i % meshes.size();
+        const Transform to_world =
+            Transform::translation({20.f * (i % 2), 20.f * (i / 2 % 2),
+                                    20.f * (i / 4)});
+        instances.push_back({mesh, to_world});
+        for (const auto& tri : meshes[mesh]) {
+            flat.push_back(test_triangle(to_world(tri.vertices[0]),
+                                         to_world(tri.vertices[1]),
+                                         to_world(tri.vertices[2])));
+        }
+    }
+    InstancedScene scene(meshes, instances);
+    BVH bvh(flat);
+    REQUIRE(scene.num_triangles() == flat.size());
+
+    InstancedIntersection intersection(scene);
+    BVHIntersection bvh_intersection(bvh);
+
+    std::default_random_engine gen;
+    size_t num_hits = 0, num_same = 0;
+    for (const auto& ray : random_rays(gen, 10000, 60, {10, 10, 10})) {
+
+        float r, a, b;
+        const auto id = intersection.intersect(ray, r, a, b);
+        float flat_r, flat_a, flat_b;
+        const auto flat_id = bvh_intersection.intersect(ray, flat_r, flat_a,
+                                                        flat_b);
+        const bool occluded =
+            intersection.occluded(ray, std::numeric_limits<float>::max());
+        REQUIRE(occluded == static_cast<bool>(id));
+        if (!id && !flat_id) {
+            continue;
+        }
+        num_hits += 1;
+        // Rounding errors of the translation may change hits at the edges.
+        if (id == flat_id) {
+            num_same += 1;
+            REQUIRE(r == Approx(flat_r));
+            const Vector3f diff =
+                intersection[id].vertices[0] - flat[flat_id].vertices[0];
+            REQUIRE(diff.length() < 1e-4f);
+        }
+    }
+    REQUIRE(0 < num_hits);
+    REQUIRE(num_hits - num_same <= num_hits / 100);
+}
+
+TEST_CASE("Instance of a missing mesh", "[instancing]") {
+    REQUIRE_THROWS_AS(InstancedScene({unit_square()}, {{1, Transform()}}),
+                      std::runtime_error);
+}
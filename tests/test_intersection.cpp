@@ -35,6 +35,24 @@ TEST_CASE("Ray AABB intersection", "[intersection]") {
                                Bbox3f{{0, 0, 0}, {1, 1, 1}}));
 }
 
+TEST_CASE("Ray AABB intersection with precomputed ray", "[intersection]") {
+    const PrecomputedRay ray(Ray({0, 0.5f, 0.5f}, {-1, 0, 0}));
+    REQUIRE(ray.d_inv.x == -1);
+    REQUIRE(ray.d_inv.y == 1 / EPS);
+    REQUIRE(ray.sign[0] == 1);
+    REQUIRE(ray.sign[1] == 0);
+    REQUIRE(ray.sign[2] == 0);
+
+    float tmin, tmax;
+    REQUIRE(intersect_ray_box(ray, Bbox3f{{-2, 0, 0}, {-1, 1, 1}}, tmin,
+                              tmax));
+    REQUIRE(tmin == 1);
+    REQUIRE(tmax == 2);
+
+    REQUIRE(!intersect_ray_box(ray, Bbox3f{{-2, 1, 0}, {-1, 2, 1}}, tmin,
+                               tmax));
+}
+
 
 TEST_CASE("Test intersect plane with AABB", "[intersection]") {
     REQUIRE(intersect_plane_box(
@@ -1,11 +1,21 @@
+#include "../bench/reference_traversal.h"
 #include "../lib//output.h"
+#include "../lib/intersection.h"
 #include "../lib/kdtree.h"
 #include "../lib/runtime.h"
 #include "helper.h"
 #include <catch.hpp>
 
+#include <algorithm>
+#include <atomic>
 #include <cereal/archives/portable_binary.hpp>
+#include <cstdio>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <sstream>
+#include <stack>
+#include <thread>
 #include <unordered_set>
 
 TEST_CASE("Trivial smoke test", "[kdtree]") {
@@ -26,8 +36,9 @@ TEST_CASE("Four separated triangles test", "[kdtree]") {
     auto c = test_triangle({0, 2, 1}, {0, 3, 1}, {1, 3, 1});
     auto d = test_triangle({3, 2, 1}, {3, 3, 1}, {2, 3, 1});
     KDTree tree(Triangles{a, b, c, d});
-    REQUIRE(tree.height() == 1);
-    REQUIRE(tree.num_nodes() == 5);
+    // all triangles fit into a single bundle, hence splitting does not pay off
+    REQUIRE(tree.height() == 0);
+    REQUIRE(tree.num_nodes() == 1);
 
     KDTreeIntersection tree_intersection(tree);
     KDTreeIntersection::OptionalId hit;
@@ -84,8 +95,8 @@ TEST_CASE("Serialize and deserialize", "[kdtree]") {
         iarchive(tree_in);
     }
 
-    REQUIRE(tree_in.height() == 1);
-    REQUIRE(tree_in.num_nodes() == 5);
+    REQUIRE(tree_in.height() == 0);
+    REQUIRE(tree_in.num_nodes() == 1);
     REQUIRE(tree_in.num_triangles() == 4);
 
     REQUIRE(tree_in.triangles()[0] == a);
@@ -159,6 +170,547 @@ TEST_CASE("KDTree stress test", "[kdtree]") {
     std::cerr << std::endl;
 }
 
+namespace {
+
+std::string to_bytes(KDTree& tree) {
+    std::ostringstream os;
+    {
+        cereal::PortableBinaryOutputArchive oarchive(os);
+        oarchive(tree);
+    }
+    return os.str();
+}
+
+} // namespace
+
+TEST_CASE("Build strategies produce the same tree", "[kdtree]") {
+    using Strategy = KDTree::BuildStrategy;
+
+    auto check = [](const Triangles& tris) {
+        KDTree tree_a(tris, Strategy::SORT_PER_NODE);
+        KDTree tree_b(tris, Strategy::PRESORTED_EVENTS);
+        REQUIRE(tree_a.height() == tree_b.height());
+        REQUIRE(tree_a.num_nodes() == tree_b.num_nodes());
+        REQUIRE(to_bytes(tree_a) == to_bytes(tree_b));
+    };
+
+    SECTION("random triangles") {
+        for (size_t count : {10, 100, 1000, 5000}) {
+            check(random_small_triangles(count));
+        }
+    }
+
+    SECTION("random large triangles") {
+        Triangles tris;
+        for (size_t i = 0; i < 1000; ++i) {
+            tris.push_back(random_triangle());
+        }
+        check(tris);
+    }
+
+    SECTION("parallel build") {
+        Triangles tris = random_small_triangles(20000);
+        KDTree tree(tris, Strategy::PRESORTED_EVENTS);
+        for (size_t num_threads : {2, 3, 8}) {
+            KDTree parallel_tree(tris, Strategy::PRESORTED_EVENTS, num_threads);
+            REQUIRE(to_bytes(tree) == to_bytes(parallel_tree));
+        }
+    }
+
+    SECTION("coplanar triangles") {
+        for (auto ax : AXES3) {
+            Triangles tris;
+            for (float pos = 0.f; pos < 10.f; pos += 1.f) {
+                for (size_t i = 0; i < 10; ++i) {
+                    tris.push_back(
+                        random_regular_triangle_on_unit_sphere(ax, pos));
+                }
+            }
+            check(tris);
+        }
+    }
+}
+
+TEST_CASE("Memory of the kd-tree build is counted", "[kdtree]") {
+    using Strategy = KDTree::BuildStrategy;
+    const auto& counter = allocation_counter<detail::KDTreeBuildTag>();
+    const Triangles tris = random_small_triangles(1000);
+
+    for (auto strategy :
+         {Strategy::SORT_PER_NODE, Strategy::PRESORTED_EVENTS}) {
+        const size_t bytes = counter.bytes();
+        KDTree tree(tris, strategy);
+        REQUIRE(0 < tree.build_memory().num_allocations);
+        // at least the events of all triangles along one axis
+        REQUIRE(tris.size() * 2 * sizeof(float) <
+                tree.build_memory().peak_bytes);
+        // the build does not keep any of its memory
+        REQUIRE(counter.bytes() == bytes);
+    }
+}
+
+TEST_CASE("Write and map kd-tree file", "[kdtree]") {
+    auto triangles = random_small_triangles(1000);
+    const auto key = KDTree::cache_key(triangles);
+    KDTree tree(triangles);
+    const std::string filename = "test_kdtree.cache";
+    tree.write_file(filename, key);
+
+    SECTION("mapped tree is the same") {
+        KDTree mapped;
+        REQUIRE(mapped.map_file(filename, key));
+        REQUIRE(to_bytes(mapped) == to_bytes(tree));
+        REQUIRE(mapped.height() == tree.height());
+
+        KDTreeIntersection tree_intersection(tree);
+        KDTreeIntersection mapped_intersection(mapped);
+        for (size_t i = 0; i < 1000; ++i) {
+            Ray ray(random_point(), Vector3f(random_point()));
+            float r, s, t, mapped_r;
+            auto hit = tree_intersection.intersect(ray, r, s, t);
+            REQUIRE(mapped_intersection.intersect(ray, mapped_r, s, t) == hit);
+            if (hit) {
+                REQUIRE(mapped_r == r);
+            }
+        }
+    }
+
+    SECTION("key of other triangles is rejected") {
+        triangles.pop_back();
+        KDTree mapped;
+        REQUIRE(!mapped.map_file(filename, KDTree::cache_key(triangles)));
+        REQUIRE(mapped.num_triangles() == 0);
+    }
+
+    SECTION("truncated file is rejected") {
+        std::string bytes;
+        {
+            std::ifstream in(filename, std::ios::binary);
+            bytes.assign(std::istreambuf_iterator<char>(in), {});
+        }
+        {
+            std::ofstream out(filename, std::ios::binary);
+            out.write(bytes.data(), bytes.size() / 2);
+        }
+        KDTree mapped;
+        REQUIRE(!mapped.map_file(filename, key));
+    }
+
+    SECTION("load or build uses the cache only for the same triangles") {
+        auto loaded = KDTree::load_or_build(triangles, filename);
+        REQUIRE(to_bytes(loaded) == to_bytes(tree));
+
+        auto other_triangles = random_small_triangles(100);
+        auto other = KDTree::load_or_build(other_triangles, filename);
+        REQUIRE(other.num_triangles() == 100);
+        KDTree mapped;
+        REQUIRE(mapped.map_file(filename, KDTree::cache_key(other_triangles)));
+    }
+
+    SECTION("load or build from an indexed mesh") {
+        const IndexedMesh mesh(triangles);
+        auto built = KDTree::load_or_build(mesh, filename);
+        REQUIRE(to_bytes(built) == to_bytes(tree));
+        KDTree mapped;
+        REQUIRE(mapped.map_file(filename, KDTree::cache_key(mesh)));
+        REQUIRE(to_bytes(mapped) == to_bytes(tree));
+    }
+
+    SECTION("concurrent writers of the same file do not interfere") {
+        std::vector<std::thread> writers;
+        std::atomic<size_t> num_failed{0};
+        for (size_t i = 0; i < 4; ++i) {
+            writers.emplace_back([&] {
+                try {
+                    tree.write_file(filename, key);
+                } catch (const std::runtime_error&) {
+                    num_failed += 1;
+                }
+            });
+        }
+        for (auto& writer : writers) {
+            writer.join();
+        }
+        REQUIRE(num_failed == 0);
+        KDTree mapped;
+        REQUIRE(mapped.map_file(filename, key));
+        REQUIRE(to_bytes(mapped) == to_bytes(tree));
+    }
+
+    std::remove(filename.c_str());
+}
+
+TEST_CASE("Refined tree equals tree built from scratch", "[kdtree]") {
+    auto triangles = random_small_triangles(1000);
+    KDTree tree(triangles);
+
+    // subdivide every triangle into 4 triangles at the midpoints of its sides
+    Triangles refined;
+    std::vector<KDTree::TriangleId> parents;
+    for (size_t i = 0; i < triangles.size(); ++i) {
+        const auto& vs = triangles[i].vertices;
+        Point3f ma = vs[1] + 0.5f * (vs[2] - vs[1]);
+        Point3f mb = vs[0] + 0.5f * (vs[2] - vs[0]);
+        Point3f mc = vs[0] + 0.5f * (vs[1] - vs[0]);
+        for (auto tri : {std::array<Point3f, 3>{vs[0], mc, mb},
+                         std::array<Point3f, 3>{mc, vs[1], ma},
+                         std::array<Point3f, 3>{mb, ma, vs[2]},
+                         std::array<Point3f, 3>{ma, mb, mc}}) {
+            refined.emplace_back(tri);
+            parents.push_back(i);
+        }
+    }
+
+    KDTree refined_tree = tree.refine(refined, parents);
+    KDTree expected_tree(refined);
+    REQUIRE(refined_tree.num_triangles() == refined.size());
+    REQUIRE(refined_tree.height() == tree.height());
+
+    KDTreeIntersection refined_intersection(refined_tree);
+    KDTreeIntersection expected_intersection(expected_tree);
+    for (int i = 0; i < 10000; ++i) {
+        Ray ray(random_point(), Vector3f(random_point()));
+        float r, s, t, expected_r, expected_s, expected_t;
+        auto id = refined_intersection.intersect(ray, r, s, t);
+        auto expected_id = expected_intersection.intersect(ray, expected_r,
+                                                           expected_s,
+                                                           expected_t);
+        REQUIRE(id == expected_id);
+        if (id) {
+            REQUIRE(r == expected_r);
+        }
+    }
+}
+
+TEST_CASE("Updated tree equals tree built from scratch", "[kdtree]") {
+    auto triangles = random_small_triangles(1000);
+    KDTree tree(triangles);
+
+    Triangles updated = triangles;
+    std::vector<KDTree::TriangleId> changed;
+    SECTION("triangles move within the bounding box") {
+        // move every 10th triangle onto the position of another triangle
+        for (size_t i = 0; i < triangles.size(); i += 10) {
+            updated[i] = Triangle(
+                triangles[(7 * i + 3) % triangles.size()].vertices);
+            changed.push_back(i);
+        }
+    }
+    SECTION("a triangle moves out of the bounding box") {
+        auto vs = triangles[0].vertices;
+        for (auto& v : vs) {
+            v = v + Vector3f(100, 0, 0);
+        }
+        updated[0] = Triangle(vs);
+        changed.push_back(0);
+    }
+
+    KDTree updated_tree = tree.update(updated, changed);
+    KDTree expected_tree(updated);
+    REQUIRE(updated_tree.num_triangles() == updated.size());
+
+    KDTreeIntersection updated_intersection(updated_tree);
+    KDTreeIntersection expected_intersection(expected_tree);
+    for (int i = 0; i < 10000; ++i) {
+        Ray ray(random_point(), Vector3f(random_point()));
+        float r, s, t, expected_r, expected_s, expected_t;
+        auto id = updated_intersection.intersect(ray, r, s, t);
+        auto expected_id = expected_intersection.intersect(ray, expected_r,
+                                                           expected_s,
+                                                           expected_t);
+        REQUIRE(id == expected_id);
+        if (id) {
+            REQUIRE(r == expected_r);
+        }
+    }
+}
+
+TEST_CASE("Small subtrees do not straddle cache lines", "[kdtree]") {
+    using Node = detail::FlatNode;
+    KDTree tree(random_small_triangles(5000));
+    const auto nodes = tree.nodes();
+    REQUIRE(reinterpret_cast<uintptr_t>(nodes.data()) % 64 == 0);
+    constexpr size_t NODES_PER_LINE = 64 / sizeof(Node);
+
+    std::function<size_t(size_t)> subtree_size = [&](size_t index) {
+        const Node& node = nodes[index];
+        if (node.is_leaf()) {
+            return size_t(1);
+        }
+        return 1 + subtree_size(index + 1) + subtree_size(node.right());
+    };
+
+    std::stack<size_t> stack;
+    stack.push(0);
+    while (!stack.empty()) {
+        const Node& node = nodes[stack.top()];
+        const size_t index = stack.top();
+        stack.pop();
+        if (node.is_leaf()) {
+            REQUIRE(node.bundles_begin() <= node.bundles_end());
+            REQUIRE(node.bundles_end() <= tree.bundles().size());
+            continue;
+        }
+
+        // a small right subtree is stored within a single cache line
+        const size_t right = node.right();
+        const size_t size = subtree_size(right);
+        if (size <= NODES_PER_LINE) {
+            REQUIRE(right / NODES_PER_LINE ==
+                    (right + size - 1) / NODES_PER_LINE);
+        }
+        stack.push(right);
+        stack.push(index + 1);
+    }
+}
+
+TEST_CASE("Traversal agrees with a traversal using std::stack", "[kdtree]") {
+    static constexpr size_t RAYS_PER_LINE = 100;
+
+    KDTree tree(random_small_triangles(10000));
+    KDTreeIntersection tree_intersection(tree);
+
+    const Point3f origin{0, 0, 1000};
+    for (size_t i = 0; i < RAYS_PER_LINE; ++i) {
+        for (size_t j = 0; j < RAYS_PER_LINE; ++j) {
+            float x = -10.f + 20.f * i / RAYS_PER_LINE;
+            float y = -10.f + 20.f * j / RAYS_PER_LINE;
+            const Ray ray(origin, Point3f(x, y, 0) - origin);
+
+            float r, ref_r, s, t;
+            auto hit = tree_intersection.intersect(ray, r, s, t);
+            auto ref_hit = bench::reference_intersect(tree, ray, ref_r);
+            REQUIRE(hit == ref_hit);
+            if (hit) {
+                REQUIRE(r == ref_r);
+            }
+        }
+    }
+}
+
+TEST_CASE("Packet traversal equals scalar traversal", "[kdtree]") {
+    KDTree tree(random_small_triangles(1000));
+    KDTreeIntersection tree_intersection(tree);
+
+    auto check = [&tree_intersection](const KDTreeIntersection::RayPacket& rays,
+                                      unsigned active) {
+        auto hits = tree_intersection.intersect_packet(rays, active);
+        for (size_t i = 0; i < rays.size(); ++i) {
+            if (!(active & (1 << i))) {
+                REQUIRE(!hits[i].id);
+                continue;
+            }
+            float r, s, t;
+            auto id = tree_intersection.intersect(rays[i], r, s, t);
+            REQUIRE(hits[i].id == id);
+            if (id) {
+                REQUIRE(hits[i].r == r);
+                REQUIRE(hits[i].a == s);
+                REQUIRE(hits[i].b == t);
+            }
+        }
+    };
+
+    std::default_random_engine gen;
+    std::uniform_real_distribution<float> rnd(-0.5f, 0.5f);
+    for (unsigned n = 0; n < 1000; ++n) {
+        KDTreeIntersection::RayPacket rays;
+
+        SECTION("coherent packet") {
+            const Point3f origin{rnd(gen), rnd(gen), 100};
+            float x = 20.f * rnd(gen);
+            float y = 20.f * rnd(gen);
+            for (size_t i = 0; i < rays.size(); ++i) {
+                Point3f target(x + 0.01f * i, y + 0.01f * (i % 2), 0);
+                rays[i] = {origin, target - origin};
+            }
+            check(rays, 0xf);
+            check(rays, n % 16);
+        }
+
+        SECTION("incoherent packet") {
+            const auto random = random_rays(gen, rays.size());
+            std::copy(random.begin(), random.end(), rays.begin());
+            check(rays, 0xf);
+            check(rays, n % 16);
+        }
+    }
+}
+
+TEST_CASE("Closest hit is limited by ray.t_max", "[kdtree]") {
+    KDTree tree(random_small_triangles(1000));
+    KDTreeIntersection tree_intersection(tree);
+
+    std::default_random_engine gen;
+    for (size_t n = 0; n < 1000; ++n) {
+        KDTreeIntersection::RayPacket rays;
+        const auto random = random_rays(gen, rays.size());
+        const auto t_max = random_distances(gen, rays.size());
+        for (size_t i = 0; i < rays.size(); ++i) {
+            rays[i] = {random[i].o, random[i].d, t_max[i]};
+        }
+
+        const auto hits = tree_intersection.intersect_packet(rays, 0xf);
+        for (size_t i = 0; i < rays.size(); ++i) {
+            float r, s, t;
+            const Ray unlimited(rays[i].o, rays[i].d);
+            auto hit = tree_intersection.intersect(unlimited, r, s, t);
+            if (!hit || rays[i].t_max <= r) {
+                hit = {};
+            }
+            float limited_r;
+            REQUIRE(tree_intersection.intersect(rays[i], limited_r, s, t) ==
+                    hit);
+            REQUIRE(hits[i].id == hit);
+            if (hit) {
+                REQUIRE(limited_r == r);
+                REQUIRE(hits[i].r == r);
+            }
+        }
+    }
+}
+
+TEST_CASE("Occlusion query agrees with closest hit", "[kdtree]") {
+    KDTree tree(random_small_triangles(1000));
+    KDTreeIntersection tree_intersection(tree);
+
+    std::default_random_engine gen;
+    const auto rays = random_rays(gen, 10000);
+    const auto t_max = random_distances(gen, rays.size());
+    for (size_t i = 0; i < rays.size(); ++i) {
+        float r, s, t;
+        auto hit = tree_intersection.intersect(rays[i], r, s, t);
+        bool occluded = hit && r < t_max[i];
+        REQUIRE(tree_intersection.occluded(rays[i], t_max[i]) == occluded);
+    }
+
+    // the closest triangle is only an occluder if it is before t_max
+    const auto& tri = tree_intersection[0];
+    const Vector3f sum = Vector3f(tri.vertices[0]) + Vector3f(tri.vertices[1]) +
+                         Vector3f(tri.vertices[2]);
+    const Point3f center(sum / 3.f);
+    const Ray ray({0, 0, 100}, center - Point3f{0, 0, 100});
+    float r, s, t;
+    REQUIRE(tree_intersection.intersect(ray, r, s, t));
+    REQUIRE(tree_intersection.occluded(ray, std::nextafter(r, 1000.f)));
+    REQUIRE(!tree_intersection.occluded(ray, r));
+}
+
+TEST_CASE("Packet occlusion query agrees with scalar occlusion query",
+          "[kdtree]") {
+    KDTree tree(random_small_triangles(1000));
+    KDTreeIntersection tree_intersection(tree);
+
+    auto check = [&tree_intersection](
+        const KDTreeIntersection::RayPacket& rays,
+        const std::array<float, KDTreeIntersection::PACKET_SIZE>& t_max,
+        unsigned active) {
+        unsigned occluded =
+            tree_intersection.occluded_packet(rays, t_max, active);
+        for (size_t i = 0; i < rays.size(); ++i) {
+            bool expected = (active & (1 << i)) &&
+                            tree_intersection.occluded(rays[i], t_max[i]);
+            REQUIRE(static_cast<bool>(occluded & (1 << i)) == expected);
+        }
+    };
+
+    std::default_random_engine gen;
+    std::uniform_real_distribution<float> rnd(-0.5f, 0.5f);
+    for (unsigned n = 0; n < 1000; ++n) {
+        KDTreeIntersection::RayPacket rays;
+        std::array<float, KDTreeIntersection::PACKET_SIZE> t_max;
+
+        SECTION("coherent packet") {
+            const Point3f origin{rnd(gen), rnd(gen), 100};
+            float x = 20.f * rnd(gen);
+            float y = 20.f * rnd(gen);
+            for (size_t i = 0; i < rays.size(); ++i) {
+                Point3f target(x + 0.01f * i, y + 0.01f * (i % 2), 0);
+                rays[i] = {origin, target - origin};
+                t_max[i] = rnd(gen) + 1;
+            }
+            check(rays, t_max, 0xf);
+            check(rays, t_max, n % 16);
+        }
+
+        SECTION("incoherent packet") {
+            const auto random = random_rays(gen, rays.size());
+            const auto distances = random_distances(gen, rays.size());
+            std::copy(random.begin(), random.end(), rays.begin());
+            std::copy(distances.begin(), distances.end(), t_max.begin());
+            check(rays, t_max, 0xf);
+            check(rays, t_max, n % 16);
+        }
+    }
+}
+
+TEST_CASE("Batch queries agree with scalar queries", "[kdtree]") {
+    KDTree tree(random_small_triangles(1000));
+
+    // a batch, which does not fill its last packet
+    std::default_random_engine gen;
+    const auto rays = random_rays(gen, 1001);
+    const auto t_max = random_distances(gen, rays.size());
+
+    // in the given order and sorted (cf. KDTreeIntersection::intersect_batch)
+    for (bool sort_batches : {false, true}) {
+        KDTreeIntersection tree_intersection(tree, sort_batches);
+        std::vector<Intersector::Hit> hits;
+        tree_intersection.intersect_batch(rays, hits);
+        std::vector<uint8_t> occluded;
+        tree_intersection.occluded_batch(rays, t_max, occluded);
+        REQUIRE(hits.size() == rays.size());
+        REQUIRE(occluded.size() == rays.size());
+        for (size_t i = 0; i < rays.size(); ++i) {
+            float r, a, b;
+            const auto id = tree_intersection.intersect(rays[i], r, a, b);
+            REQUIRE(hits[i].id == id);
+            if (id) {
+                REQUIRE(hits[i].r == Approx(r));
+            }
+            REQUIRE(static_cast<bool>(occluded[i]) ==
+                    tree_intersection.occluded(rays[i], t_max[i]));
+        }
+    }
+}
+
+TEST_CASE("Cached occluders agree with occlusion query", "[kdtree]") {
+    // a wall between the light and the points of a floor
+    Triangles triangles = random_small_triangles(1000);
+    triangles.push_back(test_triangle({-10, 5, -10}, {10, 5, -10}, {0, 5, 10}));
+    KDTree tree(triangles);
+    KDTreeIntersection tree_intersection(tree);
+    const Point3f light{0, 20, 0};
+
+    std::default_random_engine gen;
+    std::uniform_real_distribution<float> rnd(-0.5f, 0.5f);
+    // rays of another light
+    const auto random = random_rays(gen, 1000);
+    const auto t_max = random_distances(gen, random.size());
+    for (size_t i = 0; i < random.size(); ++i) {
+        const Point3f p{4 * rnd(gen), 0, 4 * rnd(gen)};
+        const Ray ray(p, light - p);
+        const auto id = tree_intersection.occluder(ray, 1);
+        REQUIRE(static_cast<bool>(id) == tree_intersection.occluded(ray, 1));
+        if (id) {
+            float r, s, t;
+            REQUIRE(intersect_ray_triangle(ray, tree_intersection[id], r, s,
+                                           t));
+            REQUIRE(r < 1);
+        }
+        REQUIRE(tree_intersection.light_occluded(0, ray, 1) ==
+                static_cast<bool>(id));
+
+        REQUIRE(tree_intersection.light_occluded(1, random[i], t_max[i]) ==
+                tree_intersection.occluded(random[i], t_max[i]));
+    }
+
+    // the shadow rays of the floor are mostly blocked by the wall
+    const auto& counts = tree_intersection.occluder_cache_counts();
+    REQUIRE(counts.tests == 2000);
+    REQUIRE(counts.hits > 500);
+}
+
 TEST_CASE("Test cube in kdtree", "[kdtree]") {
     // cube made of triangles
     // front
@@ -182,7 +734,7 @@ TEST_CASE("Test cube in kdtree", "[kdtree]") {
 
     KDTree tree(Triangles{a1, a2, a3, a4, b1, b2, b3, b4, c1, c2, c3, c4});
     REQUIRE(tree.height() == 0);
-    REQUIRE(tree.num_nodes() == 7);
+    REQUIRE(tree.num_nodes() == 1);
 }
 
 TEST_CASE("All triangles are in the same plane", "[kdtree]") {
@@ -184,3 +184,28 @@ TEST_CASE("Complex square subdivide4", "[subdivide4]") {
         REQUIRE(corner_pts == (Points{mac, c, mbc}));
     }
 }
+
+TEST_CASE("Build mesh from triangles", "[build_mesh]") {
+    Point3f a(0, 0, 0), b(1, 0, 0), c(0, 1, 0), d(1, 1, 0);
+    Normal3f n(0, 0, 1), m(0, 0, -1);
+
+    SECTION("shared corners are merged") {
+        Triangles tris{Triangle({a, b, c}, {n, n, n}, {}, {}, {}, {}, 0),
+                       Triangle({b, d, c}, {n, n, n}, {}, {}, {}, {}, 0)};
+        auto mesh = build_mesh(tris);
+        REQUIRE(mesh.n_vertices() == 4);
+        REQUIRE(mesh.n_faces() == 2);
+        REQUIRE(get_points(mesh, RadiosityMesh::FaceHandle(0)) ==
+                (Points{{0, 0, 0}, {1, 0, 0}, {0, 1, 0}}));
+        REQUIRE(get_corner_points(mesh, RadiosityMesh::FaceHandle(1)) ==
+                (Points{{1, 0, 0}, {1, 1, 0}, {0, 1, 0}}));
+    }
+
+    SECTION("corners with different normals are not merged") {
+        Triangles tris{Triangle({a, b, c}, {n, n, n}, {}, {}, {}, {}, 0),
+                       Triangle({b, d, c}, {m, m, m}, {}, {}, {}, {}, 0)};
+        auto mesh = build_mesh(tris);
+        REQUIRE(mesh.n_vertices() == 6);
+        REQUIRE(mesh.n_faces() == 2);
+    }
+}
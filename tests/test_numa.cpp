@@ -0,0 +1,118 @@
+#include "../lib/kdtree.h"
+#include "../lib/numa.h"
+#include "helper.h"
+#include <catch.hpp>
+
+#include <cstdio>
+#include <fstream>
+#include <set>
+#include <string>
+#include <sys/stat.h>
+#include <utility>
+#include <vector>
+
+TEST_CASE("Parse CPU lists of sysfs", "[numa]") {
+    REQUIRE(numa::parse_cpu_list("0-3,8,10-11\n") ==
+            std::vector<int>({0, 1, 2, 3, 8, 10, 11}));
+    REQUIRE(numa::parse_cpu_list("5") == std::vector<int>({5}));
+    REQUIRE(numa::parse_cpu_list("").empty());
+    REQUIRE_THROWS(numa::parse_cpu_list("3-1"));
+    REQUIRE_THROWS(numa::parse_cpu_list("a-b"));
+}
+
+TEST_CASE("Workers fill the NUMA nodes one after another", "[numa]") {
+    numa::Topology topology;
+    topology.node_cpus = {{0, 1, 4, 5}, {2, 3}};
+
+    const std::vector<int> cpus = {0, 1, 4, 5, 2, 3, 0};
+    const std::vector<size_t> nodes = {0, 0, 0, 0, 1, 1, 0};
+    for (size_t worker = 0; worker < cpus.size(); ++worker) {
+        REQUIRE(topology.worker_cpu(worker) == cpus[worker]);
+        REQUIRE(topology.worker_node(worker) == nodes[worker]);
+    }
+    REQUIRE(topology.num_worker_nodes(1) == 1);
+    REQUIRE(topology.num_worker_nodes(4) == 1);
+    REQUIRE(topology.num_worker_nodes(5) == 2);
+    REQUIRE(topology.num_worker_nodes(100) == 2);
+}
+
+TEST_CASE("Read the NUMA topology", "[numa]") {
+    // without nodes, all CPUs are on a single node
+    const auto fallback = numa::Topology::read("/nonexistent");
+    REQUIRE(fallback.num_nodes() == 1);
+    REQUIRE(fallback.node_cpus[0].size() > 0);
+
+    REQUIRE(numa::Topology::system().num_nodes() > 0);
+}
+
+TEST_CASE("Read a NUMA topology with sparse node ids", "[numa]") {
+    // node1 is offline, node3 has no CPUs
+    const std::string dirname = "test_numa.sysfs";
+    const std::vector<std::pair<int, std::string>> nodes = {
+        {0, "0-1"}, {2, "2,3"}, {3, ""}};
+    mkdir(dirname.c_str(), 0755);
+    std::ofstream(dirname + "/online") << "0,2-3\n";
+    for (const auto& node : nodes) {
+        const std::string node_dirname =
+            dirname + "/node" + std::to_string(node.first);
+        mkdir(node_dirname.c_str(), 0755);
+        std::ofstream(node_dirname + "/cpulist") << node.second << "\n";
+    }
+
+    const auto topology = numa::Topology::read(dirname);
+    REQUIRE(topology.node_cpus ==
+            std::vector<std::vector<int>>({{0, 1}, {2, 3}}));
+
+    for (const auto& node : nodes) {
+        const std::string node_dirname =
+            dirname + "/node" + std::to_string(node.first);
+        std::remove((node_dirname + "/cpulist").c_str());
+        std::remove(node_dirname.c_str());
+    }
+    std::remove((dirname + "/online").c_str());
+    std::remove(dirname.c_str());
+}
+
+TEST_CASE("Pinned workers know their node", "[numa]") {
+    // two nodes on the same CPU, which is available everywhere
+    numa::Topology topology;
+    topology.node_cpus = {{0}, {0}};
+    const size_t num_threads = 2;
+    ThreadPool pool(num_threads);
+    numa::pin_workers(pool, num_threads, topology);
+
+    // the nodes stay with the workers for all later tasks
+    std::set<size_t> nodes;
+    for (int i = 0; i < 20; ++i) {
+        nodes.insert(pool.enqueue([]() { return numa::current_node(); }).get());
+    }
+    for (size_t node : nodes) {
+        REQUIRE(node < 2);
+    }
+}
+
+TEST_CASE("Replicas of the kd-tree have their own memory", "[numa]") {
+    Triangles triangles;
+    for (int i = 0; i < 100; ++i) {
+        triangles.push_back(random_triangle());
+    }
+    const KDTree tree(triangles);
+
+    numa::Topology topology;
+    topology.node_cpus = {{0}, {0}};
+    const auto replicas = numa::replicate_per_node(
+        topology, 2, [&tree]() { return tree.replicate(); });
+    REQUIRE(replicas.size() == 2);
+
+    const Ray ray({0, 0, -20}, {0, 0, 1});
+    KDTreeIntersection expected(tree);
+    for (const KDTree& replica : replicas) {
+        REQUIRE(replica.nodes().data() != tree.nodes().data());
+        REQUIRE(replica.num_nodes() == tree.num_nodes());
+        REQUIRE(replica.num_triangles() == tree.num_triangles());
+        REQUIRE(replica.height() == tree.height());
+
+        KDTreeIntersection intersection(replica);
+        REQUIRE(intersection.intersect(ray) == expected.intersect(ray));
+    }
+}
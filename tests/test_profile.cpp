@@ -0,0 +1,42 @@
+#include "../lib/profile.h"
+
+#include <catch.hpp>
+
+#include <sstream>
+
+using namespace turner;
+
+namespace {
+
+ProfilerResults make_results() {
+    ProfilerResults res;
+    const uint64_t render = 1ull << static_cast<size_t>(ProfCategory::Render);
+    const uint64_t trace = 1ull << static_cast<size_t>(ProfCategory::Trace);
+    res.samples = {{0, render, 3}, {1, render | trace, 5}};
+    res.category_counts = {{ProfCategory::size, 8},
+                           {ProfCategory::Render, 8},
+                           {ProfCategory::Trace, 5}};
+    res.thread_category_counts = {
+        {{ProfCategory::size, 3}, {ProfCategory::Render, 3}},
+        {{ProfCategory::size, 5},
+         {ProfCategory::Render, 5},
+         {ProfCategory::Trace, 5}}};
+    return res;
+}
+
+} // namespace
+
+TEST_CASE("Profiler results are written as folded stacks", "[profile]") {
+    std::ostringstream os;
+    write_folded(os, make_results());
+    REQUIRE(os.str() == "thread 0;render 3\nthread 1;render;trace() 5\n");
+}
+
+TEST_CASE("Profiler results are written as JSON", "[profile]") {
+    std::ostringstream os;
+    write_json(os, make_results());
+    REQUIRE(os.str() == "{\"total\": 8, "
+                        "\"categories\": {\"render\": 8, \"trace()\": 5}, "
+                        "\"threads\": [{\"render\": 3}, "
+                        "{\"render\": 5, \"trace()\": 5}]}\n");
+}
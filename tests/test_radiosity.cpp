@@ -1,8 +1,12 @@
+#include "../lib/kdtree.h"
 #include "../lib/radiosity.h"
+#include "../lib/radiosity_bake.h"
 #include "helper.h"
 #include <catch.hpp>
 
 #include <cmath>
+#include <cstdio>
+#include <fstream>
 #include <random>
 
 namespace {
@@ -251,3 +255,47 @@ TEST_CASE("Solid angle of a randomized triangles", "[solid_angle]") {
         REQUIRE(angle == Approx(ref_angle_2).epsilon(0.001));
     }
 }
+
+TEST_CASE("Radiosity bake round trip", "[radiosity_bake]") {
+    const std::string filename = "test_radiosity.bake";
+
+    RadiosityBake bake;
+    bake.scene_key = 42;
+    bake.mode = 1;
+    bake.parameters = {0.04f, 1e-6f, 3, 3};
+    bake.radiosity = {Color(1, 2, 3, 1), Color(4, 5, 6, 1)};
+    bake.leaves.vertices = {{0, 0, 0}, {1, 0, 0}, {0, 1, 0}, {1, 1, 0}};
+    bake.leaves.faces = {{{0, 1, 2}}, {{1, 3, 2}}};
+    bake.leaves.root_ids = {0, 0};
+    bake.leaves.face_radiosity = {Color(1, 0, 0, 1), Color(0, 1, 0, 1)};
+    bake.leaves.vertex_radiosity = {Color(1, 0, 0, 1), Color(0.5, 0.5, 0, 1),
+                                    Color(0.5, 0.5, 0, 1), Color(0, 1, 0, 1)};
+    write_bake(filename, bake);
+
+    RadiosityBake loaded;
+    REQUIRE(read_bake(filename, loaded));
+    REQUIRE(loaded.matches(42, 1, {0.04f, 1e-6f, 3, 3}));
+    REQUIRE(!loaded.matches(43, 1, {0.04f, 1e-6f, 3, 3}));
+    REQUIRE(!loaded.matches(42, 0, {0.04f, 1e-6f, 3, 3}));
+    REQUIRE(!loaded.matches(42, 1, {0.05f, 1e-6f, 3, 3}));
+    REQUIRE(loaded.radiosity == bake.radiosity);
+    REQUIRE(loaded.leaves.vertices == bake.leaves.vertices);
+    REQUIRE(loaded.leaves.faces == bake.leaves.faces);
+    REQUIRE(loaded.leaves.root_ids == bake.leaves.root_ids);
+    REQUIRE(loaded.leaves.face_radiosity == bake.leaves.face_radiosity);
+    REQUIRE(loaded.leaves.vertex_radiosity == bake.leaves.vertex_radiosity);
+
+    // the corner radiosity is recomputed from the vertex radiosity
+    REQUIRE(loaded.leaves.corner_radiosity.size() == 2);
+    REQUIRE(loaded.leaves.corner_radiosity[1][1] == Color(0, 1, 0, 1));
+    REQUIRE(loaded.leaves.corner_radiosity[1][2] == Color(0.5, 0.5, 0, 1));
+
+    // other files are not read as bakes
+    {
+        std::ofstream out(filename, std::ios::binary);
+        out << "not a bake";
+    }
+    REQUIRE(!read_bake(filename, loaded));
+    std::remove(filename.c_str());
+    REQUIRE(!read_bake(filename, loaded));
+}
@@ -2,6 +2,7 @@
 #include "../lib/output.h"
 #include <catch.hpp>
 
+#include <cmath>
 #include <sstream>
 
 TEST_CASE("Test image width", "[raster]") {
@@ -56,6 +57,56 @@ TEST_CASE("Test image PBM serialization", "[raster]") {
     REQUIRE(ss.str() == EXPECTED);
 }
 
+TEST_CASE("Test image binary PPM serialization", "[raster]") {
+    Image img(2, 2);
+    img(0, 1) = Color(1, 1, 1, 1);
+    img(1, 1) = Color(0.5, 2, 0, 1);
+    std::stringstream ss;
+    write_ppm(ss, img);
+
+    const std::string header = "P6\n2 2\n255\n";
+    const std::string data = ss.str();
+    REQUIRE(data.size() == header.size() + 12);
+    REQUIRE(data.substr(0, header.size()) == header);
+    const std::vector<int> expected = {0,   0,   0,   0,   0,   0,
+                                       255, 255, 255, 127, 255, 0};
+    for (size_t i = 0; i < expected.size(); ++i) {
+        REQUIRE(static_cast<uint8_t>(data[header.size() + i]) == expected[i]);
+    }
+}
+
+TEST_CASE("Test image PFM serialization", "[raster]") {
+    Image img(2, 2);
+    img(0, 0) = Color(2.5, 0.5, 0.25, 1);
+    img(1, 1) = Color(1, 1, 1, 0.5);
+    std::stringstream ss;
+    write_pfm(ss, img);
+
+    std::string magic, scale;
+    size_t width, height;
+    ss >> magic >> width >> height >> scale;
+    ss.get(); // single whitespace before data
+    REQUIRE(magic == "PF");
+    REQUIRE(width == 2);
+    REQUIRE(height == 2);
+    REQUIRE((scale == "-1.0" || scale == "1.0"));
+
+    std::vector<float> data(12);
+    ss.read(reinterpret_cast<char*>(data.data()), 12 * sizeof(float));
+    REQUIRE(ss.gcount() == 12 * sizeof(float));
+    // bottom row first, HDR values are not clamped
+    const std::vector<float> expected = {0,    0,    0,     0.5f, 0.5f, 0.5f,
+                                         2.5f, 0.5f, 0.25f, 0,    0,    0};
+    REQUIRE(data == expected);
+}
+
+TEST_CASE("Test parse image format", "[raster]") {
+    REQUIRE(parse_image_format("ppm") == ImageFormat::PPM);
+    REQUIRE(parse_image_format("ppm-ascii") == ImageFormat::PPM_ASCII);
+    REQUIRE(parse_image_format("pfm") == ImageFormat::PFM);
+    REQUIRE_THROWS(parse_image_format("png"));
+}
+
 TEST_CASE("Test Bresenham's line algorithm", "[raster]") {
     Image img(2, 3);
     Color white(1, 1, 1, 1);
@@ -80,3 +131,128 @@ TEST_CASE("Test Bresenham's line algorithm", "[raster]") {
     REQUIRE(img(0, 2) == black);
     REQUIRE(img(1, 2) == white);
 }
+
+TEST_CASE("Accumulation buffer averages passes", "[raster]") {
+    AccumulationBuffer accumulation(2, 1);
+    REQUIRE(accumulation.num_passes() == 0);
+
+    Image pass(2, 1);
+    pass(0, 0) = Color(1, 0, 0, 1);
+    pass(1, 0) = Color(0, 1, 0, 1);
+    accumulation.add(pass);
+    pass(0, 0) = Color(0, 0, 1, 1);
+    accumulation.add(pass);
+    REQUIRE(accumulation.num_passes() == 2);
+
+    auto mean = accumulation.mean();
+    REQUIRE(mean(0, 0) == Color(0.5f, 0, 0.5f, 1));
+    REQUIRE(mean(1, 0) == Color(0, 1, 0, 1));
+}
+
+TEST_CASE("Accumulation buffer is resumed from its serialization",
+          "[raster]") {
+    AccumulationBuffer accumulation(3, 2);
+    Image pass(3, 2);
+    pass(2, 1) = Color(0.25f, 0.5f, 0.75f, 1);
+    accumulation.add(pass);
+
+    std::stringstream ss;
+    accumulation.write(ss);
+    auto resumed = AccumulationBuffer::read(ss);
+    REQUIRE(resumed.width() == 3);
+    REQUIRE(resumed.height() == 2);
+    REQUIRE(resumed.num_passes() == 1);
+
+    // further passes add samples
+    resumed.add(pass);
+    REQUIRE(resumed.num_passes() == 2);
+    REQUIRE(resumed.mean()(2, 1) == pass(2, 1));
+    REQUIRE(resumed.mean()(0, 0) == Color());
+
+    std::stringstream malformed("TACC\n3 2");
+    REQUIRE_THROWS_AS(AccumulationBuffer::read(malformed), std::runtime_error);
+}
+
+TEST_CASE("Merged accumulation buffers contain the passes of both",
+          "[raster]") {
+    Image pass(1, 1);
+    AccumulationBuffer node0(1, 1);
+    pass(0, 0) = Color(1, 0, 0, 1);
+    node0.add(pass);
+
+    AccumulationBuffer node1(1, 1);
+    pass(0, 0) = Color(0, 0, 1, 1);
+    node1.add(pass);
+    node1.add(pass);
+
+    node0.merge(node1);
+    REQUIRE(node0.num_passes() == 3);
+    REQUIRE(node0.mean()(0, 0).r == Approx(1.f / 3));
+    REQUIRE(node0.mean()(0, 0).b == Approx(2.f / 3));
+}
+
+TEST_CASE("Tiled image stores pixels like a row-major image", "[raster]") {
+    for (size_t tile_size : {1, 3, 16}) {
+        TiledImage<> tiled(7, 5, tile_size);
+        REQUIRE(tiled.width() == 7);
+        REQUIRE(tiled.height() == 5);
+        for (size_t y = 0; y < 5; ++y) {
+            for (size_t x = 0; x < 7; ++x) {
+                tiled.set(x, y, Color(x, y, 0, 1));
+                tiled.add(x, y, Color(0, 0, 1, 0));
+            }
+        }
+
+        auto image = tiled.resolve();
+        REQUIRE(image.width() == 7);
+        REQUIRE(image.height() == 5);
+        for (size_t y = 0; y < 5; ++y) {
+            for (size_t x = 0; x < 7; ++x) {
+                REQUIRE(image(x, y) == Color(x, y, 1, 1));
+            }
+        }
+
+        tiled.clear();
+        for (const auto& color : tiled.resolve()) {
+            REQUIRE(color == Color());
+        }
+    }
+}
+
+TEST_CASE("Half precision colors", "[raster]") {
+    using detail::float_to_half;
+    using detail::half_to_float;
+
+    // exactly representable values
+    for (float f : {0.f, -0.f, 1.f, -2.f, 0.5f, 65504.f, 6.103515625e-05f,
+                    5.9604644775390625e-08f, 0.333251953125f}) {
+        REQUIRE(half_to_float(float_to_half(f)) == f);
+    }
+    REQUIRE(float_to_half(1.f) == 0x3C00);
+    REQUIRE(float_to_half(-2.f) == 0xC000);
+    REQUIRE(float_to_half(65504.f) == 0x7BFF);
+    // smallest subnormal and smallest normal number
+    REQUIRE(float_to_half(5.9604644775390625e-08f) == 0x0001);
+    REQUIRE(float_to_half(6.103515625e-05f) == 0x0400);
+
+    // rounding to nearest even
+    REQUIRE(float_to_half(1.f + 1.f / 2048) == 0x3C00);
+    REQUIRE(float_to_half(1.f + 3.f / 2048) == 0x3C02);
+    REQUIRE(float_to_half(2.98023223876953125e-08f) == 0); // 2^-25
+    // overflow
+    REQUIRE(float_to_half(65520.f) == 0x7C00);
+    REQUIRE(std::isinf(half_to_float(float_to_half(1e10f))));
+    REQUIRE(std::isnan(half_to_float(float_to_half(NAN))));
+
+    // relative error of at most 2^-11 in the normal range
+    for (float f = 1e-4f; f < 6e4f; f *= 1.37f) {
+        REQUIRE(std::abs(half_to_float(float_to_half(f)) - f) <=
+                f / 2048);
+    }
+
+    TiledImage<HalfColor> tiled(3, 2, 2);
+    tiled.set(1, 1, Color(0.25f, 0.5f, 2, 1));
+    tiled.add(1, 1, Color(0.25f, 0, 0, 0));
+    REQUIRE(tiled(1, 1) == Color(0.5f, 0.5f, 2, 1));
+    REQUIRE(tiled(0, 1) == Color());
+}
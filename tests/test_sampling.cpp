@@ -1,3 +1,4 @@
+#include "../lib/emitters.h"
 #include "../lib/intersection.h"
 #include "../lib/output.h"
 #include "../lib/sampling.h"
@@ -5,6 +6,10 @@
 
 #include <catch.hpp>
 
+#include <cmath>
+#include <thread>
+#include <vector>
+
 namespace {
 constexpr float TOLERANCE = 0.01f;
 }
@@ -38,9 +43,72 @@ TEST_CASE("Test Hemisphere sampling", "[sampling]") {
     }
 }
 
+TEST_CASE("Orthonormal basis of a normal", "[sampling]") {
+    std::vector<Vector3f> normals{{0, 0, 1}, {0, 0, -1}, {1, 0, 0},
+                                  {0, -1, 0}};
+    for (int i = 0; i < 100; ++i) {
+        normals.push_back(normalize(random_vec()));
+    }
+    for (const auto& n : normals) {
+        Vector3f b1, b2;
+        sampling::orthonormal_basis(n, b1, b2);
+        REQUIRE(b1.length() == Approx(1.f).epsilon(TOLERANCE));
+        REQUIRE(b2.length() == Approx(1.f).epsilon(TOLERANCE));
+        REQUIRE(std::abs(dot(b1, b2)) < TOLERANCE);
+        REQUIRE(std::abs(dot(b1, n)) < TOLERANCE);
+        REQUIRE(std::abs(dot(b2, n)) < TOLERANCE);
+        // right-handed
+        REQUIRE((cross(b1, b2) - n).length() < TOLERANCE);
+    }
+}
+
+TEST_CASE("Cosine-weighted hemisphere sampling", "[sampling]") {
+    static constexpr int NUM_SAMPLES = 100000;
+
+    SECTION("sine and cosine") {
+        for (int i = 0; i < 1000; ++i) {
+            const float u = i / 1000.f;
+            float s, c;
+            sampling::detail::sincos_2pi(u, s, c);
+            REQUIRE(std::abs(s - std::sin(sampling::M_2PI * u)) < 1e-5f);
+            REQUIRE(std::abs(c - std::cos(sampling::M_2PI * u)) < 1e-5f);
+        }
+    }
+
+    SECTION("directions") {
+        sampling::seed(42);
+        // E[cos(θ)] = ∫ cos(θ) cos(θ)/π dω = 2/3
+        double sum_cos = 0;
+        for (int i = 0; i < NUM_SAMPLES; ++i) {
+            const auto dir = sampling::cosine_hemisphere();
+            REQUIRE(dir.length() == Approx(1.f).epsilon(TOLERANCE));
+            REQUIRE(0 < dir.z);
+            sum_cos += dir.z;
+        }
+        REQUIRE(std::abs(sum_cos / NUM_SAMPLES - 2. / 3) < TOLERANCE);
+    }
+
+    SECTION("batch") {
+        sampling::seed(42);
+        std::vector<float> u1, u2;
+        for (int i = 0; i < 100; ++i) {
+            u1.push_back(sampling::uniform());
+            u2.push_back(sampling::uniform());
+        }
+        std::vector<float> x(u1.size()), y(u1.size()), z(u1.size());
+        sampling::cosine_hemisphere(u1.size(), u1.data(), u2.data(), x.data(),
+                                    y.data(), z.data());
+        for (size_t i = 0; i < u1.size(); ++i) {
+            const Vector3f dir(x[i], y[i], z[i]);
+            REQUIRE((dir - sampling::cosine_hemisphere(u1[i], u2[i]))
+                        .length() < 1e-6f);
+        }
+    }
+}
+
 TEST_CASE("Test Triangle sampling", "[sampling]") {
     static constexpr int NUM_SAMPLES = 100;
-    float r, s, t;
+    float r = 0, s, t;
 
     for (int j = 0; j < NUM_SAMPLES; ++j) {
         Triangle triangle = random_triangle();
@@ -55,3 +123,180 @@ TEST_CASE("Test Triangle sampling", "[sampling]") {
         REQUIRE(length == Approx(r).epsilon(TOLERANCE));
     }
 }
+
+TEST_CASE("Stratified samples cover every stratum once", "[sampling]") {
+    static constexpr size_t NUM_STRATA = 4;
+    auto samples = sampling::stratified_square<NUM_STRATA>();
+
+    std::vector<int> count(NUM_STRATA * NUM_STRATA, 0);
+    for (const auto& sample : samples) {
+        REQUIRE(0 <= sample[0]);
+        REQUIRE(sample[0] < 1);
+        REQUIRE(0 <= sample[1]);
+        REQUIRE(sample[1] < 1);
+        size_t x = sample[0] * NUM_STRATA;
+        size_t y = sample[1] * NUM_STRATA;
+        count[y * NUM_STRATA + x] += 1;
+    }
+    for (int c : count) {
+        REQUIRE(c == 1);
+    }
+
+    // the corners of the unit square are mapped to the corners of the
+    // triangle
+    Triangle triangle = random_triangle();
+    const auto& pos = triangle.vertices[0];
+    REQUIRE(sampling::triangle(pos, triangle.u, triangle.v, 0, 0) == pos);
+    auto p = sampling::triangle(pos, triangle.u, triangle.v, 1, 0);
+    REQUIRE((p - triangle.vertices[1]).length() < TOLERANCE);
+    p = sampling::triangle(pos, triangle.u, triangle.v, 1, 1);
+    REQUIRE((p - triangle.vertices[2]).length() < TOLERANCE);
+}
+
+TEST_CASE("Seeded samples do not depend on the thread", "[sampling]") {
+    static constexpr int NUM_SAMPLES = 100;
+    Triangle triangle = random_triangle();
+
+    auto draw = [&triangle]() {
+        sampling::seed(42);
+        std::vector<Point3f> samples;
+        for (int i = 0; i < NUM_SAMPLES; ++i) {
+            samples.push_back(sampling::triangle(triangle));
+        }
+        return samples;
+    };
+
+    auto expected = draw();
+    std::vector<Point3f> actual;
+    std::thread([&draw, &actual]() { actual = draw(); }).join();
+
+    REQUIRE(actual.size() == expected.size());
+    for (size_t i = 0; i < expected.size(); ++i) {
+        REQUIRE(actual[i] == expected[i]);
+    }
+}
+
+TEST_CASE("Sobol samples of a pixel are stratified", "[sampler]") {
+    static constexpr size_t NUM_STRATA = 4;
+    static constexpr size_t NUM_SAMPLES = NUM_STRATA * NUM_STRATA;
+    SobolSampler sampler(false);
+
+    for (uint32_t first_dimension : {0, 2, 6}) {
+        std::vector<int> count_2d(NUM_SAMPLES, 0);
+        std::vector<int> count_1d(NUM_SAMPLES, 0);
+        for (uint32_t index = 0; index < NUM_SAMPLES; ++index) {
+            sampler.start_sample(3, 5, index, first_dimension);
+            const auto sample = sampler.next_2d();
+            REQUIRE(0 <= sample[0]);
+            REQUIRE(sample[0] < 1);
+            REQUIRE(0 <= sample[1]);
+            REQUIRE(sample[1] < 1);
+            size_t x = sample[0] * NUM_STRATA;
+            size_t y = sample[1] * NUM_STRATA;
+            count_2d[y * NUM_STRATA + x] += 1;
+            count_1d[static_cast<size_t>(sample[0] * NUM_SAMPLES)] += 1;
+        }
+        for (int c : count_2d) {
+            REQUIRE(c == 1);
+        }
+        for (int c : count_1d) {
+            REQUIRE(c == 1);
+        }
+    }
+}
+
+TEST_CASE("Samples only depend on pixel, index and dimension", "[sampler]") {
+    for (auto type :
+         {SamplerType::RANDOM, SamplerType::SOBOL, SamplerType::BLUE_NOISE}) {
+        auto sampler = make_sampler(type);
+        sampler->start_sample(7, 11, 13, 0);
+        std::vector<float> expected;
+        for (int i = 0; i < 8; ++i) {
+            const float u = sampler->next();
+            REQUIRE(0 <= u);
+            REQUIRE(u < 1);
+            expected.push_back(u);
+        }
+
+        // other samples in between, and a new sampler
+        sampler->start_sample(8, 11, 13, 0);
+        float other = sampler->next();
+        REQUIRE(other != expected[0]);
+        auto other_sampler = make_sampler(type);
+        other_sampler->start_sample(7, 11, 13, 3);
+        for (int i = 3; i < 8; ++i) {
+            REQUIRE(other_sampler->next() == expected[i]);
+        }
+    }
+}
+
+TEST_CASE("Scoped sampler provides the uniform numbers", "[sampler]") {
+    SobolSampler sampler(false);
+    sampler.start_sample(1, 2, 3, 0);
+    const float expected = sampler.next();
+
+    sampler.start_sample(1, 2, 3, 0);
+    {
+        sampling::ScopedSampler scoped_sampler(sampler);
+        REQUIRE(sampling::uniform() == expected);
+    }
+    sampler.start_sample(1, 2, 3, 0);
+    sampling::uniform();
+    REQUIRE(sampler.next() == expected);
+}
+
+TEST_CASE("Alias table samples proportional to the weights", "[sampling]") {
+    static constexpr int NUM_SAMPLES = 100000;
+    const std::vector<float> weights{1, 0, 3, 0.5f, 1.5f, 4};
+    const float total = 10;
+
+    sampling::AliasTable table(weights);
+    REQUIRE(table.size() == weights.size());
+    for (size_t i = 0; i < weights.size(); ++i) {
+        REQUIRE(table.pdf(i) == Approx(weights[i] / total));
+    }
+
+    sampling::seed(42);
+    std::vector<int> count(weights.size(), 0);
+    for (int i = 0; i < NUM_SAMPLES; ++i) {
+        count[table.sample()] += 1;
+    }
+    REQUIRE(count[1] == 0);
+    for (size_t i = 0; i < weights.size(); ++i) {
+        float frequency = static_cast<float>(count[i]) / NUM_SAMPLES;
+        REQUIRE(std::abs(frequency - weights[i] / total) < TOLERANCE);
+    }
+}
+
+TEST_CASE("Emitters are sampled uniformly by area", "[sampling]") {
+    const Normal3f up(0, 0, 1);
+    const Color white(1, 1, 1, 1);
+    auto square_half = [&](float x0, float size, const Color& emissive) {
+        return Triangle({Point3f{x0, 0, 0}, Point3f{x0 + size, 0, 0},
+                         Point3f{x0, size, 0}},
+                        {up, up, up}, Color(), Color(), emissive, Color(), 0);
+    };
+    const std::vector<Triangle> triangles{square_half(0, 1, white),
+                                          square_half(2, 1, Color()),
+                                          square_half(4, 2, white)};
+
+    Emitters emitters(triangles);
+    REQUIRE(emitters.size() == 2);
+    REQUIRE(emitters.total_area() == Approx(2.5f));
+    REQUIRE(emitters.pdf() == Approx(1 / 2.5f));
+
+    sampling::seed(42);
+    static constexpr int NUM_SAMPLES = 10000;
+    int num_large = 0;
+    for (int i = 0; i < NUM_SAMPLES; ++i) {
+        auto sample = emitters.sample();
+        REQUIRE(sample.emission == white);
+        REQUIRE(sample.normal == up);
+        const auto& p = sample.position;
+        // not on the non-emissive triangle in [2, 3]
+        REQUIRE((p.x <= 1 || 4 <= p.x));
+        num_large += 4 <= p.x;
+    }
+    float frequency = static_cast<float>(num_large) / NUM_SAMPLES;
+    REQUIRE(std::abs(frequency - 0.8f) < 2 * TOLERANCE);
+}
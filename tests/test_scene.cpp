@@ -0,0 +1,145 @@
+#include "../lib/scene.h"
+#include <catch.hpp>
+
+#include <memory>
+
+namespace {
+
+// Mesh of a single triangle in the plane z = 0.
+aiMesh* triangle_mesh() {
+    auto* mesh = new aiMesh();
+    mesh->mNumVertices = 3;
+    mesh->mVertices = new aiVector3D[3]{{0, 0, 0}, {1, 0, 0}, {0, 1, 0}};
+    mesh->mNormals = new aiVector3D[3]{{0, 0, 1}, {0, 0, 1}, {0, 0, 1}};
+    mesh->mNumFaces = 1;
+    mesh->mFaces = new aiFace[1];
+    mesh->mFaces[0].mNumIndices = 3;
+    mesh->mFaces[0].mIndices = new unsigned[3]{0, 1, 2};
+    return mesh;
+}
+
+aiNode* translated_node(float x, float y, float z) {
+    auto* node = new aiNode();
+    node->mTransformation.a4 = x;
+    node->mTransformation.b4 = y;
+    node->mTransformation.c4 = z;
+    return node;
+}
+
+void add_children(aiNode* parent, std::vector<aiNode*> children) {
+    parent->mNumChildren = children.size();
+    parent->mChildren = new aiNode*[children.size()];
+    for (size_t i = 0; i < children.size(); ++i) {
+        parent->mChildren[i] = children[i];
+        children[i]->mParent = parent;
+    }
+}
+
+void add_mesh(aiNode* node, unsigned mesh) {
+    node->mNumMeshes = 1;
+    node->mMeshes = new unsigned[1]{mesh};
+}
+
+// Scene with a nested hierarchy:
+//
+// root (translated by (0, 0, 1))
+// +- a (translated by (1, 0, 0), mesh 0)
+//    +- b (translated by (0, 2, 0), mesh 0)
+// +- c (no mesh)
+//    +- d (translated by (0, 0, 3), mesh 0)
+std::unique_ptr<aiScene> nested_scene() {
+    std::unique_ptr<aiScene> scene(new aiScene());
+    scene->mNumMeshes = 1;
+    scene->mMeshes = new aiMesh*[1]{triangle_mesh()};
+    scene->mNumMaterials = 1;
+    scene->mMaterials = new aiMaterial*[1]{new aiMaterial()};
+
+    auto* root = translated_node(0, 0, 1);
+    auto* a = translated_node(1, 0, 0);
+    auto* b = translated_node(0, 2, 0);
+    auto* c = new aiNode();
+    auto* d = translated_node(0, 0, 3);
+    add_children(root, {a, c});
+    add_children(a, {b});
+    add_children(c, {d});
+    add_mesh(a, 0);
+    add_mesh(b, 0);
+    add_mesh(d, 0);
+    scene->mRootNode = root;
+    return scene;
+}
+
+} // namespace
+
+TEST_CASE("Node transformations are accumulated", "[scene]") {
+    const auto scene = nested_scene();
+    const auto* b = scene->mRootNode->mChildren[0]->mChildren[0];
+    const aiMatrix4x4 T = world_transformation(b);
+    REQUIRE(T.a4 == 1);
+    REQUIRE(T.b4 == 2);
+    REQUIRE(T.c4 == 1);
+
+    const auto instances = mesh_instances(scene.get());
+    REQUIRE(instances.size() == 3);
+    for (const auto& instance : instances) {
+        REQUIRE(instance.mesh == 0);
+    }
+    // depth-first order
+    REQUIRE(instances[1].to_world.b4 == 2);
+    REQUIRE(instances[2].to_world.c4 == 4);
+}
+
+TEST_CASE("Triangles of a nested scene", "[scene]") {
+    const auto scene = nested_scene();
+    for (size_t num_threads : {1, 4}) {
+        const auto triangles = triangles_from_scene(scene.get(), num_threads);
+        REQUIRE(triangles.size() == 3);
+        REQUIRE(triangles[0].vertices[0] == Point3f(1, 0, 1));
+        REQUIRE(triangles[1].vertices[1] == Point3f(2, 2, 1));
+        REQUIRE(triangles[2].vertices[2] == Point3f(0, 1, 4));
+        REQUIRE(triangles[2].normals[0] == Normal3f(0, 0, 1));
+    }
+}
+
+TEST_CASE("Instanced scene of a nested scene", "[scene]") {
+    const auto scene = nested_scene();
+    const auto instanced_scene = instanced_scene_from_scene(scene.get(), 2);
+    REQUIRE(instanced_scene.num_meshes() == 1);
+    REQUIRE(instanced_scene.num_instances() == 3);
+    REQUIRE(instanced_scene.num_triangles() == 3);
+    REQUIRE(instanced_scene.triangle(1).vertices[1] == Point3f(2, 2, 1));
+}
+
+TEST_CASE("Indexed mesh of a nested scene", "[scene]") {
+    const auto scene = nested_scene();
+    const auto mesh = indexed_mesh_from_scene(scene.get(), 2);
+    REQUIRE(mesh.num_triangles() == 3);
+    REQUIRE(mesh.vertices().size() == 9);
+    REQUIRE(mesh.materials().size() == 1);
+    REQUIRE(mesh.is_valid());
+
+    const auto triangles = triangles_from_scene(scene.get());
+    for (size_t id = 0; id < triangles.size(); ++id) {
+        REQUIRE(mesh.triangle(id).vertices == triangles[id].vertices);
+        REQUIRE(mesh.triangle(id).normals == triangles[id].normals);
+    }
+}
+
+TEST_CASE("Camera looks at the target", "[scene]") {
+    const aiVector3D eye(1, 2, 3), target(1, 2, -7);
+    const aiMatrix4x4 T =
+        look_at_transformation(eye, target, aiVector3D(0, 5, 0));
+    // the camera at the origin looking along -z
+    REQUIRE(T * aiVector3D(0, 0, 0) == eye);
+    REQUIRE(T * aiVector3D(0, 0, -10) == target);
+    REQUIRE(T * aiVector3D(0, 1, 0) == eye + aiVector3D(0, 1, 0));
+
+    const aiMatrix4x4 S = look_at_transformation(
+        aiVector3D(0, 0, 0), aiVector3D(1, 0, 0), aiVector3D(0, 0, 1));
+    const aiVector3D forward = S * aiVector3D(0, 0, -1);
+    const aiVector3D up = S * aiVector3D(0, 1, 0);
+    const aiVector3D right = S * aiVector3D(1, 0, 0);
+    REQUIRE(forward.x == Approx(1));
+    REQUIRE(up.z == Approx(1));
+    REQUIRE(right.y == Approx(-1));
+}
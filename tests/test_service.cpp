@@ -0,0 +1,47 @@
+#include "../lib/service.h"
+#include <catch.hpp>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+TEST_CASE("Split a request into arguments", "[service]") {
+    REQUIRE(split_arguments("").empty());
+    REQUIRE(split_arguments("  scene.blend\t-w 320 ") ==
+            std::vector<std::string>({"scene.blend", "-w", "320"}));
+    REQUIRE(split_arguments("--look-at=\"0 1 5 0 0 0 0 1 0\" \"\"") ==
+            std::vector<std::string>({"--look-at=0 1 5 0 0 0 0 1 0", ""}));
+    REQUIRE_THROWS(split_arguments("--look-at=\"0 1 5"));
+}
+
+TEST_CASE("Lines and data are exchanged over localhost", "[service]") {
+    TcpListener listener(0);
+    REQUIRE(listener.port() != 0);
+
+    // echo the length of every line, followed by the line
+    std::thread server([&listener]() {
+        TcpConnection connection = listener.accept();
+        std::string line;
+        while (connection.read_line(line)) {
+            connection.write(std::to_string(line.size()) + "\n" + line);
+        }
+    });
+
+    {
+        TcpConnection client = TcpConnection::connect(listener.port());
+        client.write("first\nsecond line\r\n");
+        client.write(std::string(10000, 'x') + "\n");
+
+        std::string line, data;
+        for (const std::string& expected :
+             std::vector<std::string>{"first", "second line",
+                                      std::string(10000, 'x')}) {
+            REQUIRE(client.read_line(line));
+            REQUIRE(std::stoul(line) == expected.size());
+            REQUIRE(client.read(data, expected.size()));
+            REQUIRE(data == expected);
+        }
+    }
+    // closing the client ends the connection of the server
+    server.join();
+}
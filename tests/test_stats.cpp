@@ -0,0 +1,139 @@
+#include "../lib/stats.h"
+#include <catch.hpp>
+
+#include <cmath>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+TEST_CASE("Sharded counter sums up increments of all threads", "[stats]") {
+    ShardedCounter counter;
+    REQUIRE(counter.value() == 0);
+
+    // more threads than shards to also test shared shards
+    constexpr size_t NUM_THREADS = ShardedCounter::NUM_SHARDS + 8;
+    constexpr size_t NUM_INCREMENTS = 1000;
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < NUM_THREADS; ++i) {
+        threads.emplace_back([&counter]() {
+            for (size_t j = 0; j < NUM_INCREMENTS; ++j) {
+                counter += 1;
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    REQUIRE(counter.value() == NUM_THREADS * NUM_INCREMENTS);
+    counter += 5;
+    REQUIRE(counter == NUM_THREADS * NUM_INCREMENTS + 5);
+}
+
+TEST_CASE("Running variance equals the sample variance", "[stats]") {
+    RunningVariance estimate;
+    REQUIRE(estimate.count() == 0);
+    REQUIRE(estimate.variance() == 0);
+    REQUIRE(estimate.std_error() == 0);
+
+    const std::vector<float> values{2, 4, 4, 4, 5, 5, 7, 9};
+    for (float x : values) {
+        estimate.add(x);
+    }
+    REQUIRE(estimate.count() == values.size());
+    REQUIRE(estimate.mean() == Approx(5));
+    REQUIRE(estimate.variance() == Approx(32. / 7));
+    REQUIRE(estimate.std_error() == Approx(std::sqrt(32. / 7 / 8)));
+}
+
+TEST_CASE("Pixels are counted by samples per pixel", "[stats]") {
+    REQUIRE(Stats::samples_bucket(1) == 0);
+    REQUIRE(Stats::samples_bucket(2) == 1);
+    REQUIRE(Stats::samples_bucket(3) == 1);
+    REQUIRE(Stats::samples_bucket(4) == 2);
+    REQUIRE(Stats::samples_bucket(64) == 6);
+    REQUIRE(Stats::samples_bucket(size_t(1) << 40) ==
+            Stats::NUM_SAMPLES_BUCKETS - 1);
+}
+
+namespace {
+
+const StageStats* find_stage(const std::vector<StageStats>& stages,
+                             const std::string& name) {
+    for (const auto& stage : stages) {
+        if (stage.name == name) {
+            return &stage;
+        }
+    }
+    return nullptr;
+}
+
+} // namespace
+
+TEST_CASE("Runs of a stage are accumulated", "[stats]") {
+    {
+        StageTimer _("test_stage");
+        // busy, s.t. the stage takes CPU time
+        volatile double sum = 0;
+        for (int i = 0; i < 1000000; ++i) {
+            sum = sum + std::sqrt(i);
+        }
+    }
+    {
+        StageTimer stage("test_stage");
+        stage.stop();
+        // a stopped stage is not added again
+    }
+
+    const auto stages = Stats::instance().stages();
+    const StageStats* stage = find_stage(stages, "test_stage");
+    REQUIRE(stage != nullptr);
+    REQUIRE(stage->count == 2);
+    REQUIRE(stage->wall_ms > 0);
+    REQUIRE(stage->cpu_ms >= 0);
+    REQUIRE(stage->peak_rss_bytes > 0);
+}
+
+TEST_CASE("Paused stats are not recorded", "[stats]") {
+    auto& stats = Stats::instance();
+    const size_t num_rays = stats.num_rays;
+    stats.runtime_ms = 42;
+    {
+        PausedStats paused;
+        stats.num_rays += 10;
+        std::thread([&stats]() { stats.num_rays += 10; }).join();
+        { StageTimer _("test_paused"); }
+        // a stage of another thread, e.g. a concurrent build
+        std::thread([]() { StageTimer _("test_unpaused"); }).join();
+        stats.runtime_ms = 1;
+    }
+    REQUIRE(stats.num_rays == num_rays);
+    REQUIRE(stats.runtime_ms == 42);
+    REQUIRE(find_stage(stats.stages(), "test_paused") == nullptr);
+    REQUIRE(find_stage(stats.stages(), "test_unpaused") != nullptr);
+
+    stats.num_rays += 10;
+    REQUIRE(stats.num_rays == num_rays + 10);
+}
+
+TEST_CASE("Stats are exported as JSON and Prometheus text", "[stats]") {
+    { StageTimer _("test_export"); }
+
+    std::ostringstream os;
+    write_stats_json(os, Stats::instance());
+    const std::string json = os.str();
+    REQUIRE(json.front() == '{');
+    REQUIRE(json.find("\"stages\": [") != std::string::npos);
+    REQUIRE(json.find("{\"name\": \"test_export\", \"count\": 1, ") !=
+            std::string::npos);
+
+    os.str("");
+    write_stats_prometheus(os, Stats::instance());
+    const std::string prometheus = os.str();
+    REQUIRE(prometheus.find("# TYPE turner_stage_wall_seconds gauge\n") !=
+            std::string::npos);
+    REQUIRE(prometheus.find("turner_stage_runs{stage=\"test_export\"} 1\n") !=
+            std::string::npos);
+}
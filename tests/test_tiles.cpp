@@ -0,0 +1,154 @@
+#include "../lib/tiles.h"
+#include <catch.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+#include <thread>
+
+TEST_CASE("Tiles cover every pixel exactly once", "[tiles]") {
+    for (auto order :
+         {TileOrder::SCANLINE, TileOrder::MORTON, TileOrder::SPIRAL}) {
+        for (size_t width : {1, 16, 37, 100}) {
+            for (size_t height : {1, 16, 23, 64}) {
+                auto tiles = make_tiles(width, height, 16, order);
+                REQUIRE(tiles.size() ==
+                        ((width + 15) / 16) * ((height + 15) / 16));
+
+                std::vector<int> covered(width * height, 0);
+                for (const auto& tile : tiles) {
+                    REQUIRE(0 < tile.width());
+                    REQUIRE(tile.width() <= 16);
+                    REQUIRE(0 < tile.height());
+                    REQUIRE(tile.height() <= 16);
+                    for (size_t y = tile.y0; y < tile.y1; ++y) {
+                        for (size_t x = tile.x0; x < tile.x1; ++x) {
+                            covered[y * width + x] += 1;
+                        }
+                    }
+                }
+                for (int count : covered) {
+                    REQUIRE(count == 1);
+                }
+            }
+        }
+    }
+}
+
+TEST_CASE("Tiles are ordered in Morton order", "[tiles]") {
+    auto tiles = make_tiles(4, 4, 1, TileOrder::MORTON);
+    std::vector<std::pair<size_t, size_t>> expected = {
+        {0, 0}, {1, 0}, {0, 1}, {1, 1}, {2, 0}, {3, 0}, {2, 1}, {3, 1},
+        {0, 2}, {1, 2}, {0, 3}, {1, 3}, {2, 2}, {3, 2}, {2, 3}, {3, 3}};
+    REQUIRE(tiles.size() == expected.size());
+    for (size_t i = 0; i < tiles.size(); ++i) {
+        REQUIRE(tiles[i].x0 == expected[i].first);
+        REQUIRE(tiles[i].y0 == expected[i].second);
+    }
+}
+
+TEST_CASE("Tiles are ordered in a spiral from the center", "[tiles]") {
+    auto tiles = make_tiles(3, 3, 1, TileOrder::SPIRAL);
+    std::vector<std::pair<size_t, size_t>> expected = {
+        {1, 1}, {2, 1}, {2, 2}, {1, 2}, {0, 2},
+        {0, 1}, {0, 0}, {1, 0}, {2, 0}};
+    REQUIRE(tiles.size() == expected.size());
+    for (size_t i = 0; i < tiles.size(); ++i) {
+        REQUIRE(tiles[i].x0 == expected[i].first);
+        REQUIRE(tiles[i].y0 == expected[i].second);
+    }
+}
+
+TEST_CASE("Parse tile order", "[tiles]") {
+    REQUIRE(parse_tile_order("scanline") == TileOrder::SCANLINE);
+    REQUIRE(parse_tile_order("morton") == TileOrder::MORTON);
+    REQUIRE(parse_tile_order("spiral") == TileOrder::SPIRAL);
+    REQUIRE_THROWS(parse_tile_order("hilbert"));
+    REQUIRE(to_string(TileOrder::SPIRAL) == std::string("spiral"));
+}
+
+TEST_CASE("Every tile is rendered exactly once", "[tiles]") {
+    auto tiles = make_tiles(200, 100, 8, TileOrder::MORTON);
+
+    for (size_t num_threads : {1, 2, 3, 8}) {
+        std::vector<std::atomic<int>> rendered(tiles.size());
+        for (auto& count : rendered) {
+            count = 0;
+        }
+        std::atomic<size_t> num_contexts(0);
+        std::atomic<size_t> num_wrong_tiles(0);
+        std::vector<size_t> progress;
+
+        render_tiles(tiles, num_threads,
+                     [&num_contexts]() {
+                         return num_contexts.fetch_add(1);
+                     },
+                     [&](size_t& context, const Tile& tile, size_t index) {
+                         // Catch is not thread-safe, so only count here
+                         if (tiles[index].x0 != tile.x0 ||
+                             tiles[index].y0 != tile.y0) {
+                             num_wrong_tiles += 1;
+                         }
+                         rendered[index] += 1;
+                         // uneven cost
+                         if (context == 0 && index % 2 == 0) {
+                             std::this_thread::yield();
+                         }
+                     },
+                     [&progress](size_t num_completed) {
+                         progress.push_back(num_completed);
+                     });
+
+        REQUIRE(num_contexts <= num_threads);
+        REQUIRE(num_wrong_tiles == 0);
+        for (const auto& count : rendered) {
+            REQUIRE(count == 1);
+        }
+        REQUIRE(progress.size() == tiles.size());
+        for (size_t i = 0; i < progress.size(); ++i) {
+            REQUIRE(progress[i] == i + 1);
+        }
+    }
+}
+
+TEST_CASE("Tiles are rendered on a shared pool", "[tiles]") {
+    auto tiles = make_tiles(64, 64, 8, TileOrder::MORTON);
+
+    // more workers than threads in the pool, and the pool is reused
+    ThreadPool pool(2);
+    for (size_t num_threads : {2, 5}) {
+        std::vector<std::atomic<int>> rendered(tiles.size());
+        for (auto& count : rendered) {
+            count = 0;
+        }
+        render_tiles(pool, tiles, num_threads, []() { return 0; },
+                     [&rendered](int, const Tile&, size_t index) {
+                         rendered[index] += 1;
+                     });
+        for (const auto& count : rendered) {
+            REQUIRE(count == 1);
+        }
+    }
+}
+
+TEST_CASE("Errors are rethrown after all workers finished", "[tiles]") {
+    auto tiles = make_tiles(64, 64, 8, TileOrder::MORTON);
+
+    for (size_t num_threads : {1, 2, 5}) {
+        std::atomic<size_t> num_running(0);
+        auto render = [&](int, const Tile&, size_t index) {
+            num_running += 1;
+            if (index == 0) {
+                num_running -= 1;
+                throw std::runtime_error("tile 0");
+            }
+            // the other workers are still busy, when the error is thrown
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            num_running -= 1;
+        };
+        REQUIRE_THROWS_AS(
+            render_tiles(tiles, num_threads, []() { return 0; }, render),
+            std::runtime_error);
+        REQUIRE(num_running == 0);
+    }
+}
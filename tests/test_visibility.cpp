@@ -0,0 +1,98 @@
+#include "../lib/visibility.h"
+#include "helper.h"
+#include <catch.hpp>
+
+#include <array>
+#include <limits>
+#include <vector>
+
+namespace {
+
+std::array<float, 2> test_jitter(size_t x, size_t y) {
+    return {{((x * 7 + y * 3) % 10) / 10.f, ((x * 3 + y * 7) % 10) / 10.f}};
+}
+
+} // namespace
+
+TEST_CASE("Rasterized visibility agrees with ray tracing", "[visibility]") {
+    // Random triangles around the camera, many of them crossing the camera
+    // plane, which are clipped.
+    std::vector<Triangle> triangles;
+    for (int i = 0; i < 50; ++i) {
+        triangles.push_back(random_triangle());
+    }
+
+    const Camera cam = test_camera();
+    const size_t width = 96, height = 64;
+    const CameraRays camera_rays(cam, width, height);
+    ThreadPool pool(2);
+    const VisibilityBuffer buffer =
+        rasterize_visibility(triangles, camera_rays, width, height,
+                             []() { return test_jitter; }, pool, 2);
+
+    size_t num_hits = 0;
+    size_t num_edges = 0;
+    for (size_t y = 0; y < height; ++y) {
+        for (size_t x = 0; x < width; ++x) {
+            const auto jitter = test_jitter(x, y);
+            const Ray ray(camera_rays.origin(),
+                          camera_rays.direction(x + jitter[0], y + jitter[1]));
+
+            // closest triangle by brute force
+            float r_min = std::numeric_limits<float>::max();
+            Intersector::OptionalId closest;
+            for (size_t id = 0; id < triangles.size(); ++id) {
+                float r, s, t;
+                if (intersect_ray_triangle(ray, triangles[id], r, s, t) &&
+                    r < r_min) {
+                    r_min = r;
+                    closest = Intersector::OptionalId(id);
+                }
+            }
+
+            const Intersector::OptionalId id = buffer(x, y);
+            REQUIRE(static_cast<bool>(id) == static_cast<bool>(closest));
+            if (!id) {
+                continue;
+            }
+            num_hits += 1;
+            float r, s, t;
+            if (!intersect_ray_triangle(ray, triangles[id], r, s, t)) {
+                // the raster point is on an edge (cf. VisibilityBuffer::hit)
+                num_edges += 1;
+                continue;
+            }
+            // triangles may intersect each other, i.e. the depths of the
+            // closest triangles may differ by less than the rounding
+            REQUIRE(r == Approx(r_min).epsilon(1e-3));
+        }
+    }
+    REQUIRE(num_hits > width * height / 4);
+    REQUIRE(num_edges < 4);
+}
+
+TEST_CASE("Rasterized visibility does not depend on the number of threads",
+          "[visibility]") {
+    std::vector<Triangle> triangles;
+    for (int i = 0; i < 50; ++i) {
+        triangles.push_back(random_triangle());
+    }
+
+    const Camera cam = test_camera();
+    const size_t width = 96, height = 64;
+    const CameraRays camera_rays(cam, width, height);
+    ThreadPool pool(3);
+    auto make_jitter = []() { return test_jitter; };
+    const VisibilityBuffer expected = rasterize_visibility(
+        triangles, camera_rays, width, height, make_jitter, pool, 1);
+    for (size_t num_threads : {2, 3, 7}) {
+        const VisibilityBuffer buffer =
+            rasterize_visibility(triangles, camera_rays, width, height,
+                                 make_jitter, pool, num_threads);
+        for (size_t y = 0; y < height; ++y) {
+            for (size_t x = 0; x < width; ++x) {
+                REQUIRE(buffer(x, y) == expected(x, y));
+            }
+        }
+    }
+}
@@ -0,0 +1,219 @@
+#include "../lib/kdtree.h"
+#include "../lib/wavefront.h"
+#include <catch.hpp>
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+// Horizontal triangle at height z containing (0, 0, z), facing upwards.
+Triangle horizontal_triangle(float z, const Color& diffuse) {
+    const Normal3f up(0, 0, 1);
+    const Point3f a(-10, -10, z), b(10, -10, z), c(0, 10, z);
+    return Triangle({a, b, c}, {up, up, up}, Color(), diffuse, Color(),
+                    Color(), 0);
+}
+
+Color trace_single_path(KDTreeIntersection& tree_intersection,
+                        const std::vector<Light>& lights, const Ray& ray,
+                        int max_depth, const Color& bg_color) {
+    std::vector<Color> radiance(1);
+    wavefront::trace_paths(tree_intersection, lights, {},
+                           {{ray, Color(1, 1, 1, 1), 0}}, max_depth, bg_color,
+                           radiance);
+    return radiance[0];
+}
+
+} // namespace
+
+TEST_CASE("Paths leaving the scene get the background", "[wavefront]") {
+    KDTree tree({horizontal_triangle(0, Color(1, 1, 1, 1))});
+    KDTreeIntersection tree_intersection(tree);
+
+    const Color bg_color(0.25f, 0.5f, 0.75f, 1);
+    auto radiance = trace_single_path(tree_intersection, {},
+                                      {{0, 0, 1}, {0, 0, 1}}, 3, bg_color);
+    REQUIRE(radiance.r == bg_color.r);
+    REQUIRE(radiance.g == bg_color.g);
+    REQUIRE(radiance.b == bg_color.b);
+}
+
+TEST_CASE("Direct light is attenuated by occluders", "[wavefront]") {
+    const Color diffuse(0.5f, 0.5f, 0.5f, 1);
+    const std::vector<Light> lights{{{0, 0, 1}, Color(1, 1, 1, 1)}};
+    const Ray ray({0, 0, 0.25f}, {0, 0, -1});
+
+    SECTION("unoccluded light") {
+        KDTree tree({horizontal_triangle(0, diffuse)});
+        KDTreeIntersection tree_intersection(tree);
+
+        // ρ/π cos(θ) L_light
+        auto radiance =
+            trace_single_path(tree_intersection, lights, ray, 0, Color());
+        REQUIRE(radiance.r == Approx(0.5f * M_1_PI));
+        REQUIRE(radiance.g == Approx(0.5f * M_1_PI));
+        REQUIRE(radiance.b == Approx(0.5f * M_1_PI));
+    }
+
+    SECTION("occluded light") {
+        KDTree tree({horizontal_triangle(0, diffuse),
+                     horizontal_triangle(0.5f, diffuse)});
+        KDTreeIntersection tree_intersection(tree);
+
+        auto radiance =
+            trace_single_path(tree_intersection, lights, ray, 0, Color());
+        REQUIRE(radiance.r == 0);
+        REQUIRE(radiance.g == 0);
+        REQUIRE(radiance.b == 0);
+    }
+}
+
+TEST_CASE("Emitters are sampled and hit", "[wavefront]") {
+    // small emitter at height 1 facing downwards, above a diffuse floor
+    const Normal3f down(0, 0, -1);
+    const Triangle emitter({Point3f{-1, -1, 1}, Point3f{1, -1, 1},
+                            Point3f{0, 1, 1}},
+                           {down, down, down}, Color(), Color(),
+                           Color(1, 1, 1, 1), Color(), 0);
+    const std::vector<Triangle> triangles{
+        horizontal_triangle(0, Color(0.5f, 0.5f, 0.5f, 1)), emitter};
+    KDTree tree(triangles);
+    KDTreeIntersection tree_intersection(tree);
+    const Emitters emitters(triangles);
+
+    SECTION("primary rays get the emission") {
+        std::vector<Color> radiance(1);
+        wavefront::trace_paths(tree_intersection, {}, emitters,
+                               {{{{0, 0, 0.5f}, {0, 0, 1}}, Color(1, 1, 1, 1),
+                                 0}},
+                               0, Color(), radiance);
+        REQUIRE(radiance[0].r == Approx(1));
+    }
+
+    SECTION("light sampling and multiple importance sampling agree") {
+        // Without bounces, the floor is lit by the sampled emitters only;
+        // with one bounce, also by the continuation rays hitting the emitter.
+        auto mean_radiance = [&](int max_depth) {
+            sampling::seed(42);
+            std::vector<wavefront::Path> paths;
+            for (uint32_t i = 0; i < 20000; ++i) {
+                paths.push_back(
+                    {{{0, 0, 0.5f}, {0, 0, -1}}, Color(1, 1, 1, 1), i});
+            }
+            std::vector<Color> radiance(paths.size());
+            wavefront::trace_paths(tree_intersection, {}, emitters,
+                                   std::move(paths), max_depth, Color(),
+                                   radiance);
+            float sum = 0;
+            for (const auto& color : radiance) {
+                sum += color.r;
+            }
+            return sum / radiance.size();
+        };
+
+        const float sampled = mean_radiance(0);
+        REQUIRE(0 < sampled);
+        REQUIRE(mean_radiance(1) == Approx(sampled).epsilon(0.01));
+    }
+}
+
+TEST_CASE("Paths are terminated", "[wavefront]") {
+    // the light is trapped between two parallel planes
+    const Color diffuse(0.9f, 0.9f, 0.9f, 1);
+    KDTree tree(
+        {horizontal_triangle(0, diffuse), horizontal_triangle(1, diffuse)});
+    KDTreeIntersection tree_intersection(tree);
+
+    sampling::seed(42);
+    std::vector<wavefront::Path> paths;
+    for (uint32_t i = 0; i < 1000; ++i) {
+        paths.push_back({{{0, 0, 0.5f}, {0, 0, -1}}, Color(1, 1, 1, 1), i});
+    }
+    std::vector<Color> radiance(paths.size());
+    wavefront::trace_paths(tree_intersection, {}, {}, std::move(paths), 1000,
+                           Color(1, 1, 1, 1), radiance);
+    for (const auto& color : radiance) {
+        REQUIRE(std::isfinite(color.r));
+    }
+}
+
+TEST_CASE("Ray sort keys group rays by octant and origin", "[wavefront]") {
+    const Bbox3f box({0, 0, 0}, {1, 1, 1});
+    const Vector3f dir(1, 1, 1);
+
+    // the octant dominates the origin
+    REQUIRE(ray_sort_key({{1, 1, 1}, dir}, box) <
+            ray_sort_key({{0, 0, 0}, {-1, 1, 1}}, box));
+    // origins in the same octant of the box share the upper bits
+    const uint32_t near_a = ray_sort_key({{0.1f, 0.1f, 0.1f}, dir}, box);
+    const uint32_t near_b = ray_sort_key({{0.2f, 0.2f, 0.2f}, dir}, box);
+    const uint32_t far = ray_sort_key({{0.9f, 0.9f, 0.9f}, dir}, box);
+    REQUIRE(near_a < near_b);
+    REQUIRE(near_b < far);
+    REQUIRE((near_a >> 24) == (near_b >> 24));
+    REQUIRE((near_a >> 24) != (far >> 24));
+}
+
+TEST_CASE("Sorted rays are a permutation in key order", "[wavefront]") {
+    sampling::seed(7);
+    std::vector<wavefront::Path> paths;
+    for (uint32_t i = 0; i < 100; ++i) {
+        const Point3f o(sampling::uniform(), sampling::uniform(),
+                        sampling::uniform());
+        paths.push_back({{o, sampling::cosine_hemisphere()},
+                         Color(1, 1, 1, 1),
+                         i});
+    }
+
+    std::vector<std::pair<uint32_t, uint32_t>> keys;
+    std::vector<wavefront::Path> buffer;
+    auto sorted = paths;
+    wavefront::sort_rays(sorted, keys, buffer);
+
+    REQUIRE(sorted.size() == paths.size());
+    std::vector<bool> seen(paths.size(), false);
+    Bbox3f origins(sorted.front().ray.o);
+    for (const auto& path : sorted) {
+        origins = bbox_union(origins, path.ray.o);
+    }
+    for (size_t i = 0; i < sorted.size(); ++i) {
+        seen[sorted[i].pixel] = true;
+        if (0 < i) {
+            REQUIRE(ray_sort_key(sorted[i - 1].ray, origins) <=
+                    ray_sort_key(sorted[i].ray, origins));
+        }
+    }
+    REQUIRE(std::all_of(seen.begin(), seen.end(), [](bool s) { return s; }));
+}
+
+TEST_CASE("Sorting rays does not change the direct light", "[wavefront]") {
+    const Color diffuse(0.5f, 0.5f, 0.5f, 1);
+    KDTree tree(
+        {horizontal_triangle(0, diffuse), horizontal_triangle(2, diffuse)});
+    KDTreeIntersection tree_intersection(tree);
+    const std::vector<Light> lights{{{0, 0, 1}, Color(1, 1, 1, 1)}};
+
+    // rays in all directions from the middle; without bounces, the radiance
+    // does not depend on random numbers
+    std::vector<wavefront::Path> paths;
+    for (uint32_t i = 0; i < 64; ++i) {
+        const float phi = 2 * static_cast<float>(M_PI) * i / 64;
+        const float z = i % 2 ? 1.f : -1.f;
+        paths.push_back({{{0.1f * std::cos(phi), 0.1f * std::sin(phi), 1},
+                          {std::cos(phi), std::sin(phi), z}},
+                         Color(1, 1, 1, 1),
+                         i});
+    }
+
+    std::vector<Color> unsorted(paths.size()), sorted(paths.size());
+    wavefront::trace_paths(tree_intersection, lights, {}, paths, 0, Color(),
+                           unsorted);
+    wavefront::trace_paths(tree_intersection, lights, {}, paths, 0, Color(),
+                           sorted, true);
+    for (size_t i = 0; i < paths.size(); ++i) {
+        REQUIRE(sorted[i].r == unsorted[i].r);
+        REQUIRE(sorted[i].g == unsorted[i].g);
+        REQUIRE(sorted[i].b == unsorted[i].b);
+    }
+}
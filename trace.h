@@ -1,25 +1,56 @@
 #pragma once
 
 #include "config.h"
-#include "lib/kdtree.h"
+#include "lib/emitters.h"
+#include "lib/intersector.h"
 #include "lib/types.h"
 
 /**
- * Main function of a tracer.
+ * Integrators
  *
- * Used in the main routine for tracing (cf. main.cpp).
+ * An integrator computes the light along a ray, and is a policy of the render
+ * loop (cf. `render_image`). It is a class with
  *
- * TODO: Could be a performance bottleneck since not inlined. Profile!
+ *     // whether wavefront path tracing (cf. wavefront.h) may be used
+ *     static constexpr bool WAVEFRONT;
  *
- * @param  origin            origin of the ray
- * @param  dir               direction of the ray
- * @param  tree_intersection wrapped kd-tree containing triangles for
- *                           intersection computations
- * @param  lights            all lights in the scene
- * @param  depth             recursion depth
- * @param  conf              configuration
- * @return                   Color hit by the ray
+ *     // color hit by the ray
+ *     static Color shade(const Ray& ray, const Intersector::Hit& hit,
+ *                        Intersector& tree_intersection,
+ *                        const std::vector<Light>& lights,
+ *                        const Emitters& emitters, int depth,
+ *                        const TracerConfig& conf);
+ *
+ * where
+ *
+ *     ray               ray to trace
+ *     hit               intersection of the ray with the scene, e.g.
+ *                       computed for a packet of primary rays
+ *     tree_intersection acceleration structure containing the triangles
+ *                       for intersection computations (cf. intersector.h)
+ *     lights            all point lights in the scene
+ *     emitters          all emissive triangles in the scene
+ *     depth             recursion depth
+ *     conf              configuration
+ *
+ * The integrator is defined in the file of the tracer, which also
+ * instantiates the render loop. Hence, the calls of `shade` are resolved at
+ * compile time, and can be inlined.
  */
-Color trace(const Ray& ray, KDTreeIntersection& tree_intersection,
-            const std::vector<Light>& lights, int depth,
-            const TracerConfig& conf);
+
+/**
+ * Intersect the ray with the scene and shade it with the integrator.
+ */
+template <typename Integrator>
+Color trace(const Ray& ray, Intersector& tree_intersection,
+            const std::vector<Light>& lights, const Emitters& emitters,
+            int depth, const TracerConfig& conf) {
+    if (depth > conf.max_recursion_depth) {
+        return {};
+    }
+
+    Intersector::Hit hit;
+    hit.id = tree_intersection.intersect(ray, hit.r, hit.a, hit.b);
+    return Integrator::shade(ray, hit, tree_intersection, lights, emitters,
+                             depth, conf);
+}
@@ -0,0 +1,95 @@
+/**
+ * Main routine of the tracers (cf. pathtracer.cpp, raytracer.cpp and
+ * raycaster.cpp).
+ */
+
+#pragma once
+
+#include "lib/output.h"
+#include "lib/profile.h"
+#include "lib/stats.h"
+#include "tracer_render.h"
+#include "tracer_server.h"
+
+#include <ThreadPool.h>
+#include <docopt/docopt.h>
+
+#include <functional>
+#include <future>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <string>
+
+/**
+ * Render the scene given on the command line with the integrator, and write
+ * the image to stdout. With --batch, render the frames of several cameras
+ * instead (cf. `render_batch`), and with --serve, the requests of a service
+ * (cf. tracer_server.h). With --preview, a preview is rendered, while the
+ * acceleration structure is built (cf. `render_preview`).
+ *
+ * @param usage docopt usage of the tracer
+ * @return      exit code
+ */
+template <typename Integrator>
+int tracer_main(int argc, char const* argv[], const char* usage) {
+    std::map<std::string, docopt::value> args =
+        docopt::docopt(usage, {argv + 1, argv + argc});
+    TracerConfig conf = TracerConfig::from_docopt(args);
+    if (conf.verbose) {
+        std::cerr << conf << std::endl;
+    }
+    if (conf.serve_port != 0) {
+        return serve<Integrator>(conf, usage);
+    }
+    if (!conf.profile_filename.empty()) {
+        turner::profiler_start();
+    }
+
+    try {
+        const auto loaded = import_scene(conf);
+        ThreadPool pool(conf.num_threads);
+        if (conf.numa_enabled) {
+            pin_workers(pool, conf);
+        }
+        if (!conf.preview_filename.empty()) {
+            // The preview is rendered, while the acceleration structure is
+            // built. The build is waited for, even if the preview fails.
+            auto build = std::async(std::launch::async, build_accelerator,
+                                    std::ref(*loaded), std::cref(conf));
+            render_preview<Integrator>(*loaded, conf, pool);
+            build.get();
+        } else {
+            build_accelerator(*loaded, conf);
+        }
+        if (!conf.batch_pattern.empty()) {
+            render_batch<Integrator>(*loaded, conf, pool);
+        } else {
+            const Camera cam = scene_camera(*loaded, conf);
+            const Image image =
+                render_image<Integrator>(*loaded, cam, conf, pool);
+
+            // output image
+            turner::Profile _(turner::ProfCategory::Output);
+            StageTimer stage("output");
+            write_image(std::cout, image, conf.image_format);
+        }
+
+        // output stats
+        std::cerr << Stats::instance() << std::endl;
+        if (!conf.stats_filename.empty()) {
+            write_stats(conf.stats_filename, Stats::instance());
+        }
+    } catch (const std::runtime_error& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    if (!conf.profile_filename.empty()) {
+        turner::profiler_stop();
+        const auto results = turner::profiler_get_results();
+        std::cerr << results;
+        turner::write_profile(conf.profile_filename, results);
+    }
+    return 0;
+}
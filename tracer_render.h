@@ -0,0 +1,869 @@
+/**
+ * Rendering of the tracers (cf. tracer_main.h and tracer_server.h): loading a
+ * scene, and rendering it from a camera.
+ *
+ * The render loop is a template over the integrator (cf. trace.h), which is
+ * instantiated in the file of the tracer. Hence, the shading of the hits is
+ * called directly in the loop, and can be inlined.
+ */
+
+#pragma once
+
+#include "lib/batch.h"
+#include "lib/bricks.h"
+#include "lib/bvh.h"
+#include "lib/camera_rays.h"
+#include "lib/effects.h"
+#include "lib/heatmap.h"
+#include "lib/instancing.h"
+#include "lib/kdtree.h"
+#include "lib/numa.h"
+#include "lib/output.h"
+#include "lib/profile.h"
+#include "lib/progress_bar.h"
+#include "lib/range.h"
+#include "lib/raster.h"
+#include "lib/runtime.h"
+#include "lib/sampler.h"
+#include "lib/sampling.h"
+#include "lib/scene.h"
+#include "lib/stats.h"
+#include "lib/tiles.h"
+#include "lib/triangle.h"
+#include "lib/visibility.h"
+#include "lib/wavefront.h"
+#include "trace.h"
+
+#include <assimp/Importer.hpp>  // C++ importer interface
+#include <assimp/postprocess.h> // Post processing flags
+#include <assimp/scene.h>       // Output data structure
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <math.h>
+#include <memory>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Adaptive sampling does not refine pixels darker than this luminance.
+constexpr float MIN_LUMINANCE = 0.01f;
+
+/**
+ * Add the shadow rays tested by an intersector with its occluder cache while
+ * in scope, e.g. while rendering a tile, to the stats (cf.
+ * `Intersector::light_occluded`).
+ */
+class OccluderCacheCounter {
+public:
+    explicit OccluderCacheCounter(const Intersector& intersector)
+        : intersector_(intersector)
+        , counts_(intersector.occluder_cache_counts()) {}
+
+    OccluderCacheCounter(const OccluderCacheCounter&) = delete;
+    OccluderCacheCounter& operator=(const OccluderCacheCounter&) = delete;
+
+    ~OccluderCacheCounter() {
+        const auto& counts = intersector_.occluder_cache_counts();
+        Stats::instance().occluder_cache_tests += counts.tests - counts_.tests;
+        Stats::instance().occluder_cache_hits += counts.hits - counts_.hits;
+    }
+
+private:
+    const Intersector& intersector_;
+    const Intersector::OccluderCacheCounts counts_;
+};
+
+/**
+ * Apply tone mapping and gamma correction to the linear colors of the image.
+ */
+inline void postprocess(Image& image, const TracerConfig& conf) {
+    conf.postprocessor()(image);
+}
+
+/**
+ * Save the accumulation buffer and the current image of a progressive
+ * rendering, if the corresponding files are configured.
+ */
+inline void write_snapshot(const AccumulationBuffer& accumulation,
+                           const TracerConfig& conf) {
+    turner::Profile _(turner::ProfCategory::Output);
+    if (!conf.accumulation_filename.empty()) {
+        // write to a temporary file, s.t. the previous buffer stays intact
+        // if the write fails
+        const std::string tmp_filename = conf.accumulation_filename + ".tmp";
+        {
+            std::ofstream file(tmp_filename, std::ios::binary);
+            accumulation.write(file);
+            if (!file) {
+                throw std::runtime_error(
+                    "could not write accumulation buffer to " + tmp_filename);
+            }
+        }
+        if (std::rename(tmp_filename.c_str(),
+                        conf.accumulation_filename.c_str()) != 0) {
+            std::remove(tmp_filename.c_str());
+            throw std::runtime_error("could not write accumulation buffer to " +
+                                     conf.accumulation_filename);
+        }
+    }
+
+    if (!conf.snapshot_filename.empty()) {
+        Image snapshot = accumulation.mean();
+        postprocess(snapshot, conf);
+        std::ofstream file(conf.snapshot_filename, std::ios::binary);
+        write_image(file, snapshot, conf.image_format);
+    }
+}
+
+/**
+ * Scene loaded for rendering, i.e. the imported scene, its lights and the
+ * acceleration structure of its triangles. A render service keeps it for all
+ * requests of the scene (cf. tracer_server.h).
+ */
+struct LoadedScene {
+    Assimp::Importer importer;
+    const aiScene* scene = nullptr;
+    std::vector<Light> lights;
+    // only the structure of the accelerator is built
+    AcceleratorType accelerator = AcceleratorType::KDTREE;
+    KDTree tree;
+    // replicas of the tree in the memory of the NUMA nodes 0, 1, ... with
+    // --numa, if the workers run on more than one node (cf. numa.h)
+    std::vector<KDTree> tree_replicas;
+    BVH bvh;
+    InstancedScene instanced_scene;
+    BrickedScene bricked_scene;
+    // trees of the bricks, which are mapped on demand
+    std::unique_ptr<BrickCache> brick_cache;
+    // emissive triangles are area lights
+    Emitters emitters;
+
+    // tree to be traversed by a thread on the NUMA node
+    const KDTree& node_tree(size_t node) const {
+        return node < tree_replicas.size() ? tree_replicas[node] : tree;
+    }
+};
+
+/**
+ * Import the scene of the configuration with its lights. Its acceleration
+ * structure is not built yet (cf. `build_accelerator`).
+ *
+ * @throw std::runtime_error, if the scene cannot be imported, or if it has no
+ *        camera, or more than one light
+ */
+inline std::unique_ptr<LoadedScene> import_scene(const TracerConfig& conf) {
+    std::unique_ptr<LoadedScene> loaded(new LoadedScene());
+    loaded->accelerator = conf.accelerator;
+
+    // import scene
+    std::cerr << "Loading scene..." << std::endl;
+    {
+        StageTimer _("import");
+        loaded->scene = loaded->importer.ReadFile(
+            conf.filename, aiProcess_CalcTangentSpace | aiProcess_Triangulate |
+                               aiProcess_JoinIdenticalVertices |
+                               aiProcess_GenNormals | aiProcess_SortByPType);
+    }
+    const aiScene* scene = loaded->scene;
+    if (!scene) {
+        throw std::runtime_error(loaded->importer.GetErrorString());
+    }
+
+    // a batch renders every camera, otherwise the first one is rendered
+    if (scene->mNumCameras == 0) {
+        throw std::runtime_error("scene has no camera: " + conf.filename);
+    }
+
+    // setup light
+    // we can deal only with one single or no light at all
+    if (scene->mNumLights > 1) {
+        throw std::runtime_error("scene must have at most one light: " +
+                                 conf.filename);
+    }
+    if (scene->mNumLights == 1) {
+        auto& rawLight = *scene->mLights[0];
+
+        auto* lightNode = scene->mRootNode->FindNode(rawLight.mName);
+        assert(lightNode != nullptr);
+        const auto LT = world_transformation(lightNode);
+        const auto& v = LT * aiVector3D();
+        loaded->lights.push_back(
+            {{v.x, v.y, v.z},
+             Color{rawLight.mColorDiffuse.r, rawLight.mColorDiffuse.g,
+                   rawLight.mColorDiffuse.b, 1}});
+    }
+    return loaded;
+}
+
+/**
+ * Build the acceleration structure of the imported scene, and find its
+ * emitters. Only the structure of the scene is modified, i.e. the imported
+ * scene may be rendered otherwise meanwhile (cf. `render_preview`).
+ */
+inline void build_accelerator(LoadedScene& loaded, const TracerConfig& conf) {
+    const aiScene* scene = loaded.scene;
+
+    // load triangles from the scene into the acceleration structure
+    std::cerr << "Loading triangles and building "
+              << to_string(conf.accelerator) << "..." << std::endl;
+    Runtime loading_time;
+
+    // Load KDTree from cache if it was built from the same scene or build it.
+    // The stage "build" is either.
+    auto& tree = loaded.tree;
+    auto& bvh = loaded.bvh;
+    auto& instanced_scene = loaded.instanced_scene;
+    auto& bricked_scene = loaded.bricked_scene;
+    switch (conf.accelerator) {
+    case AcceleratorType::KDTREE: {
+        IndexedMesh mesh;
+        {
+            StageTimer _("triangles");
+            mesh = indexed_mesh_from_scene(scene, conf.num_threads);
+        }
+        StageTimer _("build");
+        tree = KDTree::load_or_build(mesh, conf.kdtree_cache_filename,
+                                     KDTree::BuildStrategy::PRESORTED_EVENTS,
+                                     conf.num_threads);
+        break;
+    }
+    case AcceleratorType::BVH: {
+        Triangles triangles;
+        {
+            StageTimer _("triangles");
+            triangles = triangles_from_scene(scene, conf.num_threads);
+        }
+        StageTimer _("build");
+        bvh = BVH(std::move(triangles));
+        break;
+    }
+    case AcceleratorType::INSTANCED_BVH: {
+        // the meshes are converted and built one after another
+        StageTimer _("build");
+        instanced_scene = instanced_scene_from_scene(scene, conf.num_threads);
+        break;
+    }
+    case AcceleratorType::BRICKS: {
+        IndexedMesh mesh;
+        {
+            StageTimer _("triangles");
+            mesh = indexed_mesh_from_scene(scene, conf.num_threads);
+        }
+        // the bricks are written next to the cache of the kd-tree
+        StageTimer _("build");
+        bricked_scene =
+            BrickedScene(mesh, conf.kdtree_cache_filename + ".brick",
+                         BrickedScene::DEFAULT_BRICK_TRIANGLES,
+                         conf.num_threads);
+        loaded.brick_cache.reset(new BrickCache(
+            bricked_scene, conf.brick_cache_mb * (size_t(1) << 20)));
+        break;
+    }
+    }
+
+    // the workers on every NUMA node traverse their own replica of the tree
+    if (conf.numa_enabled && conf.accelerator == AcceleratorType::KDTREE) {
+        const auto& topology = numa::Topology::system();
+        const size_t num_nodes = topology.num_worker_nodes(conf.num_threads);
+        if (num_nodes > 1) {
+            StageTimer _("replicate");
+            loaded.tree_replicas = numa::replicate_per_node(
+                topology, num_nodes, [&tree]() { return tree.replicate(); });
+        }
+    }
+
+    auto& emitters = loaded.emitters;
+    switch (conf.accelerator) {
+    case AcceleratorType::KDTREE:
+        Stats::instance().num_triangles = tree.num_triangles();
+        Stats::instance().kdtree_height = tree.height();
+        Stats::instance().kdtree_build_allocations =
+            tree.build_memory().num_allocations;
+        Stats::instance().kdtree_build_peak_bytes =
+            tree.build_memory().peak_bytes;
+        emitters = Emitters(tree.triangles());
+        break;
+    case AcceleratorType::BVH:
+        Stats::instance().num_triangles = bvh.num_triangles();
+        emitters = Emitters(bvh.triangles());
+        break;
+    case AcceleratorType::INSTANCED_BVH:
+        Stats::instance().num_triangles = instanced_scene.num_triangles();
+        emitters = Emitters(instanced_scene.emissive_triangles());
+        break;
+    case AcceleratorType::BRICKS:
+        Stats::instance().num_triangles = bricked_scene.num_triangles();
+        emitters = Emitters(bricked_scene.emissive_triangles());
+        if (conf.verbose) {
+            std::cerr << "Bricks: " << bricked_scene.num_bricks()
+                      << std::endl;
+        }
+        break;
+    }
+    Stats::instance().loading_time_ms = loading_time();
+    if (conf.verbose) {
+        std::cerr << "Emitters: " << emitters.size() << std::endl;
+    }
+}
+
+/**
+ * Import the scene of the configuration, and build its acceleration
+ * structure.
+ *
+ * @throw std::runtime_error, if the scene cannot be imported, or if it has no
+ *        camera, or more than one light
+ */
+inline std::unique_ptr<LoadedScene> load_scene(const TracerConfig& conf) {
+    auto loaded = import_scene(conf);
+    build_accelerator(*loaded, conf);
+    return loaded;
+}
+
+/**
+ * Pin the workers of the pool to the NUMA nodes with --numa (cf. numa.h).
+ * The threads of the tree replicas are pinned by `build_accelerator`.
+ */
+inline void pin_workers(ThreadPool& pool, const TracerConfig& conf) {
+    const auto& topology = numa::Topology::system();
+    if (!numa::pin_workers(pool, conf.num_threads, topology)) {
+        std::cerr << "Threads could not be pinned to their CPUs" << std::endl;
+    }
+    if (conf.verbose) {
+        std::cerr << "NUMA nodes: "
+                  << topology.num_worker_nodes(conf.num_threads) << " of "
+                  << topology.num_nodes() << std::endl;
+    }
+}
+
+/**
+ * Camera of the scene, or the one of --look-at with the field of view of the
+ * scene camera. If the scene camera specifies an aspect ratio, it replaces
+ * the one of the configuration.
+ *
+ * @param index index of the scene camera
+ */
+inline Camera scene_camera(const LoadedScene& loaded, TracerConfig& conf,
+                           size_t index = 0) {
+    assert(index < loaded.scene->mNumCameras);
+    aiCamera camera = *loaded.scene->mCameras[index];
+    if (camera.mAspect > 0) {
+        conf.aspect = camera.mAspect;
+    } else if (camera.mAspect == 0) {
+        camera.mAspect = conf.aspect;
+    }
+    if (conf.look_at_enabled) {
+        return Camera(look_at_transformation(conf.look_at.eye,
+                                             conf.look_at.target,
+                                             conf.look_at.up),
+                      camera);
+    }
+    auto* camNode = loaded.scene->mRootNode->FindNode(camera.mName);
+    assert(camNode != nullptr);
+    return Camera(world_transformation(camNode), camera);
+}
+
+/**
+ * Render the scene from the camera with the integrator on the thread pool,
+ * and post-process the image. With --heatmap, the cost of the tiles is
+ * written as well.
+ *
+ * @throw std::runtime_error, if a progressive rendering cannot be resumed, or
+ *        the heatmap cannot be written
+ */
+template <typename Integrator>
+Image render_image(const LoadedScene& loaded, const Camera& cam,
+                   const TracerConfig& conf, ThreadPool& pool) {
+    int width = conf.width;
+    int height = width / cam.mAspect;
+
+    Image image(width, height);
+    {
+        Runtime rt(Stats::instance().runtime_ms);
+        StageTimer stage("render");
+
+        std::cerr << "Rendering ";
+
+        const CameraRays camera_rays(cam, width, height);
+
+        // A progressive rendering consists of passes of one sample per pixel.
+        TracerConfig pass_conf = conf;
+        if (conf.progressive_enabled) {
+            pass_conf.num_pixel_samples = 1;
+            pass_conf.adaptive_threshold = 0;
+        }
+        size_t pass = 0;
+
+        auto tiles = make_tiles(width, height, conf.tile_size, conf.tile_order);
+        const size_t num_tiles = tiles.size();
+        // Every tile is rendered by a single task, which owns the tile in the
+        // tiled image, i.e. samples are added without synchronization.
+        TiledImage<> tiled_image(width, height, conf.tile_size);
+
+        // The first pass samples all pixels. With adaptive sampling,
+        // further passes sample the pixels, which are not converged yet.
+        // All pixels of a pass have the same number of samples.
+        const int max_samples =
+            std::max(pass_conf.max_pixel_samples, pass_conf.num_pixel_samples);
+        const int samples_per_pass = pass_conf.adaptive_threshold > 0
+                                         ? max_samples
+                                         : pass_conf.num_pixel_samples;
+
+        // The first sample of every pixel in a pass may be rasterized (cf.
+        // visibility.h). The ids of the triangles are only the indices of the
+        // triangles in the kd-tree and the BVH.
+        const bool raster_primary =
+            conf.raster_primary_enabled &&
+            (loaded.accelerator == AcceleratorType::KDTREE ||
+             loaded.accelerator == AcceleratorType::BVH) &&
+            !(Integrator::WAVEFRONT && conf.wavefront_enabled);
+        if (conf.raster_primary_enabled && !raster_primary) {
+            std::cerr << "Primary visibility is traced, since it can only be "
+                         "rasterized for the packet tracer with a kd-tree or "
+                         "BVH"
+                      << std::endl;
+        }
+        std::unique_ptr<VisibilityBuffer> visibility;
+        uint32_t visibility_sample = 0;
+
+        // cost of the tiles over all passes (cf. --heatmap)
+        std::vector<TileCost> tile_costs(
+            conf.heatmap_filename.empty() ? 0 : num_tiles);
+
+        const auto& lights = loaded.lights;
+        const auto& emitters = loaded.emitters;
+        auto render_tile = [&tiled_image, &camera_rays, &lights, &emitters,
+                            &pass, num_tiles, max_samples, samples_per_pass,
+                            &visibility, &visibility_sample, &tile_costs,
+                            &conf = pass_conf](
+            Intersector& tree_intersection, const Tile& tile,
+            size_t tile_index) {
+            turner::Profile _(turner::ProfCategory::Render);
+            OccluderCacheCounter occluder_counter(tree_intersection);
+            std::unique_ptr<TileCostTimer> cost_timer;
+            if (!tile_costs.empty()) {
+                cost_timer.reset(new TileCostTimer(tree_intersection,
+                                                   tile_costs[tile_index]));
+            }
+            using RayPacket = Intersector::RayPacket;
+            constexpr int PACKET_SIZE = Intersector::PACKET_SIZE;
+
+            // The same samples, no matter which thread renders the tile. The
+            // samples of a pixel are numbered over all passes, and the
+            // sampler gives each of them its own numbers (cf. Sampler). The
+            // wavefront tracer draws from the random number generator of the
+            // thread, which gets different numbers in every pass.
+            const uint64_t seed =
+                (pass * num_tiles + tile_index + 1) * 0x9E3779B97F4A7C15ULL;
+            sampling::seed(seed);
+            const auto sampler = make_sampler(conf.sampler);
+
+            // pixels are indexed in the tile row by row
+            const size_t tile_width = tile.width();
+            auto pixel_x = [&tile, tile_width](uint32_t pixel) {
+                return tile.x0 + pixel % tile_width;
+            };
+            auto pixel_y = [&tile, tile_width](uint32_t pixel) {
+                return tile.y0 + pixel / tile_width;
+            };
+
+            // Sums of the samples are accumulated in the image, and the
+            // luminance of the samples in the estimates.
+            std::vector<RunningVariance> estimates(tile_width * tile.height());
+            auto add_sample = [&](uint32_t pixel, const Color& color) {
+                tiled_image.add(pixel_x(pixel), pixel_y(pixel), color);
+                estimates[pixel].add(luminance(color));
+            };
+
+            // Trace the samples first_sample, ..., first_sample +
+            // num_samples - 1 of every pixel.
+            auto trace_samples = [&](const std::vector<uint32_t>& pixels,
+                                     uint32_t first_sample, int num_samples) {
+                if (Integrator::WAVEFRONT && conf.wavefront_enabled) {
+                    // Trace the paths of all samples together. Every sample
+                    // gets its own slot in the radiance.
+                    std::vector<wavefront::Path> paths;
+                    paths.reserve(pixels.size() * num_samples);
+                    for (uint32_t pixel : pixels) {
+                        for (int i = 0; i < num_samples; ++i) {
+                            sampler->start_sample(pixel_x(pixel),
+                                                  pixel_y(pixel),
+                                                  first_sample + i, 0);
+                            const auto jitter = sampler->next_2d();
+                            paths.push_back(
+                                {camera_rays.ray(pixel_x(pixel) + jitter[0],
+                                                 pixel_y(pixel) + jitter[1]),
+                                 Color(1, 1, 1, 1),
+                                 static_cast<uint32_t>(paths.size())});
+                        }
+                    }
+                    Stats::instance().num_prim_rays += paths.size();
+
+                    std::vector<Color> radiance(paths.size());
+                    wavefront::trace_paths(tree_intersection, lights,
+                                           emitters, std::move(paths),
+                                           conf.max_recursion_depth,
+                                           conf.bg_color, radiance,
+                                           conf.sort_rays_enabled);
+                    for (size_t slot = 0; slot < radiance.size(); ++slot) {
+                        add_sample(pixels[slot / num_samples], radiance[slot]);
+                    }
+                    return;
+                }
+
+                // Trace primary rays of neighboring pixels in packets. The
+                // raster points of all packets are generated first, and their
+                // directions are computed together. Packet p consists of the
+                // points [p * PACKET_SIZE, (p + 1) * PACKET_SIZE). The first
+                // two dimensions of a sample jitter the raster point, and the
+                // tracer continues with the following ones.
+                sampling::ScopedSampler scoped_sampler(*sampler);
+                const size_t num_groups =
+                    (pixels.size() + PACKET_SIZE - 1) / PACKET_SIZE;
+                RayDirections::Floats xs(num_groups * num_samples *
+                                         PACKET_SIZE);
+                RayDirections::Floats ys(xs.size());
+                for (size_t j = 0; j < pixels.size(); j += PACKET_SIZE) {
+                    int num_pixels =
+                        std::min<int>(PACKET_SIZE, pixels.size() - j);
+                    for (int k = 0; k < num_pixels; ++k) {
+                        const uint32_t x = pixel_x(pixels[j + k]);
+                        const uint32_t y = pixel_y(pixels[j + k]);
+                        for (int i = 0; i < num_samples; ++i) {
+                            sampler->start_sample(x, y, first_sample + i, 0);
+                            const auto jitter = sampler->next_2d();
+                            size_t point =
+                                (j / PACKET_SIZE * num_samples + i) *
+                                    PACKET_SIZE +
+                                k;
+                            xs[point] = x + jitter[0];
+                            ys[point] = y + jitter[1];
+                        }
+                    }
+                }
+                RayDirections dirs;
+                camera_rays.directions(xs, ys, dirs);
+
+                for (size_t j = 0; j < pixels.size(); j += PACKET_SIZE) {
+                    int num_pixels =
+                        std::min<int>(PACKET_SIZE, pixels.size() - j);
+                    unsigned active = (1 << num_pixels) - 1;
+                    for (int i = 0; i < num_samples; ++i) {
+                        RayPacket rays = camera_rays.packet(
+                            dirs,
+                            (j / PACKET_SIZE * num_samples + i) * PACKET_SIZE);
+
+                        Stats::instance().num_prim_rays += num_pixels;
+                        Intersector::HitPacket hits;
+                        if (visibility &&
+                            first_sample + i == visibility_sample) {
+                            for (int k = 0; k < num_pixels; ++k) {
+                                hits[k] = visibility->hit(
+                                    pixel_x(pixels[j + k]),
+                                    pixel_y(pixels[j + k]), rays[k],
+                                    tree_intersection);
+                            }
+                        } else {
+                            hits = tree_intersection.intersect_packet(rays,
+                                                                      active);
+                        }
+                        for (int k = 0; k < num_pixels; ++k) {
+                            sampler->start_sample(pixel_x(pixels[j + k]),
+                                                  pixel_y(pixels[j + k]),
+                                                  first_sample + i, 2);
+                            add_sample(pixels[j + k],
+                                       Integrator::shade(rays[k], hits[k],
+                                                         tree_intersection,
+                                                         lights, emitters, 0,
+                                                         conf));
+                        }
+                    }
+                }
+            };
+
+            std::vector<uint32_t> pixels(estimates.size());
+            std::iota(pixels.begin(), pixels.end(), 0);
+            int num_samples = 0;
+            while (!pixels.empty()) {
+                int pass_samples =
+                    std::min(conf.num_pixel_samples, max_samples - num_samples);
+                trace_samples(pixels, pass * samples_per_pass + num_samples,
+                              pass_samples);
+                num_samples += pass_samples;
+                if (conf.adaptive_threshold <= 0 ||
+                    max_samples <= num_samples) {
+                    break;
+                }
+
+                auto converged = [&estimates, &conf](uint32_t pixel) {
+                    const auto& estimate = estimates[pixel];
+                    // noise in (nearly) black pixels is not visible
+                    return estimate.std_error() <=
+                           conf.adaptive_threshold *
+                               std::max(estimate.mean(), MIN_LUMINANCE);
+                };
+                pixels.erase(
+                    std::remove_if(pixels.begin(), pixels.end(), converged),
+                    pixels.end());
+            }
+
+            for (uint32_t pixel = 0; pixel < estimates.size(); ++pixel) {
+                const size_t n = estimates[pixel].count();
+                if (!conf.progressive_enabled) {
+                    Stats::instance().count_pixel_samples(n);
+                }
+                const size_t x = pixel_x(pixel), y = pixel_y(pixel);
+                tiled_image.set(x, y,
+                                tiled_image(x, y) / static_cast<float>(n));
+            }
+        };
+
+        auto render = [&](const std::string& label) {
+            auto progress_bar = ProgressBar(std::cerr, label, tiles.size());
+            auto on_progress = [&progress_bar](size_t num_completed) {
+                progress_bar.update(num_completed);
+            };
+            if (raster_primary) {
+                // the raster points of the first sample of the pass
+                visibility_sample = pass * samples_per_pass;
+                auto make_jitter = [&pass_conf, &visibility_sample]() {
+                    std::shared_ptr<Sampler> sampler =
+                        make_sampler(pass_conf.sampler);
+                    const uint32_t sample = visibility_sample;
+                    return [sampler, sample](size_t x, size_t y) {
+                        sampler->start_sample(x, y, sample, 0);
+                        return sampler->next_2d();
+                    };
+                };
+                const ArrayView<Triangle> triangles =
+                    loaded.accelerator == AcceleratorType::KDTREE
+                        ? loaded.tree.triangles()
+                        : ArrayView<Triangle>(loaded.bvh.triangles());
+                visibility.reset(new VisibilityBuffer(rasterize_visibility(
+                    triangles, camera_rays, width, height, make_jitter, pool,
+                    conf.num_threads)));
+            }
+            switch (loaded.accelerator) {
+            case AcceleratorType::KDTREE:
+                render_tiles(pool, tiles, conf.num_threads,
+                             [&loaded]() {
+                                 return KDTreeIntersection(
+                                     loaded.node_tree(numa::current_node()));
+                             },
+                             render_tile, on_progress);
+                break;
+            case AcceleratorType::BVH:
+                render_tiles(pool, tiles, conf.num_threads,
+                             [&loaded]() {
+                                 return BVHIntersection(loaded.bvh);
+                             },
+                             render_tile, on_progress);
+                break;
+            case AcceleratorType::INSTANCED_BVH:
+                render_tiles(pool, tiles, conf.num_threads,
+                             [&loaded]() {
+                                 return InstancedIntersection(
+                                     loaded.instanced_scene);
+                             },
+                             render_tile, on_progress);
+                break;
+            case AcceleratorType::BRICKS:
+                render_tiles(pool, tiles, conf.num_threads,
+                             [&loaded]() {
+                                 return BrickIntersection(
+                                     loaded.bricked_scene,
+                                     *loaded.brick_cache);
+                             },
+                             render_tile, on_progress);
+                break;
+            }
+            std::cerr << std::endl;
+            image = tiled_image.resolve();
+        };
+
+        if (!conf.progressive_enabled) {
+            render("Rendering");
+        } else {
+            AccumulationBuffer accumulation(width, height);
+            if (!conf.accumulation_filename.empty()) {
+                std::ifstream file(conf.accumulation_filename,
+                                   std::ios::binary);
+                if (file) {
+                    accumulation = AccumulationBuffer::read(file);
+                    if (accumulation.width() != image.width() ||
+                        accumulation.height() != image.height()) {
+                        throw std::runtime_error(
+                            "Accumulation buffer has a different image size");
+                    }
+                    std::cerr << "Resuming after " << accumulation.num_passes()
+                              << " passes" << std::endl;
+                }
+            }
+
+            // In a distributed rendering, this node renders the passes
+            // node_index, node_index + num_nodes, ... of all passes. Their
+            // accumulation buffers are merged afterwards (cf. merge.cpp).
+            const size_t num_passes = conf.num_pixel_samples;
+            const size_t num_node_passes =
+                conf.node_index < num_passes
+                    ? (num_passes - conf.node_index + conf.num_nodes - 1) /
+                          conf.num_nodes
+                    : 0;
+            auto last_snapshot = std::chrono::steady_clock::now();
+            while (accumulation.num_passes() < num_node_passes) {
+                pass = conf.node_index +
+                       accumulation.num_passes() * conf.num_nodes;
+                tiled_image.clear();
+                render("Pass " + std::to_string(pass + 1) + "/" +
+                       std::to_string(num_passes));
+                accumulation.add(image);
+
+                auto now = std::chrono::steady_clock::now();
+                std::chrono::duration<float> elapsed = now - last_snapshot;
+                if (accumulation.num_passes() == num_node_passes ||
+                    conf.snapshot_seconds <= elapsed.count()) {
+                    write_snapshot(accumulation, conf);
+                    last_snapshot = now;
+                }
+            }
+
+            image = accumulation.mean();
+            for (size_t i = 0; i < image.width() * image.height(); ++i) {
+                Stats::instance().count_pixel_samples(
+                    accumulation.num_passes());
+            }
+        }
+
+        if (!tile_costs.empty()) {
+            std::ofstream file(conf.heatmap_filename, std::ios::binary);
+            write_image(file, cost_heatmap(tiles, tile_costs, width, height),
+                        ImageFormat::PFM);
+            if (!file) {
+                throw std::runtime_error("could not write heatmap " +
+                                         conf.heatmap_filename);
+            }
+        }
+    }
+
+    {
+        StageTimer _("postprocess");
+        postprocess(image, conf);
+    }
+    return image;
+}
+
+/**
+ * Render a preview of the imported scene, and write it to the preview file
+ * of the configuration. The preview has a quarter of the width, one sample
+ * per pixel, and its triangles are put in a BVH, which is built much faster
+ * than the kd-tree. Hence, it is meant to be rendered, while the acceleration
+ * structure of the scene is built (cf. `build_accelerator`). Its rendering is
+ * recorded in the stats as the stage "preview" only, i.e. its rays and
+ * samples are not counted as the ones of the image (cf. `PausedStats`).
+ *
+ * @throw std::runtime_error, if the preview cannot be written
+ */
+template <typename Integrator>
+void render_preview(const LoadedScene& loaded, const TracerConfig& conf,
+                    ThreadPool& pool) {
+    StageTimer stage("preview");
+    std::cerr << "Rendering preview..." << std::endl;
+
+    // only the imported scene is shared with the loaded one
+    LoadedScene preview;
+    preview.scene = loaded.scene;
+    preview.lights = loaded.lights;
+    preview.accelerator = AcceleratorType::BVH;
+    preview.bvh = BVH(triangles_from_scene(loaded.scene, conf.num_threads));
+    preview.emitters = Emitters(preview.bvh.triangles());
+
+    TracerConfig preview_conf = conf;
+    preview_conf.width = std::max<size_t>(conf.width / 4, 1);
+    preview_conf.progressive_enabled = false;
+    preview_conf.num_pixel_samples = 1;
+    preview_conf.adaptive_threshold = 0;
+    preview_conf.heatmap_filename.clear();
+    const Camera cam = scene_camera(preview, preview_conf);
+    // counted only as the stage "preview", which ends after the pause
+    PausedStats paused;
+    const Image image =
+        render_image<Integrator>(preview, cam, preview_conf, pool);
+
+    std::ofstream file(conf.preview_filename, std::ios::binary);
+    write_image(file, image, conf.image_format);
+    if (!file) {
+        throw std::runtime_error("could not write preview " +
+                                 conf.preview_filename);
+    }
+}
+
+/**
+ * Render a frame of every camera of the scene, or of the camera list of the
+ * configuration, and write frame i to `frame_filename(conf.batch_pattern,
+ * i)`. A frame is written, while the next one is rendered.
+ *
+ * @throw std::runtime_error, if the camera list cannot be read, or a frame
+ *        cannot be written
+ */
+template <typename Integrator>
+void render_batch(const LoadedScene& loaded, const TracerConfig& conf,
+                  ThreadPool& pool) {
+    if (conf.progressive_enabled) {
+        throw std::runtime_error("--batch does not support --progressive");
+    }
+    std::vector<LookAt> cameras;
+    if (!conf.camera_list_filename.empty()) {
+        std::ifstream file(conf.camera_list_filename);
+        if (!file) {
+            throw std::runtime_error("could not read camera list " +
+                                     conf.camera_list_filename);
+        }
+        cameras = read_camera_list(file);
+    }
+    const size_t num_frames =
+        cameras.empty() ? loaded.scene->mNumCameras : cameras.size();
+
+    auto write_frame = [](const Image& image, const std::string& filename,
+                          ImageFormat format) {
+        turner::Profile _(turner::ProfCategory::Output);
+        StageTimer stage("output");
+        std::ofstream file(filename, std::ios::binary);
+        write_image(file, image, format);
+        if (!file) {
+            throw std::runtime_error("could not write frame " + filename);
+        }
+    };
+    std::future<void> output;
+    for (size_t frame = 0; frame < num_frames; ++frame) {
+        std::cerr << "Frame " << frame + 1 << "/" << num_frames << std::endl;
+        TracerConfig frame_conf = conf;
+        size_t camera_index = frame;
+        if (!conf.heatmap_filename.empty()) {
+            frame_conf.heatmap_filename =
+                frame_filename(conf.heatmap_filename, frame);
+        }
+        if (!cameras.empty()) {
+            frame_conf.look_at_enabled = true;
+            frame_conf.look_at = cameras[frame];
+            camera_index = 0;
+        }
+        const Camera cam = scene_camera(loaded, frame_conf, camera_index);
+        Image image = render_image<Integrator>(loaded, cam, frame_conf, pool);
+
+        // the previous frame was written, while this one was rendered
+        if (output.valid()) {
+            output.get();
+        }
+        output = std::async(std::launch::async, write_frame, std::move(image),
+                            frame_filename(conf.batch_pattern, frame),
+                            conf.image_format);
+    }
+    if (output.valid()) {
+        output.get();
+    }
+}
@@ -0,0 +1,138 @@
+/**
+ * Render service of the tracers (cf. --serve).
+ *
+ * The service keeps the loaded scenes with their acceleration structures, and
+ * the thread pool of the rendering. Hence, a request pays for loading a scene
+ * only the first time, and otherwise only for its rendering.
+ *
+ * It listens on a TCP port of localhost. A request is a line with the
+ * command line arguments of the tracer, e.g.
+ *
+ *     scene.blend -w 320 -p 16 --look-at="0 1 5 0 0 0 0 1 0"
+ *
+ * and its response is either the line `OK <size>` followed by the rendered
+ * image of size bytes in the requested --format, or the line
+ * `ERROR <message>`. Requests of a connection are answered in order, and
+ * connections one after another, since every rendering uses all threads of
+ * the service. A request renders with the --threads and --numa of the
+ * service, and cannot render progressively or in a batch.
+ */
+
+#pragma once
+
+#include "config.h"
+#include "lib/raster.h"
+#include "lib/service.h"
+#include "tracer_render.h"
+
+#include <ThreadPool.h>
+#include <docopt/docopt.h>
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+/**
+ * Key of a loaded scene of the service: the scene is loaded again for a
+ * request, whose options of the loading differ.
+ */
+inline std::string scene_key(const TracerConfig& conf) {
+    return conf.filename + '\n' + to_string(conf.accelerator) + '\n' +
+           conf.kdtree_cache_filename + '\n' +
+           std::to_string(conf.brick_cache_mb);
+}
+
+/**
+ * Answer the request of the service (cf. above).
+ *
+ * @param scenes loaded scenes by `scene_key`; a scene of the request is added
+ */
+template <typename Integrator>
+std::string
+answer_request(const std::string& request, const TracerConfig& service_conf,
+               const char* usage,
+               std::map<std::string, std::unique_ptr<LoadedScene>>& scenes,
+               ThreadPool& pool) {
+    try {
+        TracerConfig conf = TracerConfig::from_docopt(docopt::docopt_parse(
+            usage, split_arguments(request), /* help */ true,
+            /* version */ false));
+        if (conf.serve_port != 0 || !conf.batch_pattern.empty() ||
+            conf.progressive_enabled) {
+            throw std::runtime_error("--serve, --batch and --progressive are "
+                                     "not supported in requests");
+        }
+        // the threads of the pool are pinned to the NUMA nodes by the service
+        if (conf.numa_enabled && !service_conf.numa_enabled) {
+            throw std::runtime_error("--numa is not enabled by the service");
+        }
+        conf.num_threads = service_conf.num_threads;
+        conf.numa_enabled = service_conf.numa_enabled;
+
+        const std::string key = scene_key(conf);
+        auto it = scenes.find(key);
+        if (it == scenes.end()) {
+            it = scenes.emplace(key, load_scene(conf)).first;
+        }
+        const LoadedScene& loaded = *it->second;
+        const Camera cam = scene_camera(loaded, conf);
+        const Image image = render_image<Integrator>(loaded, cam, conf, pool);
+
+        std::ostringstream os;
+        write_image(os, image, conf.image_format);
+        const std::string data = os.str();
+        return "OK " + std::to_string(data.size()) + "\n" + data;
+    } catch (const std::exception& e) {
+        // docopt reports usage errors without a message
+        std::string message = *e.what() ? e.what() : "invalid arguments";
+        std::replace(message.begin(), message.end(), '\n', ' ');
+        return "ERROR " + message + "\n";
+    }
+}
+
+/**
+ * Run the render service on the port of the configuration. The scene of the
+ * configuration is loaded in advance.
+ *
+ * @param usage docopt usage of the tracer, which parses the requests
+ * @return      exit code, if the service cannot be started
+ */
+template <typename Integrator>
+int serve(const TracerConfig& conf, const char* usage) {
+    ThreadPool pool(conf.num_threads);
+    if (conf.numa_enabled) {
+        pin_workers(pool, conf);
+    }
+    std::map<std::string, std::unique_ptr<LoadedScene>> scenes;
+    std::unique_ptr<TcpListener> listener;
+    try {
+        scenes.emplace(scene_key(conf), load_scene(conf));
+        listener.reset(new TcpListener(conf.serve_port));
+    } catch (const std::runtime_error& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    std::cerr << "Serving on port " << listener->port() << std::endl;
+
+    while (true) {
+        try {
+            TcpConnection connection = listener->accept();
+            std::string request;
+            while (connection.read_line(request)) {
+                if (request.empty()) {
+                    continue;
+                }
+                std::cerr << "Request: " << request << std::endl;
+                connection.write(answer_request<Integrator>(
+                    request, conf, usage, scenes, pool));
+            }
+        } catch (const std::runtime_error& e) {
+            // the client has gone, but the service goes on
+            std::cerr << e.what() << std::endl;
+        }
+    }
+}